@@ -0,0 +1,256 @@
+
+#include "pch.h"
+#include "DebugEngine.h"
+
+// Compiles breakpoint conditions into programs that the simulator runs when the CPU reaches the breakpoint.
+//
+// The syntax is that of C expressions with the operators || && | ^ & == != < <= > >= + - ! ~,
+// where operands are numbers (123, 0x7B, 7Bh), register names (A, HL, BC' etc.) and symbols
+// from the loaded modules (they evaluate to their address). As in Z80 assembly, parentheses
+// around an address mean the byte at that address, as in "(HL) != 0" or "(counter) == 5".
+// Parentheses around an expression that contains a comparison or logical operator
+// are simple grouping, as in "(A == 1) || (A == 2)".
+//
+// The same expressions, between braces, give the values that a tracepoint records.
+
+class condition_compiler
+{
+	IDebugProgram2* _program;
+	UINT _radix;
+	const wchar_t* _p;
+	vector_nothrow<uint8_t>& _code;
+
+	struct binary_op
+	{
+		const wchar_t* text;
+		uint8_t precedence;
+		bool is_condition; // true for comparison and logical operators
+		BreakpointConditionOp op;
+	};
+
+	// Longer operators come first so that "<=" is not matched as "<".
+	static constexpr binary_op binary_ops[] =
+	{
+		{ L"||", 1, true,  BreakpointConditionOp::LogicalOr },
+		{ L"&&", 2, true,  BreakpointConditionOp::LogicalAnd },
+		{ L"==", 6, true,  BreakpointConditionOp::Eq },
+		{ L"!=", 6, true,  BreakpointConditionOp::Ne },
+		{ L"<=", 7, true,  BreakpointConditionOp::Le },
+		{ L">=", 7, true,  BreakpointConditionOp::Ge },
+		{ L"|",  3, false, BreakpointConditionOp::Or },
+		{ L"^",  4, false, BreakpointConditionOp::Xor },
+		{ L"&",  5, false, BreakpointConditionOp::And },
+		{ L"<",  7, true,  BreakpointConditionOp::Lt },
+		{ L">",  7, true,  BreakpointConditionOp::Gt },
+		{ L"+",  8, false, BreakpointConditionOp::Add },
+		{ L"-",  8, false, BreakpointConditionOp::Sub },
+	};
+
+public:
+	condition_compiler (IDebugProgram2* program, UINT radix, const wchar_t* text, vector_nothrow<uint8_t>& code)
+		: _program(program), _radix(radix), _p(text), _code(code)
+	{ }
+
+	// Compiles an expression that ends at "terminator", and appends its program to the code.
+	HRESULT compile (wchar_t terminator = 0)
+	{
+		bool is_condition;
+		auto hr = parse_binary(1, is_condition); RETURN_IF_FAILED_EXPECTED(hr);
+		skip_spaces();
+		if (*_p != terminator)
+			return E_INVALID_BREAKPOINT_CONDITION;
+		return S_OK;
+	}
+
+	const wchar_t* position() const { return _p; }
+
+private:
+	void skip_spaces()
+	{
+		while (iswspace(*_p))
+			_p++;
+	}
+
+	static bool is_identifier_char (wchar_t ch)
+	{
+		return iswalnum(ch) || (ch == '_') || (ch == '.') || (ch == '\'') || (ch == '@');
+	}
+
+	static bool equals (const wchar_t* str, size_t len, const char* name)
+	{
+		for (size_t i = 0; i < len; i++, name++)
+		{
+			if (!*name || ((str[i] & 0xDF) != (*name & 0xDF)))
+				return false;
+		}
+
+		return !*name;
+	}
+
+	HRESULT emit (BreakpointConditionOp op)
+	{
+		bool pushed = _code.try_push_back((uint8_t)op); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		return S_OK;
+	}
+
+	HRESULT emit (BreakpointConditionOp op, uint8_t operand)
+	{
+		auto hr = emit(op); RETURN_IF_FAILED(hr);
+		bool pushed = _code.try_push_back(operand); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		return S_OK;
+	}
+
+	HRESULT emit_const (uint16_t value)
+	{
+		auto hr = emit(BreakpointConditionOp::PushConst, (uint8_t)value); RETURN_IF_FAILED(hr);
+		bool pushed = _code.try_push_back((uint8_t)(value >> 8)); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		return S_OK;
+	}
+
+	// Precedence climbing: parses operands joined by binary operators of at least "min_precedence".
+	HRESULT parse_binary (uint8_t min_precedence, bool& is_condition)
+	{
+		auto hr = parse_unary(is_condition); RETURN_IF_FAILED_EXPECTED(hr);
+
+		while (true)
+		{
+			skip_spaces();
+			const binary_op* found = nullptr;
+			for (auto& op : binary_ops)
+			{
+				if (!wcsncmp(_p, op.text, wcslen(op.text)))
+				{
+					found = &op;
+					break;
+				}
+			}
+
+			if (!found || (found->precedence < min_precedence))
+				return S_OK;
+
+			_p += wcslen(found->text);
+			bool rhs_is_condition;
+			hr = parse_binary(found->precedence + 1, rhs_is_condition); RETURN_IF_FAILED_EXPECTED(hr);
+			hr = emit(found->op); RETURN_IF_FAILED(hr);
+			is_condition |= found->is_condition | rhs_is_condition;
+		}
+	}
+
+	HRESULT parse_unary (bool& is_condition)
+	{
+		skip_spaces();
+		BreakpointConditionOp op;
+		if ((*_p == '!') && (_p[1] != '='))
+			op = BreakpointConditionOp::Not;
+		else if (*_p == '-')
+			op = BreakpointConditionOp::Neg;
+		else if (*_p == '~')
+			op = BreakpointConditionOp::Compl;
+		else
+			return parse_primary(is_condition);
+
+		_p++;
+		auto hr = parse_unary(is_condition); RETURN_IF_FAILED_EXPECTED(hr);
+		hr = emit(op); RETURN_IF_FAILED(hr);
+		is_condition |= (op == BreakpointConditionOp::Not);
+		return S_OK;
+	}
+
+	HRESULT parse_primary (bool& is_condition)
+	{
+		HRESULT hr;
+		skip_spaces();
+		is_condition = false;
+
+		if (*_p == '(')
+		{
+			_p++;
+			hr = parse_binary(1, is_condition); RETURN_IF_FAILED_EXPECTED(hr);
+			skip_spaces();
+			if (*_p != ')')
+				return E_INVALID_BREAKPOINT_CONDITION;
+			_p++;
+
+			if (!is_condition)
+			{
+				hr = emit(BreakpointConditionOp::ReadMem8); RETURN_IF_FAILED(hr);
+			}
+
+			return S_OK;
+		}
+
+		const wchar_t* start = _p;
+		while (is_identifier_char(*_p))
+			_p++;
+		size_t len = _p - start;
+		if (!len)
+			return E_INVALID_BREAKPOINT_CONDITION;
+
+		wchar_t token[64];
+		if (len >= _countof(token))
+			return E_INVALID_BREAKPOINT_CONDITION;
+		wcsncpy_s (token, start, len);
+
+		if (iswdigit(start[0]))
+		{
+			// With the debugger in hexadecimal mode, plain numbers are hex; prefixes and suffixes work in both modes.
+			DWORD value;
+			wchar_t* end = token;
+			if (_radix == 16)
+				value = wcstoul(token, &end, 16);
+			if (*end && (ParseNumber(token, &value) != S_OK))
+				return E_INVALID_BREAKPOINT_CONDITION;
+
+			if (value > 0xFFFF)
+				return E_INVALID_BREAKPOINT_CONDITION;
+
+			return emit_const((uint16_t)value);
+		}
+
+		for (uint8_t i = 0; i < (uint8_t)z80_reg16::count; i++)
+		{
+			if (equals(start, len, z80_reg16_names[i]))
+				return emit(BreakpointConditionOp::PushReg16, i);
+		}
+
+		for (uint8_t i = 0; i < (uint8_t)z80_reg8::count; i++)
+		{
+			if (equals(start, len, z80_reg8_names[i]))
+				return emit(BreakpointConditionOp::PushReg8, i);
+		}
+
+		UINT16 address;
+		hr = GetAddressFromSymbol(_program, token, &address);
+		if (FAILED(hr))
+			return E_INVALID_BREAKPOINT_CONDITION;
+
+		return emit_const(address);
+	}
+};
+
+HRESULT CompileBreakpointCondition (IDebugProgram2* program, LPCWSTR text, UINT radix, vector_nothrow<uint8_t>& condition)
+{
+	condition.clear();
+	condition_compiler c (program, radix, text, condition);
+	return c.compile();
+}
+
+HRESULT CompileTracepointValues (IDebugProgram2* program, LPCWSTR message, UINT radix, vector_nothrow<uint8_t>& values)
+{
+	values.clear();
+	uint32_t count = 0;
+	for (const wchar_t* p = message; *p; )
+	{
+		if (*p++ != '{')
+			continue;
+
+		if (++count > TracepointMaxValues)
+			return E_INVALID_BREAKPOINT_CONDITION;
+
+		condition_compiler c (program, radix, p, values);
+		auto hr = c.compile('}'); RETURN_IF_FAILED_EXPECTED(hr);
+		p = c.position() + 1;
+	}
+
+	return S_OK;
+}
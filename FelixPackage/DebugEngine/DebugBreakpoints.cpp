@@ -3,8 +3,10 @@
 #include "DebugEngine.h"
 #include "DebugEventBase.h"
 #include "../FelixPackage.h"
+#include "SimulatorAsync.h"
 #include "shared/com.h"
 #include "shared/unordered_map_nothrow.h"
+#include "shared/string_builder.h"
 
 // https://docs.microsoft.com/en-us/visualstudio/extensibility/debugger/binding-breakpoints?view=vs-2022
 
@@ -15,6 +17,7 @@ class BreakpointManagerImpl : public IBreakpointManager, ISimulatorEventHandler
 	com_ptr<IDebugEngine2> _engine;
 	com_ptr<IDebugProgram2> _program;
 	unordered_map_nothrow<SIM_BP_COOKIE, com_ptr<IDebugBoundBreakpoint2>> _bps;
+	unordered_map_nothrow<SIM_BP_COOKIE, wil::unique_process_heap_string> _tracepointMessages;
 
 public:
 	static HRESULT CreateInstance (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program, IBreakpointManager** ppManager)
@@ -101,10 +104,78 @@ public:
 			return S_OK;
 		}
 
+		if (riidEvent == __uuidof(ISimulatorTracepointEvent))
+		{
+			com_ptr<ISimulatorTracepointEvent> tpe;
+			auto hr = event->QueryInterface(&tpe); RETURN_IF_FAILED(hr);
+			hr = OutputTracepointHits(tpe); RETURN_IF_FAILED(hr);
+			return S_OK;
+		}
+
 		return S_FALSE;
 	}
 	#pragma endregion
 
+	// Writes to the Output window one line per hit, with the braces in the message replaced by the recorded values.
+	HRESULT OutputTracepointHits (ISimulatorTracepointEvent* tpe)
+	{
+		wstring_builder sb;
+		const TracepointHit* hits = tpe->GetHits();
+		for (ULONG i = 0; i < tpe->GetHitCount(); i++)
+		{
+			auto it = _tracepointMessages.find(hits[i].cookie);
+			if (it == _tracepointMessages.end())
+				continue; // removed after the hit
+
+			uint32_t value_index = 0;
+			for (const wchar_t* p = it->second.get(); *p; p++)
+			{
+				if (*p != '{')
+				{
+					sb << *p;
+					continue;
+				}
+
+				while (*p && (*p != '}'))
+					p++;
+				if (value_index < hits[i].value_count)
+				{
+					int32_t value = hits[i].values[value_index++];
+					if (value < 0)
+						sb << '-';
+					sb << ((value < 0) ? 0u - (uint32_t)value : (uint32_t)value);
+				}
+				if (!*p)
+					break;
+			}
+
+			sb << L"\r\n";
+		}
+
+		if (ULONG lost = tpe->GetLostHitCount())
+			sb << L"(" << (uint32_t)lost << L" tracepoint hits were lost)\r\n";
+
+		RETURN_HR_IF(E_OUTOFMEMORY, sb.out_of_memory());
+		if (sb.empty())
+			return S_OK;
+
+		struct OutputStringEvent : public EventBase<IDebugOutputStringEvent2, EVENT_ASYNCHRONOUS>
+		{
+			wil::unique_bstr _text;
+
+			virtual HRESULT STDMETHODCALLTYPE GetString (BSTR* pbstrString) override
+			{
+				*pbstrString = SysAllocStringLen(_text.get(), SysStringLen(_text.get())); RETURN_IF_NULL_ALLOC(*pbstrString);
+				return S_OK;
+			}
+		};
+
+		wil::com_ptr_nothrow<OutputStringEvent> event = new (std::nothrow) OutputStringEvent(); RETURN_IF_NULL_ALLOC(event);
+		event->_text.reset(SysAllocStringLen(sb.data(), sb.size())); RETURN_IF_NULL_ALLOC(event->_text);
+		auto hr = event->Send (_callback, _engine, _program, nullptr); RETURN_IF_FAILED(hr);
+		return S_OK;
+	}
+
 	#pragma region IBreakpointManager
 	virtual HRESULT AddBreakpoint (IDebugBoundBreakpoint2* bp, BreakpointType type, bool physicalMemorySpace, UINT64 address) override
 	{
@@ -143,6 +214,8 @@ public:
 	{
 		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; }); RETURN_HR_IF(E_INVALIDARG, it == _bps.end());
 		auto hr = simulator->RemoveBreakpoint(it->first); LOG_IF_FAILED(hr);
+		if (auto tp = _tracepointMessages.find(it->first); tp != _tracepointMessages.end())
+			_tracepointMessages.erase(tp);
 		_bps.erase(it);
 
 		if (_bps.empty())
@@ -158,6 +231,70 @@ public:
 		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; });
 		return (it != _bps.end()) ? S_OK : S_FALSE;
 	}
+
+	virtual HRESULT SetCondition (IDebugBoundBreakpoint2* bp, const uint8_t* condition, uint32_t size) override
+	{
+		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; }); RETURN_HR_IF(E_INVALIDARG, it == _bps.end());
+		auto hr = simulator->SetBreakpointCondition(it->first, condition, size); RETURN_IF_FAILED(hr);
+		return S_OK;
+	}
+
+	virtual HRESULT SetPassCount (IDebugBoundBreakpoint2* bp, BreakpointPassCountStyle style, uint32_t passCount) override
+	{
+		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; }); RETURN_HR_IF(E_INVALIDARG, it == _bps.end());
+		auto hr = simulator->SetBreakpointPassCount(it->first, style, passCount); RETURN_IF_FAILED(hr);
+		return S_OK;
+	}
+
+	virtual HRESULT GetHitCount (IDebugBoundBreakpoint2* bp, uint32_t* hitCount) override
+	{
+		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; }); RETURN_HR_IF(E_INVALIDARG, it == _bps.end());
+		SIM_BP_COOKIE cookie = it->first;
+		simulator_request<uint32_t> count ([cookie](auto& count, auto c) { return simulator->GetBreakpointHitCountAsync(cookie, &count, c); });
+		auto hr = count.wait(simulator.get()); RETURN_IF_FAILED(hr);
+		*hitCount = count.value();
+		return S_OK;
+	}
+
+	virtual HRESULT SetHitCount (IDebugBoundBreakpoint2* bp, uint32_t hitCount) override
+	{
+		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; }); RETURN_HR_IF(E_INVALIDARG, it == _bps.end());
+		auto hr = simulator->SetBreakpointHitCount(it->first, hitCount); RETURN_IF_FAILED(hr);
+		return S_OK;
+	}
+
+	virtual HRESULT SetTracepoint (IDebugBoundBreakpoint2* bp, LPCWSTR message, const uint8_t* values, uint32_t size) override
+	{
+		auto it = _bps.find_if([bp](auto& p) { return p.second == bp; }); RETURN_HR_IF(E_INVALIDARG, it == _bps.end());
+		SIM_BP_COOKIE cookie = it->first;
+
+		wil::unique_process_heap_string copy;
+		auto tp = _tracepointMessages.find(cookie);
+		if (message)
+		{
+			copy = wil::make_process_heap_string_nothrow(message); RETURN_IF_NULL_ALLOC(copy);
+			if (tp == _tracepointMessages.end())
+			{
+				bool reserved = _tracepointMessages.try_reserve(_tracepointMessages.size() + 1); RETURN_HR_IF(E_OUTOFMEMORY, !reserved);
+			}
+		}
+
+		auto hr = simulator->SetTracepoint(cookie, !!message, values, size); RETURN_IF_FAILED(hr);
+
+		if (!message)
+		{
+			if (tp != _tracepointMessages.end())
+				_tracepointMessages.erase(tp);
+		}
+		else if (tp != _tracepointMessages.end())
+			tp->second = std::move(copy);
+		else
+		{
+			bool inserted = _tracepointMessages.try_insert({ cookie, std::move(copy) }); WI_ASSERT(inserted);
+		}
+
+		return S_OK;
+	}
 	#pragma endregion
 };
 
@@ -260,6 +397,22 @@ public:
 
 // ============================================================================
 
+static HRESULT ToSimulatorPassCountStyle (const BP_PASSCOUNT& pc, BreakpointPassCountStyle* style)
+{
+	switch (pc.stylePassCount)
+	{
+		case BP_PASSCOUNT_NONE:              *style = BreakpointPassCountStyle::None; return S_OK;
+		case BP_PASSCOUNT_EQUAL:             *style = BreakpointPassCountStyle::Equal; return S_OK;
+		case BP_PASSCOUNT_EQUAL_OR_GREATER:  *style = BreakpointPassCountStyle::EqualOrGreater; return S_OK;
+		case BP_PASSCOUNT_MOD:
+			RETURN_HR_IF(E_INVALIDARG, !pc.dwPassCount);
+			*style = BreakpointPassCountStyle::Mod;
+			return S_OK;
+		default:
+			RETURN_HR(E_NOTIMPL);
+	}
+}
+
 struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 {
 	ULONG _refCount = 0;
@@ -268,11 +421,16 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 	com_ptr<IBreakpointManager> _bpman;
 	bool _physicalMemorySpace;
 	UINT64 _address;
-	DWORD _hitCount = 0;
+	DWORD _hitCount = 0; // while enabled, the simulator keeps the count
 	enum_BP_STATE _state = BPS_NONE;
+	vector_nothrow<uint8_t> _condition; // compiled; empty if the breakpoint is unconditional
+	BreakpointPassCountStyle _passCountStyle = BreakpointPassCountStyle::None;
+	DWORD _passCount = 0;
+	wil::unique_process_heap_string _tracepointMessage; // null if this is not a tracepoint
+	vector_nothrow<uint8_t> _tracepointValues;
 
 	static HRESULT CreateInstance (IDebugPendingBreakpoint2* parent, IDebugProgram2* program, IBreakpointManager* bpman,
-		bool physicalMemorySpace, UINT64 address, IDebugBoundBreakpoint2** to)
+		bool physicalMemorySpace, UINT64 address, LPCWSTR tracepointMessageOrNull, IDebugBoundBreakpoint2** to)
 	{
 		auto p = wil::com_ptr_nothrow(new (std::nothrow) BoundBreakpointImpl()); RETURN_IF_NULL_ALLOC(p);
 
@@ -281,6 +439,11 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 		p->_bpman = bpman;
 		p->_physicalMemorySpace = physicalMemorySpace;
 		p->_address = address;
+		if (tracepointMessageOrNull)
+		{
+			auto hr = CompileTracepointValues (program, tracepointMessageOrNull, 10, p->_tracepointValues); RETURN_IF_FAILED_EXPECTED(hr);
+			p->_tracepointMessage = wil::make_process_heap_string_nothrow(tracepointMessageOrNull); RETURN_IF_NULL_ALLOC(p->_tracepointMessage);
+		}
 
 		*to = p.detach();
 		return S_OK;
@@ -326,6 +489,13 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 		if (_state == PBPS_DELETED)
 			RETURN_HR(E_BP_DELETED);
 
+		if (_state == BPS_ENABLED)
+		{
+			uint32_t hitCount;
+			auto hr = _bpman->GetHitCount(this, &hitCount); RETURN_IF_FAILED(hr);
+			_hitCount = hitCount;
+		}
+
 		*pdwHitCount = _hitCount;
 		return S_OK;
 	}
@@ -349,6 +519,12 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 			if (_state != BPS_ENABLED)
 			{
 				hr = _bpman->AddBreakpoint(this, BreakpointType::Code, _physicalMemorySpace, _address); RETURN_IF_FAILED(hr);
+				hr = apply_to_simulator();
+				if (FAILED(hr))
+				{
+					_bpman->RemoveBreakpoint(this);
+					RETURN_HR(hr);
+				}
 			}
 
 			_state = BPS_ENABLED;
@@ -358,6 +534,10 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 		{
 			if (_state == BPS_ENABLED)
 			{
+				uint32_t hitCount;
+				hr = _bpman->GetHitCount(this, &hitCount); LOG_IF_FAILED(hr);
+				if (SUCCEEDED(hr))
+					_hitCount = hitCount;
 				hr = _bpman->RemoveBreakpoint(this); RETURN_IF_FAILED(hr);
 			}
 			_state = BPS_DISABLED;
@@ -372,18 +552,51 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 		if (_state == PBPS_DELETED)
 			RETURN_HR(E_BP_DELETED);
 
+		if (_state == BPS_ENABLED)
+		{
+			auto hr = _bpman->SetHitCount(this, dwHitCount); RETURN_IF_FAILED(hr);
+		}
+
 		_hitCount = dwHitCount;
 		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE SetCondition (BP_CONDITION bpCondition) override
 	{
-		RETURN_HR(E_NOTIMPL);
+		RETURN_HR_IF(E_BP_DELETED, _state == BPS_DELETED);
+
+		vector_nothrow<uint8_t> condition;
+		if (bpCondition.styleCondition == BP_COND_WHEN_TRUE)
+		{
+			auto hr = CompileBreakpointCondition (_program.get(), bpCondition.bstrCondition, bpCondition.nRadix, condition); RETURN_IF_FAILED_EXPECTED(hr);
+		}
+		else
+			RETURN_HR_IF(E_NOTIMPL, bpCondition.styleCondition != BP_COND_NONE);
+
+		if (_state == BPS_ENABLED)
+		{
+			auto hr = _bpman->SetCondition(this, condition.data(), condition.size()); RETURN_IF_FAILED(hr);
+		}
+
+		_condition = std::move(condition);
+		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE SetPassCount (BP_PASSCOUNT bpPassCount) override
 	{
-		RETURN_HR(E_NOTIMPL);
+		RETURN_HR_IF(E_BP_DELETED, _state == BPS_DELETED);
+
+		BreakpointPassCountStyle style;
+		auto hr = ToSimulatorPassCountStyle(bpPassCount, &style); RETURN_IF_FAILED(hr);
+
+		if (_state == BPS_ENABLED)
+		{
+			hr = _bpman->SetPassCount(this, style, bpPassCount.dwPassCount); RETURN_IF_FAILED(hr);
+		}
+
+		_passCountStyle = style;
+		_passCount = bpPassCount.dwPassCount;
+		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE Delete() override
@@ -404,6 +617,33 @@ struct BoundBreakpointImpl : IDebugBoundBreakpoint2, IDebugBreakpointResolution2
 	}
 	#pragma endregion
 
+	// Passes to the simulator the settings kept here while the breakpoint was not enabled.
+	HRESULT apply_to_simulator()
+	{
+		HRESULT hr;
+		if (_condition.size())
+		{
+			hr = _bpman->SetCondition(this, _condition.data(), _condition.size()); RETURN_IF_FAILED(hr);
+		}
+
+		if (_passCountStyle != BreakpointPassCountStyle::None)
+		{
+			hr = _bpman->SetPassCount(this, _passCountStyle, _passCount); RETURN_IF_FAILED(hr);
+		}
+
+		if (_hitCount)
+		{
+			hr = _bpman->SetHitCount(this, _hitCount); RETURN_IF_FAILED(hr);
+		}
+
+		if (_tracepointMessage)
+		{
+			hr = _bpman->SetTracepoint(this, _tracepointMessage.get(), _tracepointValues.data(), _tracepointValues.size()); RETURN_IF_FAILED(hr);
+		}
+
+		return S_OK;
+	}
+
 	#pragma region IDebugBreakpointResolution2
 	virtual HRESULT STDMETHODCALLTYPE GetBreakpointType (BP_TYPE *pBPType) noexcept override
 	{
@@ -565,6 +805,84 @@ struct BreakpointErrorEvent : EventBase<IDebugBreakpointErrorEvent2, EVENT_ASYNC
 
 // ============================================================================
 
+// Pending breakpoints keep the condition as text and the pass count, and pass them to each breakpoint
+// they bind; the bound breakpoint compiles the condition for the simulator. The tracepoint message
+// comes with the breakpoint request and is passed to BoundBreakpointImpl::CreateInstance.
+struct pending_bp_settings
+{
+	BP_COND_STYLE style = BP_COND_NONE;
+	wil::unique_bstr text;
+	UINT radix = 10;
+	BP_PASSCOUNT pass_count = { .dwPassCount = 0, .stylePassCount = BP_PASSCOUNT_NONE };
+	wil::unique_bstr tracepoint; // null or empty for a normal breakpoint
+
+	HRESULT init (IDebugBreakpointRequest2* request)
+	{
+		auto request3 = wil::try_com_query_nothrow<IDebugBreakpointRequest3>(request);
+		if (!request3)
+			return S_OK;
+
+		BP_REQUEST_INFO2 info = { };
+		auto hr = request3->GetRequestInfo2(BPREQI_TRACEPOINT, &info); RETURN_IF_FAILED(hr);
+		tracepoint.reset(info.bstrTracepoint);
+		return S_OK;
+	}
+
+	LPCWSTR tracepoint_message() const
+	{
+		return (tracepoint && tracepoint.get()[0]) ? tracepoint.get() : nullptr;
+	}
+
+	HRESULT set_condition (IDebugBoundBreakpoint2* boundOrNull, const BP_CONDITION& c)
+	{
+		wil::unique_bstr newText;
+		if (c.bstrCondition)
+		{
+			newText = wil::make_bstr_nothrow(c.bstrCondition); RETURN_IF_NULL_ALLOC(newText);
+		}
+
+		if (boundOrNull)
+		{
+			auto hr = boundOrNull->SetCondition(c); RETURN_IF_FAILED_EXPECTED(hr);
+		}
+
+		style = c.styleCondition;
+		text = std::move(newText);
+		radix = c.nRadix;
+		return S_OK;
+	}
+
+	HRESULT set_pass_count (IDebugBoundBreakpoint2* boundOrNull, const BP_PASSCOUNT& pc)
+	{
+		if (boundOrNull)
+		{
+			auto hr = boundOrNull->SetPassCount(pc); RETURN_IF_FAILED_EXPECTED(hr);
+		}
+
+		pass_count = pc;
+		return S_OK;
+	}
+
+	HRESULT apply_to (IDebugBoundBreakpoint2* bound)
+	{
+		HRESULT hr;
+		if (style != BP_COND_NONE)
+		{
+			BP_CONDITION c = { .pThread = nullptr, .styleCondition = style, .bstrContext = nullptr, .bstrCondition = text.get(), .nRadix = radix };
+			hr = bound->SetCondition(c); RETURN_IF_FAILED_EXPECTED(hr);
+		}
+
+		if (pass_count.stylePassCount != BP_PASSCOUNT_NONE)
+		{
+			hr = bound->SetPassCount(pass_count); RETURN_IF_FAILED_EXPECTED(hr);
+		}
+
+		return S_OK;
+	}
+};
+
+// ============================================================================
+
 struct SimplePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallback2
 {
 	ULONG _refCount = 0;
@@ -578,9 +896,10 @@ struct SimplePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallback2
 	com_ptr<IDebugBoundBreakpoint2> _boundBP;
 	com_ptr<IDebugErrorBreakpoint2> _errorBP;
 	bool _advisedDebugEventCallback = false;
+	pending_bp_settings _settings;
 
 	static HRESULT CreateInstance (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program, 
-		IBreakpointManager* bpman, bool physicalMemorySpace, UINT64 address, IDebugPendingBreakpoint2** to)
+		IBreakpointManager* bpman, IDebugBreakpointRequest2* bp_request, bool physicalMemorySpace, UINT64 address, IDebugPendingBreakpoint2** to)
 	{
 		wil::com_ptr_nothrow<SimplePendingBreakpoint> p = new (std::nothrow) SimplePendingBreakpoint(); RETURN_IF_NULL_ALLOC(p);
 		p->_callback = callback;
@@ -589,6 +908,7 @@ struct SimplePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallback2
 		p->_bpman = bpman;
 		p->_physicalMemorySpace = physicalMemorySpace;
 		p->_address = address;
+		auto hr = p->_settings.init(bp_request); RETURN_IF_FAILED(hr);
 		*to = p.detach();
 		return S_OK;
 	}
@@ -633,7 +953,8 @@ struct SimplePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallback2
 		if (_boundBP)
 			return S_FALSE;
 
-		auto hr = BoundBreakpointImpl::CreateInstance (this, _program, _bpman, _physicalMemorySpace, _address, &_boundBP); RETURN_IF_FAILED(hr);
+		auto hr = BoundBreakpointImpl::CreateInstance (this, _program, _bpman, _physicalMemorySpace, _address, _settings.tracepoint_message(), &_boundBP); RETURN_IF_FAILED(hr);
+		hr = _settings.apply_to(_boundBP.get()); LOG_IF_FAILED(hr);
 		
 		if (_stateInfo.state == BPS_ENABLED)
 			// Necessary when adding a breakpoint on a source code line while debugging.
@@ -709,12 +1030,16 @@ struct SimplePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallback2
 
 	virtual HRESULT STDMETHODCALLTYPE SetCondition (BP_CONDITION bpCondition) override
 	{
-		RETURN_HR(E_NOTIMPL);
+		RETURN_HR_IF(E_BP_DELETED, _stateInfo.state == PBPS_DELETED);
+		auto hr = _settings.set_condition(_boundBP.get(), bpCondition); RETURN_IF_FAILED_EXPECTED(hr);
+		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE SetPassCount (BP_PASSCOUNT bpPassCount) override
 	{
-		RETURN_HR(E_NOTIMPL);
+		RETURN_HR_IF(E_BP_DELETED, _stateInfo.state == PBPS_DELETED);
+		auto hr = _settings.set_pass_count(_boundBP.get(), bpPassCount); RETURN_IF_FAILED_EXPECTED(hr);
+		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE EnumBoundBreakpoints (IEnumDebugBoundBreakpoints2 **ppEnum) override
@@ -806,9 +1131,9 @@ struct SimplePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallback2
 };
 
 HRESULT MakeSimplePendingBreakpoint (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program,
-	IBreakpointManager* bpman, bool physicalMemorySpace, UINT64 address, IDebugPendingBreakpoint2** to)
+	IBreakpointManager* bpman, IDebugBreakpointRequest2* bp_request, bool physicalMemorySpace, UINT64 address, IDebugPendingBreakpoint2** to)
 {
-	return SimplePendingBreakpoint::CreateInstance (callback, engine, program, bpman, physicalMemorySpace, address, to);
+	return SimplePendingBreakpoint::CreateInstance (callback, engine, program, bpman, bp_request, physicalMemorySpace, address, to);
 }
 
 // ============================================================================
@@ -828,6 +1153,7 @@ class SourceLinePendingBreakpoint : IDebugPendingBreakpoint2, IDebugEventCallbac
 	wil::com_ptr_nothrow<IDebugErrorBreakpoint2> _errorBP;
 	bool _advisedDebugEventCallback = false;
 	wil::unique_bstr _projectDir;
+	pending_bp_settings _settings;
 
 public:
 	static HRESULT CreateInstance (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program, 
@@ -844,6 +1170,7 @@ public:
 		p->_bp_request = bp_request;
 		p->_file = wil::make_process_heap_string_nothrow(file); RETURN_IF_NULL_ALLOC(p->_file);
 		p->_line_index = line_index;
+		auto hr = p->_settings.init(bp_request); RETURN_IF_FAILED(hr);
 
 		if (auto op = wil::try_com_query_nothrow<IFelixLaunchOptionsProvider>(engine))
 		{
@@ -927,7 +1254,8 @@ WI_ASSERT(!_errorBP);
 		else
 		{
 			_errorBP = nullptr;
-			hr = BoundBreakpointImpl::CreateInstance (this, _program, _bpman, physicalMemorySpace, address, &_boundBP); RETURN_IF_FAILED(hr);
+			hr = BoundBreakpointImpl::CreateInstance (this, _program, _bpman, physicalMemorySpace, address, _settings.tracepoint_message(), &_boundBP); RETURN_IF_FAILED(hr);
+			hr = _settings.apply_to(_boundBP.get()); LOG_IF_FAILED(hr);
 
 			if (_stateInfo.state == PBPS_ENABLED)
 				// Necessary when adding a breakpoint on a source code line while debugging.
@@ -1006,12 +1334,16 @@ WI_ASSERT(!_errorBP);
 
 	virtual HRESULT STDMETHODCALLTYPE SetCondition (BP_CONDITION bpCondition) override
 	{
-		RETURN_HR(E_NOTIMPL);
+		RETURN_HR_IF(E_BP_DELETED, _stateInfo.state == PBPS_DELETED);
+		auto hr = _settings.set_condition(_boundBP.get(), bpCondition); RETURN_IF_FAILED_EXPECTED(hr);
+		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE SetPassCount (BP_PASSCOUNT bpPassCount) override
 	{
-		RETURN_HR(E_NOTIMPL);
+		RETURN_HR_IF(E_BP_DELETED, _stateInfo.state == PBPS_DELETED);
+		auto hr = _settings.set_pass_count(_boundBP.get(), bpPassCount); RETURN_IF_FAILED_EXPECTED(hr);
+		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE EnumBoundBreakpoints (__RPC__deref_out_opt IEnumDebugBoundBreakpoints2 **ppEnum) override
@@ -1104,7 +1436,8 @@ WI_ASSERT(!_errorBP);
 							hr = ::GetAddressFromSourceLocation (module.get(), _projectDir.get(), _file.get(), _line_index, &address);
 							if (SUCCEEDED(hr))
 							{
-								hr = BoundBreakpointImpl::CreateInstance (this, _program, _bpman, physicalMemorySpace, address, &_boundBP); RETURN_IF_FAILED(hr);
+								hr = BoundBreakpointImpl::CreateInstance (this, _program, _bpman, physicalMemorySpace, address, _settings.tracepoint_message(), &_boundBP); RETURN_IF_FAILED(hr);
+								hr = _settings.apply_to(_boundBP.get()); LOG_IF_FAILED(hr);
 								_errorBP = nullptr;
 
 								WI_ASSERT (_stateInfo.state == PBPS_ENABLED);
@@ -2,6 +2,7 @@
 #include "pch.h"
 #include "DebugEngine.h"
 #include "../FelixPackage.h"
+#include "SimulatorAsync.h"
 #include "shared/string_builder.h"
 #include "shared/OtherGuids.h"
 #include "shared/z80_register_set.h"
@@ -804,13 +805,41 @@ public:
 		return (uint8_t)(ptr - bytes);
 	}
 
+	static constexpr uint32_t longest_instruction = 4;
+
+	// Reads from the simulator, in one round trip, the memory that "count" instructions starting at "address" can take.
+	// Unlike ReadMemoryBus this works also while the simulation is running. Returns at most 0xFFFF bytes, so "count"
+	// may be reduced.
+	static HRESULT read_instructions (uint16_t address, uint32_t& count, wistd::unique_ptr<uint8_t[]>& bytes)
+	{
+		count = std::min(count, 0xFFFFu / longest_instruction);
+		uint16_t size = (uint16_t)(count * longest_instruction);
+		simulator_request<wistd::unique_ptr<uint8_t[]>> read ([address, size](auto& buffer, auto c)
+			{
+				buffer = wil::make_unique_nothrow<uint8_t[]>(size); RETURN_IF_NULL_ALLOC(buffer);
+				return simulator->ReadMemoryBusAsync(address, size, buffer.get(), c);
+			});
+		auto hr = read.wait(simulator.get()); RETURN_IF_FAILED(hr);
+		bytes = std::move(read.value());
+		return S_OK;
+	}
+
 	#pragma region IDebugDisassemblyStream2
 	virtual HRESULT __stdcall Read(DWORD dwInstructions, DISASSEMBLY_STREAM_FIELDS dwFields, DWORD* pdwInstructionsRead, DisassemblyData* prgDisassembly) override
 	{
 		HRESULT hr;
 
+		// Everything Read needs from the simulator, asked at once rather than line by line.
+		uint32_t count = dwInstructions;
+		wistd::unique_ptr<uint8_t[]> bytes;
+		simulator_request<z80_register_set> regs ([](auto& regs, auto c) { return simulator->GetRegistersAsync(&regs, sizeof(regs), c); });
+		hr = read_instructions (_address, count, bytes); RETURN_IF_FAILED(hr);
+		hr = regs.wait(simulator.get()); RETURN_IF_FAILED(hr);
+		uint16_t pc = regs.value().pc;
+		const uint8_t* lineBytes = bytes.get();
+
 		DWORD& i = *pdwInstructionsRead;
-		for (i = 0; i < dwInstructions; i++)
+		for (i = 0; i < count; i++)
 		{
 			auto dd = &prgDisassembly[i];
 			dd->dwFields = 0;
@@ -852,20 +881,14 @@ public:
 			{
 				const char* opcode;
 				opersb operands;
-				wistd::unique_ptr<uint8_t[]> decodeBuffer;
-				static constexpr uint32_t longest_expected = 4;
-				decodeBuffer = wil::make_unique_nothrow<uint8_t[]>(longest_expected); 
-				hr = simulator->ReadMemoryBus(_address, (uint16_t)longest_expected, decodeBuffer.get()); RETURN_IF_FAILED(hr);
-				decodedLength = DecodeInstruction (_address, decodeBuffer.get(), opcode, operands, dwFields & DSF_OPERANDS_SYMBOLS);
-				WI_ASSERT(decodedLength <= longest_expected);
+				decodedLength = DecodeInstruction (_address, lineBytes, opcode, operands, dwFields & DSF_OPERANDS_SYMBOLS);
+				WI_ASSERT(decodedLength <= longest_instruction);
 				hr = MakeBstrFromString (opcode, &bstrOpcode); RETURN_IF_FAILED(hr);
 				bstrOperands.reset (SysAllocStringLen(operands.data(), operands.size())); RETURN_IF_NULL_ALLOC(bstrOperands);
 			}
 
 			// If the instruction we decoded starts before PC and ends after it,
 			// we're doing something wrong, so let's replace it with some question marks.
-			uint16_t pc;
-			hr = simulator->GetPC(&pc); RETURN_IF_FAILED(hr);
 			if (pc > _address && pc < _address + decodedLength)
 			{
 				bstrOpcode = wil::make_bstr_nothrow(L"??");
@@ -876,15 +899,13 @@ public:
 			if (dwFields & DSF_CODEBYTES) // 4
 			{
 				uint32_t opcodeLength = std::min(8u, decodedLength);
-				auto decodeBuffer = wil::make_unique_nothrow<uint8_t[]>(opcodeLength); RETURN_IF_NULL_ALLOC(decodeBuffer);
-				hr = simulator->ReadMemoryBus (_address, opcodeLength, decodeBuffer.get()); RETURN_IF_FAILED(hr);
 				wchar_t buffer[64];
-				swprintf_s (buffer, L"%02X", decodeBuffer.get()[0]);
+				swprintf_s (buffer, L"%02X", lineBytes[0]);
 				for (uint32_t i = 1; i < opcodeLength; i++)
 				{
 					wcscat_s (buffer, L" ");
 					wchar_t b[5];
-					swprintf_s (b, L"%02X", decodeBuffer.get()[i]);
+					swprintf_s (b, L"%02X", lineBytes[i]);
 					wcscat_s (buffer, b);
 				}
 
@@ -944,19 +965,15 @@ public:
 			{
 				dd->dwFlags = 0;
 
-				if (simulator->Running_HR() == S_FALSE)
-				{
-					// Silly Disassembly Window sometimes calls this function while code is running, that's why the 'if'.
-					z80_register_set regs;
-					hr = simulator->GetRegisters(&regs, (uint32_t)sizeof(regs)); RETURN_IF_FAILED(hr);
-					if (regs.pc == _address)
-						dd->dwFlags |= DF_INSTRUCTION_ACTIVE;
-				}
+				// Silly Disassembly Window sometimes calls this function while code is running, that's why the 'if'.
+				if ((simulator->Running_HR() == S_FALSE) && (pc == _address))
+					dd->dwFlags |= DF_INSTRUCTION_ACTIVE;
 
 				dd->dwFields |= DSF_FLAGS;
 			}
 
 			_address += decodedLength;
+			lineBytes += decodedLength;
 		}
 
 		return S_OK;
@@ -999,20 +1016,23 @@ public:
 		}
 		else
 		{
-			// Seek forward
-			for (INT64 i = 0; i < iInstructions; i++)
+			// Seek forward, decoding from a single read; read_instructions may shorten a very long seek.
+			uint32_t count = (uint32_t)std::min(iInstructions, (INT64)0x10000);
+			wistd::unique_ptr<uint8_t[]> bytes;
+			auto hr = read_instructions (_address, count, bytes); RETURN_IF_FAILED(hr);
+			const uint8_t* p = bytes.get();
+			for (uint32_t i = 0; i < count; i++)
 			{
-				uint8_t bytes[6];
-				simulator->ReadMemoryBus (_address, sizeof(bytes), bytes);
 				const char* dummy_opcode;
 				opersb dummy_operands;
-				uint8_t instructionLength = DecodeInstruction (_address, bytes, dummy_opcode, dummy_operands, false);
+				uint8_t instructionLength = DecodeInstruction (_address, p, dummy_opcode, dummy_operands, false);
 				if ((uint32_t)_address + instructionLength >= 0x10000)
 					return S_FALSE;
 				_address += instructionLength;
+				p += instructionLength;
 			}
 
-			return S_OK;
+			return (count < iInstructions) ? S_FALSE : S_OK;
 		}
 	}
 
@@ -121,7 +121,7 @@ public:
 					com_ptr<IFelixCodeContext> z80cc;
 					hr = cc->QueryInterface(&z80cc); RETURN_IF_FAILED(hr);
 					RETURN_HR_IF(E_FAIL, z80cc->PhysicalMemorySpace());
-					hr = MakeSimplePendingBreakpoint (_callback, this, _program, _bpman, false, z80cc->Address(), ppPendingBP); RETURN_IF_FAILED(hr);
+					hr = MakeSimplePendingBreakpoint (_callback, this, _program, _bpman, pBPRequest, false, z80cc->Address(), ppPendingBP); RETURN_IF_FAILED(hr);
 					return S_OK;
 				}
 
@@ -156,7 +156,7 @@ public:
 
 					RETURN_HR_IF(E_FAIL, !converted);
 
-					hr = MakeSimplePendingBreakpoint (_callback, this, _program, _bpman, false, address, ppPendingBP); RETURN_IF_FAILED(hr);
+					hr = MakeSimplePendingBreakpoint (_callback, this, _program, _bpman, pBPRequest, false, address, ppPendingBP); RETURN_IF_FAILED(hr);
 					return S_OK;
 				}
 
@@ -909,6 +909,23 @@ HRESULT GetModuleAtAddress (IDebugProgram2* program, UINT64 address, OUT IDebugM
 	return E_NO_MODULE_AT_THIS_ADDRESS;
 }
 
+HRESULT GetAddressFromSymbol (IDebugProgram2* program, LPCWSTR symbol, OUT UINT16* pAddress)
+{
+	com_ptr<IEnumDebugModules2> modules;
+	auto hr = program->EnumModules(&modules); RETURN_IF_FAILED(hr);
+	com_ptr<IDebugModule2> module;
+	while(SUCCEEDED(modules->Next(1, &module, nullptr)) && module)
+	{
+		wil::com_ptr_nothrow<IZ80Module> z80m;
+		wil::com_ptr_nothrow<IFelixSymbols> syms;
+		if (SUCCEEDED(module->QueryInterface(&z80m)) && SUCCEEDED(z80m->GetSymbols(&syms))
+			&& SUCCEEDED(syms->GetAddressFromSymbol(symbol, pAddress)))
+			return S_OK;
+	}
+
+	return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+}
+
 HRESULT GetSymbolFromAddress(
 	__RPC__in IDebugProgram2* program,
 	__RPC__in uint16_t address,
@@ -2,12 +2,14 @@
 #pragma once
 #include "Simulator.h"
 #include "../FelixPackage.h"
+#include "shared/vector_nothrow.h"
 
 // TODO: rename these to E_Z80_XXX
 #define E_UNKNOWN_FILE_EXTENSION             MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x201)
 #define E_UNRECOGNIZED_DEBUG_FILE_EXTENSION  MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x203)
 #define E_NO_MODULE_AT_THIS_ADDRESS          MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x207)
 #define E_NO_EXE_FILENAME                    MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x20B)
+#define E_INVALID_BREAKPOINT_CONDITION       MAKE_HRESULT(SEVERITY_ERROR, FACILITY_ITF, 0x20D)
 
 struct __declspec(novtable) __declspec(uuid("{E6B46DE8-63A5-4F11-BDD8-E61559A5525E}")) IZ80DebugPort : IDebugPort2
 {
@@ -46,6 +48,13 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{FCC163D3-2F23-457E-BDDD-EE5A94D9EC83}")
 	virtual HRESULT AddBreakpoint (IDebugBoundBreakpoint2* bp, BreakpointType type, bool physicalMemorySpace, UINT64 address) = 0;
 	virtual HRESULT RemoveBreakpoint (IDebugBoundBreakpoint2* bp) = 0;
 	virtual HRESULT ContainsBreakpoint (IDebugBoundBreakpoint2* bp) = 0;
+	virtual HRESULT SetCondition (IDebugBoundBreakpoint2* bp, const uint8_t* condition, uint32_t size) = 0;
+	virtual HRESULT SetPassCount (IDebugBoundBreakpoint2* bp, BreakpointPassCountStyle style, uint32_t passCount) = 0;
+	virtual HRESULT GetHitCount (IDebugBoundBreakpoint2* bp, uint32_t* hitCount) = 0;
+	virtual HRESULT SetHitCount (IDebugBoundBreakpoint2* bp, uint32_t hitCount) = 0;
+	// Makes a breakpoint a tracepoint (see ISimulator::SetTracepoint) whose hits are written to the Output window
+	// as "message", with the expressions between braces replaced by "values". Pass a null "message" to make it a normal breakpoint.
+	virtual HRESULT SetTracepoint (IDebugBoundBreakpoint2* bp, LPCWSTR message, const uint8_t* values, uint32_t size) = 0;
 };
 
 struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{EE258338-F1FA-4FE5-A518-F7A589F43B60}") IFelixLoadCompleteEvent : IUnknown
@@ -54,7 +63,7 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{EE258338-F1FA-4FE5-A518-F7A589F43B60}")
 
 HRESULT MakeBreakpointManager (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program, IBreakpointManager** ppManager);
 HRESULT MakeSimplePendingBreakpoint (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program,
-	IBreakpointManager* bpman, bool physicalMemorySpace, UINT64 address, IDebugPendingBreakpoint2** to);
+	IBreakpointManager* bpman, IDebugBreakpointRequest2* bp_request, bool physicalMemorySpace, UINT64 address, IDebugPendingBreakpoint2** to);
 HRESULT MakeSourceLinePendingBreakpoint (IDebugEventCallback2* callback, IDebugEngine2* engine, IDebugProgram2* program,
 	IBreakpointManager* bpman,
 	IDebugBreakpointRequest2* bp_request, const wchar_t* file, uint32_t line_index, IDebugPendingBreakpoint2** to);
@@ -93,4 +102,13 @@ HRESULT GetSymbolFromAddress(
 	__RPC__deref_out_opt SymbolKind* foundKind,
 	__RPC__deref_out_opt BSTR* foundSymbol,
 	__RPC__deref_out_opt UINT16* foundOffset,
-	__RPC__deref_out_opt IDebugModule2** foundModule);
\ No newline at end of file
+	__RPC__deref_out_opt IDebugModule2** foundModule);
+HRESULT GetAddressFromSymbol (IDebugProgram2* program, LPCWSTR symbol, OUT UINT16* pAddress);
+
+// Compiles a breakpoint condition such as "A == 3Fh && (HL) != 0" into the program format
+// described at BreakpointConditionOp. Returns E_INVALID_BREAKPOINT_CONDITION for syntax errors.
+HRESULT CompileBreakpointCondition (IDebugProgram2* program, LPCWSTR text, UINT radix, vector_nothrow<uint8_t>& condition);
+
+// Compiles the expressions between braces in a tracepoint message such as "A = {A}, counter = {(counter)}"
+// into a single program that leaves their values on the stack, for ISimulator::SetTracepoint.
+HRESULT CompileTracepointValues (IDebugProgram2* program, LPCWSTR message, UINT radix, vector_nothrow<uint8_t>& values);
\ No newline at end of file
@@ -7,6 +7,7 @@
 #include "DebugEngine.h"
 #include "DebugEventBase.h"
 #include "../FelixPackage.h"
+#include "SimulatorAsync.h"
 
 static const wchar_t SingleDebugProgramName[] = L"Z80 Program";
 
@@ -207,59 +208,9 @@ public:
 					_stepOverOrOutBreakpoint = 0;
 				}
 
-				uint16_t pc;
-				hr = simulator->GetPC(&pc); RETURN_IF_FAILED(hr);
-
-				uint32_t len = 0;
-///				TryDecodeBlockInstruction (pc, &len, nullptr); // return value ignored on purpose; we're looking at "len" instead.
-
-				if (!len)
-				{
-					uint8_t buffer[4];
-					hr = simulator->ReadMemoryBus(pc, sizeof(buffer), buffer); RETURN_IF_FAILED(hr);
-
-					if (buffer[0] == 0xCD // CALL nn
-						||  (buffer[0] & 0xC7) == 0xC4) // CALL cc, nn
-					{
-						len = 3;
-					}
-					else if ((buffer[0] & 0xC7) == 0xC7) // RST p
-					{
-						len = 1;
-					}
-					else if ((buffer[0] == 0xED && buffer[1] == 0xB0) // LDIR
-						|| (buffer[0] == 0xED && buffer[1] == 0xB8) // LDDR
-						|| (buffer[0] == 0xED && buffer[1] == 0xB1) // CPIR
-						|| (buffer[0] == 0xED && buffer[1] == 0xB9)) // CPDR
-					{
-						len = 2;
-					}
-					else if (buffer[0] == 0x76) // HALT
-					{
-						len = 1;
-					}
-				}
-
-				if (len)
-				{
-					hr = simulator->AddBreakpoint (BreakpointType::Code, false, pc + len, &_stepOverOrOutBreakpoint); RETURN_IF_FAILED(hr);
-					auto clearBP = wil::scope_exit([this]
-						{ 
-							simulator->RemoveBreakpoint(_stepOverOrOutBreakpoint);
-							_stepOverOrOutBreakpoint = 0;
-						});
-
-					bool check_breakpoints = false;
-					hr = simulator->Resume(check_breakpoints); RETURN_IF_FAILED(hr);
-
-					clearBP.release();
-					return S_OK;
-				}
-				else
-				{
-					auto hr = simulator->SimulateOne(); RETURN_IF_FAILED(hr);
-					return S_OK;
-				}
+				// The rest waits for the simulator; the step complete event comes when it's done.
+				bool started = step_over().started; RETURN_HR_IF(E_OUTOFMEMORY, !started);
+				return S_OK;
 			}
 			else if (sk == STEP_OUT)
 			{
@@ -281,6 +232,104 @@ public:
 			RETURN_HR(E_NOTIMPL);
 	}
 
+	// For the instructions that Step Over steps over by putting a breakpoint after them and resuming - CALL, RST,
+	// the repeating block instructions and HALT - returns their length; for all others returns zero.
+	static uint32_t step_over_length (const uint8_t (&buffer)[4])
+	{
+		if (buffer[0] == 0xCD // CALL nn
+			||  (buffer[0] & 0xC7) == 0xC4) // CALL cc, nn
+		{
+			return 3;
+		}
+		else if ((buffer[0] & 0xC7) == 0xC7) // RST p
+		{
+			return 1;
+		}
+		else if ((buffer[0] == 0xED && buffer[1] == 0xB0) // LDIR
+			|| (buffer[0] == 0xED && buffer[1] == 0xB8) // LDDR
+			|| (buffer[0] == 0xED && buffer[1] == 0xB1) // CPIR
+			|| (buffer[0] == 0xED && buffer[1] == 0xB9)) // CPDR
+		{
+			return 2;
+		}
+		else if (buffer[0] == 0x76) // HALT
+		{
+			return 1;
+		}
+
+		return 0;
+	}
+
+	// Step Over, after Step returned. Each request is a round trip to the simulator thread,
+	// during which the main thread goes on with other work.
+	fire_and_forget step_over()
+	{
+		com_ptr<DebugProgramImpl> self = this; // keeps us alive until the step is done
+
+		simulator_request<z80_register_set> regs ([](auto& regs, auto c) { return simulator->GetRegistersAsync(&regs, sizeof(regs), c); });
+		HRESULT hr = co_await regs;
+		if (!step_can_continue(hr))
+			co_return;
+
+		uint16_t pc = regs.value().pc;
+		simulator_request<uint8_t[4]> bytes ([pc](auto& buffer, auto c) { return simulator->ReadMemoryBusAsync(pc, sizeof(buffer), buffer, c); });
+		hr = co_await bytes;
+		if (!step_can_continue(hr))
+			co_return;
+
+		uint32_t len = step_over_length(bytes.value());
+		if (!len)
+		{
+			// The SimulateOne event completes the step.
+			simulator_request<> simulateOne ([](auto c) { return simulator->SimulateOneAsync(c); });
+			hr = co_await simulateOne;
+			step_can_continue(hr);
+			co_return;
+		}
+
+		simulator_request<SIM_BP_COOKIE> bp ([pc, len](auto& cookie, auto c)
+			{ return simulator->AddBreakpointAsync (BreakpointType::Code, false, pc + len, &cookie, c); });
+		hr = co_await bp;
+		if (!step_can_continue(hr))
+		{
+			if (SUCCEEDED(hr))
+			{
+				hr = simulator->RemoveBreakpoint(bp.value()); LOG_IF_FAILED(hr);
+			}
+			co_return;
+		}
+
+		// Hitting this breakpoint completes the step; see ProcessSimulatorEvent.
+		_stepOverOrOutBreakpoint = bp.value();
+
+		bool check_breakpoints = false;
+		simulator_request<> resume ([check_breakpoints](auto c) { return simulator->ResumeAsync(check_breakpoints, c); });
+		hr = co_await resume;
+		if (FAILED(hr) && _stepOverOrOutBreakpoint)
+		{
+			auto hr = simulator->RemoveBreakpoint(_stepOverOrOutBreakpoint); LOG_IF_FAILED(hr);
+			_stepOverOrOutBreakpoint = 0;
+		}
+		step_can_continue(hr);
+	}
+
+	// Called by step_over after each request. Returns false if the step should go no further: if the program was
+	// terminated meanwhile, or if the request failed; in the latter case it completes the step, so VS doesn't wait for it.
+	bool step_can_continue (HRESULT hr)
+	{
+		if (!_advisingSimulatorEvents)
+			return false;
+
+		if (FAILED(hr))
+		{
+			LOG_HR(hr);
+			SendStepCompleteEvent();
+			return false;
+		}
+
+		return true;
+	}
+
 	HRESULT STDMETHODCALLTYPE CauseBreak() override
 	{
 		return simulator->Break();
@@ -41,6 +41,9 @@ ULONG ReleaseST (T* _this, ULONG& refCount)
 	return 0;
 }
 
+// Everything below is COM proper, for Windows only. Builds for other platforms get SetErrorInfo from Simulator/Impl/win32_compat.h.
+#ifdef _WIN32
+
 // ============================================================================
 
 template<typename I, std::enable_if_t<std::is_constructible_v<IUnknown*, I*>, int> = 0>
@@ -632,3 +635,4 @@ public:
 };
 #pragma endregion
 
+#endif // _WIN32
@@ -1,6 +1,9 @@
 
 #pragma once
-#include <wil/wistd_type_traits.h>
+#include <new>
+#include <utility>
+#include <initializer_list>
+#include <cstdlib>
 
 template<typename T>
 class vector_nothrow
@@ -101,7 +104,7 @@ public:
 		{
 			auto temp = it;
 			it++;
-			*temp = wistd::move(*it);
+			*temp = std::move(*it);
 		}
 		(*it).~T();
 		_size--;
@@ -1,14 +1,20 @@
 
 #include "pch.h"
 #include "SimulatorInternal.h"
+#ifdef _WIN32
 #include "xaudio2/include/xaudio2redist.h"
+#endif
 
-class Beeper : public IDevice, IXAudio2VoiceCallback
+class Beeper : public IBeeperDevice
+#ifdef _WIN32
+	, IXAudio2VoiceCallback
+#endif
 {
 	Bus* _io_bus;
 
 	bool _level = false;
 	UINT64 _time = 0;
+	bool _muted = false;
 
 	static constexpr uint32_t osc_freq = 3'500'000;
 	static constexpr uint32_t sample_freq = 35000;
@@ -25,20 +31,33 @@ class Beeper : public IDevice, IXAudio2VoiceCallback
 	// this is zero at the beginning, and also after each timeout between packets
 	UINT64 _previous_packet_last_sample_time = 0;
 
+	#ifdef _WIN32
 	wil::com_ptr_nothrow<IXAudio2> _xaudio2;
 	IXAudio2MasteringVoice* _mastering_voice = nullptr;
 	IXAudio2SourceVoice* _source_voice = nullptr;
+	#endif
 
 public:
-	HRESULT InitInstance (Bus* io_bus)
+	HRESULT InitInstance (Bus* io_bus, bool audio)
 	{
 		_io_bus = io_bus;
 
 		// Let's allocate upfront the space we need.
 		bool reserved = _samples.try_reserve(buffer_length_samples * bits_per_sample / 8); RETURN_HR_IF(E_OUTOFMEMORY, !reserved);
 
-		bool pushed = _io_bus->write_responders.try_push_back({ this, &process_io_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool added = _io_bus->try_add_write_responder({ this, &process_io_write_request, 0xFF, 0xFE }); RETURN_HR_IF(E_OUTOFMEMORY, !added);
 
+		#ifndef _WIN32
+		// There's no audio output on other platforms yet.
+		audio = false;
+		#endif
+		if (!audio)
+		{
+			_muted = true;
+			return S_OK;
+		}
+
+		#ifdef _WIN32
 		auto hr = XAudio2Create (&_xaudio2, 0, XAUDIO2_DEFAULT_PROCESSOR); RETURN_IF_FAILED(hr);
 		
 		//XAUDIO2_DEBUG_CONFIGURATION xadc = { };
@@ -66,12 +85,16 @@ public:
 
 		destroySourceVoice.release();
 		destroyMasteringVoice.release();
+		#endif
 
 		return S_OK;
 	}
 
 	~Beeper()
 	{
+		_io_bus->remove_responders(this);
+
+		#ifdef _WIN32
 		if (_source_voice)
 		{
 			_source_voice->DestroyVoice();
@@ -83,6 +106,7 @@ public:
 			_mastering_voice->DestroyVoice();
 			_mastering_voice = nullptr;
 		}
+		#endif
 	}
 
 	#pragma region IDevice
@@ -110,6 +134,13 @@ public:
 		constexpr uint32_t increment = osc_freq / sample_freq;
 		static_assert(osc_freq % sample_freq == 0);
 
+		if (_muted)
+		{
+			// Step over the samples we'd generate, so that _time stays on the same sample grid.
+			_time += (requested_time - _time + increment - 1) / increment * increment;
+			return;
+		}
+
 		while (_time < requested_time)
 		{
 			// TODO: after a long pause, send a first buffer with double the normal size and double the normal delay.
@@ -169,6 +200,27 @@ public:
 	}
 	#pragma endregion
 
+	#pragma region IBeeperDevice
+	virtual void SetMuted (bool muted) override
+	{
+		#ifdef _WIN32
+		muted |= !_source_voice; // without an audio output we stay muted
+		#else
+		muted = true;
+		#endif
+		if (_muted != muted)
+		{
+			_muted = muted;
+
+			// Drop whatever was collected for the current packet. When unmuted, the first packet
+			// will start at the first level change, as it does after a long silence.
+			_samples.clear();
+			_previous_packet_last_sample_level = _level;
+			_previous_packet_last_sample_time = 0;
+		}
+	}
+	#pragma endregion
+
 	void PushSample (uint8_t value)
 	{
 		WI_ASSERT(_samples.size() < _samples.capacity());
@@ -185,20 +237,21 @@ public:
 
 	static void process_io_write_request (IDevice* d, uint16_t address, uint8_t value)
 	{
-		if ((address & 0xFF) == 0xFE)
+		auto* b = static_cast<Beeper*>(d);
+		bool new_level = !!(value & 0x10) ^ !!(value & 8);
+		if (b->_level != new_level)
 		{
-			auto* b = static_cast<Beeper*>(d);
-			bool new_level = !!(value & 0x10) ^ !!(value & 8);
-			if (b->_level != new_level)
-			{
-				b->_level = new_level;
-				//OutputDebugString(new_level ? L"1" : L"0");
-			}
+			b->_level = new_level;
+			//OutputDebugString(new_level ? L"1" : L"0");
 		}
 	}
 
 	void SendSamplesToXAudio (const uint8_t* data, uint32_t data_size_bytes)
 	{
+		#ifdef _WIN32
+		if (!_source_voice)
+			return;
+
 		XAUDIO2_VOICE_STATE state;
 		_source_voice->GetState (&state);
 		if (state.BuffersQueued == XAUDIO2_MAX_QUEUED_BUFFERS)
@@ -223,8 +276,10 @@ public:
 		if (FAILED(hr))
 			// Not sure how to handle this. We're not on the GUI thread here so our telemetry dialog code will probably crash.
 			free(copy);
+		#endif
 	}
 
+	#ifdef _WIN32
 	#pragma region IXAudio2VoiceCallback
 	virtual void STDMETHODCALLTYPE OnVoiceProcessingPassStart (UINT32 BytesRequired) override
 	{
@@ -255,12 +310,13 @@ public:
 	{
 	}
 	#pragma endregion
+	#endif
 };
 
-HRESULT STDMETHODCALLTYPE MakeBeeper (Bus* io_bus, wistd::unique_ptr<IDevice>* ppDevice)
+HRESULT STDMETHODCALLTYPE MakeBeeper (Bus* io_bus, bool audio, wistd::unique_ptr<IBeeperDevice>* ppDevice)
 {
 	auto d = wil::make_unique_nothrow<Beeper>(); RETURN_IF_NULL_ALLOC(d);
-	auto hr = d->InitInstance(io_bus); RETURN_IF_FAILED(hr);
+	auto hr = d->InitInstance(io_bus, audio); RETURN_IF_FAILED(hr);
 	*ppDevice = std::move(d);
 	return S_OK;
 }
@@ -0,0 +1,148 @@
+#include "pch.h"
+#include "SimulatorInternal.h"
+#include <cstdio>
+#include <cwctype>
+#ifdef _WIN32
+#include <share.h>
+#endif
+
+#ifdef _WIN32
+static constexpr wchar_t path_separator = L'\\';
+#else
+static constexpr wchar_t path_separator = L'/';
+
+// fopen takes a narrow path, which on these platforms is UTF-8; wchar_t holds UTF-32.
+static bool to_utf8 (const wchar_t* path, vector_nothrow<char>& to)
+{
+	for (; *path; path++)
+	{
+		uint32_t c = (uint32_t)*path;
+		char bytes[4];
+		uint32_t count;
+		if (c < 0x80)
+		{
+			bytes[0] = (char)c;
+			count = 1;
+		}
+		else if (c < 0x800)
+		{
+			bytes[0] = (char)(0xC0 | (c >> 6));
+			bytes[1] = (char)(0x80 | (c & 0x3F));
+			count = 2;
+		}
+		else if (c < 0x10000)
+		{
+			bytes[0] = (char)(0xE0 | (c >> 12));
+			bytes[1] = (char)(0x80 | ((c >> 6) & 0x3F));
+			bytes[2] = (char)(0x80 | (c & 0x3F));
+			count = 3;
+		}
+		else
+		{
+			bytes[0] = (char)(0xF0 | (c >> 18));
+			bytes[1] = (char)(0x80 | ((c >> 12) & 0x3F));
+			bytes[2] = (char)(0x80 | ((c >> 6) & 0x3F));
+			bytes[3] = (char)(0x80 | (c & 0x3F));
+			count = 4;
+		}
+
+		for (uint32_t i = 0; i < count; i++)
+		{
+			if (!to.try_push_back(bytes[i]))
+				return false;
+		}
+	}
+
+	return to.try_push_back('\0');
+}
+#endif
+
+static HRESULT hresult_from_errno (int err)
+{
+	switch (err)
+	{
+		case ENOENT: return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+		case EACCES: return E_ACCESSDENIED;
+		case ENOMEM: return E_OUTOFMEMORY;
+		default:     return E_FAIL;
+	}
+}
+
+static FILE* open_for_reading (const wchar_t* path)
+{
+#ifdef _WIN32
+	// Others may read the file meanwhile, but not write it.
+	return _wfsopen (path, L"rb", _SH_DENYWR);
+#else
+	vector_nothrow<char> utf8;
+	if (!to_utf8(path, utf8))
+	{
+		errno = ENOMEM;
+		return nullptr;
+	}
+
+	return fopen (utf8.data(), "rb");
+#endif
+}
+
+HRESULT read_file (const wchar_t* path, uint32_t max_size, vector_nothrow<uint8_t>& contents)
+{
+	FILE* f = open_for_reading(path);
+	if (!f)
+		return hresult_from_errno(errno);
+	auto close = wil::scope_exit([f] { fclose(f); });
+
+	RETURN_HR_IF(E_FAIL, fseek(f, 0, SEEK_END) != 0);
+	long size = ftell(f);
+	RETURN_HR_IF(E_FAIL, size < 0);
+	if ((unsigned long)size > max_size)
+		RETURN_WIN32(ERROR_FILE_TOO_LARGE);
+	rewind(f);
+
+	contents.clear();
+	bool resized = contents.try_resize((uint32_t)size); RETURN_HR_IF(E_OUTOFMEMORY, !resized);
+	if (size && (fread(contents.data(), 1, (size_t)size, f) != (size_t)size))
+		RETURN_WIN32(ERROR_HANDLE_EOF);
+
+	return S_OK;
+}
+
+HRESULT combine_path (const wchar_t* folder, const wchar_t* name, wchar_t* to, uint32_t to_size)
+{
+	size_t folder_length = wcslen(folder);
+	size_t name_length = wcslen(name);
+	bool separator = folder_length && (folder[folder_length - 1] != path_separator) && (folder[folder_length - 1] != L'/');
+	RETURN_HR_IF(E_BOUNDS, folder_length + separator + name_length >= to_size);
+
+	wmemcpy (to, folder, folder_length);
+	if (separator)
+		to[folder_length++] = path_separator;
+	wmemcpy (to + folder_length, name, name_length + 1);
+	return S_OK;
+}
+
+const wchar_t* find_extension (const wchar_t* path)
+{
+	const wchar_t* ext = nullptr;
+	for (const wchar_t* p = path; *p; p++)
+	{
+		if (*p == L'.')
+			ext = p;
+		else if ((*p == path_separator) || (*p == L'/'))
+			ext = nullptr;
+	}
+
+	return ext ? ext : path + wcslen(path);
+}
+
+bool extension_is (const wchar_t* path, const wchar_t* ext)
+{
+	const wchar_t* e = find_extension(path);
+	for (; *e && *ext; e++, ext++)
+	{
+		if (towlower(*e) != towlower(*ext))
+			return false;
+	}
+
+	return !*e && !*ext;
+}
@@ -2,11 +2,6 @@
 #include "pch.h"
 #include "SimulatorInternal.h"
 
-// TODO: split the RAM into two IMemoryDevice's, one for the video memory area, one for the rest.
-// This will allow the CPU to work on non-video memory for a long time, without having to wait for
-// the screen device to catch up.
-// (Either that, or refactor the bus access...)
-
 class HC_RAM : public IMemoryDevice
 {
 	Bus* _memory_bus;
@@ -23,17 +18,27 @@ public:
 		for (size_t i = 0; i < sizeof(_data); i++)
 			_data[i] = (uint8_t)rand();
 
-		bool pushed = _memory_bus->read_responders.try_push_back({ this, &process_mem_read_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
-		pushed = _memory_bus->write_responders.try_push_back({ this, &process_mem_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
-		pushed = _io_bus->write_responders.try_push_back({ this, &process_io_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool added = _io_bus->try_add_write_responder({ this, &process_io_write_request, 0x81, 0 }); RETURN_HR_IF(E_OUTOFMEMORY, !added);
+		map_pages();
 		return S_OK;
 	}
 
 	~HC_RAM()
 	{
-		_io_bus->write_responders.remove([this](auto& d) { return d.Device == this; });
-		_memory_bus->write_responders.remove([this](auto& d) { return d.Device == this; });
-		_memory_bus->read_responders.remove([this](auto& d) { return d.Device == this; });
+		_io_bus->remove_responders(this);
+		_memory_bus->unmap_pages(this);
+	}
+
+	void map_pages()
+	{
+		_memory_bus->unmap_pages(this);
+
+		// Writes always land in our buffer, also in the address range where the ROM responds to reads.
+		_memory_bus->map_write_pages (this, 0, 0x10000, _data);
+
+		DWORD from, to;
+		GetBounds (&from, &to);
+		_memory_bus->map_read_pages (this, from, to - from, &_data[from]);
 	}
 
 	virtual void STDMETHODCALLTYPE Reset() override
@@ -41,6 +46,7 @@ public:
 		_time = 0;
 		for (size_t i = 0; i < sizeof(_data); i++)
 			_data[i] = (uint8_t)rand();
+		_memory_bus->mark_code_written(0, 0x10000);
 	}
 
 	virtual UINT64 STDMETHODCALLTYPE Time() override { return _time; }
@@ -52,36 +58,17 @@ public:
 		_time = requested_time;
 	}
 
-	static uint8_t process_mem_read_request (IDevice* d, uint16_t address)
+	static void process_io_write_request (IDevice* d, uint16_t address, uint8_t value)
 	{
 		auto* ram = static_cast<HC_RAM*>(d);
-		if (!ram->_cpm)
-		{
-			if (address >= 0x4000)
-				return ram->_data[address];
-			return 0xFF;
-		}
-		else
+		bool cpm = value & 2;
+		if (ram->_cpm != cpm)
 		{
-			if (address < 0xE000)
-				return ram->_data[address];
-			return 0xFF;
+			ram->_cpm = cpm;
+			ram->map_pages();
 		}
 	}
 
-	static void process_mem_write_request (IDevice* d, uint16_t address, uint8_t value)
-	{
-		auto* ram = static_cast<HC_RAM*>(d);
-		ram->_data[address] = value;
-	}
-
-	static void process_io_write_request (IDevice* d, uint16_t address, uint8_t value)
-	{
-		auto* ram = static_cast<HC_RAM*>(d);
-		if ((address & 0x81) == 0)
-			ram->_cpm = value & 2;
-	}
-
 	#pragma region IMemoryDevice
 	virtual HRESULT GetBounds (DWORD* from, DWORD* to) override
 	{
@@ -111,6 +98,8 @@ public:
 		if (address + size > sizeof(_data))
 			return E_BOUNDS;
 		memcpy (&_data[address], bytes, size);
+		if (size)
+			_memory_bus->mark_code_written(address, size);
 		return S_OK;
 	}
 	#pragma endregion
@@ -0,0 +1,133 @@
+#include "pch.h"
+#include "SimulatorCore.h"
+#include "shared/com.h"
+
+class HeadlessSimulator : public IHeadlessSimulator, SimulatorCore
+{
+	ULONG _refCount = 0;
+
+	// Set when RunUntil stopped at a code breakpoint, so that the next RunUntil doesn't stop there again.
+	bool _stopped_at_code_bp = false;
+
+public:
+	HRESULT InitInstance (IRomImage* rom)
+	{
+		auto hr = init_core(rom, nullptr, false); RETURN_IF_FAILED(hr);
+		return S_OK;
+	}
+
+	#pragma region IUnknown
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+	{
+		RETURN_HR_IF(E_POINTER, !ppvObject);
+
+		if (   TryQI<IUnknown>(this, riid, ppvObject)
+			|| TryQI<IHeadlessSimulator>(this, riid, ppvObject)
+		)
+			return S_OK;
+
+		*ppvObject = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE AddRef() override { return ++_refCount; }
+
+	virtual ULONG STDMETHODCALLTYPE Release() override { return ReleaseST(this, _refCount); }
+	#pragma endregion
+
+	#pragma region IHeadlessSimulator
+	virtual HRESULT STDMETHODCALLTYPE Reset (UINT16 startAddress) override
+	{
+		reset_core(startAddress);
+		_stopped_at_code_bp = false;
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE LoadFile (LPCWSTR pFileName) override
+	{
+		auto snap = wil::make_unique_nothrow<snapshot>(); RETURN_IF_NULL_ALLOC_EXPECTED(snap);
+		auto hr = read_snapshot_file(pFileName, snap.get()); RETURN_IF_FAILED_EXPECTED(hr);
+		apply_snapshot(snap.get());
+		_stopped_at_code_bp = false;
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE LoadBinary (LPCWSTR pFileName, DWORD address, DWORD* loadedSize) override
+	{
+		return load_binary(pFileName, address, loadedSize);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE ReadMemoryBus (uint16_t address, uint16_t size, void* to) override
+	{
+		for (uint32_t i = 0; i < size; i++)
+			((uint8_t*)to)[i] = memoryBus.read(address + i);
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE WriteMemoryBus (uint16_t address, uint16_t size, const void* from) override
+	{
+		for (uint32_t i = 0; i < size; i++)
+			memoryBus.write (address + i, ((uint8_t*)from)[i]);
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE GetRegisters (z80_register_set* buffer, uint32_t size) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, size < sizeof(z80_register_set));
+		_cpu->GetZ80Registers(buffer);
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE SetRegisters (const z80_register_set* buffer, uint32_t size) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, size < sizeof(z80_register_set));
+		_cpu->SetZ80Registers(buffer);
+		_stopped_at_code_bp = false;
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE AddBreakpoint (BreakpointType type, UINT16 address, SIM_BP_COOKIE* pCookie) override
+	{
+		return _cpu->AddBreakpoint(type, address, pCookie);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE RemoveBreakpoint (SIM_BP_COOKIE cookie) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+		return _cpu->RemoveBreakpoint(cookie);
+	}
+
+	virtual UINT64 STDMETHODCALLTYPE Time() override { return _cpu->Time(); }
+
+	virtual HRESULT STDMETHODCALLTYPE RunUntil (UINT64 time, SIM_BP_COOKIE* bp) override
+	{
+		if (_stopped_at_code_bp)
+		{
+			// Same as ISimulator::Resume with checkBreakpointsAtCurrentPC FALSE. The devices were brought
+			// up to the CPU when it stopped, so it has nothing to wait for.
+			_stopped_at_code_bp = false;
+			bool advanced = _cpu->SimulateOne(nullptr);
+			FAIL_FAST_IF(!advanced);
+			simulate_devices_to(_cpu->Time());
+		}
+
+		BreakpointsHit bpsHit;
+		auto reason = simulate_until(time, &bpsHit);
+		if (reason != SimulateStopReason::Breakpoint)
+			return S_OK;
+
+		_stopped_at_code_bp = (bpsHit.type == BreakpointType::Code);
+		if (bp)
+			*bp = bpsHit.bps[0];
+		return S_FALSE;
+	}
+	#pragma endregion
+};
+
+HRESULT MakeHeadlessSimulator (IRomImage* rom, IHeadlessSimulator** sim)
+{
+	com_ptr<HeadlessSimulator> s = new (std::nothrow) HeadlessSimulator(); RETURN_IF_NULL_ALLOC(s);
+	auto hr = s->InitInstance(rom); RETURN_IF_FAILED(hr);
+	*sim = s.detach();
+	return S_OK;
+}
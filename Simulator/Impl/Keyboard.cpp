@@ -11,15 +11,13 @@ struct keyboard : IKeyboardDevice
 	HRESULT InitInstance (Bus* io_bus)
 	{
 		this->io_bus = io_bus;
-		bool pushed = io_bus->read_responders.try_push_back({ this, &process_read_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
-		pushed = io_bus->write_responders.try_push_back({ this, &ProcessWriteRequest }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool added = io_bus->try_add_read_responder({ this, &process_read_request, 0xFF, 0xFE }); RETURN_HR_IF(E_OUTOFMEMORY, !added);
 		return S_OK;
 	}
 
 	~keyboard()
 	{
-		io_bus->write_responders.remove([this](auto& r) { return r.Device == this; });
-		io_bus->read_responders.remove([this](auto& r) { return r.Device == this; });
+		io_bus->remove_responders(this);
 	}
 
 	virtual void STDMETHODCALLTYPE Reset() override
@@ -45,25 +43,16 @@ struct keyboard : IKeyboardDevice
 
 	static uint8_t process_read_request (IDevice* d, uint16_t address)
 	{
-		if ((address & 0xFF) == 0xFE)
+		// keys and Tape In
+		auto* kb = static_cast<keyboard*>(d);
+		uint8_t result = 0xFF;
+		for (uint8_t i = 0; i < 8; i++)
 		{
-			// keys and Tape In
-			auto* kb = static_cast<keyboard*>(d);
-			uint8_t result = 0xFF;
-			for (uint8_t i = 0; i < 8; i++)
-			{
-				if (!(address & (1 << (i + 8))))
-					result &= ~kb->keys_down[i];
-			}
-
-			return result;
+			if (!(address & (1 << (i + 8))))
+				result &= ~kb->keys_down[i];
 		}
 
-		return 0xFF;
-	}
-
-	static void ProcessWriteRequest (IDevice* d, uint16_t address, uint8_t value)
-	{
+		return result;
 	}
 
 	virtual BOOL STDMETHODCALLTYPE NeedSyncWithRealTime (UINT64* sync_time) override { return false; }
@@ -35,7 +35,7 @@ class ScreenDeviceImpl : public IScreenDevice, public IInterruptingDevice
 	UINT64 _time = 0;
 	std::optional<UINT64> _pending_irq_time;
 	uint8_t _border;
-	wil::unique_process_heap_ptr<BITMAPINFO> _screenData;
+	wistd::unique_ptr<uint8_t[]> _screenData; // a BITMAPINFO followed by the pixels; see screen_data
 	IScreenDeviceCompleteEventHandler* _screenCompleteHandler;
 
 public:
@@ -46,11 +46,11 @@ public:
 		this->irq = irq;
 		_screenCompleteHandler = screenCompleteHandler;
 
-		bool pushed = io->write_responders.try_push_back({ this, &process_io_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool pushed = io->try_add_write_responder({ this, &process_io_write_request, 0xFF, 0xFE }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
 		pushed = irq->interrupting_devices.try_push_back(this); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
 
-		_screenData.reset((BITMAPINFO*)HeapAlloc(GetProcessHeap(), 0, ScreenBufferSize)); RETURN_IF_NULL_ALLOC(_screenData);
-		InitBitmapInfoHeader(_screenData.get());
+		_screenData = wil::make_unique_nothrow<uint8_t[]>(ScreenBufferSize); RETURN_IF_NULL_ALLOC(_screenData);
+		InitBitmapInfoHeader(screen_data());
 
 		return S_OK;
 	}
@@ -58,9 +58,11 @@ public:
 	~ScreenDeviceImpl()
 	{
 		irq->interrupting_devices.remove(static_cast<IInterruptingDevice*>(this));
-		io->write_responders.remove([this](auto& w) { return w.Device == this; });
+		io->remove_responders(this);
 	}
 
+	BITMAPINFO* screen_data() const { return (BITMAPINFO*)_screenData.get(); }
+
 	static void InitBitmapInfoHeader (BITMAPINFO* bi)
 	{
 		bi->bmiHeader.biSize = sizeof(BITMAPINFO);
@@ -80,11 +82,8 @@ public:
 
 	static void process_io_write_request (IDevice* d, uint16_t address, uint8_t value)
 	{
-		if ((address & 0xFF) == 0xFE)
-		{
-			auto* s = static_cast<ScreenDeviceImpl*>(d);
-			s->_border = value & 7;
-		}
+		auto* s = static_cast<ScreenDeviceImpl*>(d);
+		s->_border = value & 7;
 	}
 
 	virtual void STDMETHODCALLTYPE Reset() override
@@ -196,7 +195,7 @@ public:
 				// left border from top of screen to bottom of screen
 				WI_ASSERT (requested_time - _time < max_time_offset);
 				uint32_t argb = spectrum_color_to_argb (_border, false);
-				uint32_t* dest_pixel = get_dest_pixel (_screenData.get(), row - vsync_row_count, (col - hsync_col_count) * 2);
+				uint32_t* dest_pixel = get_dest_pixel (screen_data(), row - vsync_row_count, (col - hsync_col_count) * 2);
 				dest_pixel[0] = argb;
 				dest_pixel[1] = argb;
 				col++;
@@ -216,7 +215,7 @@ public:
 					{
 						WI_ASSERT (requested_time - _time < max_time_offset);
 						uint32_t argb = spectrum_color_to_argb (_border, false);
-						uint32_t* dest_pixel = get_dest_pixel (_screenData.get(), row - vsync_row_count, (col - hsync_col_count) * 2);
+						uint32_t* dest_pixel = get_dest_pixel (screen_data(), row - vsync_row_count, (col - hsync_col_count) * 2);
 						dest_pixel[0] = argb;
 						dest_pixel[1] = argb;
 						col++;
@@ -250,7 +249,7 @@ public:
 						//data = memory->read(src_pixel_data);
 						//attr = memory->read(src_pixel_attr);
 
-						uint32_t* dest_pixel = get_dest_pixel (_screenData.get(), row - vsync_row_count, (col - hsync_col_count) * 2);
+						uint32_t* dest_pixel = get_dest_pixel (screen_data(), row - vsync_row_count, (col - hsync_col_count) * 2);
 
 						bool brightness = attr & 0x40;
 						auto ink_color   = spectrum_color_to_argb (attr & 7, brightness);
@@ -273,11 +272,11 @@ public:
 			{
 				// right border from top of screen to bottom of screen
 				uint32_t argb = spectrum_color_to_argb (_border, false);
-				uint32_t* dest_pixel = get_dest_pixel (_screenData.get(), row - vsync_row_count, (col - hsync_col_count) * 2);
+				uint32_t* dest_pixel = get_dest_pixel (screen_data(), row - vsync_row_count, (col - hsync_col_count) * 2);
 				dest_pixel[0] = argb;
 				dest_pixel[1] = argb;
 
-				if ((col == ticks_per_row - 1) && (row == rows_per_frame - 1))
+				if ((col == ticks_per_row - 1) && (row == rows_per_frame - 1) && _screenCompleteHandler)
 					_screenCompleteHandler->OnScreenDeviceComplete();
 
 				col++;
@@ -325,22 +324,23 @@ public:
 		WI_ASSERT(_pending_irq_time);
 		_pending_irq_time.reset();
 	}
-	/*
-	virtual bool next_irq_time (uint32_t* irq_time) const override
+
+	virtual bool next_irq_time (UINT64& irq_time) const override
 	{
-		uint32_t this_frame_start_time = _time % (ticks_per_row * rows_per_frame);
-		uint32_t this_frame_irq_time = this_frame_start_time + irq_offset_from_frame_start;
-		if (this->behind_of(this_frame_irq_time))
+		if (_pending_irq_time)
 		{
-			*irq_time = this_frame_irq_time;
+			irq_time = _pending_irq_time.value();
 			return true;
 		}
 
-		uint32_t next_frame_start_time = this_frame_start_time + ticks_per_row * rows_per_frame;
-		*irq_time = next_frame_start_time + irq_offset_from_frame_start;
+		// SimulateTo sets the pending interrupt as soon as it reaches the interrupt time point,
+		// so if we're at or past it in this frame, the next one is in the next frame.
+		UINT64 this_frame_start_time = _time - (_time % (ticks_per_row * rows_per_frame));
+		irq_time = this_frame_start_time + irq_offset_from_frame_start;
+		if (irq_time <= _time)
+			irq_time += ticks_per_row * rows_per_frame;
 		return true;
 	}
-	*/
 	#pragma endregion
 /*
 	virtual zx_spectrum_ula_regs regs() const override
@@ -360,7 +360,7 @@ public:
 		
 		if (crt)
 		{
-			memcpy(bi, _screenData.get(), ScreenBufferSize);
+			memcpy(bi, screen_data(), ScreenBufferSize);
 		}
 		else
 		{
@@ -384,10 +384,10 @@ public:
 		uint32_t border_argb = spectrum_color_to_argb (_border, false);
 
 		for (uint32_t row = 0; row < border_size_top; row++)
-			__stosd((unsigned long*)get_dest_pixel(bi, row, 0), border_argb, screen_width);
+			std::fill_n (get_dest_pixel(bi, row, 0), screen_width, border_argb);
 
 		for (uint32_t row = border_size_top + 192; row < screen_height; row++)
-			__stosd((unsigned long*)get_dest_pixel(bi, row, 0), border_argb, screen_width);
+			std::fill_n (get_dest_pixel(bi, row, 0), screen_width, border_argb);
 
 		for (uint32_t y = border_size_top; y <= border_size_top + 192; y++)
 		{
@@ -422,7 +422,7 @@ public:
 
 	virtual HRESULT GenerateScreen() override
 	{
-		GenerateInternal(_screenData.get());
+		GenerateInternal(screen_data());
 		return S_OK;
 	}
 	#pragma endregion
@@ -1,28 +1,26 @@
 
 #include "pch.h"
-#include "SimulatorInternal.h"
-#include "Z80CPU.h"
+#include "SimulatorCore.h"
+#include "SimulatorCommands.h"
 #include "shared/unordered_map_nothrow.h"
 #include "shared/com.h"
 #include "shared/inplace_function.h"
 #include <optional>
+#include <atomic>
 
 #pragma comment (lib, "Shlwapi")
 
 static constexpr UINT WM_MAIN_THREAD_WORK = WM_APP + 0;
 static constexpr UINT WM_SCREEN_COMPLETE  = WM_APP + 1;
+static constexpr UINT WM_TRACEPOINT_HITS  = WM_APP + 2;
 
 static ATOM wndClassAtom;
 
-HRESULT STDMETHODCALLTYPE MakeHC91ROM (Bus* memory_bus, Bus* io_bus, const wchar_t* folder, const wchar_t* BinaryFilename, wistd::unique_ptr<IMemoryDevice>* ppDevice);
-HRESULT STDMETHODCALLTYPE MakeHC91RAM (Bus* memory_bus, Bus* io_bus, wistd::unique_ptr<IMemoryDevice>* ppDevice);
-HRESULT STDMETHODCALLTYPE MakeBeeper (Bus* io_bus, wistd::unique_ptr<IDevice>* ppDevice);
-
 using unique_cotaskmem_bitmapinfo = wil::unique_any<BITMAPINFO*, decltype(&::CoTaskMemFree), ::CoTaskMemFree>;
 
 // ============================================================================
 
-class SimulatorImpl : public ISimulator, IScreenDeviceCompleteEventHandler
+class SimulatorImpl : public ISimulator, IScreenDeviceCompleteEventHandler, SimulatorCore
 {
 	ULONG _refCount = 0;
 
@@ -39,54 +37,77 @@ class SimulatorImpl : public ISimulator, IScreenDeviceCompleteEventHandler
 	};
 
 	std::optional<running_info> _running_info; // this is used only by the simulator thread
+	RunSpeed _runSpeed = RunSpeed::RealTime; // this too
+	UINT32 _speedMultiplier = 1;             // and this; 1 unless _runSpeed is RunSpeed::Multiplier
+	screen_rate_limiter _screenRateLimiter;  // and this
 	bool _running = false; // and this only by the main thread
 	wil::unique_handle _cpuThread;
 	wil::unique_handle _cpu_thread_exit_request;
 	vector_nothrow<wil::com_ptr_nothrow<ISimulatorEventHandler>> _eventHandlers;
 	com_ptr<IScreenCompleteEventHandler> _screenCompleteHandler;
 
-	using RunOnSimulatorThreadFunction = HRESULT(*)(void*);
-	stdext::inplace_function<HRESULT(), 64> _runOnSimulatorThreadFunction;
-	HRESULT            _runOnSimulatorThreadResult;
-	wil::unique_handle _run_on_simulator_thread_request;
-	wil::unique_handle _runOnSimulatorThreadComplete;
+	// A screen copied on the simulator thread, for the main thread to give to _screenCompleteHandler.
+	// The command that copies it and its completion each hold a reference.
+	struct screen_copy
+	{
+		std::atomic<LONG> refs = 0;
+		unique_cotaskmem_bitmapinfo screen;
+		POINT beam;
+
+		ULONG AddRef() { return ++refs; }
+		ULONG Release()
+		{
+			auto r = --refs;
+			if (r == 0)
+				delete this;
+			return r;
+		}
+	};
+
+	// What ResumeWithAsync changes before it resumes, copied from the caller's buffers.
+	struct resume_changes
+	{
+		std::optional<z80_register_set> registers;
+		wistd::unique_ptr<uint8_t[]> memory;
+		uint16_t memory_address;
+		uint16_t memory_size;
+		std::optional<uint16_t> pc;
+		BOOL check_breakpoints_at_current_pc;
+	};
+
+	wil::unique_handle _commands_available;
+	simulator_command_queue _commands { [this] { ::SetEvent(_commands_available.get()); } };
 	wil::unique_handle _waitableTimer;
 
 	vector_nothrow<stdext::inplace_function<void()>> _mainThreadWorkQueue;
 	wil::srwlock _mainThreadQueueLock;
 
-	Bus memoryBus;
-	Bus ioBus;
-	irq_line_i irq;
-	wistd::unique_ptr<IZ80CPU> _cpu;	
-	wistd::unique_ptr<IScreenDevice> _screen;
-	wistd::unique_ptr<IKeyboardDevice> _keyboard;
-	wistd::unique_ptr<IMemoryDevice> _romDevice;
-	wistd::unique_ptr<IMemoryDevice> _ramDevice;
-	wistd::unique_ptr<IDevice> _beeper;
-	vector_nothrow<IDevice*> _active_devices_;
 	bool _showCRTSnapshot = false;
 
 	// Passed via WM_SCREEN_COMPLETE from simulator thread to GUI thread while simulation is running.
 	unique_cotaskmem_bitmapinfo _screenComplete;
 
+	// Tracepoint hits go from the simulator thread to the GUI thread through this single-producer,
+	// single-consumer ring buffer. The simulator thread posts WM_TRACEPOINT_HITS only when there's
+	// no such message pending, so the GUI thread receives the hits in batches.
+	static constexpr uint32_t tracepoint_buffer_size = 4096; // must be a power of two
+	wistd::unique_ptr<TracepointHit[]> _tracepointBuffer;
+	std::atomic<uint32_t> _tracepointWriteIndex = 0; // written only by the simulator thread
+	std::atomic<uint32_t> _tracepointReadIndex = 0;  // written only by the GUI thread
+	std::atomic<uint32_t> _tracepointLostCount = 0;
+	std::atomic<bool> _tracepointHitsPosted = false;
+
+	wistd::unique_ptr<ITraceWriter> _traceWriter; // used only by the simulator thread
+
 public:
 	HRESULT InitInstance (LPCWSTR dir, LPCWSTR romFilename)
 	{
-		auto hr = MakeZ80CPU(&memoryBus, &ioBus, &irq, &_cpu); RETURN_IF_FAILED(hr);
+		wil::com_ptr_nothrow<IRomImage> rom;
+		auto hr = LoadRomImage(dir, romFilename, &rom); RETURN_IF_FAILED(hr);
+		hr = init_core(rom.get(), this, true); RETURN_IF_FAILED(hr);
 
-		hr = MakeScreenDevice(&memoryBus, &ioBus, &irq, this, &_screen); RETURN_IF_FAILED(hr);
-
-		hr = MakeKeyboardDevice(&ioBus, &_keyboard); RETURN_IF_FAILED(hr);
-		
-		hr = MakeBeeper(&ioBus, &_beeper); RETURN_IF_FAILED(hr);
-
-		hr = MakeHC91ROM (&memoryBus, &ioBus, dir, romFilename, &_romDevice); RETURN_IF_FAILED(hr);
-///		hr = _romDevice->AdviseBusAddressRangeChange(this); RETURN_IF_FAILED(hr);
-
-		hr = MakeHC91RAM (&memoryBus, &ioBus, &_ramDevice); RETURN_IF_FAILED(hr);
-
-		bool pushed = _active_devices_.try_push_back({ _screen.get(), _keyboard.get(), _romDevice.get(), _ramDevice.get(), _beeper.get() }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		_tracepointBuffer = wil::make_unique_nothrow<TracepointHit[]>(tracepoint_buffer_size); RETURN_IF_NULL_ALLOC(_tracepointBuffer);
+		_cpu->SetTracepointHandler({ this, &on_tracepoint_hit });
 
 		QueryPerformanceFrequency(&qpFrequency);
 
@@ -102,8 +123,7 @@ public:
 		_hwnd = CreateWindowExW (0, WndClassName, L"", 0, 0, 0, 0, 0, HWND_MESSAGE, nullptr, (HINSTANCE)&__ImageBase, nullptr); RETURN_LAST_ERROR_IF_NULL(_hwnd);
 		SetWindowLongPtr (_hwnd, GWLP_USERDATA, reinterpret_cast<LONG_PTR>(this));
 
-		_run_on_simulator_thread_request.reset(CreateEventW (nullptr, false, false, nullptr)); RETURN_LAST_ERROR_IF_NULL(_run_on_simulator_thread_request);
-		_runOnSimulatorThreadComplete.reset(CreateEventW (nullptr, false, false, nullptr)); RETURN_LAST_ERROR_IF_NULL(_runOnSimulatorThreadComplete);
+		_commands_available.reset(CreateEventW (nullptr, false, false, nullptr)); RETURN_LAST_ERROR_IF_NULL(_commands_available);
 
 		_waitableTimer.reset(CreateWaitableTimerExW (nullptr, nullptr, 0, SYNCHRONIZE | TIMER_MODIFY_STATE)); RETURN_LAST_ERROR_IF_NULL(_waitableTimer);
 
@@ -168,6 +188,12 @@ public:
 			lock.reset();
 			work();
 		}
+		else if (msg == WM_TRACEPOINT_HITS)
+		{
+			auto p = reinterpret_cast<SimulatorImpl*>(GetWindowLongPtr (hwnd, GWLP_USERDATA));
+			WI_ASSERT(p);
+			p->process_tracepoint_hits();
+		}
 		else if (msg == WM_SCREEN_COMPLETE)
 		{
 			auto p = reinterpret_cast<SimulatorImpl*>(GetWindowLongPtr (hwnd, GWLP_USERDATA));
@@ -204,42 +230,16 @@ public:
 		
 		auto perf_counter_delta = timeNow.QuadPart - _running_info->start_time_perf_counter.QuadPart;
 
-		auto tick_count = _running_info->start_time + perf_counter_delta * 3500 / (qpFrequency.QuadPart / 1000);
+		auto tick_count = _running_info->start_time + perf_counter_delta * 3500 * _speedMultiplier / (qpFrequency.QuadPart / 1000);
 		return tick_count;
 	}
 
-	bool simulate_devices_to (UINT64 time)
-	{
-		bool res = false;
-		while(true)
-		{
-			bool advanced = false;
-			for (auto& d : _active_devices_)
-			{
-				if (d->Time() < time)
-				{
-					uint64_t timeBefore = d->Time();
-					d->SimulateTo(time);
-					advanced |= (d->Time() > timeBefore);
-				}
-			}
-
-			if (!advanced)
-				return res;
-
-			res = true;
-		}
-	}
-
 	DWORD simulation_thread_proc()
 	{
-		HANDLE waitHandles[3] = { _run_on_simulator_thread_request.get(), _cpu_thread_exit_request.get(), _waitableTimer.get() };
+		HANDLE waitHandles[3] = { _commands_available.get(), _cpu_thread_exit_request.get(), _waitableTimer.get() };
 		bool exit_request = false;
 		while(!exit_request)
 		{
-			// TODO: add support for syncing on multiple devices, needed in case two devices need to sync on
-			// the same time _and_ the first is waiting for the second (we'd have an infinite loop with the code as it is now).
-
 			DWORD waitHandleCount = 2;
 			DWORD waitTimeout = INFINITE;
 			IDevice* device_to_sync_on = nullptr;
@@ -254,10 +254,12 @@ public:
 				// This happens while debugging the VSIX, or it may happen when this thread is starved. 
 				// If we have any such device, we "erase" the same length of time from all of the devices;
 				// we do this by rebasing the simulation startup time held in the _running_info variable.
+				// When running unthrottled there's no real time to keep up with, so there's nothing to do.
+				if (_runSpeed != RunSpeed::Unthrottled)
 				{
 					auto slowestTime = _cpu->Time();
 					INT64 slowest_offset_from_rt = (UINT64)(_cpu->Time() - rt);
-					for (auto& d : _active_devices_)
+					for (auto d : _devices.devices)
 					{
 						INT64 offset_from_rt = (UINT64)(d->Time() - rt);
 						if (offset_from_rt < slowest_offset_from_rt)
@@ -272,7 +274,7 @@ public:
 						// Slowest device is more than 50 ms behind real time. Let's see what time offset
 						// it would need to be 50 ms _ahead_ of real time, and add that offset to all devices.
 						UINT64 tick_offset = rt + milliseconds_to_ticks(50) - slowestTime;
-						UINT64 perf_counter_offset = tick_offset * (qpFrequency.QuadPart / 1000) / 3500;
+						UINT64 perf_counter_offset = tick_offset * (qpFrequency.QuadPart / 1000) / (3500 * _speedMultiplier);
 						_running_info->start_time += tick_offset;
 						_running_info->start_time_perf_counter.QuadPart += perf_counter_offset;
 					}
@@ -280,37 +282,13 @@ public:
 				#pragma endregion
 
 				// Let's find out how far we can simulate, and try to simulate to that point in time.
-				for (auto& d : _active_devices_)
-				{
-					UINT64 t;
-					if (d->NeedSyncWithRealTime(&t)
-						&& (!device_to_sync_on || (t < time_to_sync_to_)))
-					{
-						device_to_sync_on = d;
-						time_to_sync_to_ = t;
-					}
-				}
+				_devices.next_sync(&device_to_sync_on, &time_to_sync_to_);
 
 				while(true)
 				{
-					// First ask the CPU to simulate itself; then ask the devices
-					// to simulate themselves until they catch up with the CPU, not more.
-					// We don't want the devices to go far ahead of the CPU; if the CPU will stop at a breakpoint,
-					// we'll want to show to the user the devices at a time as close as possible to the CPU time;
-					// we can do that only if the devices are at all times behind the CPU or only slightly
-					// (a few clock cycles) ahead of it.
-					BreakpointsHit bpsHit = { };
-					while (_cpu->Time() < time_to_sync_to_)
-					{
-						bool advanced = _cpu->SimulateOne(&bpsHit);
-						if (!advanced || bpsHit.size)
-							break;
-					}
-
-					// Whatever the outcome of the above simulation, we must first bring the devices close to the CPU time.
-					simulate_devices_to(_cpu->Time());
-
-					if (bpsHit.size)
+					BreakpointsHit bpsHit;
+					auto reason = simulate_step(time_to_sync_to_, &bpsHit);
+					if (reason == SimulateStopReason::Breakpoint)
 					{
 						on_bp_hit(&bpsHit);
 						break;
@@ -320,15 +298,15 @@ public:
 					{
 						// Now let's see how long we need to wait for the real time to catch up.
 						WI_ASSERT(device_to_sync_on);
-						if (time_to_sync_to_ > rt)
+						if ((_runSpeed != RunSpeed::Unthrottled) && (time_to_sync_to_ > rt))
 						{
-							uint64_t hundredsOfNanoseconds = ticks_to_hundreds_of_nanoseconds(time_to_sync_to_ - rt);
+							uint64_t hundredsOfNanoseconds = ticks_to_hundreds_of_nanoseconds(time_to_sync_to_ - rt) / _speedMultiplier;
 							LARGE_INTEGER dueTime = { .QuadPart = -(INT64)hundredsOfNanoseconds };
 							BOOL bRes = SetWaitableTimer (_waitableTimer.get(), &dueTime, 0, nullptr, nullptr, FALSE); WI_ASSERT(bRes);
 							waitHandleCount = 3;
 						}
 						else
-							waitTimeout = 0; // We're lagging behind real time, so we won't wait.
+							waitTimeout = 0; // We're lagging behind real time, or running unthrottled, so we won't wait.
 						break;
 					}
 				}
@@ -340,19 +318,14 @@ public:
 				case WAIT_TIMEOUT:
 				case WAIT_OBJECT_0 + 2: // _waitableTimer
 					// Real time has caught up with the simulated time.
-					// Let's unblock the device that was waiting for this time point.
+					// Let's unblock the devices that were waiting for this time point.
 					WI_ASSERT(device_to_sync_on);
-					if (device_to_sync_on->Time() < time_to_sync_to_ + 1)
-					{
-						uint64_t timeBefore = device_to_sync_on->Time();
-						device_to_sync_on->SimulateTo(time_to_sync_to_ + 1);
-						WI_ASSERT(device_to_sync_on->Time() > timeBefore);
-					}
+					_devices.release_sync(time_to_sync_to_);
+					WI_ASSERT(device_to_sync_on->Time() > time_to_sync_to_);
 					break;
 
-				case WAIT_OBJECT_0: // _run_on_simulator_thread_request
-					_runOnSimulatorThreadResult = _runOnSimulatorThreadFunction();
-					SetEvent(_runOnSimulatorThreadComplete.get());
+				case WAIT_OBJECT_0: // _commands_available
+					_commands.run_commands([this](stdext::inplace_function<void()> work) { return post_to_main_thread(std::move(work)); });
 					break;
 
 				case WAIT_OBJECT_0 + 1: // _cpu_thread_exit_request
@@ -367,6 +340,22 @@ public:
 		return 0;
 	}
 
+	// Called on the simulator thread.
+	HRESULT post_to_main_thread (stdext::inplace_function<void()> work)
+	{
+		auto lock = _mainThreadQueueLock.lock_exclusive();
+		bool pushed = _mainThreadWorkQueue.try_push_back(std::move(work)); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		BOOL posted = PostMessageW (_hwnd, WM_MAIN_THREAD_WORK, 0, 0);
+		if (!posted)
+		{
+			DWORD le = GetLastError();
+			_mainThreadWorkQueue.remove(_mainThreadWorkQueue.end() - 1);
+			return HRESULT_FROM_WIN32(le);
+		}
+
+		return S_OK;
+	}
+
 	class BreakpointEvent : public ISimulatorBreakpointEvent
 	{
 		ULONG _refCount = 0;
@@ -438,7 +427,7 @@ public:
 				WI_ASSERT(_running);
 				_running = false;
 				if (auto bpEvent = com_ptr(new (std::nothrow) BreakpointEvent());
-					bpEvent && SUCCEEDED(bpEvent->InitInstance(BreakpointType::Code, bps->address, bps->bps, bps->size)))
+					bpEvent && SUCCEEDED(bpEvent->InitInstance(bps->type, bps->address, bps->bps, bps->size)))
 				{
 					for (uint32_t i = 0; i < _eventHandlers.size(); i++)
 						_eventHandlers[i]->ProcessSimulatorEvent(bpEvent, __uuidof(ISimulatorBreakpointEvent));
@@ -452,20 +441,7 @@ public:
 						screen.release();
 				}
 			};
-		auto lock = _mainThreadQueueLock.lock_exclusive();
-		bool pushed = _mainThreadWorkQueue.try_push_back(std::move(work));
-		if (pushed)
-		{
-			BOOL posted = PostMessageW (_hwnd, WM_MAIN_THREAD_WORK, 0, 0);
-			if (!posted)
-			{
-				DWORD le = GetLastError();
-				_mainThreadWorkQueue.remove(_mainThreadWorkQueue.end() - 1);
-				return HRESULT_FROM_WIN32(le);
-			}
-		}
-
-		return S_OK;
+		return post_to_main_thread(std::move(work));
 	}
 
 	template<typename IEvent>
@@ -494,6 +470,94 @@ public:
 		#pragma endregion
 	};
 
+	class TracepointEvent : public ISimulatorTracepointEvent
+	{
+		ULONG _refCount = 0;
+
+	public:
+		vector_nothrow<TracepointHit> _hits;
+		ULONG _lostCount = 0;
+
+		#pragma region IUnknown
+		virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+		{
+			if (   TryQI<IUnknown>(this, riid, ppvObject)
+				|| TryQI<ISimulatorEvent>(this, riid, ppvObject)
+				|| TryQI<ISimulatorTracepointEvent>(this, riid, ppvObject)
+				)
+				return S_OK;
+
+			*ppvObject = nullptr;
+			return E_NOINTERFACE;
+		}
+
+		virtual ULONG STDMETHODCALLTYPE AddRef() override { return ++_refCount; }
+
+		virtual ULONG STDMETHODCALLTYPE Release() override { return ReleaseST(this, _refCount); }
+		#pragma endregion
+
+		#pragma region ISimulatorTracepointEvent
+		virtual ULONG GetHitCount() override { return _hits.size(); }
+
+		virtual const TracepointHit* GetHits() override { return _hits.data(); }
+
+		virtual ULONG GetLostHitCount() override { return _lostCount; }
+		#pragma endregion
+	};
+
+	// Called by the CPU on the simulator thread.
+	static void on_tracepoint_hit (void* context, const TracepointHit& hit)
+	{
+		auto p = static_cast<SimulatorImpl*>(context);
+
+		uint32_t write = p->_tracepointWriteIndex.load(std::memory_order_relaxed);
+		if (write - p->_tracepointReadIndex.load(std::memory_order_acquire) == tracepoint_buffer_size)
+		{
+			p->_tracepointLostCount++;
+			return;
+		}
+
+		p->_tracepointBuffer[write & (tracepoint_buffer_size - 1)] = hit;
+		p->_tracepointWriteIndex.store(write + 1, std::memory_order_release);
+
+		if (!p->_tracepointHitsPosted.exchange(true))
+		{
+			BOOL posted = PostMessageW (p->_hwnd, WM_TRACEPOINT_HITS, 0, 0);
+			if (!posted)
+				p->_tracepointHitsPosted = false;
+		}
+	}
+
+	// Called on the GUI thread; sends to the event handlers all hits recorded until now as a single event.
+	HRESULT process_tracepoint_hits()
+	{
+		// Clear this before reading the indexes, so that hits recorded from now on post a new message.
+		_tracepointHitsPosted = false;
+
+		uint32_t read = _tracepointReadIndex.load(std::memory_order_relaxed);
+		uint32_t write = _tracepointWriteIndex.load(std::memory_order_acquire);
+		uint32_t lost = _tracepointLostCount.exchange(0);
+		if ((read == write) && !lost)
+			return S_OK;
+
+		auto event = com_ptr(new (std::nothrow) TracepointEvent());
+		bool reserved = event && event->_hits.try_reserve(write - read);
+		if (reserved)
+		{
+			for (uint32_t i = read; i != write; i++)
+				event->_hits.try_push_back(_tracepointBuffer[i & (tracepoint_buffer_size - 1)]);
+			event->_lostCount = lost;
+		}
+
+		_tracepointReadIndex.store(write, std::memory_order_release);
+		RETURN_HR_IF(E_OUTOFMEMORY, !reserved);
+
+		for (uint32_t i = 0; i < _eventHandlers.size(); i++)
+			_eventHandlers[i]->ProcessSimulatorEvent(event, __uuidof(ISimulatorTracepointEvent));
+
+		return S_OK;
+	}
+
 	HRESULT SendSimulateOneCompleteEvent()
 	{
 		WI_ASSERT(!_running);
@@ -510,7 +574,13 @@ public:
 	#pragma region ISimulator
 	virtual HRESULT STDMETHODCALLTYPE Reset (uint16_t startAddress) override
 	{
-		auto hr = RunOnSimulatorThread ([this, startAddress]
+		return reset(startAddress, nullptr);
+	}
+
+	HRESULT reset (uint16_t startAddress, const SimulatorCompletion* completion)
+	{
+		auto copy = com_ptr(new (std::nothrow) screen_copy()); RETURN_IF_NULL_ALLOC(copy);
+		return run_then ([this, startAddress, crt=_showCRTSnapshot, copy]
 			{
 				if (_running_info)
 				{
@@ -518,67 +588,67 @@ public:
 					QueryPerformanceCounter(&_running_info.value().start_time_perf_counter);
 				}
 				
-				_cpu->Reset();
-				_cpu->SetPC(startAddress);
-				for (auto& d : _active_devices_)
-					d->Reset();
-				return S_OK;
-			});
-		RETURN_IF_FAILED(hr);
-
-		_screenComplete = nullptr;
+				reset_core(startAddress);
 
-		if (!_running)
-		{
-			if (_screenCompleteHandler)
+				if (!_running_info)
+					LOG_IF_FAILED(copy_screen(crt, copy.get()));
+				return S_OK;
+			},
+			[this, copy](HRESULT hr)
 			{
-				unique_cotaskmem_bitmapinfo screen;
-				POINT beam;
-				auto hr = _screen->CopyBuffer (_showCRTSnapshot, screen.addressof(), &beam);
-				if (SUCCEEDED(hr))
-				{
-					auto hr = _screenCompleteHandler->OnScreenComplete(screen.get(), beam);
-					if (SUCCEEDED(hr))
-						screen.release();
-				}
-			}
-		}
-
-		return S_OK;
+				RETURN_IF_FAILED(hr);
+				send_screen(copy.get());
+				return S_OK;
+			}, completion);
 	}
 
-	HRESULT RunOnSimulatorThread (stdext::inplace_function<HRESULT(), 64> fun)
+	// Called on the simulator thread.
+	HRESULT copy_screen (BOOL crt, screen_copy* copy)
 	{
-		_runOnSimulatorThreadFunction = std::move(fun);
-
-		BOOL bres = SetEvent(_run_on_simulator_thread_request.get()); RETURN_LAST_ERROR_IF(!bres);
-
-		DWORD waitRes = WaitForSingleObject(_runOnSimulatorThreadComplete.get(), IsDebuggerPresent() ? INFINITE : 5000);
+		return _screen->CopyBuffer (crt, copy->screen.put(), &copy->beam);
+	}
 
-		_runOnSimulatorThreadFunction = nullptr;
+	// Called on the main thread.
+	void send_screen (screen_copy* copy)
+	{
+		{
+			auto lock = _mainThreadQueueLock.lock_exclusive();
+			_screenComplete = nullptr;
+		}
 
-		switch (waitRes)
+		if (_screenCompleteHandler && copy->screen)
 		{
-		case WAIT_OBJECT_0:
-			return _runOnSimulatorThreadResult;
+			auto hr = _screenCompleteHandler->OnScreenComplete(copy->screen.get(), copy->beam);
+			if (SUCCEEDED(hr))
+				copy->screen.release();
+		}
+	}
 
-		case WAIT_ABANDONED_0:
-			RETURN_WIN32(ERROR_ABANDONED_WAIT_0);
+	// See simulator_command_queue::run. While debugging the simulator, let's wait forever.
+	HRESULT RunOnSimulatorThread (simulator_command_queue::function_t fun)
+	{
+		return _commands.run (std::move(fun), IsDebuggerPresent() ? simulator_command_queue::no_timeout : 5000);
+	}
 
-		case WAIT_TIMEOUT:
-			RETURN_WIN32(ERROR_TIMEOUT);
+	HRESULT post_to_simulator_thread (simulator_command_queue::function_t fun, simulator_command_queue::completion_t completion = nullptr)
+	{
+		return _commands.post (std::move(fun), std::move(completion));
+	}
 
-		case WAIT_FAILED:
-			RETURN_LAST_ERROR();
+	HRESULT post_with_completion (simulator_command_queue::function_t fun, SimulatorCompletion completion)
+	{
+		RETURN_HR_IF(E_INVALIDARG, !completion.OnComplete);
+		return post_to_simulator_thread (std::move(fun), [completion](HRESULT hr) { completion.OnComplete(completion.Context, hr); });
+	}
 
-		default:
-			RETURN_HR(E_FAIL);
-		}
+	HRESULT run_then (simulator_command_queue::function_t fun, simulator_command_queue::then_t then, const SimulatorCompletion* completion)
+	{
+		return _commands.run_then (std::move(fun), std::move(then), completion, IsDebuggerPresent() ? simulator_command_queue::no_timeout : 5000);
 	}
-	
+
 	virtual HRESULT STDMETHODCALLTYPE ReadMemoryBus (uint16_t address, uint16_t size, void* to) override
 	{
-		RETURN_HR_IF(E_UNEXPECTED, _running);
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 		for (uint32_t i = 0; i < size; i++)
 			((uint8_t*)to)[i] = memoryBus.read(address + i);
 		return S_OK;
@@ -586,7 +656,7 @@ public:
 
 	virtual HRESULT STDMETHODCALLTYPE WriteMemoryBus (uint16_t address, uint16_t size, const void* from) override
 	{
-		RETURN_HR_IF(E_UNEXPECTED, _running);
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 		for (uint32_t i = 0; i < size; i++)
 			memoryBus.write (address + i, ((uint8_t*)from)[i]);
 		return S_OK;
@@ -594,66 +664,76 @@ public:
 	
 	virtual HRESULT STDMETHODCALLTYPE Break() override
 	{
-		if (!_running)
+		if (!_running && !_commands.pending_state_changes())
 			return S_FALSE;
 
-		auto hr = RunOnSimulatorThread([this]
+		return break_simulation(nullptr);
+	}
+
+	HRESULT break_simulation (const SimulatorCompletion* completion)
+	{
+		auto copy = com_ptr(new (std::nothrow) screen_copy()); RETURN_IF_NULL_ALLOC(copy);
+		return run_then ([this, crt=_showCRTSnapshot, copy]
 			{
-				WI_ASSERT(_running_info);
+				// The simulation may have stopped at a breakpoint after the main thread last looked.
+				if (!_running_info)
+					return S_FALSE;
+
 				_running_info.reset();
+				LOG_IF_FAILED(copy_screen(crt, copy.get()));
 				return S_OK;
-			});
-		RETURN_IF_FAILED(hr);
-
-		_running = false;
+			},
+			[this, copy](HRESULT hr)
+			{
+				if (hr != S_OK)
+					return hr;
 
-		using BreakEvent = SimulatorEvent<ISimulatorBreakEvent>;
-		if (auto event = com_ptr(new (std::nothrow) BreakEvent()))
-		{
-			for (uint32_t i = 0; i < _eventHandlers.size(); i++)
-				_eventHandlers[i]->ProcessSimulatorEvent(event, __uuidof(event));
-		}
+				_running = false;
 
-		_screenComplete = nullptr;
-		if (_screenCompleteHandler)
-		{
-			unique_cotaskmem_bitmapinfo screen;
-			POINT beam;
-			auto hr = _screen->CopyBuffer (_showCRTSnapshot, screen.addressof(), &beam);
-			if (SUCCEEDED(hr))
-			{
-				auto hr = _screenCompleteHandler->OnScreenComplete(screen.get(), beam);
-				if (SUCCEEDED(hr))
-					screen.release();
-			}
-		}
+				using BreakEvent = SimulatorEvent<ISimulatorBreakEvent>;
+				if (auto event = com_ptr(new (std::nothrow) BreakEvent()))
+				{
+					for (uint32_t i = 0; i < _eventHandlers.size(); i++)
+						_eventHandlers[i]->ProcessSimulatorEvent(event, __uuidof(event));
+				}
 
-		return S_OK;
+				send_screen(copy.get());
+				return S_OK;
+			}, completion);
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE Resume (BOOL checkBreakpointsAtCurrentPC) override
 	{
 		RETURN_HR_IF(E_UNEXPECTED, _running);
 
-		auto hr = RunOnSimulatorThread([this, checkBreakpointsAtCurrentPC]
-			{
-				AssertDevicesUpToDateWithCPU();
+		return run_then ([this, checkBreakpointsAtCurrentPC] { return start_running(checkBreakpointsAtCurrentPC); },
+			[this](HRESULT hr) { RETURN_IF_FAILED(hr); return on_resumed(); }, nullptr);
+	}
 
-				auto start_time = _cpu->Time();
-				LARGE_INTEGER perf_counter;
-				QueryPerformanceCounter(&perf_counter);
+	// Called on the simulator thread.
+	HRESULT start_running (BOOL checkBreakpointsAtCurrentPC)
+	{
+		RETURN_HR_IF(E_UNEXPECTED, _running_info.has_value());
 
-				if (!checkBreakpointsAtCurrentPC)
-				{
-					bool advanced = _cpu->SimulateOne(nullptr);
-					WI_ASSERT(advanced);
-				}
+		AssertDevicesUpToDateWithCPU();
 
-				_running_info = running_info { .start_time = start_time, .start_time_perf_counter = perf_counter };
-				return S_OK;
-			});
-		RETURN_IF_FAILED(hr);
+		auto start_time = _cpu->Time();
+		LARGE_INTEGER perf_counter;
+		QueryPerformanceCounter(&perf_counter);
+
+		if (!checkBreakpointsAtCurrentPC)
+		{
+			bool advanced = _cpu->SimulateOne(nullptr);
+			WI_ASSERT(advanced);
+		}
+
+		_running_info = running_info { .start_time = start_time, .start_time_perf_counter = perf_counter };
+		return S_OK;
+	}
 
+	// Called on the main thread after start_running.
+	HRESULT on_resumed()
+	{
 		_running = true;
 		using ResumeEvent = SimulatorEvent<ISimulatorResumeEvent>;
 		auto event = com_ptr(new (std::nothrow) ResumeEvent()); RETURN_IF_NULL_ALLOC(event);
@@ -676,7 +756,7 @@ public:
 
 		// While simulation is not running devices are supposed to be up to date with the processor's time.
 		uint64_t cpuTime = _cpu->Time();
-		for (auto& d : _active_devices_)
+		for (auto d : _devices.devices)
 		{
 			uint64_t deviceTime = d->Time();
 			if (deviceTime < cpuTime)
@@ -693,8 +773,16 @@ public:
 	{
 		RETURN_HR_IF(E_UNEXPECTED, _running);
 
-		auto hr = RunOnSimulatorThread ([this]
+		return simulate_one(nullptr);
+	}
+
+	HRESULT simulate_one (const SimulatorCompletion* completion)
+	{
+		auto copy = com_ptr(new (std::nothrow) screen_copy()); RETURN_IF_NULL_ALLOC(copy);
+		return run_then ([this, crt=_showCRTSnapshot, copy]
 			{
+				RETURN_HR_IF(E_UNEXPECTED, _running_info.has_value());
+
 				AssertDevicesUpToDateWithCPU();
 
 				if (!_cpu->Halted())
@@ -713,27 +801,16 @@ public:
 					} while (_cpu->Halted());
 				}
 
+				LOG_IF_FAILED(copy_screen(crt, copy.get()));
 				return S_OK;
-			});
-		RETURN_IF_FAILED(hr);
-		
-		hr = SendSimulateOneCompleteEvent(); LOG_IF_FAILED(hr);
-
-		_screenComplete = nullptr;
-		if (_screenCompleteHandler)
-		{
-			unique_cotaskmem_bitmapinfo screen;
-			POINT beam;
-			hr = _screen->CopyBuffer (_showCRTSnapshot, screen.addressof(), &beam);
-			if (SUCCEEDED(hr))
+			},
+			[this, copy](HRESULT hr)
 			{
-				hr = _screenCompleteHandler->OnScreenComplete(screen.get(), beam);
-				if (SUCCEEDED(hr))
-					screen.release();
-			}
-		}
-
-		return S_OK;
+				RETURN_IF_FAILED(hr);
+				hr = SendSimulateOneCompleteEvent(); LOG_IF_FAILED(hr);
+				send_screen(copy.get());
+				return S_OK;
+			}, completion);
 	}
 
 	/*
@@ -775,83 +852,22 @@ public:
 		return S_OK;
 	}
 	*/
-	HRESULT LoadSnapshot (const wchar_t* pFileName)
+	virtual HRESULT STDMETHODCALLTYPE LoadFile (LPCWSTR pFileName) override
 	{
-		#pragma pack (push, 1)
-		// https://rk.nvg.ntnu.no/sinclair/faq/fileform.html#SNA
-		struct snapshot_file_header
-		{
-			uint8_t i;
-			uint16_t alt_hl;
-			uint16_t alt_de;
-			uint16_t alt_bc;
-			uint16_t alt_af;
-			uint16_t hl;
-			uint16_t de;
-			uint16_t bc;
-			uint16_t iy;
-			uint16_t ix;
-			uint8_t      : 1;
-			uint8_t ei   : 1;
-			uint8_t iff2 : 1;
-			uint8_t      : 5;
-			uint8_t r;
-			uint16_t af;
-			uint16_t sp;
-			uint8_t im;
-			uint8_t border;
-		};
-		#pragma pack (pop)
-
-		com_ptr<IStream> stream;
-		auto hr = SHCreateStreamOnFileEx (pFileName, STGM_READ | STGM_SHARE_DENY_WRITE, FILE_ATTRIBUTE_NORMAL, FALSE, nullptr, &stream); RETURN_IF_FAILED_EXPECTED(hr);
-
-		STATSTG stat;
-		hr = stream->Stat (&stat, STATFLAG_NONAME); RETURN_IF_FAILED_EXPECTED(hr);
-		if (stat.cbSize.QuadPart != sizeof(snapshot_file_header) + 48 * 1024)
-			return SetErrorInfo(E_FAIL, L"The file has an unrecognized size.\r\n(Only ZX Spectrum 48K files are supported for now.)");
-
-		snapshot_file_header header;
-		ULONG read;
-		hr = stream->Read (&header, (ULONG)sizeof(header), &read); RETURN_IF_FAILED(hr); RETURN_HR_IF(E_FAIL, read != sizeof(header));
-
-		auto buffer = wil::make_unique_hlocal_nothrow<uint8_t[]>(48 * 1024); RETURN_IF_NULL_ALLOC_EXPECTED(buffer);
-		hr = stream->Read(buffer.get(), 48 * 1024, &read); RETURN_IF_FAILED_EXPECTED(hr); RETURN_HR_IF(E_FAIL, read != 48 * 1024);
+		return load_file(pFileName, nullptr);
+	}
 
-		unique_cotaskmem_bitmapinfo screen;
-		POINT beam;
+	HRESULT load_file (LPCWSTR pFileName, const SimulatorCompletion* completion)
+	{
+		auto snap = wil::make_unique_nothrow<snapshot>(); RETURN_IF_NULL_ALLOC_EXPECTED(snap);
+		auto hr = read_snapshot_file(pFileName, snap.get()); RETURN_IF_FAILED_EXPECTED(hr);
 
-		// It's ok to catch by reference since the call to RunOnSimulatorThread is blocking (returns when the work is complete).
-		hr = RunOnSimulatorThread ([this, &header, buffer=buffer.get(), &screen, &beam]
+		auto copy = com_ptr(new (std::nothrow) screen_copy()); RETURN_IF_NULL_ALLOC(copy);
+		return run_then ([this, snap=std::move(snap), copy]
 			{
 				HRESULT hr;
 
-				_cpu->Reset();
-				for (auto& d : _active_devices_)
-					d->Reset();
-
-				_ramDevice->WriteMemory(0x4000, 48 * 1024, buffer);
-
-				z80_register_set regs;
-				regs.halted = false;
-				regs.i       = header.i;
-				regs.alt.hl  = header.alt_hl;
-				regs.alt.bc  = header.alt_bc;
-				regs.alt.de  = header.alt_de;
-				regs.alt.af  = header.alt_af;
-				regs.main.hl = header.hl;
-				regs.main.de = header.de;
-				regs.main.bc = header.bc;
-				regs.ix      = header.ix;
-				regs.iy      = header.iy;
-				regs.iff1    = header.ei;
-				regs.r       = header.r;
-				regs.main.af = header.af;
-				regs.sp      = header.sp;
-				regs.im      = header.im;
-				regs.pc = memoryBus.read_uint16(regs.sp);
-				regs.sp += 2;
-				_cpu->SetZ80Registers(&regs);
+				apply_snapshot(snap.get());
 
 				if (_running_info)
 				{
@@ -861,388 +877,54 @@ public:
 				else
 				{
 					hr = _screen->GenerateScreen(); RETURN_IF_FAILED_EXPECTED(hr);
-					hr = _screen->CopyBuffer(TRUE, &screen, &beam); RETURN_IF_FAILED_EXPECTED(hr);
+					hr = copy_screen(TRUE, copy.get()); RETURN_IF_FAILED_EXPECTED(hr);
 				}
 
 				return S_OK;
-			});
-		RETURN_IF_FAILED(hr);
-
-		// TODO: do something to cause the GUI to refresh windows
-		//if (!_running)
-		//	SendSimulateOneCompleteEvent();
-
-		_screenComplete = nullptr;
-		if (screen && _screenCompleteHandler)
-		{
-			hr = _screenCompleteHandler->OnScreenComplete(screen.get(), beam);
-			if (SUCCEEDED(hr))
-				screen.release();
-		}
-
-		return S_OK;
-	}
-
-	#pragma pack (push, 1)
-	// https://worldofspectrum.org/faq/reference/z80format.htm
-	struct z80_header
-	{
-		uint8_t  a;  // 0
-		uint8_t  f;  // 1
-		uint16_t bc; // 2-3
-		uint16_t hl; // 4-5
-		uint16_t pc; // 6-7
-		uint16_t sp; // 8-9
-		uint8_t  i;  // 10
-		uint8_t  r;  // 11
-		uint8_t  r0         : 1; // 12 b0
-		uint8_t  border     : 3; // 12 b1-b3
-		uint8_t  samrom     : 1; // 12 b4
-		uint8_t  compressed : 1; // 12 b5
-		uint8_t             : 2; // 12 b6-b7
-		uint16_t de;     // 13-14
-		uint16_t alt_bc; // 15-16
-		uint16_t alt_de; // 17-18
-		uint16_t alt_hl; // 19-20
-		uint8_t  alt_a;  // 21
-		uint8_t  alt_f;  // 22
-		uint16_t iy;     // 23-24
-		uint16_t ix;     // 25-26
-		uint8_t  ei;     // 27
-		uint8_t  iff2;   // 28
-		uint8_t  im       : 2; // 29 b0-b1
-		uint8_t  issue2   : 1; // 29 b2
-		uint8_t  freq2x   : 1; // 29 b3
-		uint8_t  vid_sync : 2; // 29 b4-b5
-		uint8_t  joystick : 2; // 29 b6-b7
-	};
-	#pragma pack (pop)
-
-	HRESULT SetMalformedErrorInfo (const wchar_t* detail)
-	{
-		return SetErrorInfo(E_FAIL, L"Malformed .Z80 file: %s", detail);
-	};
-
-	HRESULT DecompressZ80 (const uint8_t* inPtr, const uint8_t* inEnd, uint8_t* outPtr, uint8_t* outEnd, bool terminatorExpected)
-	{
-		while (true)
-		{
-			if (inPtr >= inEnd)
+			},
+			[this, copy](HRESULT hr)
 			{
-				if (terminatorExpected)
-					return SetMalformedErrorInfo (L"Format version 1, compressed, no 00EDED00 terminator.");
+				RETURN_IF_FAILED(hr);
 
-				return S_OK;
-			}
+				// TODO: do something to cause the GUI to refresh windows
+				//if (!_running)
+				//	SendSimulateOneCompleteEvent();
 
-			if ((inPtr + 4 <= inEnd) && !memcmp(inPtr, "\x00\xED\xED\x00", 4))
+				send_screen(copy.get());
 				return S_OK;
-			
-			if ((inPtr + 4 <= inEnd) && (inPtr[0] == 0xED) && (inPtr[1] == 0xED))
-			{
-				inPtr += 2;
-				uint8_t repeat = *inPtr++;
-				uint8_t value = *inPtr++;
-				if (outPtr + repeat > outEnd)
-					return SetMalformedErrorInfo (L"Longer than 48K.");
-				memset (outPtr, value, repeat);
-				outPtr += repeat;
-			}
-			else
-			{
-				if (outPtr + 1 > outEnd)
-					return SetMalformedErrorInfo (L"Longer than 48K.");
-				*outPtr++ = *inPtr++;
-			}
-		}
+			}, completion);
 	}
 
-	HRESULT LoadZ80V1 (const z80_header* header, const uint8_t* inPtr, const uint8_t* inEnd, uint8_t* outPtr, uint8_t* outEnd)
+	virtual HRESULT STDMETHODCALLTYPE LoadBinary (LPCWSTR pFileName, DWORD address, DWORD* loadedSize) override
 	{
-		if (!header->compressed)
-		{
-			if (inEnd - inPtr != 48 * 1024)
-				return SetMalformedErrorInfo (L"Format version 1, not compressed, size not 48K.");
-			memcpy (outPtr, inPtr, 48 * 1024);
-		}
-		else
-		{
-			auto hr = DecompressZ80(inPtr, inEnd, outPtr, outEnd, true); RETURN_IF_FAILED(hr);
-		}
-
-		return S_OK;
-	}
-
-	#pragma pack (push, 1)
-	struct z80_header_v23
-	{
-		uint16_t len;      // 30
-		uint16_t pc;       // 32
-		uint8_t  hardware_mode; // 34
-		uint8_t  byte_35;  // 35
-		uint8_t  byte_36;  // 36
-		uint8_t  r_emu     : 1; // 37 b0
-		uint8_t  ldir_emu  : 1; // 37 b1
-		uint8_t  ay_in_use : 1; // 37 b2
-		uint8_t            : 3; // 37 b3-b5
-		uint8_t  fuller    : 1; // 37 b6
-		uint8_t  modify_hw : 1; // 37 b7
-		uint8_t  out_fffd;       // 38
-		uint8_t  sound_chip[16]; // 39-54
-		uint16_t t_counter_low;  // 55-56
-		uint8_t  t_counter_high; // 57
-		uint8_t  : 8;  // 58 - Flag byte used by Spectator
-		uint8_t  : 8;  // 59 - 0xff if MGT Rom paged
-		uint8_t  : 8;  // 60 - 0xff if Multiface Rom paged.
-		uint8_t  : 8;  // 61 - 0xff if 0-8191 is ROM, 0 if RAM
-		uint8_t  : 8;  // 62 - 0xff if 8192-16383 is ROM, 0 if RAM
-		uint8_t  joystick_key_mapping[10];  // 63
-		uint8_t  keys[10];  // 73
-		uint8_t  : 8;  // 83
-		uint8_t  : 8;  // 84
-		uint8_t  : 8;  // 85
-		uint8_t  : 8;  // 86
-	};
-	#pragma pack (pop)
-
-	static inline const wchar_t* const HardwareModeNamesV2[] = {
-		L"48K", L"48K+IF1", L"SamRam", L"128K", L"128K+IF1" };
-	static inline const wchar_t* const HardwareModeNamesV3[] = {
-		L"48K", L"48K+IF1", L"SamRam", L"48K+M.G.T.", L"128K", L"128K+IF1", L"128K+M.G.T." };
+		HRESULT hr;
 
-	HRESULT LoadZ80V23 (const z80_header_v23* header23, const uint8_t* inPtr, const uint8_t* inEnd, uint8_t* outPtr, uint8_t* outEnd)
-	{
-		const wchar_t* const* modeNames;
-		size_t modeNameCount;
-		if (header23->len == 23)
-		{
-			// Version 2
-			modeNames = HardwareModeNamesV2;
-			modeNameCount = std::size(HardwareModeNamesV2);
-		}
-		else if (header23->len == 54 || header23->len == 55)
-		{
-			// Version 3
-			modeNames = HardwareModeNamesV3;
-			modeNameCount = std::size(HardwareModeNamesV3);
-		}
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 
-		if (auto hw = header23->hardware_mode; hw != 0)
-			return SetErrorInfo (E_FAIL, L"This file specifies hardware mode %u (%s), "
-				"but the simulator currently supports only hardware mode 0 (%s).", 
-				hw, (hw < modeNameCount) ? modeNames[hw] : L"??", modeNames[0]);
+		DWORD size;
+		hr = load_binary(pFileName, address, &size); RETURN_IF_FAILED_EXPECTED(hr);
 
-		while (inPtr < inEnd)
+		if (_screenCompleteHandler)
 		{
-			if (inEnd - inPtr < 3)
-				return SetMalformedErrorInfo(L"Block Header too short.");
-			uint16_t lengthCompressedData = inPtr[0] | (inPtr[1] << 8);
-			uint8_t pageNumber = inPtr[2];
-			inPtr += 3;
-			
-			uint8_t* pagePtr;
-			if (pageNumber == 8)
-				pagePtr = outPtr; // Spectrum address 0x4000
-			else if (pageNumber == 4)
-				pagePtr = &outPtr[0x4000]; // Spectrum address 0x8000
-			else if (pageNumber == 5)
-				pagePtr = &outPtr[0x8000]; // Spectrum address 0xC000
-			else
-				return SetErrorInfo(E_FAIL, L"Unknown page number (%u) in Spectrum 48K mode.", pageNumber);
-
-			if (lengthCompressedData == 0xFFFF)
-			{
-				if (inEnd - inPtr < 0x4000)
-					return SetErrorInfo (E_FAIL, L"Page %u data too short. Expected %u, found %d.", pageNumber, 0x4000, inEnd - inPtr);
-				memcpy (pagePtr, inPtr, 0x4000);
-				inPtr += 0x4000;
-			}
-			else
-			{
-				auto hr = DecompressZ80 (inPtr, inPtr + lengthCompressedData, pagePtr, pagePtr + 0x4000, false); RETURN_IF_FAILED(hr);
-				inPtr += lengthCompressedData;
-			}
+			hr = post_screen(); RETURN_IF_FAILED(hr);
 		}
 
+		*loadedSize = size;
 		return S_OK;
 	}
 
-	HRESULT LoadZ80 (const wchar_t* pFileName)
+	// Copies the screen on the simulator thread and gives it to _screenCompleteHandler without waiting for it.
+	HRESULT post_screen()
 	{
-		com_ptr<IStream> stream;
-		auto hr = SHCreateStreamOnFileEx (pFileName, STGM_READ | STGM_SHARE_DENY_WRITE, FILE_ATTRIBUTE_NORMAL, FALSE, nullptr, &stream); RETURN_IF_FAILED_EXPECTED(hr);
-
-		STATSTG stat;
-		hr = stream->Stat (&stat, STATFLAG_NONAME); RETURN_IF_FAILED_EXPECTED(hr);
-
-		z80_header header;
-		ULONG read;
-		hr = stream->Read (&header, (ULONG)sizeof(header), &read); RETURN_IF_FAILED(hr); RETURN_HR_IF(E_FAIL, read != sizeof(header));
-		uint32_t inSize = stat.cbSize.LowPart - sizeof(header);
-		auto inBuffer = wil::unique_hglobal_ptr<uint8_t>((uint8_t*)GlobalAlloc(GMEM_FIXED, inSize)); RETURN_IF_NULL_ALLOC_EXPECTED(inBuffer);
-		hr = stream->Read(inBuffer.get(), inSize, &read); RETURN_IF_FAILED_EXPECTED(hr); RETURN_HR_IF(E_FAIL, read != inSize);
-		const uint8_t* inPtr = inBuffer.get();
-		const uint8_t* inEnd = inPtr + inSize;
-
-		auto outBuffer = wil::unique_hglobal_ptr<uint8_t>((uint8_t*)GlobalAlloc(GMEM_FIXED, 48 * 1024)); RETURN_IF_NULL_ALLOC_EXPECTED(outBuffer);
-		uint8_t* outPtr = outBuffer.get();
-		uint8_t* outEnd = outPtr + 48 * 1024;
-
-		uint16_t pc;
-		if (header.pc != 0)
-		{
-			hr = LoadZ80V1 (&header, inPtr, inEnd, outPtr, outEnd); RETURN_IF_FAILED_EXPECTED(hr);
-			pc = header.pc;
-		}
-		else
-		{
-			if (inEnd - inPtr < 2)
-				return SetMalformedErrorInfo(L"Header v2/3 too short.");
-			uint16_t header23_len = inPtr[0] | (inPtr[1] << 8);
-			if (inEnd - inPtr < (2 + header23_len))
-				return SetMalformedErrorInfo(L"Header v2/3 too short.");
-			auto* header23 = (const z80_header_v23*)inPtr;
-			inPtr += (2 + header23_len);
-			hr = LoadZ80V23 (header23, inPtr, inEnd, outPtr, outEnd); RETURN_IF_FAILED_EXPECTED(hr);
-			pc = header23->pc;
-		}
-
-		unique_cotaskmem_bitmapinfo screen;
-		POINT beam;
-
-		// It's ok to catch by reference since the call to RunOnSimulatorThread is blocking (returns when the work is complete).
-		hr = RunOnSimulatorThread ([this, pc, &header, buffer=outBuffer.get(), &screen, &beam]
+		auto copy = com_ptr(new (std::nothrow) screen_copy()); RETURN_IF_NULL_ALLOC(copy);
+		return post_to_simulator_thread ([this, crt=_showCRTSnapshot, copy] { return copy_screen(crt, copy.get()); },
+			[this, copy](HRESULT hr)
 			{
-				HRESULT hr;
-
-				_cpu->Reset();
-				for (auto& d : _active_devices_)
-					d->Reset();
-
-				_ramDevice->WriteMemory(0x4000, 48 * 1024, buffer);
-
-				z80_register_set regs;
-				regs.halted = false;
-				regs.i       = header.i;
-				regs.alt.hl  = header.alt_hl;
-				regs.alt.bc  = header.alt_bc;
-				regs.alt.de  = header.alt_de;
-				regs.alt.a   = header.alt_a;
-				regs.alt.f.val = header.alt_f;
-				regs.main.hl = header.hl;
-				regs.main.de = header.de;
-				regs.main.bc = header.bc;
-				regs.ix      = header.ix;
-				regs.iy      = header.iy;
-				regs.iff1    = header.ei;
-				regs.r       = header.r;
-				regs.main.a  = header.a;
-				regs.main.f.val = header.f;
-				regs.sp      = header.sp;
-				regs.im      = header.im;
-				regs.pc = pc;
-				_cpu->SetZ80Registers(&regs);
-
-				if (_running_info)
-				{
-					_running_info.value().start_time = 0;
-					QueryPerformanceCounter(&_running_info.value().start_time_perf_counter);
-				}
-				else
-				{
-					hr = _screen->GenerateScreen(); RETURN_IF_FAILED_EXPECTED(hr);
-					hr = _screen->CopyBuffer(TRUE, &screen, &beam); RETURN_IF_FAILED_EXPECTED(hr);
-				}
-
-				return S_OK;
+				if (SUCCEEDED(hr))
+					send_screen(copy.get());
 			});
-		RETURN_IF_FAILED(hr);
-
-		// TODO: do something to cause the GUI to refresh windows
-		//if (!_running)
-		//	SendSimulateOneCompleteEvent();
-
-		_screenComplete = nullptr;
-		if (screen && _screenCompleteHandler)
-		{
-			hr = _screenCompleteHandler->OnScreenComplete(screen.get(), beam);
-			if (SUCCEEDED(hr))
-				screen.release();
-		}
-
-		return S_OK;
 	}
 
-	virtual HRESULT STDMETHODCALLTYPE LoadFile (LPCWSTR pFileName) override
-	{
-		auto* ext = PathFindExtension(pFileName);
-
-		if (!_wcsicmp(ext, L".sna"))
-			return LoadSnapshot(pFileName);
-
-		if (!_wcsicmp(ext, L".z80"))
-			return LoadZ80(pFileName);
-
-		return SetErrorInfo (E_FAIL, L"The file extension %s is not recognized.", ext);
-	}
-
-	virtual HRESULT STDMETHODCALLTYPE LoadBinary (LPCWSTR pFileName, DWORD address, DWORD* loadedSize) override
-	{
-		HRESULT hr;
-
-		RETURN_HR_IF(E_UNEXPECTED, _running);
-
-		wil::com_ptr_nothrow<IStream> stream;
-		hr = SHCreateStreamOnFileEx (pFileName, STGM_READ | STGM_SHARE_DENY_WRITE, FILE_ATTRIBUTE_NORMAL, FALSE, nullptr, &stream);
-		if (FAILED(hr))
-			return SetErrorInfo (hr, L"Cannot access file.\r\n\r\n%s", pFileName);
-
-		STATSTG stat;
-		hr = stream->Stat (&stat, STATFLAG_NONAME); RETURN_IF_FAILED(hr);
-		if (stat.cbSize.HighPart)
-			RETURN_HR(E_BOUNDS);
-		if (!stat.cbSize.LowPart)
-			return SetErrorInfo(E_BOUNDS, L"Can't load a binary with zero length.\r\n\r\n%s", pFileName);
-		if (address + (uint16_t)stat.cbSize.LowPart <= address)
-			RETURN_HR(E_BOUNDS);
-		DWORD from, to;
-		_ramDevice->GetBounds(&from, &to);
-		if ((address < from) || (address + stat.cbSize.LowPart > to))
-			return SetErrorInfo(E_BOUNDS, L"Binary does not fit in RAM.\r\n\r\n"
-				"Binary load address range is 0x%04X...0x%04X.\r\n\r\n"
-				"RAM address range = 0x%04X...0x%04X.\r\n\r\n"
-				"Try to adjust the BaseAddress value in the project properties."
-				, address, address + stat.cbSize.LowPart, from, to);
-
-		uint8_t buffer[128];
-		for (uint16_t i = 0; i < stat.cbSize.LowPart; i += sizeof(buffer))
-		{
-			ULONG read;
-			hr = stream->Read (buffer, sizeof(buffer), &read); RETURN_IF_FAILED(hr);
-			//_memory.write (address + (uint16_t)i, { buffer, buffer + read });
-			_ramDevice->WriteMemory (address + i, read, buffer);
-		}
-
-		if (_screenCompleteHandler)
-		{
-			unique_cotaskmem_bitmapinfo screenBuffer;
-			POINT beam;
-			hr = RunOnSimulatorThread([&screenBuffer, &beam, this]
-			{
-				return _screen->CopyBuffer (_showCRTSnapshot, &screenBuffer, &beam);
-			});
-
-			if (SUCCEEDED(hr))
-			{
-				hr = _screenCompleteHandler->OnScreenComplete(screenBuffer.get(), beam); RETURN_IF_FAILED(hr);
-				if (SUCCEEDED(hr))
-					screenBuffer.release();
-			}
-		}
-
-		*loadedSize = stat.cbSize.LowPart;
-		return S_OK;
-	}
 	/*
 	virtual HRESULT STDMETHODCALLTYPE SaveMemory (IStream* stream) override
 	{
@@ -1291,12 +973,12 @@ public:
 
 	virtual HRESULT STDMETHODCALLTYPE ProcessKeyDown (uint32_t vkey, uint32_t modifiers) override
 	{
-		return RunOnSimulatorThread([this, vkey, modifiers] { return _keyboard->ProcessKeyDown(vkey, modifiers); });
+		return post_to_simulator_thread([this, vkey, modifiers] { return _keyboard->ProcessKeyDown(vkey, modifiers); });
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE ProcessKeyUp   (uint32_t vkey, uint32_t modifiers) override
 	{
-		return RunOnSimulatorThread([this, vkey, modifiers] { return _keyboard->ProcessKeyUp(vkey, modifiers); });
+		return post_to_simulator_thread([this, vkey, modifiers] { return _keyboard->ProcessKeyUp(vkey, modifiers); });
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE AddBreakpoint (BreakpointType type, bool physicalMemorySpace, UINT64 address, SIM_BP_COOKIE* pCookie) override
@@ -1314,6 +996,21 @@ public:
 			});
 	}
 
+	virtual HRESULT STDMETHODCALLTYPE AddDataBreakpoint (bool physicalMemorySpace, UINT64 address, UINT32 size, DataBreakpointAccess access, SIM_BP_COOKIE* pCookie) override
+	{
+		RETURN_HR_IF(E_NOTIMPL, physicalMemorySpace);
+		RETURN_HR_IF(E_INVALIDARG, !size || (address + size > 0x10000));
+
+		return RunOnSimulatorThread([this, address, size, access, pCookie]
+			{
+				auto hr = _cpu->AddDataBreakpoint((uint16_t)address, size, access, pCookie);
+				if (FAILED(hr))
+					return hr;
+				WI_ASSERT(*pCookie != 0);
+				return S_OK;
+			});
+	}
+
 	virtual HRESULT STDMETHODCALLTYPE RemoveBreakpoint (SIM_BP_COOKIE cookie) override
 	{
 		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
@@ -1324,6 +1021,56 @@ public:
 			});
 	}
 
+	virtual HRESULT STDMETHODCALLTYPE SetBreakpointCondition (SIM_BP_COOKIE cookie, const uint8_t* condition, uint32_t size) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return RunOnSimulatorThread([this, cookie, condition, size]
+			{
+				return _cpu->SetBreakpointCondition(cookie, condition, size);
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE SetBreakpointPassCount (SIM_BP_COOKIE cookie, BreakpointPassCountStyle style, uint32_t passCount) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return RunOnSimulatorThread([this, cookie, style, passCount]
+			{
+				return _cpu->SetBreakpointPassCount(cookie, style, passCount);
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE GetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t* hitCount) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return RunOnSimulatorThread([this, cookie, hitCount]
+			{
+				return _cpu->GetBreakpointHitCount(cookie, hitCount);
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE SetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t hitCount) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return RunOnSimulatorThread([this, cookie, hitCount]
+			{
+				return _cpu->SetBreakpointHitCount(cookie, hitCount);
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE SetTracepoint (SIM_BP_COOKIE cookie, BOOL tracepoint, const uint8_t* values, uint32_t size) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return RunOnSimulatorThread([this, cookie, tracepoint, values, size]
+			{
+				return _cpu->SetTracepoint(cookie, !!tracepoint, values, size);
+			});
+	}
+
 	virtual HRESULT STDMETHODCALLTYPE HasBreakpoints_HR() override
 	{
 		return RunOnSimulatorThread([this]
@@ -1332,29 +1079,75 @@ public:
 			});
 	}
 
+	virtual HRESULT STDMETHODCALLTYPE SetInstructionTrace (UINT32 capacity) override
+	{
+		return RunOnSimulatorThread([this, capacity]
+			{
+				return _cpu->SetInstructionTrace(capacity);
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE GetInstructionTrace (UINT32 maxCount, InstructionTraceRecord* records, UINT32* count) override
+	{
+		return RunOnSimulatorThread([this, maxCount, records, count]
+			{
+				*count = _cpu->GetInstructionTrace(records, maxCount);
+				return S_OK;
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE StartTraceFile (LPCWSTR path) override
+	{
+		return RunOnSimulatorThread([this, path]
+			{
+				stop_trace_file();
+				wistd::unique_ptr<ITraceWriter> writer;
+				auto hr = MakeTraceWriter(path, &writer); RETURN_IF_FAILED(hr);
+				_traceWriter = std::move(writer);
+				_cpu->SetTraceWriter(_traceWriter.get());
+				return S_OK;
+			});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE StopTraceFile() override
+	{
+		return RunOnSimulatorThread([this] { return stop_trace_file(); });
+	}
+
+	HRESULT stop_trace_file()
+	{
+		if (!_traceWriter)
+			return S_FALSE;
+
+		_cpu->SetTraceWriter(nullptr);
+		auto hr = _traceWriter->Flush();
+		_traceWriter.reset();
+		return hr;
+	}
+
 	virtual HRESULT STDMETHODCALLTYPE GetPC (uint16_t* pc) override
 	{
-		RETURN_HR_IF(E_UNEXPECTED, _running);
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 		*pc = _cpu->GetPC();
 		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE SetPC (uint16_t pc) override
 	{
-		RETURN_HR_IF(E_UNEXPECTED, _running);
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 		return _cpu->SetPC(pc);
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE GetStackStartAddress (UINT16* stackStartAddress) override
 	{
-		RETURN_HR_IF(E_UNEXPECTED, _running);
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 		*stackStartAddress = _cpu->GetStackStartAddress();
 		return S_OK;
 	}
 
 	virtual HRESULT STDMETHODCALLTYPE GetRegisters (z80_register_set* buffer, uint32_t size) override
 	{
-		RETURN_HR_IF(E_UNEXPECTED, _running);
+		RETURN_HR_IF(E_UNEXPECTED, _running || _commands.pending_state_changes());
 		_cpu->GetZ80Registers(buffer);
 		return S_OK;
 	}
@@ -1377,24 +1170,172 @@ public:
 
 			if (_screenCompleteHandler)
 			{
-				unique_cotaskmem_bitmapinfo screenBuffer;
-				POINT beam;
-				auto hr = RunOnSimulatorThread([&screenBuffer, &beam, this]
-				{
-					return _screen->CopyBuffer (_showCRTSnapshot, &screenBuffer, &beam);
-				});
+				auto hr = post_screen(); RETURN_IF_FAILED(hr);
+			}
+		}
 
-				if (SUCCEEDED(hr))
-				{
-					hr = _screenCompleteHandler->OnScreenComplete(screenBuffer.get(), beam); RETURN_IF_FAILED(hr);
-					if (SUCCEEDED(hr))
-						screenBuffer.release();
-				}
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE SetRunSpeed (RunSpeed speed, UINT32 multiplier) override
+	{
+		auto hr = validate_run_speed(speed, multiplier); RETURN_IF_FAILED(hr);
+
+		return post_to_simulator_thread([this, speed, multiplier]
+		{
+			_runSpeed = speed;
+			_speedMultiplier = (speed == RunSpeed::Multiplier) ? multiplier : 1;
+			_beeper->SetMuted (speed != RunSpeed::RealTime);
+			if (_running_info)
+			{
+				// Let real time continue from the current simulated time, at the new speed.
+				_running_info->start_time = _cpu->Time();
+				QueryPerformanceCounter(&_running_info->start_time_perf_counter);
 			}
+			return S_OK;
+		});
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE ReadMemoryBusAsync (uint16_t address, uint16_t size, void* to, SimulatorCompletion completion) override
+	{
+		return post_with_completion ([this, address, size, to]
+			{
+				for (uint32_t i = 0; i < size; i++)
+					((uint8_t*)to)[i] = memoryBus.read(address + i);
+				return S_OK;
+			}, completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE GetRegistersAsync (z80_register_set* buffer, uint32_t size, SimulatorCompletion completion) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, size < sizeof(z80_register_set));
+
+		return post_with_completion ([this, buffer]
+			{
+				_cpu->GetZ80Registers(buffer);
+				return S_OK;
+			}, completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE AddBreakpointAsync (BreakpointType type, bool physicalMemorySpace, UINT64 address, SIM_BP_COOKIE* pCookie, SimulatorCompletion completion) override
+	{
+		RETURN_HR_IF(E_NOTIMPL, physicalMemorySpace);
+		RETURN_HR_IF(E_INVALIDARG, address > 0xFFFF);
+
+		return post_with_completion ([this, type, address, pCookie]
+			{
+				return _cpu->AddBreakpoint(type, (uint16_t)address, pCookie);
+			}, completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE RemoveBreakpointAsync (SIM_BP_COOKIE cookie, SimulatorCompletion completion) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return post_with_completion ([this, cookie]
+			{
+				return _cpu->RemoveBreakpoint(cookie);
+			}, completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE GetBreakpointHitCountAsync (SIM_BP_COOKIE cookie, uint32_t* hitCount, SimulatorCompletion completion) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, cookie == 0);
+
+		return post_with_completion ([this, cookie, hitCount]
+			{
+				return _cpu->GetBreakpointHitCount(cookie, hitCount);
+			}, completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE BreakAsync (SimulatorCompletion completion) override
+	{
+		return break_simulation(&completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE ResumeAsync (BOOL checkBreakpointsAtCurrentPC, SimulatorCompletion completion) override
+	{
+		return run_then ([this, checkBreakpointsAtCurrentPC] { return start_running(checkBreakpointsAtCurrentPC); },
+			[this](HRESULT hr) { RETURN_IF_FAILED(hr); return on_resumed(); }, &completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE ResetAsync (UINT16 startAddress, SimulatorCompletion completion) override
+	{
+		return reset(startAddress, &completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE SimulateOneAsync (SimulatorCompletion completion) override
+	{
+		return simulate_one(&completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE LoadFileAsync (LPCWSTR pFileName, SimulatorCompletion completion) override
+	{
+		return load_file(pFileName, &completion);
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE RunCompletions (DWORD timeoutMs) override
+	{
+		// Only WM_MAIN_THREAD_WORK for our window; anything else stays in the queue. Each message is one completion
+		// or event, as posted by post_to_main_thread.
+		MSG msg;
+		ULONGLONG start = GetTickCount64();
+		while (!PeekMessageW (&msg, _hwnd, WM_MAIN_THREAD_WORK, WM_MAIN_THREAD_WORK, PM_REMOVE))
+		{
+			ULONGLONG elapsed = GetTickCount64() - start;
+			if (elapsed >= timeoutMs)
+				return S_FALSE;
+
+			// Returns when a message is posted to this thread after the PeekMessage above, which may or may not be ours.
+			DWORD waitRes = MsgWaitForMultipleObjects (0, nullptr, FALSE, (DWORD)(timeoutMs - elapsed), QS_POSTMESSAGE);
+			RETURN_LAST_ERROR_IF(waitRes == WAIT_FAILED);
 		}
 
+		do
+			DispatchMessageW(&msg);
+		while (PeekMessageW (&msg, _hwnd, WM_MAIN_THREAD_WORK, WM_MAIN_THREAD_WORK, PM_REMOVE));
+
 		return S_OK;
 	}
+
+	virtual HRESULT STDMETHODCALLTYPE ResumeWithAsync (const SimulatorResumeChanges* changes, SimulatorCompletion completion) override
+	{
+		RETURN_HR_IF(E_POINTER, !changes);
+		RETURN_HR_IF(E_INVALIDARG, changes->MemorySize && !changes->Memory);
+
+		auto c = wil::make_unique_nothrow<resume_changes>(); RETURN_IF_NULL_ALLOC(c);
+		if (changes->Registers)
+			c->registers = *changes->Registers;
+		if (changes->MemorySize)
+		{
+			c->memory = wil::make_unique_nothrow<uint8_t[]>(changes->MemorySize); RETURN_IF_NULL_ALLOC(c->memory);
+			memcpy (c->memory.get(), changes->Memory, changes->MemorySize);
+		}
+		c->memory_address = changes->MemoryAddress;
+		c->memory_size = changes->MemorySize;
+		if (changes->SetPC)
+			c->pc = changes->PC;
+		c->check_breakpoints_at_current_pc = changes->CheckBreakpointsAtCurrentPC;
+
+		return run_then ([this, c=std::move(c)]
+			{
+				RETURN_HR_IF(E_UNEXPECTED, _running_info.has_value());
+
+				if (c->registers)
+					_cpu->SetZ80Registers(&c->registers.value());
+
+				for (uint32_t i = 0; i < c->memory_size; i++)
+					memoryBus.write (c->memory_address + i, c->memory[i]);
+
+				if (c->pc)
+				{
+					auto hr = _cpu->SetPC(c->pc.value()); RETURN_IF_FAILED(hr);
+				}
+
+				return start_running(c->check_breakpoints_at_current_pc);
+			},
+			[this](HRESULT hr) { RETURN_IF_FAILED(hr); return on_resumed(); }, &completion);
+	}
 	#pragma endregion
 
 	#pragma region IScreenDeviceCompleteEventHandler
@@ -1406,6 +1347,11 @@ public:
 		// TODO: register for this callback when simulation starts running, unregister when simulation paused.
 		if (_running_info)
 		{
+			LARGE_INTEGER now;
+			QueryPerformanceCounter(&now);
+			if (!_screenRateLimiter.should_send(_runSpeed, now.QuadPart, qpFrequency.QuadPart))
+				return;
+
 			// This callback is called when the screen device finishes rendering a complete screen. This means
 			// the image on the simulated screen is identical to the image in the video memory. Thus CopyBuffer
 			// creates the same image regardless of the value of its "BOOL crt" parameter. Let's pass TRUE
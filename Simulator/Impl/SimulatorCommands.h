@@ -0,0 +1,193 @@
+#pragma once
+#include "../Simulator.h"
+#include "shared/inplace_function.h"
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+// Work for the simulator thread of SimulatorImpl. Any thread can queue commands, through a lock-free list; the
+// simulator thread takes all queued commands at once and runs them in the order they were queued, before it
+// simulates further. So commands posted back to back cost a single wake-up of the simulator thread, and a blocking
+// call (run) made after them waits for all of them in the same round trip.
+// This has no thread of its own: "wake" tells the owner that the list went from empty to not empty, and the owner
+// then calls run_commands on its simulator thread. Completions go to the main thread the same way, through the
+// function the owner passes to run_commands.
+class simulator_command_queue
+{
+public:
+	using function_t   = stdext::inplace_function<HRESULT(), 64>;
+	using completion_t = stdext::inplace_function<void(HRESULT), 64>;
+	using then_t       = stdext::inplace_function<HRESULT(HRESULT), 16>;
+	using wake_t       = stdext::inplace_function<void()>;
+
+	static constexpr uint32_t no_timeout = UINT32_MAX;
+
+private:
+	struct command
+	{
+		command* next;
+		std::atomic<LONG> refs;
+		function_t fun;
+		completion_t completion; // called on the main thread; may be empty
+		HRESULT result;
+		// Set by the first of: the simulator thread, when it starts running "fun"; run, when it gives up
+		// waiting. So a command whose caller gave up never runs.
+		std::atomic<bool> claimed = false;
+		// Set after "fun" ran; used by run.
+		std::mutex done_lock;
+		std::condition_variable done_cv;
+		bool done = false;
+
+		void release()
+		{
+			if (--refs == 0)
+				delete this;
+		}
+
+		struct releaser { void operator() (command* c) const { c->release(); } };
+	};
+	using unique_command = wistd::unique_ptr<command, command::releaser>;
+
+	std::atomic<command*> _head = nullptr; // newest first
+	wake_t _wake;
+	uint32_t _pending_state_changes = 0; // used only by the main thread; see run_then
+
+public:
+	simulator_command_queue (wake_t wake)
+		: _wake(std::move(wake))
+	{ }
+
+	simulator_command_queue (const simulator_command_queue&) = delete;
+	simulator_command_queue& operator= (const simulator_command_queue&) = delete;
+
+	// Commands queued after the simulator thread exited never ran.
+	~simulator_command_queue()
+	{
+		auto c = _head.exchange(nullptr);
+		while (c)
+		{
+			auto next = c->next;
+			c->release();
+			c = next;
+		}
+	}
+
+	// Runs "fun" on the simulator thread and waits for it to complete, so "fun" may capture references to the caller's stack.
+	// If the wait times out before "fun" started, "fun" never runs; if it times out after, we wait for "fun" to finish.
+	HRESULT run (function_t fun, uint32_t timeout_ms)
+	{
+		auto cmd = unique_command(new (std::nothrow) command()); RETURN_IF_NULL_ALLOC(cmd);
+		cmd->refs = 2; // one for us, one for the simulator thread
+		cmd->fun = std::move(fun);
+		push(cmd.get());
+
+		std::unique_lock lock(cmd->done_lock);
+		auto is_done = [&cmd] { return cmd->done; };
+		if (timeout_ms == no_timeout)
+			cmd->done_cv.wait(lock, is_done);
+		else if (!cmd->done_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), is_done))
+		{
+			if (!cmd->claimed.exchange(true))
+				RETURN_WIN32(ERROR_TIMEOUT);
+			cmd->done_cv.wait(lock, is_done); // already running
+		}
+
+		return cmd->result;
+	}
+
+	// Queues "fun" to run on the simulator thread and returns without waiting. If "completion" is not empty,
+	// it is called later on the main thread with what "fun" returned. Neither may capture references to the
+	// caller's stack. Can be called from any thread.
+	HRESULT post (function_t fun, completion_t completion = nullptr)
+	{
+		auto cmd = new (std::nothrow) command(); RETURN_IF_NULL_ALLOC(cmd);
+		cmd->refs = 1;
+		cmd->fun = std::move(fun);
+		cmd->completion = std::move(completion);
+		push(cmd);
+		return S_OK;
+	}
+
+	// For the methods that change the state of the simulation: runs "fun" on the simulator thread, then "then"
+	// on the main thread with what "fun" returned; "then" sends the events and the screen. With a null "completion"
+	// this waits for "fun" and returns what "then" returned; otherwise it returns without waiting, and passes that
+	// to the completion. The synchronous way fails while an asynchronous one is pending, since its "then" would
+	// run before the pending ones. Called on the main thread.
+	HRESULT run_then (function_t fun, then_t then, const SimulatorCompletion* completion, uint32_t timeout_ms)
+	{
+		if (!completion)
+		{
+			RETURN_HR_IF(E_UNEXPECTED, _pending_state_changes);
+			auto hr = run(std::move(fun), timeout_ms);
+			return then(hr);
+		}
+
+		RETURN_HR_IF(E_INVALIDARG, !completion->OnComplete);
+		auto hr = post (std::move(fun), [this, then=std::move(then), completion=*completion](HRESULT hr) mutable
+			{
+				_pending_state_changes--;
+				completion.OnComplete(completion.Context, then(hr));
+			});
+		RETURN_IF_FAILED(hr);
+		_pending_state_changes++;
+		return S_OK;
+	}
+
+	// The run_then calls with a completion that haven't completed yet.
+	uint32_t pending_state_changes() const { return _pending_state_changes; }
+
+	// Called on the simulator thread. Runs the commands queued so far, oldest first, and gives the completions
+	// to "post_to_main_thread", which takes a stdext::inplace_function<void()> and returns an HRESULT.
+	template<typename post_t>
+	void run_commands (post_t&& post_to_main_thread)
+	{
+		// The list comes out newest first; let's reverse it.
+		command* fifo = nullptr;
+		auto c = _head.exchange(nullptr);
+		while (c)
+		{
+			auto next = c->next;
+			c->next = fifo;
+			fifo = c;
+			c = next;
+		}
+
+		while (fifo)
+		{
+			auto cmd = unique_command(fifo);
+			fifo = fifo->next;
+
+			if (cmd->claimed.exchange(true))
+				continue; // run gave up waiting for it
+
+			cmd->result = cmd->fun();
+			cmd->fun = nullptr;
+
+			{
+				std::lock_guard lock(cmd->done_lock);
+				cmd->done = true;
+				cmd->done_cv.notify_all();
+			}
+
+			if (cmd->completion)
+			{
+				auto hr = post_to_main_thread([cmd=std::move(cmd)]() mutable { cmd->completion(cmd->result); });
+				LOG_IF_FAILED(hr);
+			}
+		}
+	}
+
+private:
+	void push (command* cmd)
+	{
+		// The simulator thread only ever takes the whole list, so there's no ABA problem here.
+		auto head = _head.load();
+		do
+			cmd->next = head;
+		while (!_head.compare_exchange_weak(head, cmd));
+
+		if (!head)
+			_wake();
+	}
+};
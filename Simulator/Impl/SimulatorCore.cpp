@@ -0,0 +1,439 @@
+#include "pch.h"
+#include "SimulatorCore.h"
+#include "shared/com.h"
+
+HRESULT STDMETHODCALLTYPE MakeHC91ROM (Bus* memory_bus, Bus* io_bus, IRomImage* image, wistd::unique_ptr<IMemoryDevice>* ppDevice);
+HRESULT STDMETHODCALLTYPE MakeHC91RAM (Bus* memory_bus, Bus* io_bus, wistd::unique_ptr<IMemoryDevice>* ppDevice);
+
+HRESULT SimulatorCore::init_core (IRomImage* rom, IScreenDeviceCompleteEventHandler* eh, bool audio)
+{
+	auto hr = MakeZ80CPU(&memoryBus, &ioBus, &irq, &_cpu); RETURN_IF_FAILED(hr);
+	hr = _cpu->SetThreadedDispatch(true); RETURN_IF_FAILED(hr);
+	hr = _cpu->SetJit(true);
+	if (hr != E_NOTIMPL)
+		RETURN_IF_FAILED(hr);
+
+	hr = MakeScreenDevice(&memoryBus, &ioBus, &irq, eh, &_screen); RETURN_IF_FAILED(hr);
+
+	hr = MakeKeyboardDevice(&ioBus, &_keyboard); RETURN_IF_FAILED(hr);
+
+	hr = MakeBeeper(&ioBus, audio, &_beeper); RETURN_IF_FAILED(hr);
+
+	hr = MakeHC91ROM (&memoryBus, &ioBus, rom, &_romDevice); RETURN_IF_FAILED(hr);
+
+	hr = MakeHC91RAM (&memoryBus, &ioBus, &_ramDevice); RETURN_IF_FAILED(hr);
+
+	for (IDevice* d : { (IDevice*)_screen.get(), (IDevice*)_keyboard.get(), (IDevice*)_romDevice.get(), (IDevice*)_ramDevice.get(), (IDevice*)_beeper.get() })
+	{
+		hr = _devices.add_device(d); RETURN_IF_FAILED(hr);
+	}
+
+	return S_OK;
+}
+
+void SimulatorCore::reset_core (uint16_t startAddress)
+{
+	_cpu->Reset();
+	_cpu->SetPC(startAddress);
+	_devices.reset();
+}
+
+SimulateStopReason SimulatorCore::simulate_step (UINT64 time, BreakpointsHit* bps)
+{
+	// First ask the CPU to simulate itself; then ask the devices
+	// to simulate themselves until they catch up with the CPU, not more.
+	// We don't want the devices to go far ahead of the CPU; if the CPU will stop at a breakpoint,
+	// we'll want to show to the user the devices at a time as close as possible to the CPU time;
+	// we can do that only if the devices are at all times behind the CPU or only slightly
+	// (a few clock cycles) ahead of it.
+	auto reason = _cpu->SimulateUntil(time, bps);
+
+	// Whatever the outcome of the above simulation, we must first bring the devices close to the CPU time.
+	simulate_devices_to(_cpu->Time());
+
+	return reason;
+}
+
+SimulateStopReason SimulatorCore::simulate_until (UINT64 time, BreakpointsHit* bps)
+{
+	while (_cpu->Time() < time)
+	{
+		IDevice* device_to_sync_on;
+		UINT64 time_to_sync_to;
+		bool sync = _devices.next_sync(&device_to_sync_on, &time_to_sync_to) && (time_to_sync_to < time);
+
+		auto reason = simulate_step (sync ? time_to_sync_to : time, bps);
+		if (reason == SimulateStopReason::Breakpoint)
+			return reason;
+
+		if (sync && (_cpu->Time() >= time_to_sync_to))
+			_devices.release_sync(time_to_sync_to);
+	}
+
+	return SimulateStopReason::TimeReached;
+}
+
+#pragma region Snapshot files
+#pragma pack (push, 1)
+// https://rk.nvg.ntnu.no/sinclair/faq/fileform.html#SNA
+struct snapshot_file_header
+{
+	uint8_t i;
+	uint16_t alt_hl;
+	uint16_t alt_de;
+	uint16_t alt_bc;
+	uint16_t alt_af;
+	uint16_t hl;
+	uint16_t de;
+	uint16_t bc;
+	uint16_t iy;
+	uint16_t ix;
+	uint8_t      : 1;
+	uint8_t ei   : 1;
+	uint8_t iff2 : 1;
+	uint8_t      : 5;
+	uint8_t r;
+	uint16_t af;
+	uint16_t sp;
+	uint8_t im;
+	uint8_t border;
+};
+#pragma pack (pop)
+
+static HRESULT ReadSNA (const wchar_t* pFileName, snapshot* s)
+{
+	static constexpr uint32_t file_size = sizeof(snapshot_file_header) + 48 * 1024;
+	vector_nothrow<uint8_t> file;
+	auto hr = read_file (pFileName, file_size, file);
+	if ((hr == HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE)) || (SUCCEEDED(hr) && (file.size() != file_size)))
+		return SetErrorInfo(E_FAIL, L"The file has an unrecognized size.\r\n(Only ZX Spectrum 48K files are supported for now.)");
+	RETURN_IF_FAILED_EXPECTED(hr);
+
+	snapshot_file_header header;
+	memcpy (&header, file.data(), sizeof(header));
+	memcpy (s->ram, file.data() + sizeof(header), 48 * 1024);
+
+	z80_register_set& regs = s->regs;
+	regs.halted = false;
+	regs.i       = header.i;
+	regs.alt.hl  = header.alt_hl;
+	regs.alt.bc  = header.alt_bc;
+	regs.alt.de  = header.alt_de;
+	regs.alt.af  = header.alt_af;
+	regs.main.hl = header.hl;
+	regs.main.de = header.de;
+	regs.main.bc = header.bc;
+	regs.ix      = header.ix;
+	regs.iy      = header.iy;
+	regs.iff1    = header.ei;
+	regs.r       = header.r;
+	regs.main.af = header.af;
+	regs.sp      = header.sp;
+	regs.im      = header.im;
+	regs.pc      = 0;
+	s->pc_on_stack = true;
+	return S_OK;
+}
+
+#pragma pack (push, 1)
+// https://worldofspectrum.org/faq/reference/z80format.htm
+struct z80_header
+{
+	uint8_t  a;  // 0
+	uint8_t  f;  // 1
+	uint16_t bc; // 2-3
+	uint16_t hl; // 4-5
+	uint16_t pc; // 6-7
+	uint16_t sp; // 8-9
+	uint8_t  i;  // 10
+	uint8_t  r;  // 11
+	uint8_t  r0         : 1; // 12 b0
+	uint8_t  border     : 3; // 12 b1-b3
+	uint8_t  samrom     : 1; // 12 b4
+	uint8_t  compressed : 1; // 12 b5
+	uint8_t             : 2; // 12 b6-b7
+	uint16_t de;     // 13-14
+	uint16_t alt_bc; // 15-16
+	uint16_t alt_de; // 17-18
+	uint16_t alt_hl; // 19-20
+	uint8_t  alt_a;  // 21
+	uint8_t  alt_f;  // 22
+	uint16_t iy;     // 23-24
+	uint16_t ix;     // 25-26
+	uint8_t  ei;     // 27
+	uint8_t  iff2;   // 28
+	uint8_t  im       : 2; // 29 b0-b1
+	uint8_t  issue2   : 1; // 29 b2
+	uint8_t  freq2x   : 1; // 29 b3
+	uint8_t  vid_sync : 2; // 29 b4-b5
+	uint8_t  joystick : 2; // 29 b6-b7
+};
+#pragma pack (pop)
+
+static HRESULT SetMalformedErrorInfo (const wchar_t* detail)
+{
+	return SetErrorInfo(E_FAIL, L"Malformed .Z80 file: %s", detail);
+}
+
+static HRESULT DecompressZ80 (const uint8_t* inPtr, const uint8_t* inEnd, uint8_t* outPtr, uint8_t* outEnd, bool terminatorExpected)
+{
+	while (true)
+	{
+		if (inPtr >= inEnd)
+		{
+			if (terminatorExpected)
+				return SetMalformedErrorInfo (L"Format version 1, compressed, no 00EDED00 terminator.");
+
+			return S_OK;
+		}
+
+		if ((inPtr + 4 <= inEnd) && !memcmp(inPtr, "\x00\xED\xED\x00", 4))
+			return S_OK;
+		
+		if ((inPtr + 4 <= inEnd) && (inPtr[0] == 0xED) && (inPtr[1] == 0xED))
+		{
+			inPtr += 2;
+			uint8_t repeat = *inPtr++;
+			uint8_t value = *inPtr++;
+			if (outPtr + repeat > outEnd)
+				return SetMalformedErrorInfo (L"Longer than 48K.");
+			memset (outPtr, value, repeat);
+			outPtr += repeat;
+		}
+		else
+		{
+			if (outPtr + 1 > outEnd)
+				return SetMalformedErrorInfo (L"Longer than 48K.");
+			*outPtr++ = *inPtr++;
+		}
+	}
+}
+
+static HRESULT LoadZ80V1 (const z80_header* header, const uint8_t* inPtr, const uint8_t* inEnd, uint8_t* outPtr, uint8_t* outEnd)
+{
+	if (!header->compressed)
+	{
+		if (inEnd - inPtr != 48 * 1024)
+			return SetMalformedErrorInfo (L"Format version 1, not compressed, size not 48K.");
+		memcpy (outPtr, inPtr, 48 * 1024);
+	}
+	else
+	{
+		auto hr = DecompressZ80(inPtr, inEnd, outPtr, outEnd, true); RETURN_IF_FAILED(hr);
+	}
+
+	return S_OK;
+}
+
+#pragma pack (push, 1)
+struct z80_header_v23
+{
+	uint16_t len;      // 30
+	uint16_t pc;       // 32
+	uint8_t  hardware_mode; // 34
+	uint8_t  byte_35;  // 35
+	uint8_t  byte_36;  // 36
+	uint8_t  r_emu     : 1; // 37 b0
+	uint8_t  ldir_emu  : 1; // 37 b1
+	uint8_t  ay_in_use : 1; // 37 b2
+	uint8_t            : 3; // 37 b3-b5
+	uint8_t  fuller    : 1; // 37 b6
+	uint8_t  modify_hw : 1; // 37 b7
+	uint8_t  out_fffd;       // 38
+	uint8_t  sound_chip[16]; // 39-54
+	uint16_t t_counter_low;  // 55-56
+	uint8_t  t_counter_high; // 57
+	uint8_t  : 8;  // 58 - Flag byte used by Spectator
+	uint8_t  : 8;  // 59 - 0xff if MGT Rom paged
+	uint8_t  : 8;  // 60 - 0xff if Multiface Rom paged.
+	uint8_t  : 8;  // 61 - 0xff if 0-8191 is ROM, 0 if RAM
+	uint8_t  : 8;  // 62 - 0xff if 8192-16383 is ROM, 0 if RAM
+	uint8_t  joystick_key_mapping[10];  // 63
+	uint8_t  keys[10];  // 73
+	uint8_t  : 8;  // 83
+	uint8_t  : 8;  // 84
+	uint8_t  : 8;  // 85
+	uint8_t  : 8;  // 86
+};
+#pragma pack (pop)
+
+static const wchar_t* const HardwareModeNamesV2[] = {
+	L"48K", L"48K+IF1", L"SamRam", L"128K", L"128K+IF1" };
+static const wchar_t* const HardwareModeNamesV3[] = {
+	L"48K", L"48K+IF1", L"SamRam", L"48K+M.G.T.", L"128K", L"128K+IF1", L"128K+M.G.T." };
+
+static HRESULT LoadZ80V23 (const z80_header_v23* header23, const uint8_t* inPtr, const uint8_t* inEnd, uint8_t* outPtr)
+{
+	const wchar_t* const* modeNames;
+	size_t modeNameCount;
+	if (header23->len == 23)
+	{
+		// Version 2
+		modeNames = HardwareModeNamesV2;
+		modeNameCount = std::size(HardwareModeNamesV2);
+	}
+	else if (header23->len == 54 || header23->len == 55)
+	{
+		// Version 3
+		modeNames = HardwareModeNamesV3;
+		modeNameCount = std::size(HardwareModeNamesV3);
+	}
+
+	if (auto hw = header23->hardware_mode; hw != 0)
+		return SetErrorInfo (E_FAIL, L"This file specifies hardware mode %u (%s), "
+			"but the simulator currently supports only hardware mode 0 (%s).", 
+			hw, (hw < modeNameCount) ? modeNames[hw] : L"??", modeNames[0]);
+
+	while (inPtr < inEnd)
+	{
+		if (inEnd - inPtr < 3)
+			return SetMalformedErrorInfo(L"Block Header too short.");
+		uint16_t lengthCompressedData = inPtr[0] | (inPtr[1] << 8);
+		uint8_t pageNumber = inPtr[2];
+		inPtr += 3;
+		
+		uint8_t* pagePtr;
+		if (pageNumber == 8)
+			pagePtr = outPtr; // Spectrum address 0x4000
+		else if (pageNumber == 4)
+			pagePtr = &outPtr[0x4000]; // Spectrum address 0x8000
+		else if (pageNumber == 5)
+			pagePtr = &outPtr[0x8000]; // Spectrum address 0xC000
+		else
+			return SetErrorInfo(E_FAIL, L"Unknown page number (%u) in Spectrum 48K mode.", pageNumber);
+
+		if (lengthCompressedData == 0xFFFF)
+		{
+			if (inEnd - inPtr < 0x4000)
+				return SetErrorInfo (E_FAIL, L"Page %u data too short. Expected %u, found %d.", pageNumber, 0x4000, inEnd - inPtr);
+			memcpy (pagePtr, inPtr, 0x4000);
+			inPtr += 0x4000;
+		}
+		else
+		{
+			auto hr = DecompressZ80 (inPtr, inPtr + lengthCompressedData, pagePtr, pagePtr + 0x4000, false); RETURN_IF_FAILED(hr);
+			inPtr += lengthCompressedData;
+		}
+	}
+
+	return S_OK;
+}
+
+
+// Much more than any 48K snapshot needs, even uncompressed; the 128K ones are rejected after reading the header.
+static constexpr uint32_t max_z80_file_size = 1024 * 1024;
+
+static HRESULT ReadZ80 (const wchar_t* pFileName, snapshot* s)
+{
+	vector_nothrow<uint8_t> file;
+	auto hr = read_file (pFileName, max_z80_file_size, file); RETURN_IF_FAILED_EXPECTED(hr);
+	if (file.size() < sizeof(z80_header))
+		return SetMalformedErrorInfo(L"Header too short.");
+
+	z80_header header;
+	memcpy (&header, file.data(), sizeof(header));
+	const uint8_t* inPtr = file.data() + sizeof(header);
+	const uint8_t* inEnd = file.data() + file.size();
+
+	uint8_t* outPtr = s->ram;
+	uint8_t* outEnd = outPtr + 48 * 1024;
+
+	uint16_t pc;
+	if (header.pc != 0)
+	{
+		hr = LoadZ80V1 (&header, inPtr, inEnd, outPtr, outEnd); RETURN_IF_FAILED_EXPECTED(hr);
+		pc = header.pc;
+	}
+	else
+	{
+		if (inEnd - inPtr < 2)
+			return SetMalformedErrorInfo(L"Header v2/3 too short.");
+		uint16_t header23_len = inPtr[0] | (inPtr[1] << 8);
+		if (inEnd - inPtr < (2 + header23_len))
+			return SetMalformedErrorInfo(L"Header v2/3 too short.");
+		auto* header23 = (const z80_header_v23*)inPtr;
+		inPtr += (2 + header23_len);
+		hr = LoadZ80V23 (header23, inPtr, inEnd, outPtr); RETURN_IF_FAILED_EXPECTED(hr);
+		pc = header23->pc;
+	}
+
+	z80_register_set& regs = s->regs;
+	regs.halted = false;
+	regs.i       = header.i;
+	regs.alt.hl  = header.alt_hl;
+	regs.alt.bc  = header.alt_bc;
+	regs.alt.de  = header.alt_de;
+	regs.alt.a   = header.alt_a;
+	regs.alt.f.val = header.alt_f;
+	regs.main.hl = header.hl;
+	regs.main.de = header.de;
+	regs.main.bc = header.bc;
+	regs.ix      = header.ix;
+	regs.iy      = header.iy;
+	regs.iff1    = header.ei;
+	regs.r       = header.r;
+	regs.main.a  = header.a;
+	regs.main.f.val = header.f;
+	regs.sp      = header.sp;
+	regs.im      = header.im;
+	regs.pc = pc;
+	s->pc_on_stack = false;
+	return S_OK;
+}
+
+HRESULT SimulatorCore::read_snapshot_file (LPCWSTR path, snapshot* s)
+{
+	if (extension_is(path, L".sna"))
+		return ReadSNA(path, s);
+
+	if (extension_is(path, L".z80"))
+		return ReadZ80(path, s);
+
+	return SetErrorInfo (E_FAIL, L"The file extension %s is not recognized.", find_extension(path));
+}
+
+void SimulatorCore::apply_snapshot (const snapshot* s)
+{
+	_cpu->Reset();
+	_devices.reset();
+
+	_ramDevice->WriteMemory(0x4000, 48 * 1024, s->ram);
+
+	z80_register_set regs = s->regs;
+	if (s->pc_on_stack)
+	{
+		regs.pc = memoryBus.read_uint16(regs.sp);
+		regs.sp += 2;
+	}
+	_cpu->SetZ80Registers(&regs);
+}
+#pragma endregion
+
+HRESULT SimulatorCore::load_binary (LPCWSTR pFileName, DWORD address, DWORD* loadedSize)
+{
+	vector_nothrow<uint8_t> file;
+	auto hr = read_file (pFileName, 0x10000, file);
+	if (hr == HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE))
+		RETURN_HR(E_BOUNDS);
+	if (FAILED(hr))
+		return SetErrorInfo (hr, L"Cannot access file.\r\n\r\n%s", pFileName);
+
+	uint32_t size = file.size();
+	if (!size)
+		return SetErrorInfo(E_BOUNDS, L"Can't load a binary with zero length.\r\n\r\n%s", pFileName);
+	if (address + (uint16_t)size <= address)
+		RETURN_HR(E_BOUNDS);
+	DWORD from, to;
+	_ramDevice->GetBounds(&from, &to);
+	if ((address < from) || (address + size > to))
+		return SetErrorInfo(E_BOUNDS, L"Binary does not fit in RAM.\r\n\r\n"
+			"Binary load address range is 0x%04X...0x%04X.\r\n\r\n"
+			"RAM address range = 0x%04X...0x%04X.\r\n\r\n"
+			"Try to adjust the BaseAddress value in the project properties."
+			, address, address + size, from, to);
+
+	_ramDevice->WriteMemory (address, size, file.data());
+
+	*loadedSize = size;
+	return S_OK;
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include "SimulatorInternal.h"
+#include "Z80CPU.h"
+
+// A ZX Spectrum 48K snapshot, as read from a .sna or .z80 file.
+struct snapshot
+{
+	z80_register_set regs;
+	bool pc_on_stack; // .sna files keep PC on the stack, as if an interrupt had just been accepted
+	uint8_t ram[48 * 1024];
+};
+
+// The machine itself: the CPU, the buses and the devices, and the scheduler that runs the devices.
+// The core has no window, no thread and no timers of its own; it runs only when its owner calls it,
+// always from the same thread. SimulatorImpl adds to it the simulator thread, pacing with real time,
+// and the messages to the GUI thread; HeadlessSimulator uses it as it is.
+class SimulatorCore
+{
+protected:
+	Bus memoryBus;
+	Bus ioBus;
+	irq_line_i irq;
+	wistd::unique_ptr<IZ80CPU> _cpu;
+	wistd::unique_ptr<IScreenDevice> _screen;
+	wistd::unique_ptr<IKeyboardDevice> _keyboard;
+	wistd::unique_ptr<IMemoryDevice> _romDevice;
+	wistd::unique_ptr<IMemoryDevice> _ramDevice;
+	wistd::unique_ptr<IBeeperDevice> _beeper;
+	DeviceScheduler _devices;
+
+	// "eh" may be null. With "audio" false the beeper is created without an audio output, and stays muted.
+	HRESULT init_core (IRomImage* rom, IScreenDeviceCompleteEventHandler* eh, bool audio);
+
+	void reset_core (uint16_t startAddress);
+
+	bool simulate_devices_to (UINT64 time)
+	{
+		return _devices.simulate_to(time);
+	}
+
+	// Runs the CPU until "time" (or until it stops for some other reason), then brings the devices up to the CPU.
+	SimulateStopReason simulate_step (UINT64 time, BreakpointsHit* bps);
+
+	// Like simulate_step, but goes on until the CPU reaches "time" or a breakpoint. Devices that need to sync
+	// with real time are let go past their sync points right away, so this runs as fast as the host can go.
+	SimulateStopReason simulate_until (UINT64 time, BreakpointsHit* bps);
+
+	// Reads a .sna or .z80 file. This doesn't touch the core, so it can run on any thread;
+	// errors are reported through SetErrorInfo on the calling thread.
+	static HRESULT read_snapshot_file (LPCWSTR path, snapshot* s);
+
+	// Resets the machine and loads into it a snapshot returned by read_snapshot_file.
+	void apply_snapshot (const snapshot* s);
+
+	// Errors are reported through SetErrorInfo on the calling thread.
+	HRESULT load_binary (LPCWSTR path, DWORD address, DWORD* loadedSize);
+};
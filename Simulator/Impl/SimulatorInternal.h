@@ -2,6 +2,7 @@
 #pragma once
 #include "../Simulator.h"
 #include "shared/vector_nothrow.h"
+#include <algorithm>
 
 struct DECLSPEC_NOVTABLE IDevice
 {
@@ -14,12 +15,37 @@ struct DECLSPEC_NOVTABLE IDevice
 
 struct BreakpointsHit
 {
-	//BreakpointType type;
-	uint16_t address;
+	BreakpointType type;
+	uint16_t address; // for code breakpoints the PC; for data breakpoints the address that was accessed
 	SIM_BP_COOKIE bps[8];
 	uint32_t size;
 };
 
+enum class SimulateStopReason
+{
+	TimeReached, // The CPU reached (or went slightly past) the requested time.
+	Breakpoint,  // A breakpoint was hit; the caller finds the details in the BreakpointsHit structure.
+	Interrupt,   // The CPU accepted an interrupt and jumped to the interrupt routine.
+	Stalled,     // The CPU needs to access a device (or poll an interrupting device) that lags behind it.
+};
+
+struct TracepointHandler
+{
+	void* Context;
+	void(*OnTracepointHit)(void* context, const TracepointHit& hit);
+};
+
+// Writes a trace file (see ISimulator::StartTraceFile). Records must come in the order the CPU made them.
+// After an error writing the file, the writer ignores further records and Flush returns the error.
+struct DECLSPEC_NOVTABLE ITraceWriter
+{
+	virtual ~ITraceWriter() = default;
+	virtual void AddInstruction (uint16_t pc, UINT64 time) = 0;
+	virtual void AddMemoryWrite (uint16_t address, uint8_t value, UINT64 time) = 0;
+	virtual HRESULT Flush() = 0;
+};
+HRESULT STDMETHODCALLTYPE MakeTraceWriter (LPCWSTR path, wistd::unique_ptr<ITraceWriter>* to);
+
 struct DECLSPEC_NOVTABLE ICPU
 {
 	virtual ~ICPU() = default;
@@ -45,20 +71,42 @@ struct DECLSPEC_NOVTABLE ICPU
 	//    the interrupt routine took some cycles, or maybe because the CPU was HALTed and remained so)
 	//  - "false" - if nothing was executed and the CPU remained at the same Time()
 	//    (maybe waiting for other devices to catch up, maybe code breakpoint).
+	// When an instruction hits data breakpoints, the function returns "true" (the instruction
+	// was executed) and reports the hits in "bps".
 	virtual bool SimulateOne (BreakpointsHit* bps) = 0;
 
+	// Executes instructions until the CPU reaches "requested_time", or until it hits a breakpoint,
+	// accepts an interrupt, or stalls waiting for other devices to catch up - whichever comes first.
+	// "bps" has the same meaning as for SimulateOne. The caller finds out how far the CPU got by calling Time().
+	// This is faster than calling SimulateOne in a loop; SimulateOne remains the function for single-stepping.
+	virtual SimulateStopReason SimulateUntil (UINT64 requested_time, BreakpointsHit* bps) = 0;
+
+	// For BreakpointType::Data this adds a write watch on the byte at "address"; use AddDataBreakpoint for more options.
 	virtual HRESULT AddBreakpoint (BreakpointType type, uint16_t address, SIM_BP_COOKIE* pCookie) = 0;
+	virtual HRESULT AddDataBreakpoint (uint16_t address, uint32_t size, DataBreakpointAccess access, SIM_BP_COOKIE* pCookie) = 0;
 	virtual HRESULT RemoveBreakpoint (SIM_BP_COOKIE cookie) = 0;
+	virtual HRESULT SetBreakpointCondition (SIM_BP_COOKIE cookie, const uint8_t* condition, uint32_t size) = 0;
+	virtual HRESULT SetBreakpointPassCount (SIM_BP_COOKIE cookie, BreakpointPassCountStyle style, uint32_t passCount) = 0;
+	virtual HRESULT GetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t* hitCount) = 0;
+	virtual HRESULT SetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t hitCount) = 0;
+	virtual HRESULT SetTracepoint (SIM_BP_COOKIE cookie, bool tracepoint, const uint8_t* values, uint32_t size) = 0;
+	// The CPU calls the handler on the simulator thread, from within SimulateOne / SimulateUntil.
+	virtual void SetTracepointHandler (TracepointHandler handler) = 0;
 	virtual BOOL HasBreakpoints() = 0;
+	virtual HRESULT SetInstructionTrace (uint32_t capacity) = 0;
+	// Returns the number of records copied.
+	virtual uint32_t GetInstructionTrace (InstructionTraceRecord* records, uint32_t max_count) = 0;
+	// Pass null to stop writing. The CPU doesn't own the writer.
+	virtual void SetTraceWriter (ITraceWriter* writer) = 0;
+	// Makes SimulateUntil run decoded instructions from a direct-threaded loop while tracing is off.
+	// It doesn't change what the simulation does.
+	virtual HRESULT SetThreadedDispatch (bool enable) = 0;
+	// Makes SimulateUntil compile the code it runs most often to host code, and run that while tracing is off.
+	// Like the threaded dispatch, it doesn't change what the simulation does. Fails with E_NOTIMPL on hosts
+	// the compiler doesn't support.
+	virtual HRESULT SetJit (bool enable) = 0;
 };
 
-/*
-struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{A97526D1-239A-4322-ABA8-33CF2690A732}") IBusAddressRangeChangeHandler : IWeakRefSource
-{
-	virtual HRESULT OnBusAddressRangeChanging (IMemoryDevice* device, uint32_t address, uint32_t size) = 0;
-	virtual HRESULT OnBusAddressRangeChanged  (IMemoryDevice* device, uint32_t address, uint32_t size) = 0;
-};
-*/
 struct DECLSPEC_NOVTABLE IMemoryDevice : IDevice
 {
 	virtual HRESULT GetBounds (DWORD* from, DWORD* to) = 0;
@@ -69,8 +117,13 @@ struct DECLSPEC_NOVTABLE IMemoryDevice : IDevice
 struct IInterruptingDevice
 {
 	virtual IDevice* as_device() = 0;
+	// Of interrupts requested for the same time point, the CPU accepts first the one from the device with the highest priority.
 	virtual uint8_t STDMETHODCALLTYPE irq_priority() = 0;
 	virtual bool irq_pending (uint64_t& irq_time, uint8_t& irq_address) const = 0;
+	// Returns the time of the pending interrupt, or else of the next one the device will request if nothing
+	// changes its state meanwhile. Returns false if the device can't tell. The CPU doesn't poll the
+	// interrupting devices again before the earliest of these times, except after a reset.
+	virtual bool next_irq_time (UINT64& irq_time) const = 0;
 	virtual void acknowledge_irq() = 0;
 };
 
@@ -90,79 +143,340 @@ static constexpr UINT64 ticks_to_hundreds_of_nanoseconds (UINT64 ticks)
 	return ticks * 10000 / 3500;
 }
 
+// Checks the arguments of ISimulator::SetRunSpeed.
+inline HRESULT validate_run_speed (RunSpeed speed, UINT32 multiplier)
+{
+	RETURN_HR_IF(E_INVALIDARG, (speed != RunSpeed::RealTime) && (speed != RunSpeed::Multiplier) && (speed != RunSpeed::Unthrottled));
+	RETURN_HR_IF(E_INVALIDARG, (speed == RunSpeed::Multiplier) && ((multiplier < 2) || (multiplier > 100)));
+	return S_OK;
+}
+
+// Picks which of the screens completed while the simulation runs go to the GUI thread. Faster than real time
+// we get more screens than the GUI can show, and copying each of them would only slow down the simulation,
+// so at any speed other than real time this lets through at most 50 screens per real second.
+class screen_rate_limiter
+{
+	static constexpr uint32_t max_screens_per_second = 50;
+	bool _sent_any = false;
+	int64_t _last_sent = 0;
+
+public:
+	// "now" is a reading of a clock that ticks "frequency" times a second, such as QueryPerformanceCounter.
+	bool should_send (RunSpeed speed, int64_t now, int64_t frequency)
+	{
+		if (speed == RunSpeed::RealTime)
+			return true;
+
+		if (_sent_any && (now - _last_sent < frequency / max_screens_per_second))
+			return false;
+
+		_sent_any = true;
+		_last_sent = now;
+		return true;
+	}
+};
+
 // ReadResponder and WriteResponder are implemented as pairs of device + handler
 // (rather than as interface classes with virtual functions) because some devices
 // are present on both buses (memory and IO) and we'd get a conflict when overriding
 // once for the memory and once for the IO. We also want to stay away from dynamic_cast.
+//
+// A responder is called only for addresses where (address & AddressMask) == AddressValue,
+// so handlers don't need to check the address themselves. The default zero mask means
+// the responder is interested in all addresses.
 
 struct ReadResponder
 {
 	IDevice* Device;
 	uint8_t(*ProcessReadRequest)(IDevice* device, uint16_t address);
+	uint16_t AddressMask = 0;
+	uint16_t AddressValue = 0;
 };
 
 struct WriteResponder
 {
 	IDevice* Device;
 	void(*ProcessWriteRequest)(IDevice* device, uint16_t address, uint8_t value);
+	uint16_t AddressMask = 0;
+	uint16_t AddressValue = 0;
+};
+
+// A memory page is a range of bus addresses owned by a single device that has a plain array of bytes
+// behind it (RAM, ROM). Reads and writes to a mapped page go straight to that array, without calling
+// into the device and without synchronizing the device's time - the content of such a device doesn't
+// change by itself as time passes, so there's nothing to synchronize. Pages that aren't mapped fall
+// back to the list of responders.
+struct MemoryPage
+{
+	IDevice*       read_device;
+	const uint8_t* read;  // points to the byte for the first address of the page; null if the page is not mapped for reading
+	IDevice*       write_device;
+	uint8_t*       write; // points to the byte for the first address of the page; null if the page is not mapped for writing
+	uint8_t        watch; // DataBreakpointAccess flags; non-zero if some address in this page is watched
+
+	// Set when the bytes read from this page may have changed: on every write, and when the page is mapped
+	// or unmapped for reading. The CPU clears it when it drops the instructions it decoded from this page.
+	uint8_t        code_written;
+};
+
+// Called by the bus for every access to a page whose "watch" flags match the access.
+// "time" is the time of the access as passed to try_read_request / try_write_request,
+// or UINT64_MAX for accesses through read() / write(), which ignore time.
+// "value" is the byte read or written.
+// The handler must check the address itself, since it is called for every address in the page.
+struct WatchHandler
+{
+	void* Context;
+	void(*OnWatchedAccess)(void* context, uint16_t address, uint8_t value, DataBreakpointAccess access, UINT64 time);
 };
 
 struct DECLSPEC_NOVTABLE Bus
 {
-	// All devices that respond to read requests.
+	static constexpr uint32_t page_size  = 0x100;
+	static constexpr uint32_t page_shift = 8;
+	static constexpr uint32_t page_count = 0x10000 / page_size;
+	static_assert ((1 << page_shift) == page_size);
+
+	// All devices that respond to read requests. Use try_add_read_responder / remove_responders to modify it.
 	vector_nothrow<ReadResponder> read_responders;
 
-	// All devices that respond to write requests.
+	// All devices that respond to write requests. Use try_add_write_responder / remove_responders to modify it.
 	vector_nothrow<WriteResponder> write_responders;
-	
+
+	// Responders from the lists above, grouped by the low byte of the addresses they respond to.
+	// The responders interested in addresses with low byte "b" are found in read_decoded at indexes
+	// from read_decode_index[b] up to (not including) read_decode_index[b + 1]. Same for write.
+	// This saves IN/OUT instructions from calling into devices that aren't decoding the port.
+	vector_nothrow<ReadResponder> read_decoded;
+	uint16_t read_decode_index[257] = { };
+	vector_nothrow<WriteResponder> write_decoded;
+	uint16_t write_decode_index[257] = { };
+
+	MemoryPage pages[page_count] = { };
+
+	WatchHandler watch_handler = { };
+
+	// Incremented by every try_write_request, so the CPU can tell whether a stretch of code wrote anything.
+	uint32_t write_count = 0;
+
+	template<typename responder_t>
+	static bool try_build_decode_table (vector_nothrow<responder_t>& responders, vector_nothrow<responder_t>& decoded, uint16_t (&index)[257])
+	{
+		uint32_t count = 0;
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			for (auto& r : responders)
+			{
+				if ((b & r.AddressMask & 0xFF) == (r.AddressValue & 0xFF))
+					count++;
+			}
+		}
+
+		if (!decoded.try_reserve(count))
+			return false;
+
+		decoded.clear();
+		for (uint32_t b = 0; b < 256; b++)
+		{
+			index[b] = (uint16_t)decoded.size();
+			for (auto& r : responders)
+			{
+				if ((b & r.AddressMask & 0xFF) == (r.AddressValue & 0xFF))
+					decoded.try_push_back(r);
+			}
+		}
+
+		index[256] = (uint16_t)decoded.size();
+		return true;
+	}
+
+	[[nodiscard]] bool try_add_read_responder (const ReadResponder& r)
+	{
+		if (!read_responders.try_push_back(r))
+			return false;
+
+		if (!try_build_decode_table(read_responders, read_decoded, read_decode_index))
+		{
+			read_responders.remove_back();
+			return false;
+		}
+
+		return true;
+	}
+
+	[[nodiscard]] bool try_add_write_responder (const WriteResponder& r)
+	{
+		if (!write_responders.try_push_back(r))
+			return false;
+
+		if (!try_build_decode_table(write_responders, write_decoded, write_decode_index))
+		{
+			write_responders.remove_back();
+			return false;
+		}
+
+		return true;
+	}
+
+	// Removes all read and write responders that belong to "device".
+	void remove_responders (IDevice* device)
+	{
+		while (true)
+		{
+			auto it = read_responders.find_if([device](auto& r) { return r.Device == device; });
+			if (it == read_responders.end())
+				break;
+			read_responders.erase(it);
+		}
+
+		while (true)
+		{
+			auto it = write_responders.find_if([device](auto& r) { return r.Device == device; });
+			if (it == write_responders.end())
+				break;
+			write_responders.erase(it);
+		}
+
+		// The tables can only shrink here, so they fit in the memory they already have.
+		bool built = try_build_decode_table(read_responders, read_decoded, read_decode_index); FAIL_FAST_IF(!built);
+		built = try_build_decode_table(write_responders, write_decoded, write_decode_index); FAIL_FAST_IF(!built);
+	}
+
+	// Maps the address range [address, address + size) so that reads in that range come directly from "data".
+	// The range must be page-aligned. Any previous read mapping of those pages is replaced.
+	void map_read_pages (IDevice* device, uint32_t address, uint32_t size, const uint8_t* data)
+	{
+		WI_ASSERT(!(address % page_size) && !(size % page_size) && (address + size <= 0x10000));
+		for (uint32_t offset = 0; offset < size; offset += page_size)
+		{
+			auto& p = pages[(address + offset) >> page_shift];
+			p.read_device = device;
+			p.read = data + offset;
+			p.code_written = 1;
+		}
+	}
+
+	// Comment from map_read_pages() applies here too.
+	void map_write_pages (IDevice* device, uint32_t address, uint32_t size, uint8_t* data)
+	{
+		WI_ASSERT(!(address % page_size) && !(size % page_size) && (address + size <= 0x10000));
+		for (uint32_t offset = 0; offset < size; offset += page_size)
+		{
+			auto& p = pages[(address + offset) >> page_shift];
+			p.write_device = device;
+			p.write = data + offset;
+		}
+	}
+
+	// Removes all mappings that belong to "device". Pages mapped meanwhile by other devices are left alone.
+	void unmap_pages (IDevice* device)
+	{
+		for (auto& p : pages)
+		{
+			if (p.read_device == device)
+			{
+				p.read_device = nullptr;
+				p.read = nullptr;
+				p.code_written = 1;
+			}
+
+			if (p.write_device == device)
+			{
+				p.write_device = nullptr;
+				p.write = nullptr;
+			}
+		}
+	}
+
+	// Sets the "watch" flags of the pages that overlap [address, address + size).
+	// Flags are only ever added here; to remove some, call clear_watched_pages and set again those still needed.
+	void set_watched_pages (uint32_t address, uint32_t size, DataBreakpointAccess access)
+	{
+		WI_ASSERT(size && (address + size <= 0x10000));
+		for (uint32_t i = address >> page_shift; i <= (address + size - 1) >> page_shift; i++)
+			pages[i].watch |= (uint8_t)access;
+	}
+
+	void clear_watched_pages()
+	{
+		for (auto& p : pages)
+			p.watch = 0;
+	}
+
+	// For devices that change their bytes without going through the bus (when reset, when loading a file).
+	void mark_code_written (uint32_t address, uint32_t size)
+	{
+		WI_ASSERT(size && (address + size <= 0x10000));
+		for (uint32_t i = address >> page_shift; i <= (address + size - 1) >> page_shift; i++)
+			pages[i].code_written = 1;
+	}
+
+	void notify_watch (uint8_t page_watch, uint16_t address, uint8_t value, DataBreakpointAccess access, UINT64 time)
+	{
+		if ((page_watch & (uint8_t)access) && watch_handler.OnWatchedAccess)
+			watch_handler.OnWatchedAccess(watch_handler.Context, address, value, access, time);
+	}
+
 	// Reads something from a bus while ignoring any time difference between devices.
 	// Useful for debugging only. Simulation-related code should always use try_read_request.
 	uint8_t read (uint16_t address)
 	{
-		uint8_t val = 0xFF;
-		for (auto& d : read_responders)
-			val &= d.ProcessReadRequest(d.Device, address);
+		auto& page = pages[address >> page_shift];
+		uint8_t val;
+		if (page.read)
+			val = page.read[address & (page_size - 1)];
+		else
+		{
+			val = 0xFF;
+			for (uint32_t i = read_decode_index[address & 0xFF]; i < read_decode_index[(address & 0xFF) + 1]; i++)
+			{
+				auto& d = read_decoded[i];
+				if ((address & d.AddressMask) == d.AddressValue)
+					val &= d.ProcessReadRequest(d.Device, address);
+			}
+		}
+
+		if (page.watch)
+			notify_watch (page.watch, address, val, DataBreakpointAccess::Read, UINT64_MAX);
 		return val;
 	}
 
 	// Comments from read() apply here too.
 	void write (uint16_t address, uint8_t value)
 	{
-		for (auto& d : write_responders)
-			d.ProcessWriteRequest(d.Device, address, value);
+		auto& page = pages[address >> page_shift];
+		if (page.write)
+			page.write[address & (page_size - 1)] = value;
+		else
+		{
+			for (uint32_t i = write_decode_index[address & 0xFF]; i < write_decode_index[(address & 0xFF) + 1]; i++)
+			{
+				auto& d = write_decoded[i];
+				if ((address & d.AddressMask) == d.AddressValue)
+					d.ProcessWriteRequest(d.Device, address, value);
+			}
+		}
+
+		page.code_written = 1;
+		if (page.watch)
+			notify_watch (page.watch, address, value, DataBreakpointAccess::Write, UINT64_MAX);
 	}
 
 	void write (uint16_t address, std::initializer_list<uint8_t> values)
 	{
 		for (size_t i = 0; i < values.size(); i++)
-		{
-			uint8_t value = *(values.begin() + i);
-			for (auto& d : write_responders)
-				d.ProcessWriteRequest(d.Device, address + (uint16_t)i, value);
-		}
+			write (address + (uint16_t)i, *(values.begin() + i));
 	}
 
 	uint16_t read_uint16 (uint16_t address)
 	{
-		uint16_t val = 0xFFFF;
-		for (auto& d : read_responders)
-		{
-			uint8_t l = d.ProcessReadRequest(d.Device, address);
-			uint8_t h = d.ProcessReadRequest(d.Device, address + 1);
-			val &= (l | (h << 8));
-		}
-		return val;
+		return read(address) | (read(address + 1) << 8);
 	}
 
 	void write_uint16 (uint16_t address, uint16_t value)
 	{
-		uint8_t l = (uint8_t)value;
-		uint8_t h = (uint8_t)(value >> 8);
-		for (auto& d : write_responders)
-		{
-			d.ProcessWriteRequest(d.Device, address, l);
-			d.ProcessWriteRequest(d.Device, address + 1, h);
-		}
+		write (address, (uint8_t)value);
+		write (address + 1, (uint8_t)(value >> 8));
 	}
 
 	// Tries to performs a read request on the bus.
@@ -171,9 +485,22 @@ struct DECLSPEC_NOVTABLE Bus
 	// If no, it returns false. If yes, it sets the 'value' variable and returns true.
 	bool try_read_request (uint16_t address, uint8_t& value, UINT64 requested_time)
 	{
+		auto& page = pages[address >> page_shift];
+		if (page.read)
+		{
+			value = page.read[address & (page_size - 1)];
+			if (page.watch)
+				notify_watch (page.watch, address, value, DataBreakpointAccess::Read, requested_time);
+			return true;
+		}
+
 		uint8_t temp = 0xFF;
-		for (auto& d : read_responders)
+		for (uint32_t i = read_decode_index[address & 0xFF]; i < read_decode_index[(address & 0xFF) + 1]; i++)
 		{
+			auto& d = read_decoded[i];
+			if ((address & d.AddressMask) != d.AddressValue)
+				continue;
+
 			if (d.Device->Time() < requested_time)
 			{
 				// A read responder is at an earlier time point. Let's try to simulate it
@@ -196,14 +523,33 @@ struct DECLSPEC_NOVTABLE Bus
 		}
 
 		value = temp;
+		if (page.watch)
+			notify_watch (page.watch, address, value, DataBreakpointAccess::Read, requested_time);
 		return true;
 	}
 
 	// Comment from try_read_request() applies here as well.
 	bool try_write_request (uint16_t address, uint8_t value, UINT64 requested_time)
 	{
-		for (auto& d : write_responders)
+		auto& page = pages[address >> page_shift];
+		if (page.write)
 		{
+			page.write[address & (page_size - 1)] = value;
+			page.code_written = 1;
+			write_count++;
+			if (page.watch)
+				notify_watch (page.watch, address, value, DataBreakpointAccess::Write, requested_time);
+			return true;
+		}
+
+		uint32_t begin = write_decode_index[address & 0xFF];
+		uint32_t end = write_decode_index[(address & 0xFF) + 1];
+		for (uint32_t i = begin; i < end; i++)
+		{
+			auto& d = write_decoded[i];
+			if ((address & d.AddressMask) != d.AddressValue)
+				continue;
+
 			if (d.Device->Time() < requested_time)
 			{
 				// Comment from try_read_request applies here too.
@@ -218,9 +564,17 @@ struct DECLSPEC_NOVTABLE Bus
 		// We want this operation to write either to all responders, or to none of them.
 		// If we got past the above "for", we know we can write to all of them.
 
-		for (auto& d : write_responders)
-			d.ProcessWriteRequest(d.Device, address, value);
+		for (uint32_t i = begin; i < end; i++)
+		{
+			auto& d = write_decoded[i];
+			if ((address & d.AddressMask) == d.AddressValue)
+				d.ProcessWriteRequest(d.Device, address, value);
+		}
 
+		page.code_written = 1;
+		write_count++;
+		if (page.watch)
+			notify_watch (page.watch, address, value, DataBreakpointAccess::Write, requested_time);
 		return true;
 	}
 
@@ -248,7 +602,7 @@ struct DECLSPEC_NOVTABLE Bus
 	}
 };
 
-struct __declspec(novtable) irq_line_i
+struct DECLSPEC_NOVTABLE irq_line_i
 {
 	vector_nothrow<IInterruptingDevice*> interrupting_devices;
 
@@ -259,30 +613,220 @@ struct __declspec(novtable) irq_line_i
 	//
 	bool try_poll_irq_at_time_point (bool& interrupted, uint8_t& irq_address, UINT64 cpu_time)
 	{
+		// Interrupts are delivered in the order they were requested: the earliest one first and,
+		// of those requested at the same time point, the one with the highest priority.
+		IInterruptingDevice* earliest = nullptr;
+		UINT64 earliest_time = 0;
+		uint8_t earliest_address = 0;
 		for (auto d : interrupting_devices)
 		{
 			if (d->as_device()->Time() < cpu_time)
 				return false;
 
 			UINT64 irq_time;
-			if (d->irq_pending(irq_time, irq_address) && ((int32_t)(irq_time - cpu_time) <= 0))
+			uint8_t address;
+			if (d->irq_pending(irq_time, address) && ((int32_t)(irq_time - cpu_time) <= 0))
 			{
-				// TODO: look for the earliest irqs, and if there are more of them at the same time, look at irq priorities.
-				d->acknowledge_irq();
-				interrupted = true;
-				return true;
+				if (!earliest || ((int32_t)(irq_time - earliest_time) < 0)
+					|| ((irq_time == earliest_time) && (d->irq_priority() > earliest->irq_priority())))
+				{
+					earliest = d;
+					earliest_time = irq_time;
+					earliest_address = address;
+				}
 			}
 		}
 
+		if (earliest)
+		{
+			earliest->acknowledge_irq();
+			irq_address = earliest_address;
+			interrupted = true;
+			return true;
+		}
+
 		// All interrupting devices have caught up with the CPU and none has a pending interrupt at that time point.
 		interrupted = false;
 		return true;
 	}
+
+	// Returns the earliest time at which any device could request an interrupt, or UINT64_MAX if none ever will.
+	// A device that can't tell when it will request its next interrupt could do so right after the time it has reached.
+	UINT64 next_irq_time() const
+	{
+		UINT64 earliest = UINT64_MAX;
+		for (auto d : interrupting_devices)
+		{
+			UINT64 irq_time;
+			if (!d->next_irq_time(irq_time))
+				irq_time = d->as_device()->Time() + 1;
+			earliest = std::min(earliest, irq_time);
+		}
+
+		return earliest;
+	}
+};
+
+// Runs the devices of a simulator (other than the CPU) in time order. Devices are kept in two heaps:
+// one on the time each device has reached, so that bringing the devices up to a time point runs only
+// those behind it, earliest first; and one on the time point each device needs to sync with real time
+// at (see IDevice::NeedSyncWithRealTime), so the simulator can find the next one without asking every device.
+//
+// Devices also advance outside the scheduler, when the bus asks a device that lags behind the CPU to
+// catch up; so an entry in the heaps may be stale. A stale entry has an earlier time than the device,
+// never a later one, and gets refreshed when it reaches the top. Devices are reset through the scheduler
+// (see reset), since that moves them back in time.
+struct DeviceScheduler
+{
+	struct entry
+	{
+		UINT64   time;
+		IDevice* device;
+
+		// For std::push_heap and friends, which build max-heaps.
+		bool operator< (const entry& other) const { return time > other.time; }
+	};
+
+	vector_nothrow<IDevice*> devices;
+	vector_nothrow<entry> by_time;
+	vector_nothrow<entry> by_sync_time;
+	vector_nothrow<entry> blocked; // used by simulate_to
+
+	HRESULT add_device (IDevice* device)
+	{
+		bool pushed = devices.try_push_back(device); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool reserved = by_time.try_reserve(devices.size())
+			&& by_sync_time.try_reserve(devices.size())
+			&& blocked.try_reserve(devices.size());
+		if (!reserved)
+		{
+			devices.remove_back();
+			RETURN_HR(E_OUTOFMEMORY);
+		}
+
+		rebuild();
+		return S_OK;
+	}
+
+	// Resets all devices, which moves them back in time.
+	void reset()
+	{
+		for (auto d : devices)
+			d->Reset();
+		rebuild();
+	}
+
+	void rebuild()
+	{
+		by_time.clear();
+		by_sync_time.clear();
+		for (auto d : devices)
+		{
+			push (by_time, { d->Time(), d });
+			UINT64 sync_time;
+			if (d->NeedSyncWithRealTime(&sync_time))
+				push (by_sync_time, { sync_time, d });
+		}
+	}
+
+	// Brings all devices up to "time", running first the one furthest behind. A device that can't advance
+	// (it waits for another device) is retried after some other device advances. Returns true if any device
+	// advanced, false if none of them needed to or could.
+	bool simulate_to (UINT64 time)
+	{
+		bool res = false;
+		while (by_time.size() && (by_time.front().time < time))
+		{
+			entry e = pop(by_time);
+			UINT64 time_before = e.device->Time();
+			if (time_before != e.time)
+			{
+				// Stale; the device advanced meanwhile.
+				push (by_time, { time_before, e.device });
+				continue;
+			}
+
+			e.device->SimulateTo(time);
+			UINT64 time_after = e.device->Time();
+			if (time_after == time_before)
+			{
+				bool pushed = blocked.try_push_back(e); FAIL_FAST_IF(!pushed); // capacity reserved in add_device
+				continue;
+			}
+
+			res = true;
+			push (by_time, { time_after, e.device });
+			while (blocked.size())
+				push (by_time, blocked.remove_back());
+		}
+
+		while (blocked.size())
+			push (by_time, blocked.remove_back());
+		return res;
+	}
+
+	// Returns the device that needs to sync with real time first, and the time point of that sync;
+	// returns false if no device needs to.
+	bool next_sync (IDevice** device, UINT64* sync_time)
+	{
+		while (by_sync_time.size())
+		{
+			auto& top = by_sync_time.front();
+			if (top.device->Time() <= top.time)
+			{
+				*device = top.device;
+				*sync_time = top.time;
+				return true;
+			}
+
+			// The device went past that time point; ask it for its next one.
+			entry e = pop(by_sync_time);
+			UINT64 t;
+			if (e.device->NeedSyncWithRealTime(&t))
+				push (by_sync_time, { t, e.device });
+		}
+
+		return false;
+	}
+
+	// Called when real time has reached "sync_time": lets all devices waiting for that time point
+	// go past it. Running them together (rather than only the one next_sync returned) means two devices
+	// that sync at the same time point can't block each other.
+	void release_sync (UINT64 sync_time)
+	{
+		bool advanced;
+		do
+		{
+			advanced = false;
+			for (auto& e : by_sync_time)
+			{
+				if ((e.time <= sync_time) && (e.device->Time() < sync_time + 1))
+				{
+					UINT64 time_before = e.device->Time();
+					e.device->SimulateTo(sync_time + 1);
+					advanced |= (e.device->Time() > time_before);
+				}
+			}
+		} while (advanced);
+	}
+
+	static void push (vector_nothrow<entry>& heap, const entry& e)
+	{
+		bool pushed = heap.try_push_back(e); FAIL_FAST_IF(!pushed); // capacity reserved in add_device
+		std::push_heap (heap.begin(), heap.end());
+	}
+
+	static entry pop (vector_nothrow<entry>& heap)
+	{
+		std::pop_heap (heap.begin(), heap.end());
+		return heap.remove_back();
+	}
 };
 
 struct IScreenDeviceCompleteEventHandler
 {
 	// Function called by the screen device every time it completes drawing a screen.
+	// The handler passed to MakeScreenDevice may be null.
 	virtual void OnScreenDeviceComplete() = 0;
 };
 
@@ -307,3 +851,28 @@ struct IKeyboardDevice : IDevice
 	virtual HRESULT STDMETHODCALLTYPE ProcessKeyUp (uint32_t vkey, uint32_t modifiers) = 0;
 };
 HRESULT STDMETHODCALLTYPE MakeKeyboardDevice (Bus* io_bus, wistd::unique_ptr<IKeyboardDevice>* ppDevice);
+
+struct IBeeperDevice : IDevice
+{
+	// A muted beeper keeps following the simulated time but produces no audio; the simulator
+	// mutes it when running faster than real time, as the audio would be only noise then.
+	virtual void SetMuted (bool muted) = 0;
+};
+// With "audio" false the beeper doesn't create an audio output, and stays muted.
+HRESULT STDMETHODCALLTYPE MakeBeeper (Bus* io_bus, bool audio, wistd::unique_ptr<IBeeperDevice>* ppDevice);
+
+// Files: the core reads its files (ROM images, snapshots, binaries) only through these, so that it reads them
+// the same way on all platforms. Paths are wide strings, as on Windows, and a relative path is relative to the
+// current directory of the process.
+
+// Reads a whole file into "contents"; fails with ERROR_FILE_TOO_LARGE if the file is longer than "max_size" bytes.
+HRESULT read_file (const wchar_t* path, uint32_t max_size, vector_nothrow<uint8_t>& contents);
+
+// Writes to "to" the path of "name" in "folder"; fails with E_BOUNDS if it doesn't fit in "to_size" characters.
+HRESULT combine_path (const wchar_t* folder, const wchar_t* name, wchar_t* to, uint32_t to_size);
+
+// Returns the extension in "path", including the dot, or the terminating null if there's none.
+const wchar_t* find_extension (const wchar_t* path);
+
+// Tells whether "path" has the extension "ext" (as ".sna"), in any case.
+bool extension_is (const wchar_t* path, const wchar_t* ext);
@@ -0,0 +1,240 @@
+#include "pch.h"
+#include "SimulatorInternal.h"
+#include "shared/com.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class SimulatorPool : public ISimulatorPool
+{
+	ULONG _refCount = 0;
+
+	static constexpr UINT64 default_slice_ticks = milliseconds_to_ticks(20);
+
+	struct run
+	{
+		IHeadlessSimulator* sim;
+		UINT64 time;
+		HRESULT* result;
+		SIM_BP_COOKIE* bp;
+	};
+
+	// Each worker has its own queue of runs. The worker pushes and pops at the back, so it keeps going with
+	// the run it just sliced, whose simulator is still in its cache; other workers steal from the front.
+	struct worker
+	{
+		std::mutex lock;
+		vector_nothrow<run> runs;
+		std::thread thread;
+	};
+
+	UINT64 _slice_ticks;
+	wistd::unique_ptr<worker[]> _workers;
+	uint32_t _worker_count = 0;
+	uint32_t _next_worker = 0; // Submit spreads the runs over the workers, round-robin
+
+	// A semaphore of sorts: _work_available counts the times a run became available for stealing,
+	// and a sleeping worker wakes up for each.
+	std::mutex _wake_lock;
+	std::condition_variable _wake;
+	uint32_t _work_available = 0;
+	bool _exit_requested = false;
+
+	// Runs submitted and not yet completed.
+	std::mutex _outstanding_lock;
+	std::condition_variable _all_done; // notified when _outstanding drops to zero
+	uint32_t _outstanding = 0;
+
+public:
+	HRESULT InitInstance (UINT32 threadCount, UINT64 sliceTicks)
+	{
+		if (!threadCount)
+			threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+
+		_slice_ticks = sliceTicks ? sliceTicks : default_slice_ticks;
+
+		_workers = wil::make_unique_nothrow<worker[]>(threadCount); RETURN_IF_NULL_ALLOC(_workers);
+		_worker_count = threadCount;
+
+		// Without exceptions, std::thread terminates the process if it can't start a thread.
+		for (uint32_t i = 0; i < threadCount; i++)
+			_workers[i].thread = std::thread(&SimulatorPool::worker_proc, this, i);
+
+		return S_OK;
+	}
+
+	~SimulatorPool()
+	{
+		WI_ASSERT(!_outstanding);
+
+		{
+			std::lock_guard lock(_wake_lock);
+			_exit_requested = true;
+		}
+		_wake.notify_all();
+
+		for (uint32_t i = 0; i < _worker_count; i++)
+		{
+			if (_workers[i].thread.joinable())
+				_workers[i].thread.join();
+		}
+	}
+
+	#pragma region IUnknown
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+	{
+		RETURN_HR_IF(E_POINTER, !ppvObject);
+
+		if (   TryQI<IUnknown>(this, riid, ppvObject)
+			|| TryQI<ISimulatorPool>(this, riid, ppvObject)
+		)
+			return S_OK;
+
+		*ppvObject = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE AddRef() override { return ++_refCount; }
+
+	virtual ULONG STDMETHODCALLTYPE Release() override { return ReleaseST(this, _refCount); }
+	#pragma endregion
+
+	#pragma region ISimulatorPool
+	virtual HRESULT STDMETHODCALLTYPE Submit (IHeadlessSimulator* sim, UINT64 time, HRESULT* result, SIM_BP_COOKIE* bp) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, !sim || !result);
+
+		// Count the run before a worker can see it, so that it can't complete before being counted.
+		{
+			std::lock_guard lock(_outstanding_lock);
+			_outstanding++;
+		}
+
+		worker& w = _workers[_next_worker];
+		_next_worker = (_next_worker + 1) % _worker_count;
+
+		bool pushed;
+		{
+			std::lock_guard lock(w.lock);
+			pushed = w.runs.try_push_back(run { .sim = sim, .time = time, .result = result, .bp = bp });
+		}
+
+		if (!pushed)
+		{
+			complete_run();
+			RETURN_HR(E_OUTOFMEMORY);
+		}
+
+		wake_one();
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE Wait() override
+	{
+		std::unique_lock lock(_outstanding_lock);
+		_all_done.wait(lock, [this] { return !_outstanding; });
+		return S_OK;
+	}
+	#pragma endregion
+
+	void complete_run()
+	{
+		// Notify while holding the lock: once Wait sees zero, the caller may destroy the pool.
+		std::lock_guard lock(_outstanding_lock);
+		WI_ASSERT(_outstanding);
+		if (--_outstanding == 0)
+			_all_done.notify_all();
+	}
+
+	void wake_one()
+	{
+		{
+			std::lock_guard lock(_wake_lock);
+			_work_available++;
+		}
+		_wake.notify_one();
+	}
+
+	// Takes a run from the back of this worker's queue or, if that's empty, from the front of another's.
+	bool take_run (uint32_t index, run* r)
+	{
+		{
+			worker& w = _workers[index];
+			std::lock_guard lock(w.lock);
+			if (w.runs.size())
+			{
+				*r = w.runs.remove_back();
+				return true;
+			}
+		}
+
+		for (uint32_t i = 1; i < _worker_count; i++)
+		{
+			worker& victim = _workers[(index + i) % _worker_count];
+			std::lock_guard lock(victim.lock);
+			if (victim.runs.size())
+			{
+				*r = victim.runs.remove(victim.runs.begin());
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	void run_slice (uint32_t index, const run& r)
+	{
+		UINT64 slice_end = r.sim->Time() + _slice_ticks;
+		auto hr = r.sim->RunUntil (std::min(r.time, slice_end), r.bp);
+		if ((hr == S_OK) && (r.sim->Time() < r.time))
+		{
+			// Not done yet; queue the rest of the run. If this worker now has more than this one run,
+			// the others are up for stealing, so let's wake up a worker that might be sleeping.
+			worker& w = _workers[index];
+			std::unique_lock lock(w.lock);
+			bool pushed = w.runs.try_push_back(r);
+			if (pushed)
+			{
+				bool others = w.runs.size() > 1;
+				lock.unlock();
+				if (others)
+					wake_one();
+				return;
+			}
+
+			hr = E_OUTOFMEMORY;
+		}
+
+		*r.result = hr;
+		complete_run();
+	}
+
+	void worker_proc (uint32_t index)
+	{
+		while (true)
+		{
+			run r;
+			if (take_run(index, &r))
+			{
+				run_slice (index, r);
+				continue;
+			}
+
+			// _work_available may count runs that other workers already took; in that case
+			// we find nothing when we wake up, and go back to waiting.
+			std::unique_lock lock(_wake_lock);
+			_wake.wait(lock, [this] { return _work_available || _exit_requested; });
+			if (_exit_requested)
+				return;
+			_work_available--;
+		}
+	}
+};
+
+HRESULT MakeSimulatorPool (UINT32 threadCount, UINT64 sliceTicks, ISimulatorPool** to)
+{
+	com_ptr<SimulatorPool> p = new (std::nothrow) SimulatorPool(); RETURN_IF_NULL_ALLOC(p);
+	auto hr = p->InitInstance(threadCount, sliceTicks); RETURN_IF_FAILED(hr);
+	*to = p.detach();
+	return S_OK;
+}
@@ -0,0 +1,464 @@
+
+#include "pch.h"
+#include "SimulatorInternal.h"
+#include "shared/com.h"
+
+// A trace file is a trace_file_header followed by chunks. Each chunk is a trace_chunk_header followed by
+// at most chunk_payload_size bytes of records. The chunk header summarizes the records - time range, PC range,
+// bloom filter of the written addresses - so that a query reads only the chunks that may contain what it looks for.
+//
+// Records are delta-compressed against the previous record in the same chunk, so each chunk decodes on its own.
+// A record starts with a tag byte, followed by:
+//  - for record_instruction: varint time delta, zigzag varint PC delta;
+//  - for record_write: varint time delta, zigzag varint delta from the previous written address, the value written.
+// A write record follows the record of the instruction that made the write.
+
+static constexpr char trace_file_magic[8] = { 'F', 'E', 'L', 'I', 'X', 'T', 'R', 'C' };
+static constexpr uint32_t trace_file_version = 1;
+static constexpr uint32_t chunk_magic = 0x4B435254; // "TRCK"
+static constexpr uint32_t chunk_payload_size = 0x10000;
+static constexpr uint32_t max_record_size = 1 + 10 + 3 + 1;
+static constexpr uint32_t bloom_bits = 2048;
+
+enum : uint8_t { record_instruction, record_write };
+
+struct trace_file_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t chunk_payload_size;
+};
+
+struct trace_chunk_header
+{
+	uint32_t magic;
+	uint32_t payload_size;
+	UINT64 first_time;
+	UINT64 last_time;
+	uint32_t record_count;
+	uint16_t start_pc; // PC of the last instruction before this chunk; the base for the first PC delta
+	uint16_t min_pc;
+	uint16_t max_pc;
+	uint8_t written_addresses[bloom_bits / 8];
+};
+
+static void bloom_hashes (uint16_t address, uint32_t (&h)[2])
+{
+	h[0] = address & (bloom_bits - 1);
+	h[1] = ((address * 40503u) >> 5) & (bloom_bits - 1);
+}
+
+static bool bloom_may_contain (const trace_chunk_header& header, uint16_t address)
+{
+	uint32_t h[2];
+	bloom_hashes(address, h);
+	for (auto bit : h)
+	{
+		if (!(header.written_addresses[bit / 8] & (1 << (bit % 8))))
+			return false;
+	}
+
+	return true;
+}
+
+static uint16_t zigzag (int16_t value) { return (uint16_t)((value << 1) ^ (value >> 15)); }
+
+static int16_t unzigzag (uint16_t value) { return (int16_t)((value >> 1) ^ -(int16_t)(value & 1)); }
+
+// ============================================================================
+
+class trace_writer : public ITraceWriter
+{
+	wil::unique_hfile _file;
+	HRESULT _hr = S_OK; // the first error; nothing more is written after an error
+	trace_chunk_header _header;
+	uint8_t _payload[chunk_payload_size];
+	uint32_t _payload_size;
+	UINT64 _last_time;
+	uint16_t _last_pc;
+	uint16_t _last_write_address;
+	bool _last_was_instruction;
+
+public:
+	HRESULT InitInstance (LPCWSTR path)
+	{
+		_file.reset (CreateFileW (path, GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr)); RETURN_LAST_ERROR_IF(!_file);
+
+		trace_file_header fh = { };
+		memcpy (fh.magic, trace_file_magic, sizeof(fh.magic));
+		fh.version = trace_file_version;
+		fh.chunk_payload_size = chunk_payload_size;
+		auto hr = write(&fh, sizeof(fh)); RETURN_IF_FAILED(hr);
+
+		_last_pc = 0;
+		begin_chunk();
+		return S_OK;
+	}
+
+	~trace_writer()
+	{
+		if (_file)
+			LOG_IF_FAILED(Flush());
+	}
+
+	virtual void AddInstruction (uint16_t pc, UINT64 time) override
+	{
+		// An instruction that stalled waiting for some device is retried later at the same time;
+		// it must appear only once. (It can't have made any write before stalling.)
+		if (_last_was_instruction && (pc == _last_pc) && (time == _last_time))
+			return;
+
+		if (!begin_record(time))
+			return;
+
+		_payload[_payload_size++] = record_instruction;
+		put_varint (time - _last_time);
+		put_varint (zigzag((int16_t)(pc - _last_pc)));
+		_last_time = time;
+		_last_pc = pc;
+		_last_was_instruction = true;
+
+		if (pc < _header.min_pc)
+			_header.min_pc = pc;
+		if (pc > _header.max_pc)
+			_header.max_pc = pc;
+	}
+
+	virtual void AddMemoryWrite (uint16_t address, uint8_t value, UINT64 time) override
+	{
+		if (!begin_record(time))
+			return;
+
+		_payload[_payload_size++] = record_write;
+		put_varint (time - _last_time);
+		put_varint (zigzag((int16_t)(address - _last_write_address)));
+		_payload[_payload_size++] = value;
+		_last_time = time;
+		_last_write_address = address;
+		_last_was_instruction = false;
+
+		uint32_t h[2];
+		bloom_hashes(address, h);
+		for (auto bit : h)
+			_header.written_addresses[bit / 8] |= (1 << (bit % 8));
+	}
+
+	virtual HRESULT Flush() override
+	{
+		if (SUCCEEDED(_hr) && _header.record_count)
+			_hr = write_chunk();
+		return _hr;
+	}
+
+private:
+	HRESULT write (const void* data, uint32_t size)
+	{
+		DWORD written;
+		BOOL bres = WriteFile (_file.get(), data, size, &written, nullptr); RETURN_LAST_ERROR_IF(!bres);
+		RETURN_HR_IF(E_FAIL, written != size);
+		return S_OK;
+	}
+
+	void begin_chunk()
+	{
+		memset (&_header, 0, sizeof(_header));
+		_header.magic = chunk_magic;
+		_header.start_pc = _last_pc;
+		_header.min_pc = 0xFFFF;
+		_payload_size = 0;
+		_last_write_address = 0;
+		_last_was_instruction = false;
+	}
+
+	HRESULT write_chunk()
+	{
+		_header.payload_size = _payload_size;
+		auto hr = write(&_header, sizeof(_header)); RETURN_IF_FAILED(hr);
+		hr = write(_payload, _payload_size); RETURN_IF_FAILED(hr);
+		begin_chunk();
+		return S_OK;
+	}
+
+	bool begin_record (UINT64 time)
+	{
+		if (FAILED(_hr))
+			return false;
+
+		// Times within a chunk only go forward; when the CPU is reset, its time goes back to zero.
+		if ((_payload_size + max_record_size > chunk_payload_size)
+			|| (_header.record_count && (time < _last_time)))
+		{
+			_hr = write_chunk();
+			if (FAILED(_hr))
+				return false;
+		}
+
+		if (!_header.record_count)
+		{
+			_header.first_time = time;
+			_last_time = time;
+		}
+
+		_header.last_time = time;
+		_header.record_count++;
+		return true;
+	}
+
+	void put_varint (UINT64 value)
+	{
+		while (value >= 0x80)
+		{
+			_payload[_payload_size++] = (uint8_t)value | 0x80;
+			value >>= 7;
+		}
+
+		_payload[_payload_size++] = (uint8_t)value;
+	}
+};
+
+HRESULT STDMETHODCALLTYPE MakeTraceWriter (LPCWSTR path, wistd::unique_ptr<ITraceWriter>* to)
+{
+	auto w = wil::make_unique_nothrow<trace_writer>(); RETURN_IF_NULL_ALLOC(w);
+	auto hr = w->InitInstance(path); RETURN_IF_FAILED(hr);
+	*to = std::move(w);
+	return S_OK;
+}
+
+// ============================================================================
+
+class TraceFileImpl : public ITraceFile
+{
+	ULONG _refCount = 0;
+	wil::unique_hfile _file;
+
+	struct chunk
+	{
+		UINT64 payload_offset;
+		trace_chunk_header header;
+	};
+
+	vector_nothrow<chunk> _chunks;
+	wistd::unique_ptr<uint8_t[]> _payload;
+
+	struct record
+	{
+		uint8_t type;
+		UINT64 time;
+		uint16_t pc;      // for a write, the PC of the instruction that made it
+		uint16_t address;
+		uint8_t value;
+	};
+
+public:
+	HRESULT InitInstance (LPCWSTR path)
+	{
+		_file.reset (CreateFileW (path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr)); RETURN_LAST_ERROR_IF(!_file);
+
+		_payload = wil::make_unique_nothrow<uint8_t[]>(chunk_payload_size); RETURN_IF_NULL_ALLOC(_payload);
+
+		LARGE_INTEGER file_size;
+		BOOL bres = GetFileSizeEx (_file.get(), &file_size); RETURN_LAST_ERROR_IF(!bres);
+
+		trace_file_header fh;
+		auto hr = read_at(0, &fh, sizeof(fh)); RETURN_IF_FAILED(hr);
+		RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT), memcmp(fh.magic, trace_file_magic, sizeof(fh.magic))
+			|| (fh.version != trace_file_version) || (fh.chunk_payload_size != chunk_payload_size));
+
+		// Read all chunk headers, so that queries need only look at them in memory. The file may still
+		// be being written; we stop at the first chunk that is not completely written.
+		UINT64 offset = sizeof(fh);
+		while (offset + sizeof(trace_chunk_header) <= (UINT64)file_size.QuadPart)
+		{
+			chunk c;
+			hr = read_at(offset, &c.header, sizeof(c.header)); RETURN_IF_FAILED(hr);
+			RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT), (c.header.magic != chunk_magic) || (c.header.payload_size > chunk_payload_size));
+			c.payload_offset = offset + sizeof(c.header);
+			if (c.payload_offset + c.header.payload_size > (UINT64)file_size.QuadPart)
+				break;
+
+			bool pushed = _chunks.try_push_back(c); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+			offset = c.payload_offset + c.header.payload_size;
+		}
+
+		return S_OK;
+	}
+
+	#pragma region IUnknown
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+	{
+		RETURN_HR_IF(E_POINTER, !ppvObject);
+
+		if (   TryQI<IUnknown>(this, riid, ppvObject)
+			|| TryQI<ITraceFile>(this, riid, ppvObject))
+			return S_OK;
+
+		*ppvObject = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE AddRef() override { return ++_refCount; }
+
+	virtual ULONG STDMETHODCALLTYPE Release() override { return ReleaseST(this, _refCount); }
+	#pragma endregion
+
+	#pragma region ITraceFile
+	virtual HRESULT STDMETHODCALLTYPE FindWrites (uint16_t address, UINT64 fromTime, UINT64 toTime, UINT32 maxCount, TraceFileWrite* writes, UINT32* count) override
+	{
+		*count = 0;
+		bool more = false;
+		for (auto& c : _chunks)
+		{
+			if ((c.header.last_time < fromTime) || (c.header.first_time >= toTime) || !bloom_may_contain(c.header, address))
+				continue;
+
+			auto hr = for_each_record (c, [&](const record& r)
+				{
+					if ((r.type != record_write) || (r.address != address) || (r.time < fromTime) || (r.time >= toTime))
+						return true;
+
+					if (*count == maxCount)
+					{
+						more = true;
+						return false;
+					}
+
+					writes[(*count)++] = { .time = r.time, .pc = r.pc, .address = r.address, .value = r.value };
+					return true;
+				}); RETURN_IF_FAILED(hr);
+
+			if (more)
+				return S_FALSE;
+		}
+
+		return S_OK;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE FindLastWrite (uint16_t address, UINT64 beforeTime, TraceFileWrite* write) override
+	{
+		for (uint32_t i = _chunks.size(); i--; )
+		{
+			auto& c = _chunks[i];
+			if ((c.header.first_time >= beforeTime) || !bloom_may_contain(c.header, address))
+				continue;
+
+			bool found = false;
+			auto hr = for_each_record (c, [&](const record& r)
+				{
+					if (r.time >= beforeTime)
+						return false;
+
+					if ((r.type == record_write) && (r.address == address))
+					{
+						*write = { .time = r.time, .pc = r.pc, .address = r.address, .value = r.value };
+						found = true;
+					}
+
+					return true;
+				}); RETURN_IF_FAILED(hr);
+
+			if (found)
+				return S_OK;
+		}
+
+		return S_FALSE;
+	}
+
+	virtual HRESULT STDMETHODCALLTYPE FindFirstExecution (uint16_t pc, UINT64 fromTime, UINT64* time) override
+	{
+		for (auto& c : _chunks)
+		{
+			if ((c.header.last_time < fromTime) || (pc < c.header.min_pc) || (pc > c.header.max_pc))
+				continue;
+
+			bool found = false;
+			auto hr = for_each_record (c, [&](const record& r)
+				{
+					if ((r.type == record_instruction) && (r.pc == pc) && (r.time >= fromTime))
+					{
+						*time = r.time;
+						found = true;
+						return false;
+					}
+
+					return true;
+				}); RETURN_IF_FAILED(hr);
+
+			if (found)
+				return S_OK;
+		}
+
+		return S_FALSE;
+	}
+	#pragma endregion
+
+private:
+	HRESULT read_at (UINT64 offset, void* to, uint32_t size)
+	{
+		OVERLAPPED o = { };
+		o.Offset = (DWORD)offset;
+		o.OffsetHigh = (DWORD)(offset >> 32);
+		DWORD read;
+		BOOL bres = ReadFile (_file.get(), to, size, &read, &o); RETURN_LAST_ERROR_IF(!bres);
+		RETURN_HR_IF(HRESULT_FROM_WIN32(ERROR_HANDLE_EOF), read != size);
+		return S_OK;
+	}
+
+	static bool get_varint (const uint8_t*& p, const uint8_t* end, UINT64& value)
+	{
+		value = 0;
+		for (uint32_t shift = 0; shift < 64; shift += 7)
+		{
+			if (p == end)
+				return false;
+			uint8_t b = *p++;
+			value |= (UINT64)(b & 0x7F) << shift;
+			if (!(b & 0x80))
+				return true;
+		}
+
+		return false;
+	}
+
+	// Decodes the records of a chunk and calls "fn" for each; stops early if "fn" returns false.
+	template<typename fn_t>
+	HRESULT for_each_record (const chunk& c, fn_t fn)
+	{
+		auto hr = read_at(c.payload_offset, _payload.get(), c.header.payload_size); RETURN_IF_FAILED(hr);
+
+		static constexpr HRESULT corrupt = HRESULT_FROM_WIN32(ERROR_FILE_CORRUPT);
+		const uint8_t* p = _payload.get();
+		const uint8_t* end = p + c.header.payload_size;
+		record r = { .type = record_instruction, .time = c.header.first_time, .pc = c.header.start_pc, .address = 0, .value = 0 };
+		while (p < end)
+		{
+			r.type = *p++;
+			UINT64 delta;
+			RETURN_HR_IF(corrupt, !get_varint(p, end, delta));
+			r.time += delta;
+			RETURN_HR_IF(corrupt, !get_varint(p, end, delta) || (delta > 0xFFFF));
+			if (r.type == record_instruction)
+				r.pc += unzigzag((uint16_t)delta);
+			else if (r.type == record_write)
+			{
+				r.address += unzigzag((uint16_t)delta);
+				RETURN_HR_IF(corrupt, p == end);
+				r.value = *p++;
+			}
+			else
+				RETURN_HR(corrupt);
+
+			if (!fn(r))
+				break;
+		}
+
+		return S_OK;
+	}
+};
+
+HRESULT OpenTraceFile (LPCWSTR path, ITraceFile** to)
+{
+	com_ptr<TraceFileImpl> p = new (std::nothrow) TraceFileImpl(); RETURN_IF_NULL_ALLOC(p);
+	auto hr = p->InitInstance(path); RETURN_IF_FAILED(hr);
+	*to = p.detach();
+	return S_OK;
+}
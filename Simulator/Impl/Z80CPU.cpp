@@ -1,8 +1,11 @@
 
 #include "pch.h"
 #include "Z80CPU.h"
+#include "Z80Jit.h"
 #include "shared/unordered_map_nothrow.h"
 #include "shared/com.h"
+#include <utility>
+#include <algorithm>
 
 // For the P/V flag calculation, the "Parity/Overflow Flag" paragraph in the Z80 pdf has a good explanation.
 
@@ -142,13 +145,52 @@ struct s_z_pv_flags_t
 // Z is set if the Accumulator is 0 after an operation; otherwise, it is reset.
 // P/V is set if the parity of the Accumulator is even after an operation; otherwise, it is reset.
 static const s_z_pv_flags_t s_z_pv_flags;
+
+// Opcodes (without prefix, or after DD/FD) of the instructions that neither read nor write F, plus those of
+// the instructions that manage the flags they leave pending themselves (see cpu::set_flags_pending).
+// Before executing any other instruction, the CPU computes the pending flags.
+struct flags_neutral_t
+{
+	bool opcodes[0x100] = { };
+
+	constexpr flags_neutral_t()
+	{
+		for (uint32_t op = 0x40; op < 0xC0; op++)
+			opcodes[op] = true; // ld r, r' / halt / add, adc, sub, sbc, and, xor, or, cp
+		for (uint32_t op = 0x04; op < 0x40; op += 8)
+		{
+			opcodes[op] = true;     // inc r
+			opcodes[op + 1] = true; // dec r
+			opcodes[op + 2] = true; // ld r, n
+		}
+		for (uint32_t op = 0xC6; op < 0x100; op += 8)
+		{
+			opcodes[op] = true;     // add, adc, sub, sbc, and, xor, or, cp n
+			opcodes[op + 1] = true; // rst
+		}
+		for (uint32_t op = 0x01; op < 0x40; op += 0x10)
+		{
+			opcodes[op] = true;      // ld rr, nn
+			opcodes[op + 2] = true;  // inc rr
+			opcodes[op + 8] = true;  // add hl, rr
+			opcodes[op + 10] = true; // dec rr
+		}
+		const uint8_t others[] = { 0x00, 0x02, 0x07, 0x0A, 0x0F, 0x10, 0x12, 0x17, 0x18, 0x1A, 0x1F, 0x22, 0x2A, 0x32, 0x3A,
+			0xC1, 0xC3, 0xC5, 0xC9, 0xCD, 0xD1, 0xD3, 0xD5, 0xD9, 0xDB, 0xE1, 0xE3, 0xE5, 0xE9, 0xEB, 0xF3, 0xF9, 0xFB };
+		for (auto op : others)
+			opcodes[op] = true;
+	}
+};
+
+static constexpr flags_neutral_t flags_neutral;
 #pragma endregion
 
 class cpu : public IZ80CPU
 {
-	using handler_t    = bool(cpu::*)(hl_ix_iy xy, uint8_t opcode);
-	using ed_handler_t = bool(cpu::*)(uint8_t opcode);
-	using cb_handler_t = bool(cpu::*)(hl_ix_iy xy, uint16_t memhlxy_addr, uint8_t opcode);
+	// Handlers that depend on the prefix or the opcode take them as template arguments;
+	// see main_handler, ed_handler and cb_handler.
+	using handler_t    = bool(cpu::*)();
+	using cb_handler_t = bool(cpu::*)(uint16_t memhlxy_addr);
 
 	Bus*       memory;
 	Bus*       io;
@@ -157,6 +199,28 @@ class cpu : public IZ80CPU
 	UINT64 cpu_time = 0;
 	z80_register_set regs = { };
 
+	// The operands and result of the last flag-setting instruction while its flags are not yet written
+	// to regs.main.f; see set_flags_pending. Flags are never pending outside SimulateOne / SimulateUntil,
+	// so regs.main.f is exact for everyone else.
+	struct lazy_flags
+	{
+		uint8_t operation; // 0-7: the ALU operations on A, as in bits 3-5 of their opcodes; or one of lazy_*
+		uint16_t before;
+		uint16_t other;    // for rotates and shifts, the new carry
+		uint16_t result;
+	};
+
+	static constexpr uint8_t lazy_inc = 8;           // inc r
+	static constexpr uint8_t lazy_dec = 9;           // dec r
+	static constexpr uint8_t lazy_add16 = 10;        // add hl/ix/iy, rr
+	static constexpr uint8_t lazy_adc16 = 11;        // adc hl, rr
+	static constexpr uint8_t lazy_sbc16 = 12;        // sbc hl, rr
+	static constexpr uint8_t lazy_rotate_a = 13;     // rlca, rrca, rla, rra
+	static constexpr uint8_t lazy_rotate_shift = 14; // rlc, rrc, rl, rr, sla, sra, sll, srl
+
+	lazy_flags _lazy_flags = { };
+	bool _flags_pending = false;
+
 	// The "EI" instruction sets this to 2.
 	// After simulate_one() executes any instruction, it checks this value and:
 	//  - if 2, it decrements it to 1;
@@ -168,8 +232,120 @@ class cpu : public IZ80CPU
 	// Whenever SP is assigned, this is set to the same value;
 	uint16_t _start_of_stack = 0;
 
+	struct code_bp
+	{
+		SIM_BP_COOKIE cookie;
+		vector_nothrow<uint8_t> condition; // empty if the breakpoint is unconditional; see BreakpointConditionOp
+		uint32_t hit_count = 0;
+		BreakpointPassCountStyle pass_count_style = BreakpointPassCountStyle::None;
+		uint32_t pass_count = 0;
+		bool tracepoint = false;
+		vector_nothrow<uint8_t> trace_values; // program that leaves the values to record on the stack
+	};
+
 	SIM_BP_COOKIE _nextBpCookie = 1;
-	unordered_map_nothrow<uint16_t, vector_nothrow<SIM_BP_COOKIE>> code_bps;
+	unordered_map_nothrow<uint16_t, vector_nothrow<code_bp>> code_bps;
+
+	// One bit for each address in code_bps, so that checking for breakpoints before each instruction
+	// is a single bit test; the map is searched only when the bit is set.
+	uint8_t code_bps_bitmap[0x10000 / 8] = { };
+
+	// PC and time of the last check_code_bps() that counted hits without breaking. If the instruction
+	// stalls and is retried, the breakpoints at its address are not evaluated and counted a second time.
+	uint16_t _bps_counted_pc = 0;
+	UINT64 _bps_counted_time = UINT64_MAX;
+
+	struct data_bp
+	{
+		SIM_BP_COOKIE cookie;
+		uint16_t address;
+		uint32_t size;
+		DataBreakpointAccess access;
+	};
+
+	vector_nothrow<data_bp> data_bps;
+
+	// While an instruction is executing, this points to the structure where the caller
+	// of SimulateOne / SimulateUntil wants to receive data breakpoint hits; null otherwise.
+	BreakpointsHit* _data_bps_hit = nullptr;
+
+	TracepointHandler _tracepoint_handler = { };
+
+	// Ring buffer with the last instructions executed; see SetInstructionTrace.
+	wistd::unique_ptr<InstructionTraceRecord[]> _trace;
+	uint32_t _trace_capacity = 0; // zero while tracing is off
+	uint32_t _trace_next = 0;     // index where the next record goes
+	uint32_t _trace_size = 0;     // number of valid records
+
+	ITraceWriter* _trace_writer = nullptr;
+
+	// Instructions decoded from mapped memory pages; see find_decoded.
+	struct decoded_instruction;
+
+	// Executes a decoded instruction; one is instantiated for each prefix and opcode (see threaded_routine).
+	using threaded_t = bool(*)(cpu& c, const decoded_instruction& d);
+
+	struct decoded_instruction
+	{
+		uint32_t   epoch;     // the entry is valid while this equals the _code_epochs element of its page
+		int8_t     disp;      // for CB instructions with IX/IY, the displacement
+		uint8_t    bytes[4];  // the instruction bytes starting at its address
+		threaded_t exec;
+	};
+
+	// One entry per address, by page. A page's entries are allocated when the CPU first executes from it,
+	// since most programs run from a few pages, and a simulator pool has many CPUs.
+	wistd::unique_ptr<decoded_instruction[]> _decoded[Bus::page_count];
+	uint32_t _code_epochs[Bus::page_count];
+
+	bool _threaded_dispatch = false; // see execute_step::threaded
+
+	// Compiles hot code to x86-64; see execute_step::jit. Null unless SetJit enabled it.
+	wistd::unique_ptr<IZ80Jit> _jit;
+
+	// How many more routines for decoded instructions continue_threaded may go on to, and the PC of the last
+	// instruction it let through, for the loop of SimulateUntil to look for an idle loop there.
+	// Nonzero only while the loop runs decoded instructions with nothing to check between them.
+	uint32_t _threaded_chain = 0;
+	uint16_t _threaded_last_pc = 0;
+
+	// GCC and Clang turn the call continue_threaded makes into a jump, so the number of instructions
+	// it goes through is limited only by how often the loop should take back control. The compilers we
+	// can't rely on for this keep the one call per instruction from the loop.
+#if defined(__GNUC__)
+	static constexpr uint32_t threaded_chain_max = 64;
+#else
+	static constexpr uint32_t threaded_chain_max = 0;
+#endif
+
+	// No interrupt can come before this time, so try_accept_irq doesn't poll the interrupting devices
+	// until then. Updated after each poll from what the devices announce (see IInterruptingDevice::next_irq_time).
+	// Zero when not known, which makes the next poll happen.
+	UINT64 _irq_deadline = 0;
+
+	// The time the loop of SimulateUntil runs to; zero outside SimulateUntil. Repeating block instructions
+	// and a halted CPU may do the work of more than one dispatch per call, but only that of dispatches
+	// the loop would have started before this time; see block_iterations_allowed and halted_steps_allowed.
+	UINT64 _simulate_until_time = 0;
+
+	// The state at the head of a possible idle loop, as skip_idle_loop last saw it.
+	static constexpr uint16_t idle_loop_max_size = 32;
+
+	struct idle_loop_state
+	{
+		z80_register_set regs; // with R cleared; only PC, SP, BC, DE, HL and A unless "complete"
+		bool     complete;
+		uint8_t  r;
+		UINT64   time;
+		uint32_t writes;       // memory and I/O writes up to then
+	};
+
+	idle_loop_state _idle_loop;
+	bool _idle_loop_valid = false;
+
+	// While a decoded instruction executes, this points to its operand bytes, which decode_u8 and decode_u16
+	// then take from here rather than from the bus.
+	const uint8_t* _operands = nullptr;
 
 public:
 	HRESULT InitInstance (Bus* memory, Bus* io, irq_line_i* irq)
@@ -177,34 +353,97 @@ public:
 		this->memory = memory;
 		this->io = io;
 		this->irq = irq;
+		for (auto& e : _code_epochs)
+			e = 1;
+		memory->watch_handler = { this, &on_watched_access };
 		return S_OK;
 	}
 
+	~cpu()
+	{
+		memory->watch_handler = { };
+	}
+
+	static void on_watched_access (void* context, uint16_t address, uint8_t value, DataBreakpointAccess access, UINT64 time)
+	{
+		auto* c = static_cast<cpu*>(context);
+
+		// Accesses made at an earlier time come from devices catching up with the CPU
+		// (for example the screen reading video memory), not from the instruction being executed.
+		if (time < c->cpu_time)
+			return;
+
+		// Accesses through read() / write() come from the debugger, not from the CPU.
+		if (c->_trace_writer && (access == DataBreakpointAccess::Write) && (time != UINT64_MAX))
+			c->_trace_writer->AddMemoryWrite(address, value, time);
+
+		auto* bps = c->_data_bps_hit;
+		if (!bps)
+			return;
+
+		for (auto& bp : c->data_bps)
+		{
+			if (!((uint8_t)bp.access & (uint8_t)access) || ((uint32_t)(address - bp.address) >= bp.size))
+				continue;
+
+			// An instruction may access the same watched range more than once (PUSH, LDIR...).
+			bool already_hit = false;
+			for (uint32_t i = 0; i < bps->size; i++)
+				already_hit |= (bps->bps[i] == bp.cookie);
+
+			if (!already_hit && (bps->size < _countof(bps->bps)))
+			{
+				bps->type = BreakpointType::Data;
+				bps->address = address;
+				bps->bps[bps->size++] = bp.cookie;
+			}
+		}
+	}
+
+	void update_watched_pages()
+	{
+		memory->clear_watched_pages();
+		for (auto& bp : data_bps)
+			memory->set_watched_pages (bp.address, bp.size, bp.access);
+		if (_trace_writer)
+			memory->set_watched_pages (0, 0x10000, DataBreakpointAccess::Write);
+	}
+
 	uint8_t decode_u8()
 	{
-		uint8_t val = memory->read(regs.pc);
+		uint8_t val = _operands ? *_operands++ : memory->read(regs.pc);
 		regs.pc++;
 		return val;
 	}
 
 	uint16_t decode_u16()
 	{
-		uint16_t val = memory->read_uint16(regs.pc);
+		uint16_t val;
+		if (_operands)
+		{
+			val = _operands[0] | (_operands[1] << 8);
+			_operands += 2;
+		}
+		else
+			val = memory->read_uint16(regs.pc);
 		regs.pc += 2;
 		return val;
 	}
 
 	// Calculates the address of (hl), or (ix+d), or (iy+d)
-	uint16_t decode_mem_hl (hl_ix_iy xy)
+	template<hl_ix_iy xy>
+	uint16_t decode_mem_hl()
 	{
-		if (xy == hl_ix_iy::hl)
+		if constexpr (xy == hl_ix_iy::hl)
 			return regs.main.hl;
-	
-		int8_t disp = (int8_t)decode_u8();
-		uint16_t addr = (xy == hl_ix_iy::ix) ? regs.ix : regs.iy;
-		uint16_t dispu16 = (uint16_t)(int16_t)disp;
-		addr = addr + dispu16;
-		return addr;
+		else
+		{
+			int8_t disp = (int8_t)decode_u8();
+			uint16_t addr = (xy == hl_ix_iy::ix) ? regs.ix : regs.iy;
+			uint16_t dispu16 = (uint16_t)(int16_t)disp;
+			addr = addr + dispu16;
+			return addr;
+		}
 	}
 
 	static __forceinline bool same_sign(uint8_t a, uint8_t b)
@@ -217,70 +456,110 @@ public:
 		return !((a ^ b) & 0x8000);
 	}
 
-	void do_reg_a_operation (uint8_t operation, uint8_t other)
+	// Flag-setting instructions only compute their result; they leave their flags pending in _lazy_flags,
+	// and materialize_flags computes them when something needs F - usually never, as the next flag-setting
+	// instruction overwrites them. materialize_flags takes the carry of ADC/SBC and the bits of F that
+	// INC, DEC, ADD HL and the rotates of A keep from regs.main.f, so those must call materialize_flags
+	// before reading F or computing their result.
+	void set_flags_pending (uint8_t operation, uint16_t before, uint16_t other, uint16_t result)
+	{
+		_lazy_flags = { .operation = operation, .before = before, .other = other, .result = result };
+		_flags_pending = true;
+	}
+
+	template<uint8_t operation>
+	void do_reg_a_operation (uint8_t other)
 	{
 		uint8_t before = regs.main.a;
-		switch (operation)
+		if constexpr (operation == 0) // add
+			regs.main.a += other;
+		else if constexpr (operation == 1) // adc
+		{
+			materialize_flags();
+			regs.main.a += (other + regs.main.f.c);
+		}
+		else if constexpr (operation == 2) // sub
+			regs.main.a -= other;
+		else if constexpr (operation == 3) // sbc
+		{
+			materialize_flags();
+			regs.main.a -= (other + regs.main.f.c);
+		}
+		else if constexpr (operation == 4) // and
+			regs.main.a &= other;
+		else if constexpr (operation == 5) // xor
+			regs.main.a ^= other;
+		else if constexpr (operation == 6) // or
+			regs.main.a |= other;
+		else // cp
+		{
+			set_flags_pending (operation, before, other, (uint8_t)(before - other));
+			return;
+		}
+
+		set_flags_pending (operation, before, other, regs.main.a);
+	}
+
+	void materialize_flags()
+	{
+		if (!_flags_pending)
+			return;
+
+		_flags_pending = false;
+		uint8_t before = (uint8_t)_lazy_flags.before;
+		uint8_t other = (uint8_t)_lazy_flags.other;
+		uint8_t after = (uint8_t)_lazy_flags.result;
+		uint8_t carry = regs.main.f.c;
+		switch (_lazy_flags.operation)
 		{
 		case 0: // add
 			// For addition, operands with different signs never cause overflow. When adding operands
 			// with similar signs and the result contains a different sign, the Overflow Flag is set
-			regs.main.a += other;
-			regs.main.f.val = (regs.main.a & 0xA8) // S, R5, R3
-				| (regs.main.a ? 0 : z80_flag::z)  // Z
+			regs.main.f.val = (after & 0xA8) // S, R5, R3
+				| (after ? 0 : z80_flag::z)  // Z
 				| (((before & 0xF) + (other & 0xF)) & 0x10) // H
-				| ((same_sign(before, other) && !same_sign(before, regs.main.a)) ? z80_flag::pv : 0) // P/V
+				| ((same_sign(before, other) && !same_sign(before, after)) ? z80_flag::pv : 0) // P/V
 				| 0 // N
-				| (regs.main.a < before); // C
+				| (after < before); // C
 			break;
 
 		case 1: // adc
-			regs.main.a += (other + regs.main.f.c);
-			regs.main.f.val = (regs.main.a & 0xA8)  // S, R5, R3
-				| (regs.main.a ? 0 : z80_flag::z)   // Z
-				| (((before & 0xF) + (other & 0xF) + regs.main.f.c) & 0x10) // H
-				| ((same_sign(before, other) && !same_sign(before, regs.main.a)) ? z80_flag::pv : 0) // P/V
+			regs.main.f.val = (after & 0xA8)  // S, R5, R3
+				| (after ? 0 : z80_flag::z)   // Z
+				| (((before & 0xF) + (other & 0xF) + carry) & 0x10) // H
+				| ((same_sign(before, other) && !same_sign(before, after)) ? z80_flag::pv : 0) // P/V
 				| 0 // N
-				| ((((uint32_t)before + (uint32_t)other + (uint32_t)regs.main.f.c) >> 8) & 1); // C
+				| ((((uint32_t)before + (uint32_t)other + (uint32_t)carry) >> 8) & 1); // C
 			break;
 
 		case 2: // sub
-			regs.main.a -= other;
-			regs.main.f.val = (regs.main.a & 0xA8) // S, R5, R3
-				| (regs.main.a ? 0 : z80_flag::z)  // Z
+			regs.main.f.val = (after & 0xA8) // S, R5, R3
+				| (after ? 0 : z80_flag::z)  // Z
 				| (((before & 0x0F) - (other & 0x0F)) & 0x10) // H
-				| ((!same_sign(before, other) && !same_sign(before, regs.main.a)) ? z80_flag::pv : 0) // P/V
+				| ((!same_sign(before, other) && !same_sign(before, after)) ? z80_flag::pv : 0) // P/V
 				| z80_flag::n // N
-				| (regs.main.a > before); // C
+				| (after > before); // C
 			break;
 
 		case 3: // sbc
-			regs.main.a -= (other + regs.main.f.c);
-			regs.main.f.val = (regs.main.a & 0xA8) // S, R5, R3
-				| (regs.main.a ? 0 : z80_flag::z)  // Z
-				| (((before & 0x0F) - (other & 0x0F) - regs.main.f.c) & 0x10) // H
-				| ((!same_sign(before, other) && !same_sign(before, regs.main.a)) ? z80_flag::pv : 0) // P/V
+			regs.main.f.val = (after & 0xA8) // S, R5, R3
+				| (after ? 0 : z80_flag::z)  // Z
+				| (((before & 0x0F) - (other & 0x0F) - carry) & 0x10) // H
+				| ((!same_sign(before, other) && !same_sign(before, after)) ? z80_flag::pv : 0) // P/V
 				| z80_flag::n // N
-				| ((((uint32_t)before - (uint32_t)other - (uint32_t)regs.main.f.c) >> 8) & 1); // C
+				| ((((uint32_t)before - (uint32_t)other - (uint32_t)carry) >> 8) & 1); // C
 			break;
 
 		case 4: // and
-			regs.main.a &= other;
-			regs.main.f.val = s_z_pv_flags.flags[regs.main.a] | z80_flag::h;
+			regs.main.f.val = s_z_pv_flags.flags[after] | z80_flag::h;
 			break;
 
 		case 5: // xor
-			regs.main.a ^= other;
-			regs.main.f.val = s_z_pv_flags.flags[regs.main.a];
-			break;
-
 		case 6: // or
-			regs.main.a |= other;
-			regs.main.f.val = s_z_pv_flags.flags[regs.main.a];
+			regs.main.f.val = s_z_pv_flags.flags[after];
 			break;
 
-		default: // cp
-			uint8_t after = regs.main.a - other;
+		case 7: // cp
 			regs.main.f.val = (after & 0x80) // S
 				| (other & 0x28) // R5, R3
 				| (after ? 0 : z80_flag::z)  // Z
@@ -289,47 +568,117 @@ public:
 				| z80_flag::n // N
 				| (after > before); // C
 			break;
+
+		case lazy_inc:
+			regs.main.f.val = (after & 0xA8) // S, X5, X3
+				| (after ? 0 : z80_flag::z) // Z
+				| (((before & 0x10) != (after & 0x10)) ? z80_flag::h : 0) // H
+				| ((before == 0x7f) ? z80_flag::pv : 0) // P/V
+				| carry; // C
+			break;
+
+		case lazy_dec:
+			regs.main.f.val = (after & 0xA8) // S, X5, X3
+				| (after ? 0 : z80_flag::z) // Z
+				| (((before & 0x10) != (after & 0x10)) ? z80_flag::h : 0) // H
+				| ((before == 0x80) ? z80_flag::pv : 0) // P/V
+				| z80_flag::n // N
+				| carry; // C
+			break;
+
+		case lazy_add16:
+		{
+			uint16_t before16 = _lazy_flags.before;
+			uint16_t other16 = _lazy_flags.other;
+			uint16_t after16 = _lazy_flags.result;
+			regs.main.f.val = (regs.main.f.val & (z80_flag::s | z80_flag::z | z80_flag::pv)) // S, Z, P/V
+				| ((after16 >> 8) & (z80_flag::r3 | z80_flag::r5)) // R3, R5
+				| ((((before16 & 0x0FFF) + (other16 & 0x0FFF)) >> 8) & z80_flag::h) // H
+				| 0 // N
+				| ((after16 < before16) ? z80_flag::c : 0); // C
+			break;
 		}
-	}
 
-	bool condition_met (uint8_t cc) const
-	{
-		switch(cc)
+		case lazy_adc16:
+		{
+			uint16_t before16 = _lazy_flags.before;
+			uint16_t other16 = _lazy_flags.other;
+			uint16_t after16 = _lazy_flags.result;
+			regs.main.f.val = ((after16 >> 8) & 0x80) // S
+				| (after16 ? 0 : z80_flag::z) // Z
+				| ((after16 >> 8) & (z80_flag::r5 | z80_flag::r3)) // R3, R5
+				| ((((before16 & 0x0FFF) + (other16 & 0xFFF) + carry) & 0x1000) >> 8) // H
+				| ((same_sign(before16, other16) && !same_sign(before16, after16)) ? z80_flag::pv : 0) // P/V
+				| 0 // N
+				| ((((uint32_t)before16 + (uint32_t)other16 + (uint32_t)carry) >> 16) & 1); // C
+			break;
+		}
+
+		case lazy_sbc16:
 		{
-			case 0:  return !regs.main.f.z;  // nz
-			case 1:  return  regs.main.f.z;  // z
-			case 2:  return !regs.main.f.c;  // nc
-			case 3:  return  regs.main.f.c;  // c
-			case 4:  return !regs.main.f.pv; // po
-			case 5:  return  regs.main.f.pv; // pe
-			case 6:  return !regs.main.f.s;  // p
-			default: return  regs.main.f.s;  // m
+			uint16_t before16 = _lazy_flags.before;
+			uint16_t other16 = _lazy_flags.other;
+			uint16_t after16 = _lazy_flags.result;
+			regs.main.f.val = ((after16 >> 8) & 0x80) // S
+				| (after16 ? 0 : z80_flag::z) // Z
+				| ((after16 >> 8) & (z80_flag::r5 | z80_flag::r3)) // R3, R5
+				| ((((before16 & 0x0FFF) - (other16 & 0x0FFF) - carry) & 0x1000) >> 8) // H
+				| ((!same_sign(before16, other16) && !same_sign(before16, after16)) ? z80_flag::pv : 0) // P/V
+				| z80_flag::n // N
+				| ((((uint32_t)before16 - (uint32_t)other16 - (uint32_t)carry) >> 16) & 1); // C
+			break;
+		}
+
+		case lazy_rotate_a:
+			regs.main.f.val = (regs.main.f.val & (z80_flag::s | z80_flag::z | z80_flag::pv)) // S, Z, P/V
+				| (after & (z80_flag::r3 | z80_flag::r5)) // R3, R5
+				| other; // C; H and N are reset
+			break;
+
+		default: // lazy_rotate_shift
+			regs.main.f.val = s_z_pv_flags.flags[after] | other;
+			break;
 		}
 	}
 
+	template<uint8_t cc>
+	bool condition_met() const
+	{
+		if constexpr (cc == 0)      return !regs.main.f.z;  // nz
+		else if constexpr (cc == 1) return  regs.main.f.z;  // z
+		else if constexpr (cc == 2) return !regs.main.f.c;  // nc
+		else if constexpr (cc == 3) return  regs.main.f.c;  // c
+		else if constexpr (cc == 4) return !regs.main.f.pv; // po
+		else if constexpr (cc == 5) return  regs.main.f.pv; // pe
+		else if constexpr (cc == 6) return !regs.main.f.s;  // p
+		else                        return  regs.main.f.s;  // m
+	}
+
 	// nop
-	bool sim_00 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_00()
 	{
 		cpu_time += 4;
 		return true;
 	}
 
 	// ld bc/de/hl/sp, nn
-	bool sim_01 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_01()
 	{
 		uint16_t val = decode_u16();
-		uint8_t i = (opcode & 0x30) >> 4;
+		constexpr uint8_t i = (opcode & 0x30) >> 4;
 		regs.bc_de_hl_sp (xy, i) = val;
-		if (i == 3)
+		if constexpr (i == 3)
 			_start_of_stack = val;
-		cpu_time += 10;
+		cpu_time += (xy == hl_ix_iy::hl) ? 10 : 14;
 		return true;
 	}
 
 	// ld (bc)/(de), a
-	bool sim_02 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_02()
 	{
-		uint8_t i = (opcode >> 4) & 1;
+		constexpr uint8_t i = (opcode >> 4) & 1;
 		uint16_t addr = i ? regs.main.de : regs.main.bc;
 		if (!memory->try_write_request(addr, regs.main.a, cpu_time))
 			return false;
@@ -338,21 +687,23 @@ public:
 	}
 
 	// inc bc/de/hl/sp
-	bool sim_03 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_03()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		regs.bc_de_hl_sp(xy, i)++;
 		cpu_time += ((xy == hl_ix_iy::hl) ? 6 : 10);
 		return true;
 	}
 	
 	// inc r
-	bool sim_04 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_04()
 	{
-		uint8_t i = (opcode >> 3) & 7;
+		constexpr uint8_t i = (opcode >> 3) & 7;
 		uint8_t before;
 		uint8_t after;
-		if (i != 6)
+		if constexpr (i != 6)
 		{
 			before = regs.r8(i, xy);
 			after = before + 1;
@@ -361,7 +712,7 @@ public:
 		}
 		else
 		{
-			uint16_t addr = decode_mem_hl(xy);
+			uint16_t addr = decode_mem_hl<xy>();
 			if (!memory->try_read_request(addr, before, cpu_time))
 				return false;
 			after = before + 1;
@@ -369,22 +720,19 @@ public:
 			cpu_time += ((xy == hl_ix_iy::hl) ? 11 : 23);
 		}
 
-		regs.main.f.val = (after & 0xA8) // S, X5, X3
-			| (after ? 0 : z80_flag::z) // Z
-			| (((before & 0x10) != (after & 0x10)) ? z80_flag::h : 0) // H
-			| ((before == 0x7f) ? z80_flag::pv : 0) // P/V
-			| (regs.main.f.val & 1); // C
-		
+		materialize_flags();
+		set_flags_pending (lazy_inc, before, 1, after);
 		return true;
 	}
 
 	// dec r
-	bool sim_05 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_05()
 	{
-		uint8_t i = (opcode >> 3) & 7;
+		constexpr uint8_t i = (opcode >> 3) & 7;
 		uint8_t before;
 		uint8_t after;
-		if (i != 6)
+		if constexpr (i != 6)
 		{
 			before = regs.r8(i, xy);
 			after = before - 1;
@@ -393,7 +741,7 @@ public:
 		}
 		else
 		{
-			uint16_t addr = decode_mem_hl(xy);
+			uint16_t addr = decode_mem_hl<xy>();
 			if (!memory->try_read_request(addr, before, cpu_time))
 				return false;
 			after = before - 1;
@@ -401,20 +749,17 @@ public:
 			cpu_time += ((xy == hl_ix_iy::hl) ? 11 : 23);
 		}
 
-		regs.main.f.val = (after & 0xA8) // S, X5, X3
-			| (after ? 0 : z80_flag::z) // Z
-			| (((before & 0x10) != (after & 0x10)) ? z80_flag::h : 0) // H
-			| ((before == 0x80) ? z80_flag::pv : 0) // P/V
-			| z80_flag::n // N
-			| (regs.main.f.val & 1); // C
+		materialize_flags();
+		set_flags_pending (lazy_dec, before, 1, after);
 		return true;
 	}
 
 	// ld b/c/d/e/h/l/(hl)/a, n
-	bool sim_06 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_06()
 	{
-		uint8_t i = (opcode >> 3) & 7;
-		if (i != 6)
+		constexpr uint8_t i = (opcode >> 3) & 7;
+		if constexpr (i != 6)
 		{
 			uint8_t val = decode_u8();
 			regs.r8(i, xy) = val;
@@ -422,7 +767,7 @@ public:
 		}
 		else
 		{
-			uint16_t addr = decode_mem_hl(xy);
+			uint16_t addr = decode_mem_hl<xy>();
 			uint8_t val = decode_u8();
 			if (!memory->try_write_request(addr, val, cpu_time))
 				return false;
@@ -433,18 +778,18 @@ public:
 	}
 
 	// rlca
-	bool sim_07 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_07()
 	{
-		regs.main.a = (regs.main.a << 1) | (regs.main.a >> 7);
-		regs.main.f.h = 0;
-		regs.main.f.n = 0;
-		regs.main.f.c = regs.main.a & 1;
+		materialize_flags();
+		uint8_t before = regs.main.a;
+		regs.main.a = (before << 1) | (before >> 7);
+		set_flags_pending (lazy_rotate_a, before, before >> 7, regs.main.a);
 		cpu_time += 4;
 		return true;
 	}
 
 	// ex af, af'
-	bool sim_08 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_08()
 	{
 		std::swap(regs.main.af, regs.alt.af);
 		cpu_time += 4;
@@ -452,26 +797,25 @@ public:
 	}
 
 	// add hl, bc/de/hl/sp
-	bool sim_09 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_09()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		uint16_t before = regs.hl(xy);
 		uint16_t other = regs.bc_de_hl_sp(xy, i);
 		uint16_t after = before + other;
 		regs.hl(xy) = after;
 		cpu_time += ((xy != hl_ix_iy::hl) ? 15 : 11);
-		regs.main.f.val = (regs.main.f.val & (z80_flag::s | z80_flag::z | z80_flag::pv)) // S, Z, P/V
-			| ((after >> 8) & (z80_flag::r3 | z80_flag::r5)) // R3, R5
-			| ((((before & 0x0FFF) + (other & 0x0FFF)) >> 8) & z80_flag::h) // H
-			| 0 // N
-			| ((after < before) ? z80_flag::c : 0); // C
+		materialize_flags();
+		set_flags_pending (lazy_add16, before, other, after);
 		return true;
 	}
 
 	// ld a, (bc)/(de)
-	bool sim_0a (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_0a()
 	{
-		uint8_t i = (opcode >> 4) & 1;
+		constexpr uint8_t i = (opcode >> 4) & 1;
 		uint16_t addr = i ? regs.main.de : regs.main.bc;
 		uint8_t value;
 		if (!memory->try_read_request(addr, value, cpu_time))
@@ -482,27 +826,28 @@ public:
 	}
 
 	// dec bc/de/hl/sp
-	bool sim_0b (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_0b()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		regs.bc_de_hl_sp(xy, i)--;
 		cpu_time += ((xy == hl_ix_iy::hl) ? 6 : 10);
 		return true;
 	}
 
 	// rrca
-	bool sim_0f (hl_ix_iy xy, uint8_t opcode)
+	bool sim_0f()
 	{
-		regs.main.a = (regs.main.a >> 1) | (regs.main.a << 7);
-		regs.main.f.h = 0;
-		regs.main.f.n = 0;
-		regs.main.f.c = (regs.main.a & 0x80) ? 1 : 0;
+		materialize_flags();
+		uint8_t before = regs.main.a;
+		regs.main.a = (before >> 1) | (before << 7);
+		set_flags_pending (lazy_rotate_a, before, before & 1, regs.main.a);
 		cpu_time += 4;
 		return true;
 	}
 
 	// djnz e
-	bool sim_10 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_10()
 	{
 		int8_t e = (int8_t)decode_u8();
 		regs.b()--;
@@ -517,19 +862,18 @@ public:
 	}
 
 	// rla
-	bool sim_17 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_17()
 	{
+		materialize_flags();
 		uint8_t before = regs.main.a;
-		regs.main.a = (regs.main.a << 1) | regs.main.f.c;
-		regs.main.f.h = 0;
-		regs.main.f.n = 0;
-		regs.main.f.c = (before & 0x80) ? 1 : 0;
+		regs.main.a = (before << 1) | regs.main.f.c;
+		set_flags_pending (lazy_rotate_a, before, before >> 7, regs.main.a);
 		cpu_time += 4;
 		return true;
 	}
 
 	// jr e
-	bool sim_18 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_18()
 	{
 		uint8_t e = decode_u8();
 		regs.pc = regs.pc + (uint16_t)(int16_t)(int8_t)e;
@@ -538,32 +882,22 @@ public:
 	}
 
 	// rra
-	bool sim_1f (hl_ix_iy xy, uint8_t opcode)
+	bool sim_1f()
 	{
+		materialize_flags();
 		uint8_t before = regs.main.a;
-		regs.main.a = (regs.main.a >> 1) | (regs.main.f.c ? 0x80 : 0);
-		regs.main.f.h = 0;
-		regs.main.f.n = 0;
-		regs.main.f.c = before & 1;
+		regs.main.a = (before >> 1) | (regs.main.f.c ? 0x80 : 0);
+		set_flags_pending (lazy_rotate_a, before, before & 1, regs.main.a);
 		cpu_time += 4;
 		return true;
 	}
 
 	// jr nz/z/nc/c, e
-	bool sim_20 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_20()
 	{
-		uint8_t c = (opcode >> 3) & 3;
 		uint8_t e = decode_u8();
-		bool jump;
-		switch(c)
-		{
-			case 0: jump = !regs.main.f.z; break; // nz
-			case 1: jump =  regs.main.f.z; break; // z
-			case 2: jump = !regs.main.f.c; break; // nc
-			case 3: jump =  regs.main.f.c; break; // c
-		}
-
-		if (jump)
+		if (condition_met<(opcode >> 3) & 3>())
 		{
 			regs.pc = regs.pc + (uint16_t)(int16_t)(int8_t)e;
 			cpu_time += 12;
@@ -574,17 +908,18 @@ public:
 	}
 
 	// ld (nn), hl
-	bool sim_22 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_22()
 	{
 		uint16_t addr = decode_u16();
 		if (!memory->try_write_request (addr, regs.hl(xy), cpu_time))
 			return false;
-		cpu_time += 16;
+		cpu_time += (xy == hl_ix_iy::hl) ? 16 : 20;
 		return true;
 	}
 
 	// daa
-	bool sim_27 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_27()
 	{
 		size_t daaIndex = regs.main.a + (((regs.main.f.val & 3) + ((regs.main.f.val >> 2) & 4)) << 8);
 		regs.main.af = daa_table.s_DaaResults[daaIndex];
@@ -592,19 +927,20 @@ public:
 	}
 
 	// ld hl, (nn)
-	bool sim_2a (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_2a()
 	{
 		uint16_t addr = decode_u16();
 		uint16_t val;
 		if (!memory->try_read_request (addr, val, cpu_time))
 			return false;
 		regs.hl(xy) = val;
-		cpu_time += 16;
+		cpu_time += (xy == hl_ix_iy::hl) ? 16 : 20;
 		return true;
 	}
 
 	// cpl
-	bool sim_2f (hl_ix_iy xy, uint8_t opcode)
+	bool sim_2f()
 	{
 		regs.main.a = ~regs.main.a;
 		regs.main.f.h = 1;
@@ -616,7 +952,7 @@ public:
 	}
 
 	// ld (nn), a
-	bool sim_32 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_32()
 	{
 		uint16_t addr = decode_u16();
 		if (!memory->try_write_request (addr, regs.main.a, cpu_time))
@@ -626,7 +962,7 @@ public:
 	}
 
 	// scf
-	bool sim_37 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_37()
 	{
 		regs.main.f.h = 0;
 		regs.main.f.n = 0;
@@ -638,7 +974,7 @@ public:
 	}
 
 	// la a, (nn)
-	bool sim_3a (hl_ix_iy xy, uint8_t opcode)
+	bool sim_3a()
 	{
 		uint16_t addr = decode_u16();
 		uint8_t val;
@@ -650,7 +986,7 @@ public:
 	}
 
 	// ccf
-	bool sim_3f (hl_ix_iy xy, uint8_t opcode)
+	bool sim_3f()
 	{
 		regs.main.f.h = regs.main.f.c;
 		regs.main.f.n = 0;
@@ -662,23 +998,24 @@ public:
 	}
 
 	// ld r, r
-	bool sim_40 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_40()
 	{
-		uint8_t dst = (opcode >> 3) & 7;
-		uint8_t src = opcode & 7;
-		if (dst == 6)
+		constexpr uint8_t dst = (opcode >> 3) & 7;
+		constexpr uint8_t src = opcode & 7;
+		if constexpr (dst == 6)
 		{
 			// ld (hl)/(ix+d)/(iy+d), r8
 			uint8_t value = regs.r8(src, hl_ix_iy::hl); // source reg is here the regular h/l; the DD/FD prefix applies only to the destination
-			uint16_t dest_addr = decode_mem_hl(xy);
+			uint16_t dest_addr = decode_mem_hl<xy>();
 			if (!memory->try_write_request(dest_addr, value, cpu_time))
 				return false;
 			cpu_time += ((xy == hl_ix_iy::hl) ? 7 : 19);
 		}
-		else if (src == 6)
+		else if constexpr (src == 6)
 		{
 			// ld r8, (hl)/(ix+d)/(iy+d)
-			uint16_t src_addr = decode_mem_hl(xy);
+			uint16_t src_addr = decode_mem_hl<xy>();
 			uint8_t value;
 			if (!memory->try_read_request(src_addr, value, cpu_time))
 				return false;
@@ -694,7 +1031,7 @@ public:
 	}
 
 	// halt
-	bool sim_76 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_76()
 	{
 		regs.halted = true;
 		cpu_time += 4;
@@ -702,33 +1039,33 @@ public:
 	}
 
 	// add/adc/sub/sbc/and/xor/or/cp b/c/d/e/h/l/(hl)/a
-	bool sim_80 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_80()
 	{
-		uint8_t i = opcode & 7;
-		uint8_t operation = (opcode >> 3) & 7;
+		constexpr uint8_t i = opcode & 7;
 		uint8_t other;
-		if (i != 6)
+		if constexpr (i != 6)
 		{
 			other = regs.r8(i, xy);
 			cpu_time += ((xy == hl_ix_iy::hl) ? 4 : 8);
 		}
 		else
 		{
-			uint16_t addr = decode_mem_hl(xy);
+			uint16_t addr = decode_mem_hl<xy>();
 			if (!memory->try_read_request(addr, other, cpu_time))
 				return false;
 			cpu_time += ((xy == hl_ix_iy::hl) ? 7 : 19);
 		}
 
-		do_reg_a_operation (operation, other);
+		do_reg_a_operation<(opcode >> 3) & 7>(other);
 		return true;
 	}
 
 	// ret nz/z/nc/c/po/pe/p/m
-	bool sim_c0 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_c0()
 	{
-		uint8_t cc = (opcode >> 3) & 7;
-		if (condition_met(cc))
+		if (condition_met<(opcode >> 3) & 7>())
 		{
 			uint16_t addr = memory->read_uint16(regs.sp);
 			regs.sp += 2;
@@ -741,9 +1078,10 @@ public:
 	}
 
 	// pop bc/de/hl/af
-	bool sim_c1 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_c1()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		// Some games write to video memory using push/pop. We have to simulate this, not write through.
 		uint16_t value;
 		if (!memory->try_read_request(regs.sp, value, cpu_time))
@@ -755,18 +1093,18 @@ public:
 	}
 
 	// jp nz/z/nc/c/po/pe/p/m, nn
-	bool sim_c2 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_c2()
 	{
-		uint8_t cc = (opcode >> 3) & 7;
 		uint16_t addr = decode_u16();
-		if (condition_met(cc))
+		if (condition_met<(opcode >> 3) & 7>())
 			regs.pc = addr;
 		cpu_time += 10;
 		return true;
 	}
 
 	// jp nn
-	bool sim_c3 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_c3()
 	{
 		uint16_t val = decode_u16();
 		regs.pc = val;
@@ -775,11 +1113,11 @@ public:
 	}
 
 	// call nz/z/nc/c/po/pe/p/m, nn
-	bool sim_c4 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_c4()
 	{
-		uint8_t cc = (opcode >> 3) & 7;
 		uint16_t addr = decode_u16();
-		if (condition_met(cc))
+		if (condition_met<(opcode >> 3) & 7>())
 		{
 			// Let's not go too far with the simulation and do a simple write of the return address.
 			memory->write_uint16 (regs.sp - 2, regs.pc);
@@ -794,9 +1132,10 @@ public:
 	}
 
 	// push bc/de/hl/af
-	bool sim_c5 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_c5()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		uint16_t value = regs.bc_de_hl_af(xy, i);
 		// Some games write to video memory using push/pop. We have to simulate this, not write through.
 		if (!memory->try_write_request(regs.sp - 2, value, cpu_time))
@@ -807,19 +1146,20 @@ public:
 	}
 
 	// add/adc/sub/sbc/and/xor/or/cp imm8
-	bool sim_c6 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_c6()
 	{
 		uint8_t other = decode_u8();
-		uint8_t operation = (opcode >> 3) & 7;
-		do_reg_a_operation (operation, other);
+		do_reg_a_operation<(opcode >> 3) & 7>(other);
 		cpu_time += 7;
 		return true;
 	}
 
 	// rst 0/8/10h/...
-	bool sim_c7 (hl_ix_iy xy, uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_c7()
 	{
-		uint16_t addr = opcode & 0x38;
+		constexpr uint16_t addr = opcode & 0x38;
 		// Let's not go too far with the simulation and do a simple write of the return address.
 		memory->write_uint16 (regs.sp - 2, regs.pc);
 		regs.sp -= 2;
@@ -829,7 +1169,7 @@ public:
 	}
 
 	// ret
-	bool sim_c9 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_c9()
 	{
 		if (regs.sp == _start_of_stack)
 		{
@@ -849,7 +1189,7 @@ public:
 	}
 
 	// call nn
-	bool sim_cd (hl_ix_iy xy, uint8_t opcode)
+	bool sim_cd()
 	{
 		uint16_t addr = decode_u16();
 		// Let's not go too far with the simulation and do a simple write of the return address.
@@ -861,7 +1201,7 @@ public:
 	}
 
 	// out (n), a
-	bool sim_d3 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_d3()
 	{
 		uint8_t val = decode_u8();
 		if (!io->try_write_request(val | (regs.main.a << 8), regs.main.a, cpu_time))
@@ -871,7 +1211,7 @@ public:
 	}
 
 	// exx
-	bool sim_d9 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_d9()
 	{
 		std::swap<uint16_t>(regs.main.bc, regs.alt.bc);
 		std::swap<uint16_t>(regs.main.de, regs.alt.de);
@@ -881,7 +1221,7 @@ public:
 	}
 
 	// in a, (n)
-	bool sim_db (hl_ix_iy xy, uint8_t opcode)
+	bool sim_db()
 	{
 		uint8_t val = decode_u8();
 		if (!io->try_read_request (val | (regs.main.a << 8), regs.main.a, cpu_time))
@@ -891,7 +1231,8 @@ public:
 	}
 
 	// ex (sp), hl/ix/iy
-	bool sim_e3 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_e3()
 	{
 		uint16_t other;
 		if (!memory->try_read_request (regs.sp, other, cpu_time))
@@ -904,7 +1245,8 @@ public:
 	}
 
 	// jp hl/ix/iy
-	bool sim_e9 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_e9()
 	{
 		regs.pc = regs.hl(xy);
 		cpu_time += ((xy == hl_ix_iy::hl) ? 4 : 8);
@@ -912,7 +1254,7 @@ public:
 	}
 
 	// ex de, hl
-	bool sim_eb (hl_ix_iy xy, uint8_t opcode)
+	bool sim_eb()
 	{
 		// The real CPU ignores any IX/IY prefix on this one.
 		uint16_t temp = regs.main.hl;
@@ -923,7 +1265,7 @@ public:
 	}
 
 	// di
-	bool sim_f3 (hl_ix_iy xy, uint8_t opcode)
+	bool sim_f3()
 	{
 		regs.iff1 = 0;
 		_ei_countdown = 0;
@@ -932,7 +1274,7 @@ public:
 	}
 
 	// ei
-	bool sim_fb (hl_ix_iy xy, uint8_t opcode)
+	bool sim_fb()
 	{
 		_ei_countdown = 2;
 		cpu_time += 4;
@@ -940,61 +1282,80 @@ public:
 	}
 
 	// ld sp, hl/ix/iy
-	bool sim_f9 (hl_ix_iy xy, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_f9()
 	{
 		regs.sp = regs.hl(xy);
-		cpu_time += 6;
+		cpu_time += (xy == hl_ix_iy::hl) ? 6 : 10;
 		_start_of_stack = regs.sp;
 		return true;
 	}
 
-	static constexpr handler_t dispatch[] = {
-		&sim_00,  &sim_01,  &sim_02,  &sim_03,  &sim_04,  &sim_05,  &sim_06,  &sim_07,  // 00 - 07
-		&sim_08,  &sim_09,  &sim_0a,  &sim_0b,  &sim_04,  &sim_05,  &sim_06,  &sim_0f,  // 08 - 0f
-		&sim_10,  &sim_01,  &sim_02,  &sim_03,  &sim_04,  &sim_05,  &sim_06,  &sim_17,  // 10 - 17
-		&sim_18,  &sim_09,  &sim_0a,  &sim_0b,  &sim_04,  &sim_05,  &sim_06,  &sim_1f,  // 18 - 1f
-		&sim_20,  &sim_01,  &sim_22,  &sim_03,  &sim_04,  &sim_05,  &sim_06,  &sim_27,  // 20 - 27
-		&sim_20,  &sim_09,  &sim_2a,  &sim_0b,  &sim_04,  &sim_05,  &sim_06,  &sim_2f,  // 28 - 2f
-		&sim_20,  &sim_01,  &sim_32,  &sim_03,  &sim_04,  &sim_05,  &sim_06,  &sim_37,  // 30 - 37
-		&sim_20,  &sim_09,  &sim_3a,  &sim_0b,  &sim_04,  &sim_05,  &sim_06,  &sim_3f,  // 38 - 3f
-
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 40 - 47
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 48 - 4f
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 50 - 57
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 58 - 5f
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 60 - 67
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 68 - 6f
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_76,  &sim_40,  // 70 - 77
-		&sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  &sim_40,  // 78 - 7f
-
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // 80 - 87
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // 88 - 8f
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // 90 - 97
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // 98 - 9f
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // a0 - a7
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // a8 - af
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // b0 - b7
-		&sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  &sim_80,  // b8 - bf
-
-		&sim_c0,  &sim_c1,  &sim_c2,  &sim_c3,  &sim_c4,  &sim_c5,  &sim_c6,  &sim_c7,  // c0 - c7
-		&sim_c0,  &sim_c9,  &sim_c2,  nullptr, &sim_c4,  &sim_cd,  &sim_c6,  &sim_c7,  // c8 - cf
-		&sim_c0,  &sim_c1,  &sim_c2,  &sim_d3,  &sim_c4,  &sim_c5,  &sim_c6,  &sim_c7,  // d0 - d7
-		&sim_c0,  &sim_d9,  &sim_c2,  &sim_db,  &sim_c4,  nullptr, &sim_c6,  &sim_c7,  // d8 - df
-		&sim_c0,  &sim_c1,  &sim_c2,  &sim_e3,  &sim_c4,  &sim_c5,  &sim_c6,  &sim_c7,  // e0 - e7
-		&sim_c0,  &sim_e9,  &sim_c2,  &sim_eb,  &sim_c4,  nullptr, &sim_c6,  &sim_c7,  // e8 - ef
-		&sim_c0,  &sim_c1,  &sim_c2,  &sim_f3,  &sim_c4,  &sim_c5,  &sim_c6,  &sim_c7,  // f0 - f7
-		&sim_c0,  &sim_f9,  &sim_c2,  &sim_fb,  &sim_c4,  nullptr, &sim_c6,  &sim_c7,  // f8 - ff
-	};
+	// The handler of an opcode without prefix or after DD / FD, instantiated for both; null for the prefixes.
+	template<hl_ix_iy xy, uint8_t opcode>
+	static constexpr handler_t main_handler()
+	{
+		if constexpr (opcode == 0x00) return &cpu::sim_00;
+		else if constexpr ((opcode & 0xCF) == 0x01) return &cpu::sim_01<xy, opcode>;
+		else if constexpr ((opcode & 0xEF) == 0x02) return &cpu::sim_02<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0x03) return &cpu::sim_03<xy, opcode>;
+		else if constexpr ((opcode & 0xC7) == 0x04) return &cpu::sim_04<xy, opcode>;
+		else if constexpr ((opcode & 0xC7) == 0x05) return &cpu::sim_05<xy, opcode>;
+		else if constexpr ((opcode & 0xC7) == 0x06) return &cpu::sim_06<xy, opcode>;
+		else if constexpr (opcode == 0x07) return &cpu::sim_07;
+		else if constexpr (opcode == 0x08) return &cpu::sim_08;
+		else if constexpr ((opcode & 0xCF) == 0x09) return &cpu::sim_09<xy, opcode>;
+		else if constexpr ((opcode & 0xEF) == 0x0A) return &cpu::sim_0a<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0x0B) return &cpu::sim_0b<xy, opcode>;
+		else if constexpr (opcode == 0x0F) return &cpu::sim_0f;
+		else if constexpr (opcode == 0x10) return &cpu::sim_10;
+		else if constexpr (opcode == 0x17) return &cpu::sim_17;
+		else if constexpr (opcode == 0x18) return &cpu::sim_18;
+		else if constexpr (opcode == 0x1F) return &cpu::sim_1f;
+		else if constexpr ((opcode & 0xE7) == 0x20) return &cpu::sim_20<opcode>;
+		else if constexpr (opcode == 0x22) return &cpu::sim_22<xy, opcode>;
+		else if constexpr (opcode == 0x27) return &cpu::sim_27;
+		else if constexpr (opcode == 0x2A) return &cpu::sim_2a<xy, opcode>;
+		else if constexpr (opcode == 0x2F) return &cpu::sim_2f;
+		else if constexpr (opcode == 0x32) return &cpu::sim_32;
+		else if constexpr (opcode == 0x37) return &cpu::sim_37;
+		else if constexpr (opcode == 0x3A) return &cpu::sim_3a;
+		else if constexpr (opcode == 0x3F) return &cpu::sim_3f;
+		else if constexpr (opcode == 0x76) return &cpu::sim_76;
+		else if constexpr ((opcode & 0xC0) == 0x40) return &cpu::sim_40<xy, opcode>;
+		else if constexpr ((opcode & 0xC0) == 0x80) return &cpu::sim_80<xy, opcode>;
+		else if constexpr ((opcode & 0xC7) == 0xC0) return &cpu::sim_c0<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0xC1) return &cpu::sim_c1<xy, opcode>;
+		else if constexpr ((opcode & 0xC7) == 0xC2) return &cpu::sim_c2<opcode>;
+		else if constexpr (opcode == 0xC3) return &cpu::sim_c3;
+		else if constexpr ((opcode & 0xC7) == 0xC4) return &cpu::sim_c4<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0xC5) return &cpu::sim_c5<xy, opcode>;
+		else if constexpr ((opcode & 0xC7) == 0xC6) return &cpu::sim_c6<opcode>;
+		else if constexpr ((opcode & 0xC7) == 0xC7) return &cpu::sim_c7<opcode>;
+		else if constexpr (opcode == 0xC9) return &cpu::sim_c9;
+		else if constexpr (opcode == 0xCD) return &cpu::sim_cd;
+		else if constexpr (opcode == 0xD3) return &cpu::sim_d3;
+		else if constexpr (opcode == 0xD9) return &cpu::sim_d9;
+		else if constexpr (opcode == 0xDB) return &cpu::sim_db;
+		else if constexpr (opcode == 0xE3) return &cpu::sim_e3<xy, opcode>;
+		else if constexpr (opcode == 0xE9) return &cpu::sim_e9<xy, opcode>;
+		else if constexpr (opcode == 0xEB) return &cpu::sim_eb;
+		else if constexpr (opcode == 0xF3) return &cpu::sim_f3;
+		else if constexpr (opcode == 0xF9) return &cpu::sim_f9<xy, opcode>;
+		else if constexpr (opcode == 0xFB) return &cpu::sim_fb;
+		else return nullptr; // CB, DD, ED, FD
+	}
 
 	#pragma region ED group
 
 	// in r, (c)
-	bool sim_ed40 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed40()
 	{
 		uint8_t value;
 		if (!io->try_read_request(regs.main.bc, value, cpu_time))
 			return false;
-		uint8_t i = (opcode >> 3) & 7;
+		constexpr uint8_t i = (opcode >> 3) & 7;
 		regs.r8(i, hl_ix_iy::hl) = value;
 		regs.main.f.val = s_z_pv_flags.flags[value];
 		cpu_time += 12;
@@ -1002,9 +1363,10 @@ public:
 	}
 
 	// out (c), r
-	bool sim_ed41 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed41()
 	{
-		uint8_t i = (opcode >> 3) & 7;
+		constexpr uint8_t i = (opcode >> 3) & 7;
 		uint8_t value = regs.r8(i, hl_ix_iy::hl);
 		if (!io->try_write_request(regs.main.bc, value, cpu_time))
 			return false;
@@ -1013,7 +1375,7 @@ public:
 	}
 
 	// neg
-	bool sim_ed44 (uint8_t opcode)
+	bool sim_ed44()
 	{
 		uint8_t before = regs.main.a;
 		regs.main.a = 0 - regs.main.a;
@@ -1028,15 +1390,15 @@ public:
 	}
 
 	// retn
-	bool sim_ed45 (uint8_t opcode)
+	bool sim_ed45()
 	{
 		regs.iff1 = regs.iff2;
 		cpu_time += 4;
-		return sim_c9(hl_ix_iy::hl, 0xc9);
+		return sim_c9();
 	}
 
 	// im 0
-	bool sim_ed46 (uint8_t opcode)
+	bool sim_ed46()
 	{
 		regs.im = 0;
 		cpu_time += 8;
@@ -1044,7 +1406,7 @@ public:
 	}
 
 	// ld i, a
-	bool sim_ed47 (uint8_t opcode)
+	bool sim_ed47()
 	{
 		regs.i = regs.main.a;
 		cpu_time += 9;
@@ -1052,7 +1414,7 @@ public:
 	}
 
 	// ld r, a
-	bool sim_ed4f (uint8_t opcode)
+	bool sim_ed4f()
 	{
 		regs.r = regs.main.a;
 		cpu_time += 9;
@@ -1060,7 +1422,7 @@ public:
 	}
 
 	// im 1
-	bool sim_ed56 (uint8_t opcode)
+	bool sim_ed56()
 	{
 		regs.im = 1;
 		cpu_time += 8;
@@ -1069,9 +1431,13 @@ public:
 
 	// ld a, i (ED 57)
 	// ld a, r (ED 5F)
-	bool sim_ed57 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed57()
 	{
-		regs.main.a = (opcode == 0x57) ? regs.i : regs.r;
+		if constexpr (opcode == 0x57)
+			regs.main.a = regs.i;
+		else
+			regs.main.a = regs.r;
 		regs.main.f.val = (regs.main.a & 0xA8) // S, X5, X3
 			| (regs.main.a ? 0 : 0x40) // Z
 			| (regs.iff2 ? 4 : 0) // P/V
@@ -1082,7 +1448,7 @@ public:
 	}
 
 	// im 2
-	bool sim_ed5e (uint8_t opcode)
+	bool sim_ed5e()
 	{
 		regs.im = 2;
 		cpu_time += 8;
@@ -1090,45 +1456,36 @@ public:
 	}
 
 	// sbc hl, bc/de/hl/sp
-	bool sim_ed42 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed42()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		uint16_t before = regs.main.hl;
 		uint16_t other = regs.bc_de_hl_sp(hl_ix_iy::hl, i);
 		regs.main.hl -= (other + regs.main.f.c);
 		cpu_time += 15;
-		regs.main.f.val = ((regs.main.hl >> 8) & 0x80) // S
-			| (regs.main.hl ? 0 : z80_flag::z) // Z
-			| (regs.main.hl & 0x28) // R3, R5
-			| ((((before & 0x0FFF) - (other & 0x0FFF) - regs.main.f.c) & 0x1000) >> 8) // H
-			| ((!same_sign(before, other) && !same_sign(before, regs.main.hl)) ? z80_flag::pv : 0) // P/V
-			| z80_flag::n // N
-			| ((((uint32_t)before - (uint32_t)other - (uint32_t)regs.main.f.c) >> 16) & 1); // C
+		set_flags_pending (lazy_sbc16, before, other, regs.main.hl);
 		return true;
 	}
 
 	// adc hl, bc/de/hl/sp
-	bool sim_ed4a (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed4a()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		uint16_t before = regs.main.hl;
 		uint16_t other = regs.bc_de_hl_sp(hl_ix_iy::hl, i);
 		regs.main.hl += (other + regs.main.f.c);
 		cpu_time += 15;
-		regs.main.f.val = ((regs.main.hl >> 8) & 0x80) // S
-			| (regs.main.hl ? 0 : z80_flag::z) // Z
-			| ((regs.main.hl >> 8) & (z80_flag::r5 | z80_flag::r3)) // R3, R5
-			| ((((before & 0x0FFF) + (other & 0xFFF) + regs.main.f.c) & 0x1000) >> 8) // H
-			| ((same_sign(before, other) && !same_sign(before, regs.main.hl)) ? z80_flag::pv : 0) // P/V
-			| 0 // N
-			| ((((uint32_t)before + (uint32_t)other + (uint32_t)regs.main.f.c) >> 16) & 1); // C
+		set_flags_pending (lazy_adc16, before, other, regs.main.hl);
 		return true;
 	}
 
 	// ld (nn), bc/de/hl/sp
-	bool sim_ed43 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed43()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		uint16_t addr = decode_u16();
 		uint16_t val = regs.bc_de_hl_sp(hl_ix_iy::hl, i);
 		if (!memory->try_write_request(addr, val, cpu_time))
@@ -1138,38 +1495,40 @@ public:
 	}
 
 	// ld bc/de/hl/sp, (nn)
-	bool sim_ed4B (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed4B()
 	{
-		uint8_t i = (opcode >> 4) & 3;
+		constexpr uint8_t i = (opcode >> 4) & 3;
 		uint16_t addr = decode_u16();
 		uint16_t value;
 		if (!memory->try_read_request(addr, value, cpu_time))
 			return false;
 		regs.bc_de_hl_sp(hl_ix_iy::hl, i) = value;
-		if (i == 3)
+		if constexpr (i == 3)
 			_start_of_stack = value;
 		cpu_time += 20;
 		return true;
 	}
 
 	// reti
-	bool sim_ed4d (uint8_t ocode)
+	bool sim_ed4d()
 	{
 		// As far as I can tell, this instruction is different from the RET instruction only
 		// in hardware signaling. Code below does a simple RET.
 		cpu_time += 4;
-		return sim_c9(hl_ix_iy::hl, 0xc9);
+		return sim_c9();
 	}
 
 	// rrd/rld
-	bool sim_ed67 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_ed67()
 	{
-		bool is_rld = opcode & 8;
+		constexpr bool is_rld = opcode & 8;
 		uint8_t mem;
 		if (!memory->try_read_request(regs.main.hl, mem, cpu_time))
 			return false;
 		uint8_t new_a;
-		if (is_rld)
+		if constexpr (is_rld)
 		{
 			new_a = (regs.main.a & 0xF0) | (mem >> 4);
 			mem = (mem << 4) | (regs.main.a & 0x0F);
@@ -1188,7 +1547,8 @@ public:
 	}
 
 	// LDI/LDD/LDIR/LDDR
-	bool sim_eda0 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_eda0()
 	{
 		uint8_t data;
 		if (!memory->try_read_request(regs.main.hl, data, cpu_time))
@@ -1196,35 +1556,64 @@ public:
 		if (!memory->try_write_request(regs.main.de, data, cpu_time))
 			return false;
 
-		uint16_t increment = (opcode & 8) ? -1 : 1;
+		constexpr uint16_t increment = (opcode & 8) ? -1 : 1;
 		regs.main.hl += increment;
 		regs.main.de += increment;
 		regs.main.bc--;
 		cpu_time += 16;
-		regs.main.f.val = (regs.main.f.val & (z80_flag::s | z80_flag::z | z80_flag::c))
-			| (((data + regs.main.a) & 2) ? z80_flag::r5 : 0)
-			| (((data + regs.main.a) & 8) ? z80_flag::r3 : 0)
-			| (regs.main.bc ? z80_flag::pv : 0);
-		bool repeat = opcode & 0x10;
-		if (repeat && regs.main.bc)
+		set_ld_block_flags(data);
+		if constexpr ((opcode & 0x10) != 0) // repeat
 		{
-			regs.pc -= 2;
-			cpu_time += 5;
+			if (regs.main.bc)
+			{
+				regs.pc -= 2;
+				cpu_time += 5;
+				if (uint32_t count = block_iterations_allowed())
+					repeat_ld_block (opcode & 8, count);
+			}
 		}
 
 		return true;
 	}
 
+	void set_ld_block_flags (uint8_t data)
+	{
+		regs.main.f.val = (regs.main.f.val & (z80_flag::s | z80_flag::z | z80_flag::c))
+			| (((data + regs.main.a) & 2) ? z80_flag::r5 : 0)
+			| (((data + regs.main.a) & 8) ? z80_flag::r3 : 0)
+			| (regs.main.bc ? z80_flag::pv : 0);
+	}
+
 	// CPI/CPD/CPIR/CPDR
-	bool sim_eda1 (uint8_t opcode)
+	template<uint8_t opcode>
+	bool sim_eda1()
 	{
 		uint8_t memhl;
 		if (!memory->try_read_request(regs.main.hl, memhl, cpu_time))
 			return false;
 
-		uint16_t increment = (opcode & 8) ? -1 : 1;
+		constexpr uint16_t increment = (opcode & 8) ? -1 : 1;
 		regs.main.hl += increment;
 		regs.main.bc--;
+		set_cp_block_flags(memhl);
+		constexpr bool repeat = opcode & 0x10;
+		if (repeat && regs.main.bc && (regs.main.a != memhl))
+		{
+			cpu_time += 21;
+			regs.pc -= 2;
+			if (uint32_t count = block_iterations_allowed())
+				repeat_cp_block (opcode & 8, count);
+		}
+		else
+		{
+			cpu_time += 16;
+		}
+
+		return true;
+	}
+
+	void set_cp_block_flags (uint8_t memhl)
+	{
 		uint8_t diff = regs.main.a - memhl;
 		uint8_t hf = ((regs.main.a & 0xF) - (memhl & 0xF)) & 0x10; // H
 		uint8_t n = regs.main.a - memhl - (hf ? 1 : 0);
@@ -1236,22 +1625,25 @@ public:
 			| (regs.main.bc ? z80_flag::pv : 0) // P/V
 			| z80_flag::n
 			| (regs.main.f.val & z80_flag::c);
-		bool repeat = opcode & 0x10;
-		if (repeat && regs.main.bc && diff)
+	}
+
+	// INI/IND/INIR/INDR
+	template<uint8_t opcode>
+	bool sim_eda2()
+	{
+		if (!ini_ind(opcode))
+			return false;
+		constexpr bool repeat = opcode & 0x10;
+		if (repeat && regs.b())
 		{
-			cpu_time += 21;
 			regs.pc -= 2;
+			cpu_time += 5;
+			repeat_io_block (opcode, &cpu::ini_ind);
 		}
-		else
-		{
-			cpu_time += 16;
-		}
-
 		return true;
 	}
 
-	// INI/IND/INIR/INDR
-	bool sim_eda2 (uint8_t opcode)
+	bool ini_ind (uint8_t opcode)
 	{
 		uint8_t value;
 		if (!io->try_read_request (regs.main.bc, value, cpu_time))
@@ -1267,17 +1659,26 @@ public:
 			| z80_flag::n // N
 			| (regs.main.f.val & 1); // C
 		cpu_time += 16;
-		bool repeat = opcode & 0x10;
+		return true;
+	}
+
+	// OUTI/OUTD/OTIR/OTDR
+	template<uint8_t opcode>
+	bool sim_eda3()
+	{
+		if (!outi_outd(opcode))
+			return false;
+		constexpr bool repeat = opcode & 0x10;
 		if (repeat && regs.b())
 		{
 			regs.pc -= 2;
 			cpu_time += 5;
+			repeat_io_block (opcode, &cpu::outi_outd);
 		}
 		return true;
 	}
 
-	// OUTI/OUTD/OTIR/OTDR
-	bool sim_eda3 (uint8_t opcode)
+	bool outi_outd (uint8_t opcode)
 	{
 		uint8_t value;
 		if (!memory->try_read_request (regs.main.hl, value, cpu_time))
@@ -1293,143 +1694,313 @@ public:
 			| z80_flag::n // N
 			| (regs.main.f.val & 1); // C
 		cpu_time += 16;
-		bool repeat = opcode & 0x10;
-		if (repeat && regs.b())
-		{
-			regs.pc -= 2;
-			cpu_time += 5;
-		}
 		return true;
-
 	}
 
-	static constexpr ed_handler_t dispatch_ed[256] = {
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 00 - 07
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 08 - 0f
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 10 - 17
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 18 - 1f
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 20 - 27
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 28 - 2f
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 30 - 37
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 38 - 3f
-
-		&sim_ed40, &sim_ed41,  &sim_ed42, &sim_ed43, &sim_ed44, &sim_ed45, &sim_ed46, &sim_ed47, // 40 - 47
-		&sim_ed40, &sim_ed41,  &sim_ed4a, &sim_ed4B, nullptr,   &sim_ed4d, nullptr,   &sim_ed4f, // 48 - 4f
-		&sim_ed40, &sim_ed41,  &sim_ed42, &sim_ed43, nullptr,   nullptr,   &sim_ed56, &sim_ed57, // 50 - 57
-		&sim_ed40, &sim_ed41,  &sim_ed4a, &sim_ed4B, nullptr,   nullptr,   &sim_ed5e, &sim_ed57, // 58 - 5f
-		&sim_ed40, &sim_ed41,  &sim_ed42, &sim_ed43, nullptr,   nullptr,   nullptr,   &sim_ed67, // 60 - 67
-		&sim_ed40, &sim_ed41,  &sim_ed4a, &sim_ed4B, nullptr,   nullptr,   nullptr,   &sim_ed67, // 68 - 6f
-		nullptr,   &sim_ed41,  &sim_ed42, &sim_ed43, nullptr,   nullptr,   nullptr,   nullptr,   // 70 - 77
-		&sim_ed40, &sim_ed41,  &sim_ed4a, &sim_ed4B, nullptr,   nullptr,   nullptr,   nullptr,   // 78 - 7f
-
-		nullptr,     nullptr,   nullptr,   nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 80 - 87
-		nullptr,     nullptr,   nullptr,   nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 88 - 8f
-		nullptr,     nullptr,   nullptr,   nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 90 - 97
-		nullptr,     nullptr,   nullptr,   nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // 98 - 9f
-		&sim_eda0, &sim_eda1, &sim_eda2, &sim_eda3,  nullptr,  nullptr,  nullptr,  nullptr,  // a0 - a7
-		&sim_eda0, &sim_eda1, &sim_eda2, &sim_eda3,  nullptr,  nullptr,  nullptr,  nullptr,  // a8 - af
-		&sim_eda0, &sim_eda1, &sim_eda2, &sim_eda3,  nullptr,  nullptr,  nullptr,  nullptr,  // b0 - b7
-		&sim_eda0, &sim_eda1, &sim_eda2, &sim_eda3,  nullptr,  nullptr,  nullptr,  nullptr,  // b8 - bf
-
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // c0 - c7
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // c8 - cf
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // d0 - d7
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // d8 - df
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // e0 - e7
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // e8 - ef
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // f0 - f7
-		nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  nullptr,  // f8 - ff
-	};
-	#pragma endregion
+	#pragma region Block instructions in bulk
+	// A repeating block instruction executes one iteration per dispatch, and moves PC back to itself
+	// if there are more. When nothing could observe the iterations in between, the handlers run the next
+	// ones in the same call: LDIR/LDDR as memmove / byte-fill runs on mapped pages, CPIR/CPDR as a scan
+	// of mapped pages, and INIR/INDR/OTIR/OTDR as a loop of bus requests. They leave the registers, flags,
+	// R and cpu_time exactly as that many dispatches would.
 
-	#pragma region CB group
-	static void do_cb_rotate_shift_operation (uint8_t& before, uint8_t& after, uint8_t& c, uint8_t opcode)
+	// Returns how many more iterations of the repeating block instruction at PC may run in this call.
+	// None while tracing, when there's a code breakpoint at PC, or while an EI is about to enable interrupts.
+	// Otherwise, those that start before _simulate_until_time and before an interrupt could be accepted.
+	uint32_t block_iterations_allowed() const
 	{
-		switch(opcode & 0x38)
-		{
-			case 0: // RLC
-				after = (before << 1) | (before >> 7);
-				c = before >> 7;
-				break;
-			case 8: // RRC
-				after = (before >> 1) | (before << 7);
-				c = before & 1;
-				break;
-			case 0x10: // RL
-				after = (before << 1) | c;
-				c = before >> 7;
-				break;
-			case 0x18: // RR
-				after = (before >> 1) | (c << 7);
-				c = before & 1;
-				break;
-			case 0x20: // SLA
-				after = before << 1;
-				c = before >> 7;
-				break;
-			case 0x28: // SRA
-				after = (uint8_t)((int8_t)before >> 1);
-				c = before & 1;
-				break;
-			case 0x30: // SLL (undocumented)
-				after = (before << 1) | 1;
-				c = before >> 7;
-				break;
-			case 0x38: // SRL
-				after = before >> 1;
-				c = before & 1;
-				break;
-			default:
-				FAIL_FAST();
-		}
+		if (_trace_capacity || _trace_writer || _ei_countdown)
+			return 0;
+
+		if (code_bps_bitmap[regs.pc >> 3] & (1 << (regs.pc & 7)))
+			return 0;
+
+		UINT64 limit = std::min(_simulate_until_time, earliest_irq_time());
+		if (limit <= cpu_time)
+			return 0;
+
+		// Iterations that repeat take 21 cycles each.
+		return (uint32_t)std::min<UINT64>((limit - cpu_time + 20) / 21, UINT32_MAX);
 	}
 
-	// rlc/rrc/rl/rr/sla/sra/sll/srl r8
-	bool sim_cb00 (hl_ix_iy xy, uint16_t memhlxy_addr, uint8_t opcode)
+	// Returns the earliest time at which the CPU could accept an interrupt, or UINT64_MAX if never.
+	UINT64 earliest_irq_time() const
 	{
-		uint8_t i = opcode & 7;
-		uint8_t before, after;
-		uint8_t c = regs.main.f.c;
-		if (i != 6)
-		{
-			// Let's not bother with the undocumented instructions from DDCB and FDCB.
-			before = regs.r8(i, hl_ix_iy::hl);
-			do_cb_rotate_shift_operation(before, after, c, opcode);
-			regs.r8(i, hl_ix_iy::hl) = after;
-			cpu_time += ((xy == hl_ix_iy::hl) ? 8 : 23);
-		}
-		else
+		return regs.iff1 ? _irq_deadline : UINT64_MAX;
+	}
+
+	// Called with PC on the instruction after an iteration that repeats.
+	void finish_block_iterations (uint32_t done, bool repeats)
+	{
+		regs.r = (regs.r & 0x80) | ((regs.r + 2 * done) & 0x7f);
+		if (!repeats)
 		{
-			if (!memory->try_read_request(memhlxy_addr, before, cpu_time))
-				return false;
-			do_cb_rotate_shift_operation(before, after, c, opcode);
-			if (!memory->try_write_request(memhlxy_addr, after, cpu_time))
-				return false;
-			cpu_time += ((xy == hl_ix_iy::hl) ? 15 : 23);
+			// The last iteration took 16 cycles, not 21, and didn't move PC back.
+			regs.pc += 2;
+			cpu_time -= 5;
 		}
-
-		regs.main.f.val = s_z_pv_flags.flags[after] | c;
-		return true;
 	}
 
-	// bit b, r8
-	bool sim_cb40 (hl_ix_iy xy, uint16_t memhlxy_addr, uint8_t opcode)
+	void repeat_ld_block (bool decrement, uint32_t count)
 	{
-		uint8_t reg = opcode & 7;
-		uint8_t mask = 1 << ((opcode >> 3) & 7);
-		uint8_t value;
-
-		if (xy == hl_ix_iy::hl)
+		uint32_t done = 0;
+		uint8_t data = 0;
+		while (count && regs.main.bc)
 		{
-			if (reg != 6)
+			auto& src_page = memory->pages[regs.main.hl >> Bus::page_shift];
+			auto& dst_page = memory->pages[regs.main.de >> Bus::page_shift];
+			if (!src_page.read || !dst_page.write || src_page.watch || dst_page.watch)
+				break;
+
+			// The run of bytes that stays within both pages.
+			uint32_t src_offset = regs.main.hl & (Bus::page_size - 1);
+			uint32_t dst_offset = regs.main.de & (Bus::page_size - 1);
+			uint32_t run = decrement ? (std::min(src_offset, dst_offset) + 1) : (Bus::page_size - std::max(src_offset, dst_offset));
+			run = std::min({ run, count, (uint32_t)regs.main.bc });
+			uint32_t unclipped_run = run;
+			run = clip_run_at_instruction (regs.main.de, decrement, run);
+
+			const uint8_t* src = src_page.read + src_offset - (decrement ? run - 1 : 0);
+			uint8_t* dst = dst_page.write + dst_offset - (decrement ? run - 1 : 0);
+			bool overlaps = decrement ? ((uintptr_t)dst < (uintptr_t)src) && ((uintptr_t)dst + run > (uintptr_t)src)
+				: ((uintptr_t)dst > (uintptr_t)src) && ((uintptr_t)dst < (uintptr_t)src + run);
+			if (!overlaps)
+				memmove (dst, src, run);
+			else if (decrement)
 			{
-				value = regs.r8(reg, hl_ix_iy::hl);
-				cpu_time += 8;
+				// Copying downwards onto bytes not yet read repeats a pattern, as LDDR does.
+				for (uint32_t i = run; i--; )
+					dst[i] = src[i];
 			}
 			else
 			{
-				if (!memory->try_read_request(memhlxy_addr, value, cpu_time))
-					return false;
+				// Same for copying upwards (the usual fill with LD (HL), n / LDIR with DE = HL + 1).
+				for (uint32_t i = 0; i < run; i++)
+					dst[i] = src[i];
+			}
+
+			data = decrement ? dst[0] : dst[run - 1];
+			dst_page.code_written = 1;
+			memory->write_count += run;
+			uint16_t delta = decrement ? (uint16_t)-(int32_t)run : (uint16_t)run;
+			regs.main.hl += delta;
+			regs.main.de += delta;
+			regs.main.bc -= (uint16_t)run;
+			cpu_time += 21 * run;
+			count -= run;
+			done += run;
+			if (run < unclipped_run)
+				break;
+		}
+
+		if (done)
+		{
+			set_ld_block_flags(data);
+			finish_block_iterations (done, regs.main.bc != 0);
+		}
+	}
+
+	// A run that writes over the block instruction itself must end there, and the bulk with it:
+	// the next iteration has to be fetched again.
+	uint32_t clip_run_at_instruction (uint16_t dst, bool decrement, uint32_t run) const
+	{
+		for (uint16_t address : { regs.pc, (uint16_t)(regs.pc + 1) })
+		{
+			uint16_t offset = decrement ? (uint16_t)(dst - address) : (uint16_t)(address - dst);
+			if (offset < run)
+				run = offset + 1u;
+		}
+
+		return run;
+	}
+
+	void repeat_cp_block (bool decrement, uint32_t count)
+	{
+		uint32_t done = 0;
+		uint8_t memhl = 0;
+		bool found = false;
+		while (count && regs.main.bc && !found)
+		{
+			auto& page = memory->pages[regs.main.hl >> Bus::page_shift];
+			if (!page.read || page.watch)
+				break;
+
+			uint32_t offset = regs.main.hl & (Bus::page_size - 1);
+			uint32_t run = decrement ? (offset + 1) : (Bus::page_size - offset);
+			run = std::min({ run, count, (uint32_t)regs.main.bc });
+
+			const uint8_t* p = page.read + offset;
+			uint32_t i = 0;
+			while ((i < run) && !found)
+			{
+				memhl = decrement ? *(p - i) : p[i];
+				found = (memhl == regs.main.a);
+				i++;
+			}
+
+			regs.main.hl += decrement ? (uint16_t)-(int32_t)i : (uint16_t)i;
+			regs.main.bc -= (uint16_t)i;
+			cpu_time += 21 * i;
+			count -= i;
+			done += i;
+		}
+
+		if (done)
+		{
+			set_cp_block_flags(memhl);
+			finish_block_iterations (done, regs.main.bc && !found);
+		}
+	}
+
+	// Bus requests for I/O can stall; the iteration that stalls is left for the next dispatch.
+	void repeat_io_block (uint8_t opcode, bool (cpu::*iteration)(uint8_t))
+	{
+		uint32_t count = block_iterations_allowed();
+		uint32_t done = 0;
+		while (count && regs.b())
+		{
+			uint16_t hl = regs.main.hl;
+			if (!(this->*iteration)(opcode))
+				break;
+			cpu_time += 5;
+			count--;
+			done++;
+
+			// Stop after writing over the instruction itself, or after hitting a data breakpoint.
+			if ((uint16_t)(hl - regs.pc) < 2)
+				break;
+			if (_data_bps_hit && _data_bps_hit->size)
+				break;
+		}
+
+		if (done)
+			finish_block_iterations (done, regs.b() != 0);
+	}
+	#pragma endregion
+
+	// The handler of an opcode after ED; null for those with no instruction, which execute as two NOPs of sorts.
+	template<uint8_t opcode>
+	static constexpr handler_t ed_handler()
+	{
+		if constexpr (opcode == 0x70) return nullptr; // in (c) (undocumented)
+		else if constexpr ((opcode & 0xC7) == 0x40) return &cpu::sim_ed40<opcode>;
+		else if constexpr ((opcode & 0xC7) == 0x41) return &cpu::sim_ed41<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0x42) return &cpu::sim_ed42<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0x4A) return &cpu::sim_ed4a<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0x43) return &cpu::sim_ed43<opcode>;
+		else if constexpr ((opcode & 0xCF) == 0x4B) return &cpu::sim_ed4B<opcode>;
+		else if constexpr (opcode == 0x44) return &cpu::sim_ed44;
+		else if constexpr (opcode == 0x45) return &cpu::sim_ed45;
+		else if constexpr (opcode == 0x46) return &cpu::sim_ed46;
+		else if constexpr (opcode == 0x47) return &cpu::sim_ed47;
+		else if constexpr (opcode == 0x4D) return &cpu::sim_ed4d;
+		else if constexpr (opcode == 0x4F) return &cpu::sim_ed4f;
+		else if constexpr (opcode == 0x56) return &cpu::sim_ed56;
+		else if constexpr ((opcode & 0xF7) == 0x57) return &cpu::sim_ed57<opcode>;
+		else if constexpr (opcode == 0x5E) return &cpu::sim_ed5e;
+		else if constexpr ((opcode & 0xF7) == 0x67) return &cpu::sim_ed67<opcode>;
+		else if constexpr ((opcode & 0xE7) == 0xA0) return &cpu::sim_eda0<opcode>;
+		else if constexpr ((opcode & 0xE7) == 0xA1) return &cpu::sim_eda1<opcode>;
+		else if constexpr ((opcode & 0xE7) == 0xA2) return &cpu::sim_eda2<opcode>;
+		else if constexpr ((opcode & 0xE7) == 0xA3) return &cpu::sim_eda3<opcode>;
+		else return nullptr;
+	}
+	#pragma endregion
+
+	#pragma region CB group
+	template<uint8_t operation>
+	static void do_cb_rotate_shift_operation (uint8_t& before, uint8_t& after, uint8_t& c)
+	{
+		if constexpr (operation == 0) // RLC
+		{
+			after = (before << 1) | (before >> 7);
+			c = before >> 7;
+		}
+		else if constexpr (operation == 8) // RRC
+		{
+			after = (before >> 1) | (before << 7);
+			c = before & 1;
+		}
+		else if constexpr (operation == 0x10) // RL
+		{
+			after = (before << 1) | c;
+			c = before >> 7;
+		}
+		else if constexpr (operation == 0x18) // RR
+		{
+			after = (before >> 1) | (c << 7);
+			c = before & 1;
+		}
+		else if constexpr (operation == 0x20) // SLA
+		{
+			after = before << 1;
+			c = before >> 7;
+		}
+		else if constexpr (operation == 0x28) // SRA
+		{
+			after = (uint8_t)((int8_t)before >> 1);
+			c = before & 1;
+		}
+		else if constexpr (operation == 0x30) // SLL (undocumented)
+		{
+			after = (before << 1) | 1;
+			c = before >> 7;
+		}
+		else // SRL
+		{
+			after = before >> 1;
+			c = before & 1;
+		}
+	}
+
+	// rlc/rrc/rl/rr/sla/sra/sll/srl r8
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_cb00 (uint16_t memhlxy_addr)
+	{
+		constexpr uint8_t i = opcode & 7;
+		uint8_t before, after;
+		uint8_t c = regs.main.f.c;
+		if constexpr (i != 6)
+		{
+			// Let's not bother with the undocumented instructions from DDCB and FDCB.
+			before = regs.r8(i, hl_ix_iy::hl);
+			do_cb_rotate_shift_operation<opcode & 0x38>(before, after, c);
+			regs.r8(i, hl_ix_iy::hl) = after;
+			cpu_time += ((xy == hl_ix_iy::hl) ? 8 : 23);
+		}
+		else
+		{
+			if (!memory->try_read_request(memhlxy_addr, before, cpu_time))
+				return false;
+			do_cb_rotate_shift_operation<opcode & 0x38>(before, after, c);
+			if (!memory->try_write_request(memhlxy_addr, after, cpu_time))
+				return false;
+			cpu_time += ((xy == hl_ix_iy::hl) ? 15 : 23);
+		}
+
+		set_flags_pending (lazy_rotate_shift, before, c, after);
+		return true;
+	}
+
+	// bit b, r8
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_cb40 (uint16_t memhlxy_addr)
+	{
+		constexpr uint8_t reg = opcode & 7;
+		constexpr uint8_t mask = 1 << ((opcode >> 3) & 7);
+		uint8_t value;
+
+		if constexpr (xy == hl_ix_iy::hl)
+		{
+			if constexpr (reg != 6)
+			{
+				value = regs.r8(reg, hl_ix_iy::hl);
+				cpu_time += 8;
+			}
+			else
+			{
+				if (!memory->try_read_request(memhlxy_addr, value, cpu_time))
+					return false;
 				cpu_time += 12;
 			}
 		}
@@ -1445,16 +2016,17 @@ public:
 	}
 
 	// res/set b, r8
-	bool sim_cb80 (hl_ix_iy xy, uint16_t memhlxy_addr, uint8_t opcode)
+	template<hl_ix_iy xy, uint8_t opcode>
+	bool sim_cb80 (uint16_t memhlxy_addr)
 	{
 		// Let's not bother with the undocumented instructions from DDCB and FDCB.
 
-		uint8_t reg = opcode & 7;
-		uint8_t bit = (opcode >> 3) & 7;
-		if (reg != 6)
+		constexpr uint8_t reg = opcode & 7;
+		constexpr uint8_t bit = (opcode >> 3) & 7;
+		if constexpr (reg != 6)
 		{
 			// Let's not bother with the undocumented instructions from DDCB and FDCB.
-			if (opcode & 0x40)
+			if constexpr ((opcode & 0x40) != 0)
 				regs.r8(reg, hl_ix_iy::hl) |= (1 << bit);
 			else
 				regs.r8(reg, hl_ix_iy::hl) &= ~(1 << bit);
@@ -1465,7 +2037,7 @@ public:
 			uint8_t value;
 			if (!memory->try_read_request(memhlxy_addr, value, cpu_time))
 				return false;
-			if (opcode & 0x40)
+			if constexpr ((opcode & 0x40) != 0)
 				value |= (1 << bit);
 			else
 				value &= ~(1 << bit);
@@ -1479,67 +2051,606 @@ public:
 	}
 	#pragma endregion
 
-	virtual bool SimulateOne (BreakpointsHit* bps) override
+	#pragma region Specialized dispatch tables
+	// The handlers take the prefix and the opcode as template arguments, so the register indexes, timings
+	// and operations they decode from them fold away at compile time. main_handler, ed_handler and cb_handler
+	// pick the instantiation for each prefix and opcode; the tables below hold them all, for the dispatch
+	// of fetched instructions. The tables are defined after the class.
+	template<typename handler_type>
+	struct dispatch_table
 	{
-		if (bps)
-			bps->size = 0;
+		handler_type handlers[256];
+	};
 
-		if (regs.iff1)
+	static const dispatch_table<handler_t>    dispatch_xy[3]; // indexed by hl_ix_iy
+	static const dispatch_table<handler_t>    dispatch_ed;
+	static const dispatch_table<cb_handler_t> dispatch_cb_xy[3]; // CB, DDCB, FDCB
+
+	template<hl_ix_iy xy, uint8_t opcode>
+	static constexpr cb_handler_t cb_handler()
+	{
+		if constexpr ((opcode & 0xC0) == 0x00)
+			return &cpu::sim_cb00<xy, opcode>;
+		else if constexpr ((opcode & 0xC0) == 0x40)
+			return &cpu::sim_cb40<xy, opcode>;
+		else
+			return &cpu::sim_cb80<xy, opcode>;
+	}
+
+	template<hl_ix_iy xy, size_t... opcodes>
+	static constexpr dispatch_table<handler_t> make_dispatch (std::index_sequence<opcodes...>)
+	{
+		return { { main_handler<xy, (uint8_t)opcodes>()... } };
+	}
+
+	template<size_t... opcodes>
+	static constexpr dispatch_table<handler_t> make_dispatch_ed (std::index_sequence<opcodes...>)
+	{
+		return { { ed_handler<(uint8_t)opcodes>()... } };
+	}
+
+	template<hl_ix_iy xy, size_t... opcodes>
+	static constexpr dispatch_table<cb_handler_t> make_dispatch_cb (std::index_sequence<opcodes...>)
+	{
+		return { { cb_handler<xy, (uint8_t)opcodes>()... } };
+	}
+
+	// Routines for decoded instructions. Each one does all the work of executing its instruction, with the
+	// prefix length, the R increment and whether pending flags are needed known at compile time, so that
+	// running decoded code costs one indirect call per instruction and no decoding at all.
+	static const dispatch_table<threaded_t> threaded_xy[3]; // indexed by hl_ix_iy
+	static const dispatch_table<threaded_t> threaded_ed;
+	static const dispatch_table<threaded_t> threaded_cb[3];
+
+	template<hl_ix_iy xy, uint8_t opcode>
+	static bool threaded_routine (cpu& c, const decoded_instruction& d)
+	{
+		constexpr uint8_t prefix_length = (xy == hl_ix_iy::hl) ? 1 : 2;
+		if constexpr (!flags_neutral.opcodes[opcode])
+			c.materialize_flags();
+		uint16_t oldpc = c.regs.pc;
+		uint8_t oldr = c.regs.r;
+		c.regs.pc += prefix_length;
+		c.regs.r = (oldr & 0x80) | ((oldr + prefix_length) & 0x7f);
+		c._operands = &d.bytes[prefix_length];
+		bool executed = (c.*main_handler<xy, opcode>())();
+		c._operands = nullptr;
+		if (!c.complete_instruction(executed, oldpc, oldr))
+			return false;
+		return continue_threaded(c, oldpc);
+	}
+
+	template<uint8_t opcode>
+	static bool threaded_routine_ed (cpu& c, const decoded_instruction& d)
+	{
+		c.materialize_flags();
+		uint16_t oldpc = c.regs.pc;
+		uint8_t oldr = c.regs.r;
+		c.regs.pc += 2;
+		c.regs.r = (oldr & 0x80) | ((oldr + 2) & 0x7f);
+		c._operands = &d.bytes[2];
+		bool executed = (c.*ed_handler<opcode>())();
+		c._operands = nullptr;
+		if (!c.complete_instruction(executed, oldpc, oldr))
+			return false;
+		return continue_threaded(c, oldpc);
+	}
+
+	// ED followed by an opcode with no instruction: two NOPs of sorts.
+	static bool threaded_routine_ed_nop (cpu& c, const decoded_instruction&)
+	{
+		uint16_t oldpc = c.regs.pc;
+		c.regs.pc += 2;
+		c.regs.r = (c.regs.r & 0x80) | ((c.regs.r + 2) & 0x7f);
+		c.cpu_time += 8;
+		return continue_threaded(c, oldpc);
+	}
+
+	template<hl_ix_iy xy, uint8_t opcode>
+	static bool threaded_routine_cb (cpu& c, const decoded_instruction& d)
+	{
+		c.materialize_flags();
+		uint16_t oldpc = c.regs.pc;
+		uint8_t oldr = c.regs.r;
+		uint16_t memhlxy_addr;
+		if constexpr (xy == hl_ix_iy::hl)
 		{
-			bool interrupted;
-			uint8_t irq_address;
-			if (!irq->try_poll_irq_at_time_point(interrupted, irq_address, cpu_time))
-				return false;
+			c.regs.pc += 2;
+			memhlxy_addr = c.regs.main.hl;
+		}
+		else
+		{
+			c.regs.pc += 4;
+			memhlxy_addr = ((xy == hl_ix_iy::ix) ? c.regs.ix : c.regs.iy) + (uint16_t)(int16_t)d.disp;
+		}
+		c.regs.r = (oldr & 0x80) | ((oldr + 2) & 0x7f);
+		bool executed = (c.*cb_handler<xy, opcode>())(memhlxy_addr);
+		if (!c.complete_instruction(executed, oldpc, oldr))
+			return false;
+		return continue_threaded(c, oldpc);
+	}
+
+	// Called by a routine for a decoded instruction, as its last action, after executing the instruction at "oldpc".
+	// Goes on to the routine for the next instruction if the loop of SimulateUntil would do nothing but call it:
+	// that instruction is decoded and current, and the CPU is not halted, not at the head of a possible idle loop,
+	// and before both the requested time and the earliest interrupt. Each routine then has its own indirect jump
+	// to the next one, which the branch predictor learns far better than the single call in the loop.
+	// A stall further on returns false, as if the first instruction stalled; the loop returns Stalled either way.
+	static __forceinline bool continue_threaded (cpu& c, uint16_t oldpc)
+	{
+		if (!c._threaded_chain || c.regs.halted || ((uint16_t)(oldpc - c.regs.pc) < idle_loop_max_size)
+			|| (c.cpu_time >= std::min(c._simulate_until_time, c.earliest_irq_time())))
+		{
+			c._threaded_last_pc = oldpc;
+			return true;
+		}
+
+		const MemoryPage& page = c.memory->pages[c.regs.pc >> Bus::page_shift];
+		const decoded_instruction* d = c.decoded_entry();
+		if (!d || !c.is_current(page, *d))
+		{
+			c._threaded_last_pc = oldpc;
+			return true;
+		}
+
+		c._threaded_chain--;
+		return d->exec(c, *d);
+	}
+
+	template<hl_ix_iy xy, size_t... opcodes>
+	static constexpr dispatch_table<threaded_t> make_threaded (std::index_sequence<opcodes...>)
+	{
+		return { { make_threaded_routine<xy, (uint8_t)opcodes>()... } };
+	}
 
-			if (interrupted)
+	template<hl_ix_iy xy, uint8_t opcode>
+	static constexpr threaded_t make_threaded_routine()
+	{
+		if constexpr (main_handler<xy, opcode>() == nullptr)
+			return nullptr; // prefixes
+		else
+			return &cpu::threaded_routine<xy, opcode>;
+	}
+
+	template<size_t... opcodes>
+	static constexpr dispatch_table<threaded_t> make_threaded_ed (std::index_sequence<opcodes...>)
+	{
+		return { { make_threaded_routine_ed<(uint8_t)opcodes>()... } };
+	}
+
+	template<uint8_t opcode>
+	static constexpr threaded_t make_threaded_routine_ed()
+	{
+		if constexpr (ed_handler<opcode>() == nullptr)
+			return &cpu::threaded_routine_ed_nop;
+		else
+			return &cpu::threaded_routine_ed<opcode>;
+	}
+
+	template<hl_ix_iy xy, size_t... opcodes>
+	static constexpr dispatch_table<threaded_t> make_threaded_cb (std::index_sequence<opcodes...>)
+	{
+		return { { &cpu::threaded_routine_cb<xy, (uint8_t)opcodes>... } };
+	}
+	#pragma endregion
+
+	// Returns false if some interrupting device lags behind the CPU, or if the CPU needs to
+	// access memory at a time point the memory device hasn't yet reached. Returns true otherwise,
+	// with "accepted" telling whether the CPU jumped to an interrupt routine.
+	bool try_accept_irq (bool& accepted)
+	{
+		accepted = false;
+
+		// No interrupt can come before the deadline, so there's nothing to poll.
+		if (cpu_time < _irq_deadline)
+			return true;
+
+		bool interrupted;
+		uint8_t irq_address;
+		if (!irq->try_poll_irq_at_time_point(interrupted, irq_address, cpu_time))
+			return false;
+
+		_irq_deadline = irq->next_irq_time();
+
+		if (interrupted)
+		{
+			regs.halted = false;
+
+			if (regs.im == 0 || regs.im == 1)
 			{
-				regs.halted = false;
+				if (!memory->try_write_request (regs.sp - 2, regs.pc, cpu_time))
+					return false;
+				regs.sp -= 2;
+				regs.pc = 0x38;
+				regs.iff1 = false;
+				cpu_time += 13;
+			}
+			else
+			{
+				uint16_t addr = (regs.i << 8) | (irq_address & 0xFE);
+				if (!memory->try_read_request (addr, addr, cpu_time))
+					return false;
+				if (!memory->try_write_request (regs.sp - 2, regs.pc, cpu_time))
+					return false;
+				regs.sp -= 2;
+				regs.pc = addr;
+				regs.iff1 = false;
+				cpu_time += 19;
+			}
+
+			accepted = true;
+		}
+
+		return true;
+	}
+
+	bool check_code_bps (BreakpointsHit* bps)
+	{
+		if (!(code_bps_bitmap[regs.pc >> 3] & (1 << (regs.pc & 7))))
+			return false;
+
+		if ((cpu_time == _bps_counted_time) && (regs.pc == _bps_counted_pc))
+			return false;
+
+		auto it = code_bps.find(regs.pc);
+		WI_ASSERT(it != code_bps.end());
+
+		bps->size = 0;
+		for (auto& bp : it->second)
+		{
+			if (!bp.condition.empty() && !evaluate_condition(bp.condition))
+				continue;
+
+			bp.hit_count++;
+			if (!pass_count_satisfied(bp))
+				continue;
+
+			if (bp.tracepoint)
+				record_tracepoint(bp);
+			else if (bps->size < _countof(bps->bps))
+				bps->bps[bps->size++] = bp.cookie;
+		}
+
+		if (!bps->size)
+		{
+			_bps_counted_pc = regs.pc;
+			_bps_counted_time = cpu_time;
+			return false;
+		}
+
+		bps->type = BreakpointType::Code;
+		bps->address = regs.pc;
+		return true;
+	}
+
+	static bool pass_count_satisfied (const code_bp& bp)
+	{
+		switch (bp.pass_count_style)
+		{
+			case BreakpointPassCountStyle::Equal:          return bp.hit_count == bp.pass_count;
+			case BreakpointPassCountStyle::EqualOrGreater: return bp.hit_count >= bp.pass_count;
+			case BreakpointPassCountStyle::Mod:            return (bp.hit_count % bp.pass_count) == 0;
+			default:                                       return true;
+		}
+	}
+
+	void record_tracepoint (const code_bp& bp)
+	{
+		if (!_tracepoint_handler.OnTracepointHit)
+			return;
+
+		TracepointHit hit;
+		hit.cookie = bp.cookie;
+		hit.address = regs.pc;
+		hit.time = cpu_time;
+		int32_t stack[condition_stack_size];
+		hit.value_count = (uint8_t)run_program(bp.trace_values, stack);
+		for (uint32_t i = 0; i < hit.value_count; i++)
+			hit.values[i] = stack[i];
+		_tracepoint_handler.OnTracepointHit(_tracepoint_handler.Context, hit);
+	}
+
+	#pragma region Breakpoint programs
+	// Conditions and tracepoint values are programs for the stack machine described at BreakpointConditionOp.
+	static constexpr uint32_t condition_stack_size = 16;
 
-				if (regs.im == 0 || regs.im == 1)
+	uint16_t reg8 (z80_reg8 r) const
+	{
+		switch (r)
+		{
+			case z80_reg8::b:     return regs.main.bc >> 8;
+			case z80_reg8::c:     return regs.main.bc & 0xFF;
+			case z80_reg8::d:     return regs.main.de >> 8;
+			case z80_reg8::e:     return regs.main.de & 0xFF;
+			case z80_reg8::h:     return regs.main.hl >> 8;
+			case z80_reg8::l:     return regs.main.hl & 0xFF;
+			case z80_reg8::a:     return regs.main.a;
+			case z80_reg8::f:     return regs.main.f.val;
+			case z80_reg8::alt_b: return regs.alt.bc >> 8;
+			case z80_reg8::alt_c: return regs.alt.bc & 0xFF;
+			case z80_reg8::alt_d: return regs.alt.de >> 8;
+			case z80_reg8::alt_e: return regs.alt.de & 0xFF;
+			case z80_reg8::alt_h: return regs.alt.hl >> 8;
+			case z80_reg8::alt_l: return regs.alt.hl & 0xFF;
+			case z80_reg8::alt_a: return regs.alt.a;
+			case z80_reg8::alt_f: return regs.alt.f.val;
+			case z80_reg8::i:     return regs.i;
+			case z80_reg8::r:     return regs.r;
+			default:              FAIL_FAST();
+		}
+	}
+
+	// Checks that a program is well formed, so that run_program need not check anything.
+	// Returns in "depth" the number of values the program leaves on the stack.
+	static bool validate_program (const uint8_t* code, uint32_t size, uint32_t& depth)
+	{
+		depth = 0;
+		uint32_t i = 0;
+		while (i < size)
+		{
+			auto op = (BreakpointConditionOp)code[i++];
+			switch (op)
+			{
+				case BreakpointConditionOp::PushConst:
+					if ((size - i < 2) || (depth == condition_stack_size))
+						return false;
+					i += 2;
+					depth++;
+					break;
+
+				case BreakpointConditionOp::PushReg8:
+				case BreakpointConditionOp::PushReg16:
 				{
-					if (!memory->try_write_request (regs.sp - 2, regs.pc, cpu_time))
+					auto count = (op == BreakpointConditionOp::PushReg8) ? (uint8_t)z80_reg8::count : (uint8_t)z80_reg16::count;
+					if ((i == size) || (code[i] >= count) || (depth == condition_stack_size))
 						return false;
-					regs.sp -= 2;
-					regs.pc = 0x38;
-					regs.iff1 = false;
-					cpu_time += 13;
-					return true;
+					i++;
+					depth++;
+					break;
 				}
-				else
-				{
-					uint16_t addr = (regs.i << 8) | (irq_address & 0xFE);
-					if (!memory->try_read_request (addr, addr, cpu_time))
+
+				case BreakpointConditionOp::ReadMem8:
+				case BreakpointConditionOp::Neg:
+				case BreakpointConditionOp::Not:
+				case BreakpointConditionOp::Compl:
+					if (depth < 1)
+						return false;
+					break;
+
+				default:
+					if (op > BreakpointConditionOp::LogicalOr)
 						return false;
-					if (!memory->try_write_request (regs.sp - 2, regs.pc, cpu_time))
+					if (depth < 2)
 						return false;
-					regs.sp -= 2;
-					regs.pc = addr;
-					regs.iff1 = false;
-					cpu_time += 19;
-					return true;
+					depth--;
+					break;
+			}
+		}
+
+		return true;
+	}
+
+	// Returns the number of values left on the stack.
+	uint32_t run_program (const vector_nothrow<uint8_t>& program, int32_t (&stack)[condition_stack_size])
+	{
+		// Memory reads done by the program must not trigger data breakpoints.
+		auto data_bps_hit = std::exchange(_data_bps_hit, nullptr);
+		auto restore_data_bps_hit = wil::scope_exit([this, data_bps_hit] { _data_bps_hit = data_bps_hit; });
+
+		// The program may read F.
+		materialize_flags();
+
+		uint32_t sp = 0;
+		const uint8_t* code = program.data();
+		const uint8_t* end = code + program.size();
+		while (code < end)
+		{
+			auto op = (BreakpointConditionOp)*code++;
+			switch (op)
+			{
+				case BreakpointConditionOp::PushConst: stack[sp++] = code[0] | (code[1] << 8); code += 2; break;
+				case BreakpointConditionOp::PushReg8:  stack[sp++] = reg8((z80_reg8)*code++); break;
+				case BreakpointConditionOp::PushReg16: stack[sp++] = regs.reg((z80_reg16)*code++); break;
+				case BreakpointConditionOp::ReadMem8:  stack[sp - 1] = memory->read((uint16_t)stack[sp - 1]); break;
+				case BreakpointConditionOp::Neg:       stack[sp - 1] = -stack[sp - 1]; break;
+				case BreakpointConditionOp::Not:       stack[sp - 1] = !stack[sp - 1]; break;
+				case BreakpointConditionOp::Compl:     stack[sp - 1] = ~stack[sp - 1]; break;
+				default:
+				{
+					int32_t b = stack[--sp];
+					int32_t& a = stack[sp - 1];
+					switch (op)
+					{
+						case BreakpointConditionOp::Add:        a = a + b; break;
+						case BreakpointConditionOp::Sub:        a = a - b; break;
+						case BreakpointConditionOp::And:        a = a & b; break;
+						case BreakpointConditionOp::Or:         a = a | b; break;
+						case BreakpointConditionOp::Xor:        a = a ^ b; break;
+						case BreakpointConditionOp::Eq:         a = a == b; break;
+						case BreakpointConditionOp::Ne:         a = a != b; break;
+						case BreakpointConditionOp::Lt:         a = a < b; break;
+						case BreakpointConditionOp::Le:         a = a <= b; break;
+						case BreakpointConditionOp::Gt:         a = a > b; break;
+						case BreakpointConditionOp::Ge:         a = a >= b; break;
+						case BreakpointConditionOp::LogicalAnd: a = a && b; break;
+						case BreakpointConditionOp::LogicalOr:  a = a || b; break;
+						default: FAIL_FAST();
+					}
+					break;
 				}
 			}
 		}
 
+		return sp;
+	}
+
+	bool evaluate_condition (const vector_nothrow<uint8_t>& condition)
+	{
+		int32_t stack[condition_stack_size];
+		// SetBreakpointCondition checked that the program leaves exactly one value.
+		run_program(condition, stack);
+		return stack[0] != 0;
+	}
+	#pragma endregion
+
+	// Executes the instruction at PC, or spends 4 cycles if the CPU is halted.
+	// Returns false (and leaves the CPU unchanged) if the instruction couldn't be executed
+	// because some device lags behind the CPU.
+	bool try_execute_one()
+	{
 		if (regs.halted)
 		{
-			cpu_time += 4;
-			regs.r = (regs.r & 0x80) | ((regs.r + 1) & 0x7f);
+			uint32_t steps = halted_steps_allowed();
+			cpu_time += 4 * (UINT64)steps;
+			regs.r = (regs.r & 0x80) | ((regs.r + steps) & 0x7f);
 			return true;
 		}
 
-		if (bps)
+		// Instructions in mapped pages (RAM, ROM) are decoded once and then executed from _decoded.
+		// We fetch through the bus those near the end of a page (they may continue in the next page)
+		// and those in a page watched for reads (their fetch must trigger the data breakpoint).
+		auto& page = memory->pages[regs.pc >> Bus::page_shift];
+		if (can_decode(page))
 		{
-			auto it = code_bps.find(regs.pc);
-			if (it != code_bps.end())
-			{
-				bps->address = regs.pc;
-				bps->size = std::min((uint32_t)_countof(BreakpointsHit::bps), it->second.size());
-				memcpy(bps->bps, it->second.data(), bps->size * sizeof(SIM_BP_COOKIE));
+			if (auto d = find_decoded(page))
+				return execute_decoded(*d);
+		}
+
+		return try_execute_fetched();
+	}
+
+	// A halted CPU spends 4 cycles per dispatch until an interrupt. Rather than coming back to the
+	// loop of SimulateUntil (and, while devices lag behind, to the simulator) for each of those,
+	// it takes in one call all the steps that start before _simulate_until_time and before an interrupt
+	// could be accepted. The poll after the last step then finds the interrupt, as it would have
+	// after single steps. Returns at least one.
+	uint32_t halted_steps_allowed() const
+	{
+		UINT64 limit = std::min(_simulate_until_time, earliest_irq_time());
+		if (limit <= cpu_time + 4)
+			return 1;
+
+		return (uint32_t)std::min<UINT64>((limit - cpu_time + 3) / 4, UINT32_MAX);
+	}
+
+	bool can_decode (const MemoryPage& page) const
+	{
+		return page.read && !(page.watch & (uint8_t)DataBreakpointAccess::Read)
+			&& ((regs.pc & (Bus::page_size - 1)) <= Bus::page_size - sizeof(decoded_instruction::bytes));
+	}
+
+	// Fills "d" from the bytes of an instruction. Returns false for a DD/FD prefix followed by another prefix,
+	// which try_execute_fetched executes as a NOP of sorts.
+	static bool decode_instruction (const uint8_t* bytes, decoded_instruction& d)
+	{
+		uint8_t i = 0;
+		uint8_t opcode = bytes[i++];
+		hl_ix_iy xy = hl_ix_iy::hl;
+		d.disp = 0;
+		if ((opcode == 0xDD) || (opcode == 0xFD))
+		{
+			xy = (opcode == 0xDD) ? hl_ix_iy::ix : hl_ix_iy::iy;
+			opcode = bytes[i++];
+			if (opcode == 0xDD || opcode == 0xFD || opcode == 0xED)
 				return false;
+		}
+
+		if (opcode == 0xED)
+		{
+			opcode = bytes[i++];
+			d.exec = threaded_ed.handlers[opcode];
+		}
+		else if (opcode == 0xCB)
+		{
+			if (xy != hl_ix_iy::hl)
+				d.disp = (int8_t)bytes[i++];
+			opcode = bytes[i++];
+			d.exec = threaded_cb[(int)xy].handlers[opcode];
+		}
+		else
+		{
+			d.exec = threaded_xy[(int)xy].handlers[opcode];
+			WI_ASSERT(d.exec);
+		}
+
+		memcpy (d.bytes, bytes, sizeof(d.bytes));
+		return true;
+	}
+
+	// Returns the decoded instruction at PC, decoding it if needed; returns null if it can't be decoded.
+	decoded_instruction* find_decoded (MemoryPage& page)
+	{
+		uint32_t page_index = regs.pc >> Bus::page_shift;
+		auto& entries = _decoded[page_index];
+		if (!entries)
+		{
+			// Value-initialized, so with epoch 0, which no page has.
+			entries = wil::make_unique_nothrow<decoded_instruction[]>(Bus::page_size);
+			if (!entries)
+				return nullptr;
+		}
+
+		uint32_t epoch = code_epoch(page, page_index);
+		auto& d = entries[regs.pc & (Bus::page_size - 1)];
+		if (d.epoch != epoch)
+		{
+			if (!decode_instruction(&page.read[regs.pc & (Bus::page_size - 1)], d))
+				return nullptr;
+			d.epoch = epoch;
+		}
+
+		return &d;
+	}
+
+	// Returns the epoch of the code in a page: instructions decoded, and blocks compiled, from the page
+	// in the same epoch still hold its bytes.
+	uint32_t code_epoch (MemoryPage& page, uint32_t page_index)
+	{
+		if (page.code_written)
+		{
+			// Something wrote to this page (or mapped it to something else) since we last looked.
+			// Changing the epoch drops all instructions decoded from it.
+			page.code_written = 0;
+			if (!++_code_epochs[page_index])
+			{
+				// Wrapped around; make sure no entry matches the new epoch by chance.
+				if (auto& entries = _decoded[page_index])
+				{
+					for (uint32_t i = 0; i < Bus::page_size; i++)
+						entries[i].epoch = 0;
+				}
+
+				if (_jit)
+					_jit->drop_page(page_index);
+				_code_epochs[page_index] = 1;
 			}
 		}
 
+		return _code_epochs[page_index];
+	}
+
+	// Returns the entry in _decoded for PC, or null if the CPU never executed from its page.
+	decoded_instruction* decoded_entry() const
+	{
+		auto& entries = _decoded[regs.pc >> Bus::page_shift];
+		return entries ? &entries[regs.pc & (Bus::page_size - 1)] : nullptr;
+	}
+
+	// Whether "d", the entry in _decoded for PC, holds the instruction at PC: decoded since the last write to its page,
+	// and with no data breakpoint needing its fetch.
+	bool is_current (const MemoryPage& page, const decoded_instruction& d) const
+	{
+		return !page.code_written && (d.epoch == _code_epochs[regs.pc >> Bus::page_shift])
+			&& !(page.watch & (uint8_t)DataBreakpointAccess::Read);
+	}
+
+	bool execute_decoded (const decoded_instruction& d)
+	{
+		return d.exec(*this, d);
+	}
+
+	bool try_execute_fetched()
+	{
 		uint8_t opcode;
 		bool b = memory->try_read_request (regs.pc, opcode, cpu_time);
 		if (!b)
@@ -1576,41 +2687,48 @@ public:
 			opcode = decode_u8();
 			if (xy == hl_ix_iy::hl)
 				regs.r = (regs.r & 0x80) | ((regs.r + 1) & 0x7f);
-			auto handler = dispatch_ed[opcode];
+			auto handler = dispatch_ed.handlers[opcode];
 			if (!handler)
 			{
 				cpu_time += 8;
 				return true;
 			}
 
-			executed = (this->*handler)(opcode);
+			materialize_flags();
+			executed = (this->*handler)();
 		}
 		else if (opcode == 0xcb)
 		{
-			uint16_t memhlxy_addr = decode_mem_hl(xy);
+			materialize_flags();
+			uint16_t memhlxy_addr = regs.main.hl;
+			if (xy != hl_ix_iy::hl)
+				memhlxy_addr = ((xy == hl_ix_iy::ix) ? regs.ix : regs.iy) + (uint16_t)(int16_t)(int8_t)decode_u8();
 			opcode = decode_u8();
 			if (xy == hl_ix_iy::hl)
 				regs.r = (regs.r & 0x80) | ((regs.r + 1) & 0x7f);
-			cb_handler_t handler;
-			if ((opcode & 0xC0) == 0x00)
-				handler = &cpu::sim_cb00;
-			else if ((opcode & 0xC0) == 0x40)
-				handler = &cpu::sim_cb40;
-			else
-				handler = &cpu::sim_cb80;
-			executed = (this->*handler) (xy, memhlxy_addr, opcode);
+			auto handler = dispatch_cb_xy[(int)xy].handlers[opcode];
+			executed = (this->*handler) (memhlxy_addr);
 		}
 		else
 		{
-			auto handler = dispatch[opcode];
+			auto handler = dispatch_xy[(int)xy].handlers[opcode];
 			WI_ASSERT(handler);
-			executed = (this->*handler)(xy, opcode);
+			if (!flags_neutral.opcodes[opcode])
+				materialize_flags();
+			executed = (this->*handler)();
 		}
 
+		return complete_instruction(executed, oldpc, oldr);
+	}
+
+	bool complete_instruction (bool executed, uint16_t oldpc, uint8_t oldr)
+	{
 		if (!executed)
 		{
 			regs.pc = oldpc;
 			regs.r = oldr;
+			if (_data_bps_hit)
+				_data_bps_hit->size = 0;
 			return false;
 		}
 
@@ -1624,6 +2742,251 @@ public:
 		return true;
 	}
 
+	// Same as try_execute_one, but also records the instruction in the trace and/or the trace file.
+	bool try_execute_one_traced()
+	{
+		if (regs.halted)
+			return try_execute_one();
+
+		if (_trace_writer)
+			_trace_writer->AddInstruction(regs.pc, cpu_time);
+
+		if (!_trace_capacity)
+			return try_execute_one();
+
+		materialize_flags();
+		auto& rec = _trace[_trace_next];
+		rec.time = cpu_time;
+		rec.pc = regs.pc;
+		rec.af = regs.main.af;
+		rec.bc = regs.main.bc;
+		rec.de = regs.main.de;
+		rec.hl = regs.main.hl;
+		rec.sp = regs.sp;
+
+		// Reading the opcode bytes must not trigger data breakpoints.
+		auto data_bps_hit = std::exchange(_data_bps_hit, nullptr);
+		for (uint32_t i = 0; i < _countof(rec.opcode); i++)
+			rec.opcode[i] = memory->read((uint16_t)(regs.pc + i));
+		_data_bps_hit = data_bps_hit;
+
+		if (!try_execute_one())
+			return false;
+
+		_trace_next = (_trace_next + 1 == _trace_capacity) ? 0 : (_trace_next + 1);
+		if (_trace_size < _trace_capacity)
+			_trace_size++;
+		return true;
+	}
+
+	virtual bool SimulateOne (BreakpointsHit* bps) override
+	{
+		if (bps)
+			bps->size = 0;
+
+		_data_bps_hit = data_bps.size() ? bps : nullptr;
+		auto clear_data_bps_hit = wil::scope_exit([this] { _data_bps_hit = nullptr; });
+		auto complete_flags = wil::scope_exit([this] { materialize_flags(); });
+
+		if (regs.iff1)
+		{
+			bool accepted;
+			if (!try_accept_irq(accepted))
+			{
+				if (bps)
+					bps->size = 0;
+				return false;
+			}
+
+			if (accepted)
+				return true;
+		}
+
+		if (bps && !regs.halted && check_code_bps(bps))
+			return false;
+
+		return (_trace_capacity || _trace_writer) ? try_execute_one_traced() : try_execute_one();
+	}
+
+	// How the loop of SimulateUntil executes an instruction.
+	enum class execute_step
+	{
+		one,      // try_execute_one
+		traced,   // try_execute_one_traced
+		threaded, // direct-threaded: a current decoded instruction is looked up inline and its routine called
+		          // with no function in between; the routines then go on by themselves (see continue_threaded)
+		jit,      // a block compiled by _jit, which runs the instructions that start before the next
+		          // interrupt could be accepted; try_execute_one where there's no block
+	};
+
+	virtual SimulateStopReason SimulateUntil (UINT64 requested_time, BreakpointsHit* bps) override
+	{
+		// The loop is compiled once for each step, so that each copy has only the code its step needs.
+		if (_trace_capacity || _trace_writer)
+			return simulate_until<execute_step::traced>(requested_time, bps);
+		else if (_jit)
+			return simulate_until<execute_step::jit>(requested_time, bps);
+		else if (_threaded_dispatch)
+			return simulate_until<execute_step::threaded>(requested_time, bps);
+		else
+			return simulate_until<execute_step::one>(requested_time, bps);
+	}
+
+	template<execute_step step>
+	SimulateStopReason simulate_until (UINT64 requested_time, BreakpointsHit* bps)
+	{
+		if (bps)
+			bps->size = 0;
+
+		// Breakpoints can't be added or removed while we're in this function,
+		// so let's look up the breakpoint map only if there's something in it.
+		BreakpointsHit* check_bps = code_bps.size() ? bps : nullptr;
+		_data_bps_hit = data_bps.size() ? bps : nullptr;
+		auto clear_data_bps_hit = wil::scope_exit([this] { _data_bps_hit = nullptr; });
+		auto complete_flags = wil::scope_exit([this] { materialize_flags(); });
+		_simulate_until_time = requested_time;
+		auto clear_simulate_until_time = wil::scope_exit([this] { _simulate_until_time = 0; });
+
+		// Breakpoints must see every iteration of a loop, and every instruction.
+		bool idle_loops = (step != execute_step::traced) && !check_bps && !_data_bps_hit;
+		_idle_loop_valid = false;
+
+		// The instructions don't change these, so they stay in registers across the calls below.
+		MemoryPage* const pages = memory->pages;
+		const uint32_t chain = idle_loops ? threaded_chain_max : 0;
+
+		while (cpu_time < requested_time)
+		{
+			if (regs.iff1)
+			{
+				bool accepted;
+				if (!try_accept_irq(accepted))
+				{
+					if (bps)
+						bps->size = 0;
+					return SimulateStopReason::Stalled;
+				}
+
+				if (accepted)
+					return (bps && bps->size) ? SimulateStopReason::Breakpoint : SimulateStopReason::Interrupt;
+			}
+
+			if (check_bps && !regs.halted && check_code_bps(check_bps))
+				return SimulateStopReason::Breakpoint;
+
+			uint16_t pc = regs.pc;
+			bool executed;
+			if constexpr (step == execute_step::traced)
+				executed = try_execute_one_traced();
+			else if constexpr (step == execute_step::threaded)
+			{
+				const MemoryPage& page = pages[pc >> Bus::page_shift];
+				const decoded_instruction* d = decoded_entry();
+				if (!regs.halted && d && is_current(page, *d))
+				{
+					_threaded_chain = chain;
+					executed = d->exec(*this, *d);
+					_threaded_chain = 0;
+					pc = _threaded_last_pc;
+				}
+				else
+					executed = try_execute_one();
+			}
+			else if constexpr (step == execute_step::jit)
+			{
+				// The block needs F exact, and leaves it exact.
+				int32_t last_pc = -1;
+				MemoryPage& page = pages[pc >> Bus::page_shift];
+				if (!regs.halted && !_ei_countdown && can_decode(page))
+				{
+					UINT64 limit = std::min(requested_time, earliest_irq_time());
+					uint32_t epoch = code_epoch(page, pc >> Bus::page_shift);
+					if (auto code = _jit->find_block(epoch, limit, check_bps != nullptr, code_bps_bitmap))
+					{
+						materialize_flags();
+						last_pc = code(limit);
+					}
+				}
+
+				if (last_pc >= 0)
+				{
+					executed = true;
+					pc = (uint16_t)last_pc;
+				}
+				else
+					executed = try_execute_one();
+			}
+			else
+				executed = try_execute_one();
+			if (!executed)
+				return SimulateStopReason::Stalled;
+
+			if (idle_loops && ((uint16_t)(pc - regs.pc) < idle_loop_max_size))
+				skip_idle_loop();
+
+			if (bps && bps->size)
+				return SimulateStopReason::Breakpoint;
+		}
+
+		return SimulateStopReason::TimeReached;
+	}
+
+	// Called by the loop of SimulateUntil when execution jumps back by a short distance (or not at all),
+	// which is where the head of a busy-wait loop is: a wait for a key, or for a frame counter that the
+	// interrupt routine changes. If the last time we got here the registers were the same as now (other
+	// than R), and the code in between wrote nothing to memory or I/O, the next iterations will all be
+	// the same as that one until something changes what the loop reads. During SimulateUntil only an
+	// interrupt can do that, since everything else that changes device state (keys pressed, for instance)
+	// reaches the devices between calls. So we skip ahead by whole iterations, up to the earliest
+	// interrupt or _simulate_until_time; the simulator then waits for real time to catch up.
+	void skip_idle_loop()
+	{
+		uint32_t writes = memory->write_count + io->write_count;
+		auto& last = _idle_loop;
+
+		// Most jumps back here are from loops that do work, which changes the write count or one of the
+		// registers loops change most often. Only when those match do we pay for the flags and the full
+		// comparison; and only then do we save all the registers, for the next time to compare with.
+		if (!_idle_loop_valid || (last.writes != writes) || (last.regs.pc != regs.pc) || (last.regs.sp != regs.sp)
+			|| (last.regs.main.bc != regs.main.bc) || (last.regs.main.de != regs.main.de)
+			|| (last.regs.main.hl != regs.main.hl) || (last.regs.main.a != regs.main.a))
+		{
+			last.regs.pc = regs.pc;
+			last.regs.sp = regs.sp;
+			last.regs.main.bc = regs.main.bc;
+			last.regs.main.de = regs.main.de;
+			last.regs.main.hl = regs.main.hl;
+			last.regs.main.a = regs.main.a;
+			last.complete = false;
+		}
+		else
+		{
+			materialize_flags();
+			z80_register_set now = regs;
+			now.r = 0;
+			if (last.complete && (last.time < cpu_time) && !_ei_countdown && !memcmp(&last.regs, &now, sizeof(now)))
+			{
+				UINT64 iteration_time = cpu_time - last.time;
+				UINT64 limit = std::min(_simulate_until_time, earliest_irq_time());
+				if (limit > cpu_time)
+				{
+					UINT64 iterations = (limit - cpu_time) / iteration_time;
+					uint8_t r_increment = (regs.r - last.r) & 0x7f;
+					cpu_time += iterations * iteration_time;
+					regs.r = (regs.r & 0x80) | ((regs.r + (iterations % 128) * r_increment) & 0x7f);
+				}
+			}
+
+			last.regs = now;
+			last.complete = true;
+		}
+
+		last.r = regs.r;
+		last.time = cpu_time;
+		last.writes = writes;
+		_idle_loop_valid = true;
+	}
+
 	// ========================================================================
 
 	virtual UINT64 Time() override
@@ -1636,6 +2999,10 @@ public:
 		memset (&regs, 0, sizeof(regs));
 		_start_of_stack = 0;
 		cpu_time = 0;
+		_bps_counted_time = UINT64_MAX;
+		_flags_pending = false;
+		_idle_loop_valid = false;
+		_irq_deadline = 0;
 	}
 
 	virtual void GetZ80Registers (z80_register_set* pRegs) override
@@ -1650,6 +3017,7 @@ public:
 	
 	#ifdef SIM_TESTS
 	virtual z80_register_set* GetRegsPtr() override { return &regs; }
+	virtual uint32_t GetJitBlockCount() override { return _jit ? _jit->compiled_blocks() : 0; }
 	#endif
 
 	virtual UINT16 GetStackStartAddress() const override { return _start_of_stack; }
@@ -1668,26 +3036,38 @@ public:
 	{
 		if (type == BreakpointType::Code)
 		{
+			// Unconditional, not a tracepoint, and breaking on every hit.
+			code_bp bp = {
+				.cookie = _nextBpCookie,
+				.condition = { },
+				.hit_count = 0,
+				.pass_count_style = BreakpointPassCountStyle::None,
+				.pass_count = 0,
+				.tracepoint = false,
+				.trace_values = { },
+			};
+
 			auto it = code_bps.find(address);
 			if (it == code_bps.end())
 			{
-				bool added = code_bps.try_insert({ address, vector_nothrow<SIM_BP_COOKIE>{ } });
+				bool added = code_bps.try_insert({ address, vector_nothrow<code_bp>{ } });
 				if (!added)
 					return E_OUTOFMEMORY;
 
 				auto it = code_bps.find(address);
-				added = it->second.try_push_back(_nextBpCookie);
+				added = it->second.try_push_back(std::move(bp));
 				if (!added)
 				{
 					code_bps.remove(it);
 					return E_OUTOFMEMORY;
 				}
+				code_bps_bitmap[address >> 3] |= (1 << (address & 7));
 				*pCookie = _nextBpCookie;
 				_nextBpCookie++;
 			}
 			else
 			{
-				bool added = it->second.try_push_back(_nextBpCookie);
+				bool added = it->second.try_push_back(std::move(bp));
 				if (!added)
 					return E_OUTOFMEMORY;
 				*pCookie = _nextBpCookie;
@@ -1697,33 +3077,209 @@ public:
 			return S_OK;
 		}
 		else
-			return E_NOTIMPL;
+			return AddDataBreakpoint (address, 1, DataBreakpointAccess::Write, pCookie);
+	}
+
+	virtual HRESULT AddDataBreakpoint (uint16_t address, uint32_t size, DataBreakpointAccess access, SIM_BP_COOKIE* pCookie) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, !size || (address + size > 0x10000));
+		RETURN_HR_IF(E_INVALIDARG, !(uint8_t)access || ((uint8_t)access & ~(uint8_t)DataBreakpointAccess::ReadWrite));
+
+		bool added = data_bps.try_push_back({ _nextBpCookie, address, size, access }); RETURN_HR_IF(E_OUTOFMEMORY, !added);
+		memory->set_watched_pages (address, size, access);
+		*pCookie = _nextBpCookie;
+		_nextBpCookie++;
+		return S_OK;
 	}
 
 	virtual HRESULT RemoveBreakpoint (SIM_BP_COOKIE cookie) override
 	{
 		for (auto it = code_bps.begin(); it != code_bps.end(); it++)
 		{
-			if (auto it1 = it->second.find(cookie); it1 != it->second.end())
+			if (auto it1 = it->second.find_if([cookie](auto& bp) { return bp.cookie == cookie; }); it1 != it->second.end())
 			{
 				it->second.erase(it1);
 				if (it->second.empty())
+				{
+					code_bps_bitmap[it->first >> 3] &= ~(1 << (it->first & 7));
 					code_bps.erase(it);
+				}
 				return S_OK;
 			}
 		}
 
-		// TODO: search data breakpoints
+		if (auto it = data_bps.find_if([cookie](auto& bp) { return bp.cookie == cookie; }); it != data_bps.end())
+		{
+			data_bps.erase(it);
+			update_watched_pages();
+			return S_OK;
+		}
 
 		return E_INVALIDARG;
 	}
 
+	code_bp* find_code_bp (SIM_BP_COOKIE cookie)
+	{
+		for (auto& p : code_bps)
+		{
+			if (auto it = p.second.find_if([cookie](auto& bp) { return bp.cookie == cookie; }); it != p.second.end())
+				return &*it;
+		}
+
+		return nullptr;
+	}
+
+	virtual HRESULT SetBreakpointCondition (SIM_BP_COOKIE cookie, const uint8_t* condition, uint32_t size) override
+	{
+		uint32_t depth;
+		RETURN_HR_IF(E_INVALIDARG, size && (!validate_program(condition, size, depth) || (depth != 1)));
+
+		auto bp = find_code_bp(cookie); RETURN_HR_IF(E_INVALIDARG, !bp);
+		vector_nothrow<uint8_t> c;
+		bool reserved = c.try_reserve(size); RETURN_HR_IF(E_OUTOFMEMORY, !reserved);
+		for (uint32_t i = 0; i < size; i++)
+			c.try_push_back(condition[i]);
+		bp->condition = std::move(c);
+		return S_OK;
+	}
+
+	virtual HRESULT SetBreakpointPassCount (SIM_BP_COOKIE cookie, BreakpointPassCountStyle style, uint32_t passCount) override
+	{
+		RETURN_HR_IF(E_INVALIDARG, (style > BreakpointPassCountStyle::Mod) || ((style == BreakpointPassCountStyle::Mod) && !passCount));
+		auto bp = find_code_bp(cookie); RETURN_HR_IF(E_INVALIDARG, !bp);
+		bp->pass_count_style = style;
+		bp->pass_count = passCount;
+		return S_OK;
+	}
+
+	virtual HRESULT GetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t* hitCount) override
+	{
+		auto bp = find_code_bp(cookie); RETURN_HR_IF(E_INVALIDARG, !bp);
+		*hitCount = bp->hit_count;
+		return S_OK;
+	}
+
+	virtual HRESULT SetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t hitCount) override
+	{
+		auto bp = find_code_bp(cookie); RETURN_HR_IF(E_INVALIDARG, !bp);
+		bp->hit_count = hitCount;
+		return S_OK;
+	}
+
+	virtual HRESULT SetTracepoint (SIM_BP_COOKIE cookie, bool tracepoint, const uint8_t* values, uint32_t size) override
+	{
+		uint32_t depth;
+		RETURN_HR_IF(E_INVALIDARG, !validate_program(values, size, depth) || (depth > TracepointMaxValues));
+
+		auto bp = find_code_bp(cookie); RETURN_HR_IF(E_INVALIDARG, !bp);
+		vector_nothrow<uint8_t> v;
+		bool reserved = v.try_reserve(size); RETURN_HR_IF(E_OUTOFMEMORY, !reserved);
+		for (uint32_t i = 0; i < size; i++)
+			v.try_push_back(values[i]);
+		bp->tracepoint = tracepoint;
+		bp->trace_values = std::move(v);
+		return S_OK;
+	}
+
+	virtual void SetTracepointHandler (TracepointHandler handler) override
+	{
+		_tracepoint_handler = handler;
+	}
+
 	virtual BOOL HasBreakpoints() override
 	{
-		return code_bps.size();
+		return code_bps.size() || data_bps.size();
+	}
+
+	virtual HRESULT SetInstructionTrace (uint32_t capacity) override
+	{
+		wistd::unique_ptr<InstructionTraceRecord[]> trace;
+		if (capacity)
+		{
+			trace = wil::make_unique_nothrow<InstructionTraceRecord[]>(capacity); RETURN_IF_NULL_ALLOC(trace);
+		}
+
+		_trace = std::move(trace);
+		_trace_capacity = capacity;
+		_trace_next = 0;
+		_trace_size = 0;
+		return S_OK;
+	}
+
+	virtual uint32_t GetInstructionTrace (InstructionTraceRecord* records, uint32_t max_count) override
+	{
+		uint32_t count = (max_count < _trace_size) ? max_count : _trace_size;
+		if (!count)
+			return 0;
+
+		uint32_t index = (_trace_next + _trace_capacity - count) % _trace_capacity;
+		for (uint32_t i = 0; i < count; i++)
+		{
+			records[i] = _trace[index];
+			index = (index + 1 == _trace_capacity) ? 0 : (index + 1);
+		}
+
+		return count;
+	}
+
+	virtual HRESULT SetThreadedDispatch (bool enable) override
+	{
+		_threaded_dispatch = enable;
+		return S_OK;
+	}
+
+	virtual HRESULT SetJit (bool enable) override
+	{
+		if (!enable)
+		{
+			_jit = nullptr;
+			return S_OK;
+		}
+
+		if (!_jit)
+		{
+			z80_jit_cpu c = { .regs = &regs, .time = &cpu_time, .start_of_stack = &_start_of_stack, .memory = memory };
+			auto hr = MakeZ80Jit(c, &_jit); RETURN_IF_FAILED_EXPECTED(hr);
+		}
+
+		return S_OK;
+	}
+
+	virtual void SetTraceWriter (ITraceWriter* writer) override
+	{
+		_trace_writer = writer;
+		update_watched_pages();
 	}
 };
 
+constexpr cpu::dispatch_table<cpu::handler_t> cpu::dispatch_xy[3] = {
+	make_dispatch<hl_ix_iy::hl>(std::make_index_sequence<256>()),
+	make_dispatch<hl_ix_iy::ix>(std::make_index_sequence<256>()),
+	make_dispatch<hl_ix_iy::iy>(std::make_index_sequence<256>()),
+};
+
+constexpr cpu::dispatch_table<cpu::handler_t> cpu::dispatch_ed = make_dispatch_ed(std::make_index_sequence<256>());
+
+constexpr cpu::dispatch_table<cpu::cb_handler_t> cpu::dispatch_cb_xy[3] = {
+	make_dispatch_cb<hl_ix_iy::hl>(std::make_index_sequence<256>()),
+	make_dispatch_cb<hl_ix_iy::ix>(std::make_index_sequence<256>()),
+	make_dispatch_cb<hl_ix_iy::iy>(std::make_index_sequence<256>()),
+};
+
+constexpr cpu::dispatch_table<cpu::threaded_t> cpu::threaded_xy[3] = {
+	make_threaded<hl_ix_iy::hl>(std::make_index_sequence<256>()),
+	make_threaded<hl_ix_iy::ix>(std::make_index_sequence<256>()),
+	make_threaded<hl_ix_iy::iy>(std::make_index_sequence<256>()),
+};
+
+constexpr cpu::dispatch_table<cpu::threaded_t> cpu::threaded_ed = make_threaded_ed(std::make_index_sequence<256>());
+
+constexpr cpu::dispatch_table<cpu::threaded_t> cpu::threaded_cb[3] = {
+	make_threaded_cb<hl_ix_iy::hl>(std::make_index_sequence<256>()),
+	make_threaded_cb<hl_ix_iy::ix>(std::make_index_sequence<256>()),
+	make_threaded_cb<hl_ix_iy::iy>(std::make_index_sequence<256>()),
+};
+
 HRESULT STDMETHODCALLTYPE MakeZ80CPU (Bus* memory, Bus* io, irq_line_i* irq, wistd::unique_ptr<IZ80CPU>* ppCPU)
 {
 	auto d = wil::make_unique_nothrow<cpu>(); RETURN_IF_NULL_ALLOC(d);
@@ -10,6 +10,7 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{97DCFDDE-9DCD-4FDB-A373-15FFB9EDF488}")
 
 	#ifdef SIM_TESTS
 	virtual z80_register_set* GetRegsPtr() = 0;
+	virtual uint32_t GetJitBlockCount() = 0; // the blocks compiled since SetJit enabled the JIT
 	#endif
 };
 
@@ -0,0 +1,2253 @@
+#include "pch.h"
+#include "Z80Jit.h"
+#include <array>
+#include <utility>
+
+#if defined(_M_X64) || defined(__x86_64__)
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// How compiled blocks run:
+//  - The Z80 registers the block uses stay in host registers for its whole run: BC in ebx, DE in edx,
+//    HL in ecx, SP in r10d, IX in r11d, IY in r12d, A in r8d and F in r9d, each zero-extended. The prologue
+//    loads them from the register set, and the epilogue stores back those the block changes. B, C, D, E, H
+//    and L are then bh, bl, dh, dl, ch and cl. Instructions that touch these only write bytes and words,
+//    or values that fit, so the upper bits stay zero.
+//  - r14 points to the register set, and the time and the start of the stack are addressed from it too;
+//    r13 points to the memory pages of the bus. rax, rsi, rdi, rbp and r15 are scratch.
+//  - The time is updated in memory when the block exits, and when it jumps back to its start.
+//  - F is computed exactly, from the host flags, but only where the value may be seen: by a later instruction,
+//    or after an exit. Instructions in between that set all of F make the computation unneeded.
+//  - Before an instruction accesses memory, the block checks that the pages are mapped for the access and not
+//    watched. If not, it exits with nothing done, and the interpreter then executes the instruction through
+//    the bus, which stalls for devices that are behind, or notifies the data breakpoints.
+//  - After a write into its own code, the block exits; the CPU then sees a new epoch for the page.
+
+#pragma region x86-64 assembler
+// x86-64 registers, by their numbers in instruction encodings. ah, ch, dh and bh exist only as byte operands
+// of instructions without a REX prefix, where they have the numbers of spl, bpl, sil and dil.
+enum x64_reg : uint8_t { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15, ah = 0x14, ch, dh, bh, no_reg = 0xFF };
+
+enum x64_cc : uint8_t { cc_o, cc_no, cc_b, cc_ae, cc_e, cc_ne, cc_be, cc_a };
+
+enum x64_alu : uint8_t { alu_add, alu_or, alu_adc, alu_sbb, alu_and, alu_sub, alu_xor, alu_cmp };
+
+enum x64_shift : uint8_t { shift_rol, shift_ror, shift_rcl, shift_rcr, shift_shl, shift_shr, shift_sar = 7 };
+
+// A register, or memory at base + index * scale + disp.
+struct x64_operand
+{
+	uint8_t reg;
+	uint8_t base;
+	uint8_t index;
+	uint8_t scale;
+	int32_t disp;
+};
+
+static constexpr x64_operand reg (uint8_t r) { return { r, no_reg, no_reg, 1, 0 }; }
+static constexpr x64_operand mem (uint8_t base, int32_t disp) { return { no_reg, base, no_reg, 1, disp }; }
+static constexpr x64_operand mem (uint8_t base, uint8_t index, uint8_t scale, int32_t disp) { return { no_reg, base, index, scale, disp }; }
+
+static constexpr bool fits_int8 (int64_t value) { return (value >= -128) && (value <= 127); }
+
+// Emits the few instructions the compiler needs into a buffer. Running out of buffer or labels isn't
+// reported right away; "finish" then fails.
+class x64_assembler
+{
+	uint8_t* _code = nullptr;
+	uint32_t _capacity = 0;
+	uint32_t _size = 0;
+	bool _overflow = false;
+
+	static constexpr uint32_t max_labels = 1024;
+	static constexpr uint32_t max_fixups = 2048;
+	static constexpr uint32_t unbound = UINT32_MAX;
+
+	uint32_t _labels[max_labels];
+	uint32_t _label_count = 0;
+
+	struct fixup
+	{
+		uint32_t at;    // of the rel32 field
+		uint32_t label;
+	};
+
+	fixup _fixups[max_fixups];
+	uint32_t _fixup_count = 0;
+
+	// For instructions with a ModRM byte. "reg_field" is a register, or an opcode extension; "byte_regs" tells
+	// which of the two operands are byte registers (1 for "reg_field", 2 for "rm"), since those decide between
+	// a REX prefix (spl..dil) and none (ah..bh). "size" is the operand size, for the 66 and REX.W prefixes.
+	void modrm (uint32_t size, uint32_t opcode, uint32_t opcode_length, uint8_t reg_field, const x64_operand& rm,
+		uint8_t byte_regs, uint32_t imm_size = 0, int64_t imm = 0)
+	{
+		bool need_rex = (size == 8);
+		bool no_rex = false;
+		auto check_byte_reg = [&need_rex, &no_rex](uint8_t r)
+		{
+			if (r & 0x10)
+				no_rex = true;
+			else if ((r >= 4) && (r < 8))
+				need_rex = true;
+		};
+
+		if (byte_regs & 1)
+			check_byte_reg(reg_field);
+		if ((byte_regs & 2) && (rm.reg != no_reg))
+			check_byte_reg(rm.reg);
+
+		uint8_t rex = 0x40 | ((size == 8) ? 8 : 0);
+		if (!(reg_field & 0x10) && (reg_field & 8))
+			rex |= 4;
+		if (rm.reg != no_reg)
+		{
+			if (!(rm.reg & 0x10) && (rm.reg & 8))
+				rex |= 1;
+		}
+		else
+		{
+			if (rm.base & 8)
+				rex |= 1;
+			if ((rm.index != no_reg) && (rm.index & 8))
+				rex |= 2;
+		}
+
+		need_rex |= (rex != 0x40);
+		WI_ASSERT(!(need_rex && no_rex));
+
+		if (size == 2)
+			byte(0x66);
+		if (need_rex)
+			byte(rex);
+		for (uint32_t i = opcode_length; i--; )
+			byte((uint8_t)(opcode >> (i * 8)));
+
+		uint8_t r = reg_field & 7;
+		if (rm.reg != no_reg)
+			byte(0xC0 | (r << 3) | (rm.reg & 7));
+		else
+		{
+			uint8_t base = rm.base & 7;
+			uint8_t mod = ((rm.disp == 0) && (base != 5)) ? 0 : fits_int8(rm.disp) ? 1 : 2;
+			if ((rm.index == no_reg) && (base != 4))
+				byte((mod << 6) | (r << 3) | base);
+			else
+			{
+				uint8_t ss = (rm.scale == 8) ? 3 : (rm.scale == 4) ? 2 : (rm.scale == 2) ? 1 : 0;
+				uint8_t index = (rm.index == no_reg) ? 4 : (rm.index & 7);
+				byte((mod << 6) | (r << 3) | 4);
+				byte((ss << 6) | (index << 3) | base);
+			}
+
+			if (mod == 1)
+				byte((uint8_t)rm.disp);
+			else if (mod == 2)
+				dword((uint32_t)rm.disp);
+		}
+
+		if (imm_size == 1)
+			byte((uint8_t)imm);
+		else if (imm_size == 2)
+		{
+			byte((uint8_t)imm);
+			byte((uint8_t)(imm >> 8));
+		}
+		else if (imm_size == 4)
+			dword((uint32_t)imm);
+	}
+
+	void byte (uint8_t b)
+	{
+		if (_size < _capacity)
+			_code[_size++] = b;
+		else
+			_overflow = true;
+	}
+
+	void dword (uint32_t d)
+	{
+		for (uint32_t i = 0; i < 4; i++)
+			byte((uint8_t)(d >> (i * 8)));
+	}
+
+	void rel32 (uint32_t label)
+	{
+		if (_fixup_count < max_fixups)
+			_fixups[_fixup_count++] = { _size, label };
+		else
+			_overflow = true;
+		dword(0);
+	}
+
+public:
+	void reset (uint8_t* code, uint32_t capacity)
+	{
+		_code = code;
+		_capacity = capacity;
+		_size = 0;
+		_overflow = false;
+		_label_count = 0;
+		_fixup_count = 0;
+	}
+
+	uint32_t size() const { return _size; }
+
+	// Patches the jumps to their labels. Returns false if something didn't fit.
+	bool finish()
+	{
+		if (_overflow)
+			return false;
+
+		for (uint32_t i = 0; i < _fixup_count; i++)
+		{
+			uint32_t target = _labels[_fixups[i].label];
+			if (target == unbound)
+				return false;
+			int32_t rel = (int32_t)(target - (_fixups[i].at + 4));
+			memcpy (&_code[_fixups[i].at], &rel, 4);
+		}
+
+		return true;
+	}
+
+	uint32_t new_label()
+	{
+		if (_label_count == max_labels)
+		{
+			_overflow = true;
+			return 0;
+		}
+
+		_labels[_label_count] = unbound;
+		return _label_count++;
+	}
+
+	void bind (uint32_t label) { _labels[label] = _size; }
+
+	void jmp (uint32_t label) { byte(0xE9); rel32(label); }
+	void jcc (x64_cc cc, uint32_t label) { byte(0x0F); byte(0x80 | cc); rel32(label); }
+
+	// op dst, src
+	void alu (x64_alu op, uint32_t size, const x64_operand& dst, uint8_t src)
+	{
+		modrm(size, (op << 3) | ((size == 1) ? 0 : 1), 1, src, dst, (size == 1) ? 3 : 0);
+	}
+
+	// op dst, src
+	void alu_load (x64_alu op, uint32_t size, uint8_t dst, const x64_operand& src)
+	{
+		modrm(size, (op << 3) | ((size == 1) ? 2 : 3), 1, dst, src, (size == 1) ? 3 : 0);
+	}
+
+	// op dst, imm
+	void alu_imm (x64_alu op, uint32_t size, const x64_operand& dst, int32_t imm)
+	{
+		if (size == 1)
+			modrm(1, 0x80, 1, op, dst, 2, 1, imm);
+		else if (fits_int8(imm))
+			modrm(size, 0x83, 1, op, dst, 0, 1, imm);
+		else
+			modrm(size, 0x81, 1, op, dst, 0, (size == 2) ? 2 : 4, imm);
+	}
+
+	// mov dst, src
+	void mov (uint32_t size, const x64_operand& dst, uint8_t src)
+	{
+		modrm(size, (size == 1) ? 0x88 : 0x89, 1, src, dst, (size == 1) ? 3 : 0);
+	}
+
+	// mov dst, src
+	void mov_load (uint32_t size, uint8_t dst, const x64_operand& src)
+	{
+		modrm(size, (size == 1) ? 0x8A : 0x8B, 1, dst, src, (size == 1) ? 3 : 0);
+	}
+
+	// mov dst, imm
+	void mov_imm (uint32_t size, const x64_operand& dst, int64_t imm)
+	{
+		if ((dst.reg != no_reg) && ((size == 4) || ((size == 8) && (imm != (int32_t)imm))))
+		{
+			if ((size == 8) || (dst.reg & 8))
+				byte(0x40 | ((size == 8) ? 8 : 0) | ((dst.reg & 8) ? 1 : 0));
+			byte(0xB8 | (dst.reg & 7));
+			dword((uint32_t)imm);
+			if (size == 8)
+				dword((uint32_t)(imm >> 32));
+		}
+		else if (size == 1)
+			modrm(1, 0xC6, 1, 0, dst, 2, 1, imm);
+		else
+			modrm(size, 0xC7, 1, 0, dst, 0, (size == 2) ? 2 : 4, imm);
+	}
+
+	// movzx dst, src (a byte or a word)
+	void movzx (uint8_t dst, const x64_operand& src, uint32_t src_size)
+	{
+		modrm(4, (src_size == 1) ? 0x0FB6 : 0x0FB7, 2, dst, src, (src_size == 1) ? 2 : 0);
+	}
+
+	void xchg (uint32_t size, const x64_operand& dst, uint8_t src)
+	{
+		modrm(size, (size == 1) ? 0x86 : 0x87, 1, src, dst, (size == 1) ? 3 : 0);
+	}
+
+	void shift (x64_shift kind, uint32_t size, const x64_operand& dst, uint8_t count)
+	{
+		if (count == 1)
+			modrm(size, (size == 1) ? 0xD0 : 0xD1, 1, kind, dst, 2);
+		else
+			modrm(size, (size == 1) ? 0xC0 : 0xC1, 1, kind, dst, 2, 1, count);
+	}
+
+	void inc (uint32_t size, const x64_operand& dst) { modrm(size, (size == 1) ? 0xFE : 0xFF, 1, 0, dst, 2); }
+	void dec (uint32_t size, const x64_operand& dst) { modrm(size, (size == 1) ? 0xFE : 0xFF, 1, 1, dst, 2); }
+	void neg (uint32_t size, const x64_operand& dst) { modrm(size, (size == 1) ? 0xF6 : 0xF7, 1, 3, dst, 2); }
+
+	void test_imm (uint32_t size, const x64_operand& dst, int32_t imm)
+	{
+		modrm(size, (size == 1) ? 0xF6 : 0xF7, 1, 0, dst, 2, (size == 1) ? 1 : (size == 2) ? 2 : 4, imm);
+	}
+
+	void test (uint32_t size, const x64_operand& dst, uint8_t src)
+	{
+		modrm(size, (size == 1) ? 0x84 : 0x85, 1, src, dst, (size == 1) ? 3 : 0);
+	}
+
+	// setcc dst (a byte)
+	void setcc (x64_cc cc, const x64_operand& dst) { modrm(1, 0x0F90 | cc, 2, 0, dst, 2); }
+
+	// bt dst, bit
+	void bt (uint32_t size, const x64_operand& dst, uint8_t bit) { modrm(size, 0x0FBA, 2, 4, dst, 0, 1, bit); }
+
+	void lea (uint32_t size, uint8_t dst, const x64_operand& src) { modrm(size, 0x8D, 1, dst, src, 0); }
+
+	// imul dst, src, imm
+	void imul_imm (uint32_t size, uint8_t dst, const x64_operand& src, int32_t imm)
+	{
+		if (fits_int8(imm))
+			modrm(size, 0x6B, 1, dst, src, 0, 1, imm);
+		else
+			modrm(size, 0x69, 1, dst, src, 0, 4, imm);
+	}
+
+	void lahf() { byte(0x9F); }
+
+	void push (uint8_t r)
+	{
+		if (r & 8)
+			byte(0x41);
+		byte(0x50 | (r & 7));
+	}
+
+	void pop (uint8_t r)
+	{
+		if (r & 8)
+			byte(0x41);
+		byte(0x58 | (r & 7));
+	}
+
+	void ret() { byte(0xC3); }
+};
+#pragma endregion
+
+#pragma region Decoder
+enum class jit_group : uint8_t { main, ed, cb };
+
+// What the compiler needs to know of an instruction besides its bytes.
+enum : uint8_t
+{
+	insn_reads_f     = 1,  // reads F, or changes only some of its bits
+	insn_writes_f    = 2,
+	insn_memory      = 4,  // accesses memory, so the block may exit before it
+	insn_writes_mem  = 8,  // the block exits after it if it writes into the block
+	insn_ends        = 16, // transfers control; the block ends with it
+};
+
+struct jit_insn
+{
+	uint16_t  pc;
+	uint8_t   length;
+	jit_group group;
+	hl_ix_iy  xy;
+	uint8_t   opcode;
+	int8_t    disp;        // for (ix+d) and (iy+d)
+	uint16_t  operand;     // n, e or nn
+	uint8_t   time;        // for conditional instructions, when the condition doesn't hold
+	uint8_t   time_taken;  // for conditional instructions, when the condition holds
+	uint8_t   r_increment;
+	uint8_t   props;       // insn_*
+	bool      f_live;      // whether F may be seen after the instruction; see compute_f_liveness
+};
+
+// Whether the main instruction "op" accesses (hl), which takes a displacement after a DD/FD prefix.
+static bool uses_memory_hl (uint8_t op)
+{
+	if ((op == 0x34) || (op == 0x35) || (op == 0x36))
+		return true;
+	if (((op & 0xC0) == 0x40) && (op != 0x76))
+		return ((op & 7) == 6) || (((op >> 3) & 7) == 6);
+	return ((op & 0xC0) == 0x80) && ((op & 7) == 6);
+}
+
+// The bytes of immediate operand that follow main instruction "op".
+static uint32_t operand_size (uint8_t op)
+{
+	if (((op & 0xC7) == 0x06) || ((op & 0xC7) == 0xC6) || (op == 0x10) || (op == 0x18) || ((op & 0xE7) == 0x20)
+		|| (op == 0xD3) || (op == 0xDB))
+		return 1;
+	if (((op & 0xCF) == 0x01) || (op == 0x22) || (op == 0x2A) || (op == 0x32) || (op == 0x3A)
+		|| ((op & 0xC7) == 0xC2) || (op == 0xC3) || ((op & 0xC7) == 0xC4) || (op == 0xCD))
+		return 2;
+	return 0;
+}
+
+// Fills the time and the properties of a main instruction; the times are those the interpreter adds.
+// Returns false for the instructions the compiler leaves to the interpreter.
+static bool decode_main (jit_insn& in)
+{
+	uint8_t op = in.opcode;
+	bool hl = (in.xy == hl_ix_iy::hl);
+	auto t = [hl](uint8_t t_hl, uint8_t t_xy) -> uint8_t { return hl ? t_hl : t_xy; };
+	uint8_t y = (op >> 3) & 7;
+	uint8_t z = op & 7;
+	uint8_t alu_f = ((y == 1) || (y == 3)) ? (insn_reads_f | insn_writes_f) : insn_writes_f;
+
+	switch (op >> 6)
+	{
+		case 0:
+			switch (z)
+			{
+				case 0:
+					if (op == 0x00)
+						in.time = 4;
+					else if (op == 0x08)
+						{ in.time = 4; in.props = insn_reads_f | insn_writes_f; }
+					else if (op == 0x10)
+						{ in.time = 8; in.time_taken = 13; in.props = insn_ends; }
+					else if (op == 0x18)
+						{ in.time = 12; in.props = insn_ends; }
+					else
+						{ in.time = 7; in.time_taken = 12; in.props = insn_reads_f | insn_ends; }
+					return true;
+
+				case 1:
+					if (y & 1)
+						{ in.time = t(11, 15); in.props = insn_reads_f | insn_writes_f; }
+					else
+						in.time = t(10, 14);
+					return true;
+
+				case 2:
+					switch (op)
+					{
+						case 0x02: case 0x12: in.time = 7; in.props = insn_memory | insn_writes_mem; break;
+						case 0x0A: case 0x1A: in.time = 7; in.props = insn_memory; break;
+						case 0x22: in.time = t(16, 20); in.props = insn_memory | insn_writes_mem; break;
+						case 0x2A: in.time = t(16, 20); in.props = insn_memory; break;
+						case 0x32: in.time = 13; in.props = insn_memory | insn_writes_mem; break;
+						case 0x3A: in.time = 13; in.props = insn_memory; break;
+					}
+					return true;
+
+				case 3:
+					in.time = t(6, 10);
+					return true;
+
+				case 4:
+				case 5:
+					in.time = (y == 6) ? t(11, 23) : t(4, 8);
+					in.props = insn_reads_f | insn_writes_f | ((y == 6) ? (insn_memory | insn_writes_mem) : 0);
+					return true;
+
+				case 6:
+					if (y == 6)
+						{ in.time = t(10, 19); in.props = insn_memory | insn_writes_mem; }
+					else
+						in.time = t(7, 11);
+					return true;
+
+				default:
+					if (op == 0x27)
+						return false; // daa
+					in.time = 4;
+					in.props = insn_reads_f | insn_writes_f;
+					return true;
+			}
+
+		case 1:
+			if (op == 0x76)
+				return false; // halt
+			if (y == 6)
+				{ in.time = t(7, 19); in.props = insn_memory | insn_writes_mem; }
+			else if (z == 6)
+				{ in.time = t(7, 19); in.props = insn_memory; }
+			else
+				in.time = t(4, 8);
+			return true;
+
+		case 2:
+			in.time = (z == 6) ? t(7, 19) : t(4, 8);
+			in.props = alu_f | ((z == 6) ? insn_memory : 0);
+			return true;
+
+		default:
+			switch (z)
+			{
+				case 0:
+					in.time = 5;
+					in.time_taken = 11;
+					in.props = insn_reads_f | insn_memory | insn_ends;
+					return true;
+
+				case 1:
+					switch (op)
+					{
+						case 0xC9: in.time = 10; in.props = insn_memory | insn_ends; break;
+						case 0xD9: in.time = 4; break;
+						case 0xE9: in.time = t(4, 8); in.props = insn_ends; break;
+						case 0xF9: in.time = t(6, 10); break;
+						default:
+							in.time = t(10, 14);
+							in.props = insn_memory | ((op == 0xF1) ? insn_writes_f : 0);
+							break;
+					}
+					return true;
+
+				case 2:
+					in.time = 10;
+					in.time_taken = 10;
+					in.props = insn_reads_f | insn_ends;
+					return true;
+
+				case 3:
+					switch (op)
+					{
+						case 0xC3: in.time = 10; in.props = insn_ends; return true;
+						case 0xE3: in.time = t(19, 23); in.props = insn_memory | insn_writes_mem; return true;
+						case 0xEB: in.time = 4; return true;
+						case 0xF3: in.time = 4; return true;
+						default: return false; // out (n),a; in a,(n); ei
+					}
+
+				case 4:
+					in.time = 10;
+					in.time_taken = 17;
+					in.props = insn_reads_f | insn_memory | insn_writes_mem | insn_ends;
+					return true;
+
+				case 5:
+					if (op == 0xCD)
+						{ in.time = 17; in.props = insn_memory | insn_writes_mem | insn_ends; }
+					else
+						{ in.time = t(11, 15); in.props = insn_memory | insn_writes_mem | ((op == 0xF5) ? insn_reads_f : 0); }
+					return true;
+
+				case 6:
+					in.time = 7;
+					in.props = alu_f;
+					return true;
+
+				default:
+					in.time = 11;
+					in.props = insn_memory | insn_writes_mem | insn_ends;
+					return true;
+			}
+	}
+}
+
+static bool decode_ed (jit_insn& in)
+{
+	uint8_t op = in.opcode;
+	if ((op & 0xC7) == 0x42)
+		{ in.time = 15; in.props = insn_reads_f | insn_writes_f; }
+	else if ((op & 0xCF) == 0x43)
+		{ in.time = 20; in.props = insn_memory | insn_writes_mem; }
+	else if ((op & 0xCF) == 0x4B)
+		{ in.time = 20; in.props = insn_memory; }
+	else if (op == 0x44)
+		{ in.time = 8; in.props = insn_writes_f; }
+	else if ((op == 0x67) || (op == 0x6F))
+		{ in.time = 18; in.props = insn_reads_f | insn_writes_f | insn_memory | insn_writes_mem; }
+	else
+		return false;
+	return true;
+}
+
+static void decode_cb (jit_insn& in)
+{
+	uint8_t op = in.opcode;
+	uint8_t x = op >> 6;
+	bool hl = (in.xy == hl_ix_iy::hl);
+	bool memory = (op & 7) == 6;
+	if (x == 1)
+	{
+		in.time = !hl ? 20 : memory ? 12 : 8;
+		in.props = insn_reads_f | insn_writes_f | ((!hl || memory) ? insn_memory : 0);
+		return;
+	}
+
+	in.time = !hl ? ((memory || (x == 0)) ? 23 : 8) : memory ? 15 : 8;
+	in.props = memory ? (insn_memory | insn_writes_mem) : 0;
+	if (x == 0)
+		in.props |= ((op & 0x30) == 0x10) ? (insn_reads_f | insn_writes_f) : insn_writes_f;
+}
+
+// Decodes the instruction at "bytes", of which at least four are readable. Returns false for those
+// the compiler leaves to the interpreter.
+static bool decode (const uint8_t* bytes, uint16_t pc, jit_insn& in)
+{
+	in = { };
+	in.pc = pc;
+	in.xy = hl_ix_iy::hl;
+
+	uint32_t i = 0;
+	uint8_t op = bytes[i++];
+	if ((op == 0xDD) || (op == 0xFD))
+	{
+		in.xy = (op == 0xDD) ? hl_ix_iy::ix : hl_ix_iy::iy;
+		op = bytes[i++];
+		if ((op == 0xDD) || (op == 0xFD) || (op == 0xED))
+			return false;
+	}
+
+	if (op == 0xED)
+	{
+		in.group = jit_group::ed;
+		in.opcode = bytes[i++];
+		in.r_increment = 2;
+		if (!decode_ed(in))
+			return false;
+		if ((in.opcode & 0xC7) == 0x43)
+		{
+			in.operand = bytes[i] | (bytes[i + 1] << 8);
+			i += 2;
+		}
+	}
+	else if (op == 0xCB)
+	{
+		in.group = jit_group::cb;
+		if (in.xy != hl_ix_iy::hl)
+			in.disp = (int8_t)bytes[i++];
+		in.opcode = bytes[i++];
+		in.r_increment = 2;
+		decode_cb(in);
+	}
+	else
+	{
+		in.group = jit_group::main;
+		in.opcode = op;
+		in.r_increment = (in.xy == hl_ix_iy::hl) ? 1 : 2;
+		if (!decode_main(in))
+			return false;
+		if ((in.xy != hl_ix_iy::hl) && uses_memory_hl(op))
+			in.disp = (int8_t)bytes[i++];
+		uint32_t size = operand_size(op);
+		if (size == 1)
+			in.operand = bytes[i++];
+		else if (size == 2)
+		{
+			in.operand = bytes[i] | (bytes[i + 1] << 8);
+			i += 2;
+		}
+	}
+
+	in.length = (uint8_t)i;
+	return true;
+}
+
+// Finds out after which instructions F may be seen: at the end of the block, where the block may exit (before
+// an instruction that accesses memory, after one that writes it), and where an instruction reads F.
+static void compute_f_liveness (jit_insn* insns, uint32_t count)
+{
+	bool live = true;
+	for (uint32_t i = count; i--; )
+	{
+		jit_insn& in = insns[i];
+		in.f_live = live || (in.props & insn_writes_mem);
+		live = (in.props & (insn_reads_f | insn_memory)) || (in.f_live && !(in.props & insn_writes_f));
+	}
+}
+#pragma endregion
+
+#pragma region Compiler
+// Displacements of the fields the blocks access: from r14 for the CPU, from r13 for the bus.
+struct jit_layout
+{
+	int32_t bc, de, hl, af, sp, ix, iy, pc, r, iff1;
+	int32_t alt_bc, alt_de, alt_hl, alt_af;
+	int32_t time, start_of_stack;
+	int32_t write_count;
+};
+
+class block_compiler
+{
+	// Z80 registers that live in host registers.
+	enum : uint8_t { z80_bc = 1, z80_de = 2, z80_hl = 4, z80_sp = 8, z80_ix = 16, z80_iy = 32, z80_a = 64, z80_f = 128 };
+
+	// The frame below the saved registers.
+	static constexpr int32_t frame_time_limit = 0;  // the argument
+	static constexpr int32_t frame_r = 8;           // what earlier runs through the block added to R
+	static constexpr int32_t frame_last_pc = 12;    // what to return for an exit before the first instruction
+	static constexpr int32_t frame_size = 24;       // keeps rsp aligned to 16 after the eight pushes
+
+	static constexpr int32_t last_pc_from_frame = -2;
+	static constexpr uint32_t no_label = UINT32_MAX;
+
+	x64_assembler& a;
+	const jit_layout& L;
+	const jit_insn* _insns;
+	uint32_t _count;
+	uint16_t _start;
+	uint16_t _size;
+	uint32_t _prefix_time;
+
+	uint8_t _used = 0;    // loaded by the prologue
+	uint8_t _written = 0; // stored by the epilogue
+
+	uint32_t _body;
+	uint32_t _epilogue;
+
+	// The instruction being compiled, and the time and R increment from the start of the block to it.
+	const jit_insn* _in = nullptr;
+	uint32_t _index = 0;
+	uint32_t _time = 0;
+	uint32_t _r = 0;
+	uint32_t _exit_before = no_label;
+	uint32_t _exit_after = no_label;
+
+	struct exit_stub
+	{
+		uint32_t label;
+		uint16_t pc;
+		uint32_t time;
+		uint32_t r;
+		int32_t  last_pc;
+	};
+
+	static constexpr uint32_t max_stubs = 256;
+	exit_stub _stubs[max_stubs];
+	uint32_t _stub_count = 0;
+	bool _too_many_stubs = false;
+
+public:
+	block_compiler (x64_assembler& a, const jit_layout& layout, const jit_insn* insns, uint32_t count)
+		: a(a), L(layout), _insns(insns), _count(count)
+	{
+		_start = insns[0].pc;
+		_size = (uint16_t)(insns[count - 1].pc + insns[count - 1].length - _start);
+		_prefix_time = 0;
+		for (uint32_t i = 0; i + 1 < count; i++)
+			_prefix_time += insns[i].time;
+	}
+
+	uint32_t prefix_time() const { return _prefix_time; }
+
+	// Emits the body and the epilogue. Returns false if something didn't fit.
+	bool compile_body()
+	{
+		_body = a.new_label();
+		_epilogue = a.new_label();
+		a.bind(_body);
+
+		for (_index = 0; _index < _count; _index++)
+		{
+			_in = &_insns[_index];
+			_exit_before = no_label;
+			_exit_after = no_label;
+			switch (_in->group)
+			{
+				case jit_group::main: compile_main(); break;
+				case jit_group::ed:   compile_ed(); break;
+				default:              compile_cb(); break;
+			}
+
+			_time += _in->time;
+			_r += _in->r_increment;
+		}
+
+		const jit_insn& last = _insns[_count - 1];
+		if (!(last.props & insn_ends))
+			exit(last.pc + last.length, _time, _r, last.pc);
+
+		for (uint32_t i = 0; i < _stub_count; i++)
+		{
+			auto& s = _stubs[i];
+			a.bind(s.label);
+			exit(s.pc, s.time, s.r, s.last_pc);
+		}
+
+		emit_epilogue();
+		return !_too_many_stubs;
+	}
+
+	// Emits the prologue, which loads the registers the body uses and falls through into it.
+	void compile_prologue (const void* regs, const void* pages)
+	{
+		for (uint8_t r : { rbx, rbp, rsi, rdi, r12, r13, r14, r15 })
+			a.push(r);
+		a.alu_imm(alu_sub, 8, reg(rsp), frame_size);
+	#ifdef _WIN32
+		a.mov(8, mem(rsp, frame_time_limit), rcx);
+	#else
+		a.mov(8, mem(rsp, frame_time_limit), rdi);
+	#endif
+		a.mov_imm(4, mem(rsp, frame_r), 0);
+		a.mov_imm(4, mem(rsp, frame_last_pc), -1);
+		a.mov_imm(8, reg(r14), (int64_t)(uintptr_t)regs);
+		a.mov_imm(8, reg(r13), (int64_t)(uintptr_t)pages);
+
+		for (auto [mask, host, disp] : pair_fields())
+		{
+			if (_used & mask)
+				a.movzx(host, mem(r14, disp), 2);
+		}
+
+		if (_used & z80_a)
+			a.movzx(r8, mem(r14, L.af + 1), 1);
+		if (_used & z80_f)
+			a.movzx(r9, mem(r14, L.af), 1);
+	}
+
+private:
+	struct pair_field
+	{
+		uint8_t mask;
+		uint8_t host;
+		int32_t disp;
+	};
+
+	std::array<pair_field, 6> pair_fields() const
+	{
+		return { { { z80_bc, rbx, L.bc }, { z80_de, rdx, L.de }, { z80_hl, rcx, L.hl },
+			{ z80_sp, r10, L.sp }, { z80_ix, r11, L.ix }, { z80_iy, r12, L.iy } } };
+	}
+
+	void use (uint8_t mask) { _used |= mask; }
+
+	// Registers the block writes are also loaded, since an exit may come before the write.
+	void def (uint8_t mask)
+	{
+		_used |= mask;
+		_written |= mask;
+	}
+
+	static uint8_t xy_host (hl_ix_iy xy) { return (xy == hl_ix_iy::hl) ? rcx : (xy == hl_ix_iy::ix) ? r11 : r12; }
+	static uint8_t xy_mask (hl_ix_iy xy) { return (xy == hl_ix_iy::hl) ? z80_hl : (xy == hl_ix_iy::ix) ? z80_ix : z80_iy; }
+
+	// BC, DE, HL/IX/IY or SP, as in bits 4-5 of the opcodes.
+	static uint8_t rr_host (uint8_t p, hl_ix_iy xy)
+	{
+		static constexpr uint8_t hosts[] = { rbx, rdx, rcx, r10 };
+		return (p == 2) ? xy_host(xy) : hosts[p];
+	}
+
+	static uint8_t rr_mask (uint8_t p, hl_ix_iy xy)
+	{
+		static constexpr uint8_t masks[] = { z80_bc, z80_de, z80_hl, z80_sp };
+		return (p == 2) ? xy_mask(xy) : masks[p];
+	}
+
+	// Loads into eax, zero-extended, the 8-bit register "i" (as in bits 0-2 of the opcodes, other than 6),
+	// with "xy" choosing between H/L, IXH/IXL and IYH/IYL.
+	void load_r8 (uint8_t i, hl_ix_iy xy)
+	{
+		switch (i)
+		{
+			case 0: use(z80_bc); a.movzx(rax, reg(bh), 1); break;
+			case 1: use(z80_bc); a.movzx(rax, reg(rbx), 1); break;
+			case 2: use(z80_de); a.movzx(rax, reg(dh), 1); break;
+			case 3: use(z80_de); a.movzx(rax, reg(rdx), 1); break;
+			case 4:
+				use(xy_mask(xy));
+				if (xy == hl_ix_iy::hl)
+					a.movzx(rax, reg(ch), 1);
+				else
+				{
+					a.mov(4, reg(rax), xy_host(xy));
+					a.shift(shift_shr, 4, reg(rax), 8);
+				}
+				break;
+			case 5: use(xy_mask(xy)); a.movzx(rax, reg(xy_host(xy)), 1); break;
+			default: use(z80_a); a.mov(4, reg(rax), r8); break;
+		}
+	}
+
+	// Stores al into the 8-bit register "i"; the rest of eax may hold anything, and stays as it is.
+	// Changes edi and the host flags.
+	void store_r8 (uint8_t i, hl_ix_iy xy)
+	{
+		switch (i)
+		{
+			case 0: def(z80_bc); a.mov(1, reg(bh), rax); break;
+			case 1: def(z80_bc); a.mov(1, reg(rbx), rax); break;
+			case 2: def(z80_de); a.mov(1, reg(dh), rax); break;
+			case 3: def(z80_de); a.mov(1, reg(rdx), rax); break;
+			case 4:
+				def(xy_mask(xy));
+				if (xy == hl_ix_iy::hl)
+					a.mov(1, reg(ch), rax);
+				else
+				{
+					a.movzx(rdi, reg(rax), 1);
+					a.shift(shift_shl, 4, reg(rdi), 8);
+					a.alu_imm(alu_and, 4, reg(xy_host(xy)), 0xFF);
+					a.alu(alu_or, 4, reg(xy_host(xy)), rdi);
+				}
+				break;
+			case 5: def(xy_mask(xy)); a.mov(1, reg(xy_host(xy)), rax); break;
+			default: def(z80_a); a.movzx(r8, reg(rax), 1); break;
+		}
+	}
+
+	#pragma region Exits
+	void exit (int32_t pc, uint32_t time, uint32_t r, int32_t last_pc)
+	{
+		if (time)
+			a.alu_imm(alu_add, 8, mem(r14, L.time), (int32_t)time);
+		if (pc >= 0)
+			a.mov_imm(4, reg(rsi), pc);
+		if (last_pc == last_pc_from_frame)
+			a.mov_load(4, rdi, mem(rsp, frame_last_pc));
+		else
+			a.mov_imm(4, reg(rdi), last_pc);
+		a.mov_imm(4, reg(rax), r & 0x7F);
+		a.jmp(_epilogue);
+	}
+
+	uint32_t add_stub (uint16_t pc, uint32_t time, uint32_t r, int32_t last_pc)
+	{
+		uint32_t label = a.new_label();
+		if (_stub_count < max_stubs)
+			_stubs[_stub_count++] = { label, pc, time, r, last_pc };
+		else
+			_too_many_stubs = true;
+		return label;
+	}
+
+	// Where to go to exit with the current instruction not executed.
+	uint32_t exit_before()
+	{
+		if (_exit_before == no_label)
+			_exit_before = add_stub(_in->pc, _time, _r, _index ? _insns[_index - 1].pc : last_pc_from_frame);
+		return _exit_before;
+	}
+
+	// Where to go to exit with the current instruction executed; not for those that transfer control.
+	uint32_t exit_after()
+	{
+		if (_exit_after == no_label)
+			_exit_after = add_stub(_in->pc + _in->length, _time + _in->time, _r + _in->r_increment, _in->pc);
+		return _exit_after;
+	}
+
+	// Exits to "pc" once the current instruction took "time". If that's the start of the block, goes back
+	// there instead while the first instructions of another run begin before the time limit.
+	void jump (uint16_t pc, uint8_t time)
+	{
+		uint32_t t = _time + time;
+		uint32_t r = _r + _in->r_increment;
+		if (pc == _start)
+		{
+			uint32_t out = a.new_label();
+			a.mov_load(8, rax, mem(r14, L.time));
+			a.alu_imm(alu_add, 8, reg(rax), (int32_t)t);
+			a.lea(8, rdi, mem(rax, (int32_t)_prefix_time));
+			a.alu_load(alu_cmp, 8, rdi, mem(rsp, frame_time_limit));
+			a.jcc(cc_ae, out);
+			a.mov(8, mem(r14, L.time), rax);
+			a.alu_imm(alu_add, 4, mem(rsp, frame_r), (int32_t)r);
+			a.mov_imm(4, mem(rsp, frame_last_pc), _in->pc);
+			a.jmp(_body);
+			a.bind(out);
+		}
+
+		exit(pc, t, r, _in->pc);
+	}
+
+	// Exits to the address in esi once the current instruction took "time".
+	void jump_esi (uint8_t time)
+	{
+		exit(-1, _time + time, _r + _in->r_increment, _in->pc);
+	}
+
+	// Jumps to "not_taken" unless condition "cc" (as in bits 3-5 of the opcodes) holds.
+	void jump_unless (uint8_t cc, uint32_t not_taken)
+	{
+		static constexpr uint8_t masks[] = { z80_flag::z, z80_flag::c, z80_flag::pv, z80_flag::s };
+		use(z80_f);
+		a.test_imm(1, reg(r9), masks[cc >> 1]);
+		a.jcc((cc & 1) ? cc_e : cc_ne, not_taken);
+	}
+
+	void emit_epilogue()
+	{
+		a.bind(_epilogue);
+		a.mov(2, mem(r14, L.pc), rsi);
+		a.alu_load(alu_add, 4, rax, mem(rsp, frame_r));
+		a.movzx(rbp, mem(r14, L.r), 1);
+		a.alu(alu_add, 4, reg(rax), rbp);
+		a.alu_imm(alu_and, 4, reg(rax), 0x7F);
+		a.alu_imm(alu_and, 4, reg(rbp), 0x80);
+		a.alu(alu_or, 4, reg(rax), rbp);
+		a.mov(1, mem(r14, L.r), rax);
+
+		for (auto [mask, host, disp] : pair_fields())
+		{
+			if (_written & mask)
+				a.mov(2, mem(r14, disp), host);
+		}
+
+		if (_written & z80_a)
+			a.mov(1, mem(r14, L.af + 1), r8);
+		if (_written & z80_f)
+			a.mov(1, mem(r14, L.af), r9);
+
+		a.mov(4, reg(rax), rdi);
+		a.alu_imm(alu_add, 8, reg(rsp), frame_size);
+		for (uint8_t r : { r15, r14, r13, r12, rdi, rsi, rbp, rbx })
+			a.pop(r);
+		a.ret();
+	}
+	#pragma endregion
+
+	#pragma region Memory
+	// rdi = the page of the address in "addr" times sizeof(MemoryPage).
+	void page_offset (uint8_t addr)
+	{
+		a.mov(4, reg(rdi), addr);
+		a.shift(shift_shr, 4, reg(rdi), 8);
+		a.imul_imm(4, rdi, reg(rdi), sizeof(MemoryPage));
+	}
+
+	// Exits before the instruction unless the page of the address in "addr" is mapped for the access and not watched.
+	void check (uint8_t addr, bool write)
+	{
+		page_offset(addr);
+		a.alu_imm(alu_cmp, 1, mem(r13, rdi, 1, offsetof(MemoryPage, watch)), 0);
+		a.jcc(cc_ne, exit_before());
+		a.alu_imm(alu_cmp, 8, mem(r13, rdi, 1, write ? offsetof(MemoryPage, write) : offsetof(MemoryPage, read)), 0);
+		a.jcc(cc_e, exit_before());
+	}
+
+	// r15d = the address after the one in esi.
+	void next_address()
+	{
+		a.lea(4, r15, mem(rsi, 1));
+		a.movzx(r15, reg(r15), 2);
+	}
+
+	// Checks the addresses in esi and the one after it; leaves the latter in r15d.
+	void check16 (bool write)
+	{
+		check(rsi, write);
+		next_address();
+		check(r15, write);
+	}
+
+	// Reads into "dst" the byte at the address in "addr", whose page was checked. Changes rdi.
+	void read_byte (uint8_t addr, uint8_t dst)
+	{
+		page_offset(addr);
+		a.mov_load(8, rdi, mem(r13, rdi, 1, offsetof(MemoryPage, read)));
+		a.movzx(dst, reg(addr), 1);
+		a.movzx(dst, mem(rdi, dst, 1, 0), 1);
+	}
+
+	// Reads into eax the word at the address in esi, whose pages were checked. Changes rdi, rbp and r15.
+	void read16()
+	{
+		next_address();
+		read_byte(rsi, rax);
+		read_byte(r15, rbp);
+		a.shift(shift_shl, 4, reg(rbp), 8);
+		a.alu(alu_or, 4, reg(rax), rbp);
+	}
+
+	// Writes al to the address in "addr", whose page was checked. "counted" is for the writes the interpreter
+	// makes with try_write_request rather than Bus::write. Changes rdi, rbp and the host flags.
+	void write_byte (uint8_t addr, bool counted)
+	{
+		page_offset(addr);
+		a.lea(8, rdi, mem(r13, rdi, 1, 0));
+		a.mov_load(8, rbp, mem(rdi, offsetof(MemoryPage, write)));
+		a.mov_imm(1, mem(rdi, offsetof(MemoryPage, code_written)), 1);
+		a.movzx(rdi, reg(addr), 1);
+		a.mov(1, mem(rbp, rdi, 1, 0), rax);
+		if (counted)
+			a.alu_imm(alu_add, 4, mem(r13, L.write_count), 1);
+	}
+
+	// Writes ax to the address in esi, whose pages were checked. Changes eax, rdi, rbp, r15 and the host flags.
+	void write16 (bool counted)
+	{
+		next_address();
+		write_byte(rsi, counted);
+		a.shift(shift_shr, 4, reg(rax), 8);
+		write_byte(r15, counted);
+	}
+
+	// After a write of "size" bytes at the address in esi, exits if they overlap the block.
+	void exit_if_written_block (uint32_t size)
+	{
+		a.mov(4, reg(rdi), rsi);
+		a.alu_imm(alu_sub, 4, reg(rdi), (int32_t)(uint16_t)(_start - (size - 1)));
+		a.alu_imm(alu_and, 4, reg(rdi), 0xFFFF);
+		a.alu_imm(alu_cmp, 4, reg(rdi), (int32_t)(_size + size - 1));
+		a.jcc(cc_b, exit_after());
+	}
+
+	// Same for an address known when compiling.
+	void exit_if_written_block (uint16_t address, uint32_t size)
+	{
+		if ((uint16_t)(address - (uint16_t)(_start - (size - 1))) < _size + size - 1)
+			a.jmp(exit_after());
+	}
+
+	// esi = the address of (hl), (ix+d) or (iy+d).
+	void address_hl()
+	{
+		uint8_t host = xy_host(_in->xy);
+		use(xy_mask(_in->xy));
+		if (_in->xy == hl_ix_iy::hl)
+			a.mov(4, reg(rsi), host);
+		else
+		{
+			a.lea(4, rsi, mem(host, _in->disp));
+			a.movzx(rsi, reg(rsi), 2);
+		}
+	}
+	#pragma endregion
+
+	#pragma region Flags
+	// Right after an instruction that set the host flags as the Z80 would have (other than N and the copies
+	// of result bits), keeps them in ah and r15b, for compose_flags. Does nothing if F is dead.
+	void capture_flags()
+	{
+		if (_in->f_live)
+		{
+			a.lahf();
+			a.setcc(cc_o, reg(r15));
+		}
+	}
+
+	// F = the S, Z, H and C flags in ah, P/V from r15b (the overflow), N, and bits 3 and 5 from "x_source",
+	// for the 8-bit arithmetic. "x_source" may be rax, whose low byte is kept by capture_flags.
+	void compose_flags (uint8_t x_source, bool n)
+	{
+		def(z80_f);
+		a.movzx(r15, reg(r15), 1);
+		a.mov(4, reg(r9), x_source);
+		a.alu_imm(alu_and, 4, reg(r9), z80_flag::r3 | z80_flag::r5);
+		a.shift(shift_shr, 4, reg(rax), 8);
+		a.alu_imm(alu_and, 4, reg(rax), z80_flag::s | z80_flag::z | z80_flag::h | z80_flag::c);
+		a.lea(4, rax, mem(rax, r15, 4, n ? z80_flag::n : 0));
+		a.alu(alu_or, 4, reg(r9), rax);
+	}
+
+	// F = S, Z and P/V (parity) from the host flags in ah, bits 3 and 5 from the register "x_source",
+	// then "or_flags"; keeps the bits of F in "keep".
+	void compose_logic_flags (uint8_t x_source, uint8_t or_flags, uint8_t keep)
+	{
+		def(z80_f);
+		a.shift(shift_shr, 4, reg(rax), 8);
+		a.alu_imm(alu_and, 4, reg(rax), z80_flag::s | z80_flag::z | z80_flag::pv);
+		if (or_flags)
+			a.alu_imm(alu_or, 4, reg(rax), or_flags);
+		a.mov(4, reg(rdi), x_source);
+		a.alu_imm(alu_and, 4, reg(rdi), z80_flag::r3 | z80_flag::r5);
+		a.alu(alu_or, 4, reg(rax), rdi);
+		if (keep)
+		{
+			a.alu_imm(alu_and, 4, reg(r9), keep);
+			a.alu(alu_or, 4, reg(r9), rax);
+		}
+		else
+			a.mov(4, reg(r9), rax);
+	}
+
+	// Replaces bits 3 and 5 of F with those of A.
+	void x_flags_from_a()
+	{
+		a.mov(4, reg(rdi), r8);
+		a.alu_imm(alu_and, 4, reg(rdi), z80_flag::r3 | z80_flag::r5);
+		a.alu(alu_or, 4, reg(r9), rdi);
+	}
+
+	// add/adc/sub/sbc/and/xor/or/cp of al to A, as in bits 3-5 of the opcodes.
+	void alu_a (uint8_t y)
+	{
+		static constexpr x64_alu ops[] = { alu_add, alu_adc, alu_sub, alu_sbb, alu_and, alu_xor, alu_or, alu_cmp };
+		use(z80_a);
+		if (y != 7)
+			def(z80_a);
+		if ((y == 1) || (y == 3))
+		{
+			use(z80_f);
+			a.bt(4, reg(r9), 0);
+		}
+
+		a.alu(ops[y], 1, reg(r8), rax);
+		if (!_in->f_live)
+			return;
+
+		if ((y >= 4) && (y <= 6))
+		{
+			a.lahf();
+			compose_logic_flags(r8, (y == 4) ? z80_flag::h : 0, 0);
+		}
+		else
+		{
+			capture_flags();
+			compose_flags((y == 7) ? rax : r8, y >= 2);
+		}
+	}
+	#pragma endregion
+
+	#pragma region Main instructions
+	void compile_main()
+	{
+		const jit_insn& in = *_in;
+		uint8_t op = in.opcode;
+		hl_ix_iy xy = in.xy;
+		uint8_t y = (op >> 3) & 7;
+		uint8_t z = op & 7;
+		uint8_t p = y >> 1;
+		uint16_t next = in.pc + in.length;
+
+		switch (op >> 6)
+		{
+			case 0:
+				switch (z)
+				{
+					case 0:
+						if (op == 0x08)
+							ex_af();
+						else if (op == 0x10)
+						{
+							// djnz
+							uint32_t not_taken = a.new_label();
+							def(z80_bc);
+							a.dec(1, reg(bh));
+							a.jcc(cc_e, not_taken);
+							jump(next + (int8_t)in.operand, in.time_taken);
+							a.bind(not_taken);
+							jump(next, in.time);
+						}
+						else if (op == 0x18)
+							jump(next + (int8_t)in.operand, in.time);
+						else if (op >= 0x20)
+						{
+							uint32_t not_taken = a.new_label();
+							jump_unless(y - 4, not_taken);
+							jump(next + (int8_t)in.operand, in.time_taken);
+							a.bind(not_taken);
+							jump(next, in.time);
+						}
+						break;
+
+					case 1:
+						if (y & 1)
+							add_hl_rr(rr_host(p, xy), rr_mask(p, xy));
+						else
+						{
+							def(rr_mask(p, xy));
+							a.mov_imm(4, reg(rr_host(p, xy)), in.operand);
+							if (p == 3)
+								a.mov_imm(2, mem(r14, L.start_of_stack), in.operand);
+						}
+						break;
+
+					case 2:
+						memory_a_hl(op);
+						break;
+
+					case 3:
+						def(rr_mask(p, xy));
+						if (y & 1)
+							a.dec(2, reg(rr_host(p, xy)));
+						else
+							a.inc(2, reg(rr_host(p, xy)));
+						break;
+
+					case 4:
+					case 5:
+						inc_dec(y, z == 5);
+						break;
+
+					case 6:
+						a.mov_imm(4, reg(rax), (uint8_t)in.operand);
+						if (y == 6)
+						{
+							address_hl();
+							check(rsi, true);
+							write_byte(rsi, true);
+							exit_if_written_block(1);
+						}
+						else
+							store_r8(y, xy);
+						break;
+
+					default:
+						accumulator_flags(op);
+						break;
+				}
+				break;
+
+			case 1:
+				if (y == 6)
+				{
+					address_hl();
+					check(rsi, true);
+					load_r8(z, hl_ix_iy::hl);
+					write_byte(rsi, true);
+					exit_if_written_block(1);
+				}
+				else if (z == 6)
+				{
+					address_hl();
+					check(rsi, false);
+					read_byte(rsi, rax);
+					store_r8(y, hl_ix_iy::hl);
+				}
+				else
+				{
+					load_r8(z, xy);
+					store_r8(y, xy);
+				}
+				break;
+
+			case 2:
+				if (z == 6)
+				{
+					address_hl();
+					check(rsi, false);
+					read_byte(rsi, rax);
+				}
+				else
+					load_r8(z, xy);
+				alu_a(y);
+				break;
+
+			default:
+				switch (z)
+				{
+					case 0:
+					{
+						uint32_t not_taken = a.new_label();
+						jump_unless(y, not_taken);
+						ret(false, in.time_taken);
+						a.bind(not_taken);
+						jump(next, in.time);
+						break;
+					}
+
+					case 1:
+						if (op == 0xC9)
+							ret(true, in.time);
+						else if (op == 0xD9)
+							exx();
+						else if (op == 0xE9)
+						{
+							use(xy_mask(xy));
+							a.mov(4, reg(rsi), xy_host(xy));
+							jump_esi(in.time);
+						}
+						else if (op == 0xF9)
+						{
+							use(xy_mask(xy));
+							def(z80_sp);
+							a.mov(4, reg(r10), xy_host(xy));
+							a.mov(2, mem(r14, L.start_of_stack), r10);
+						}
+						else
+							pop(p, xy);
+						break;
+
+					case 2:
+					{
+						uint32_t not_taken = a.new_label();
+						jump_unless(y, not_taken);
+						jump(in.operand, in.time_taken);
+						a.bind(not_taken);
+						jump(next, in.time);
+						break;
+					}
+
+					case 3:
+						if (op == 0xC3)
+							jump(in.operand, in.time);
+						else if (op == 0xE3)
+							ex_sp_hl(xy);
+						else if (op == 0xEB)
+						{
+							def(z80_de | z80_hl);
+							a.xchg(4, reg(rcx), rdx);
+						}
+						else
+							a.mov_imm(1, mem(r14, L.iff1), 0); // di
+						break;
+
+					case 4:
+					{
+						uint32_t not_taken = a.new_label();
+						jump_unless(y, not_taken);
+						call(in.operand, next, in.time_taken);
+						a.bind(not_taken);
+						jump(next, in.time);
+						break;
+					}
+
+					case 5:
+						if (op == 0xCD)
+							call(in.operand, next, in.time);
+						else
+							push(p, xy);
+						break;
+
+					case 6:
+						a.mov_imm(4, reg(rax), (uint8_t)in.operand);
+						alu_a(y);
+						break;
+
+					default:
+						call(op & 0x38, next, in.time);
+						break;
+				}
+				break;
+		}
+	}
+
+	void ex_af()
+	{
+		def(z80_a | z80_f);
+		a.movzx(rax, mem(r14, L.alt_af), 2);
+		a.mov(1, mem(r14, L.alt_af), r9);
+		a.mov(1, mem(r14, L.alt_af + 1), r8);
+		a.movzx(r9, reg(rax), 1);
+		a.shift(shift_shr, 4, reg(rax), 8);
+		a.mov(4, reg(r8), rax);
+	}
+
+	void exx()
+	{
+		def(z80_bc | z80_de | z80_hl);
+		for (auto [host, disp] : { std::pair<uint8_t, int32_t> { rbx, L.alt_bc }, { rdx, L.alt_de }, { rcx, L.alt_hl } })
+		{
+			a.movzx(rax, mem(r14, disp), 2);
+			a.mov(2, mem(r14, disp), host);
+			a.mov(4, reg(host), rax);
+		}
+	}
+
+	// add hl/ix/iy, rr
+	void add_hl_rr (uint8_t src, uint8_t src_mask)
+	{
+		uint8_t dst = xy_host(_in->xy);
+		def(xy_mask(_in->xy));
+		use(src_mask);
+		a.mov(4, reg(rax), dst);
+		a.mov(4, reg(rdi), src);
+		a.alu(alu_add, 2, reg(dst), rdi);
+		if (!_in->f_live)
+			return;
+
+		// H from the carry into bit 12, C from the carry out of bit 15, bits 3 and 5 from the high byte.
+		def(z80_f);
+		a.setcc(cc_b, reg(r15));
+		a.movzx(r15, reg(r15), 1);
+		a.alu(alu_xor, 4, reg(rax), rdi);
+		a.alu(alu_xor, 4, reg(rax), dst);
+		a.shift(shift_shr, 4, reg(rax), 8);
+		a.alu_imm(alu_and, 4, reg(rax), z80_flag::h);
+		a.alu(alu_or, 4, reg(rax), r15);
+		a.mov(4, reg(rdi), dst);
+		a.shift(shift_shr, 4, reg(rdi), 8);
+		a.alu_imm(alu_and, 4, reg(rdi), z80_flag::r3 | z80_flag::r5);
+		a.alu(alu_or, 4, reg(rax), rdi);
+		a.alu_imm(alu_and, 4, reg(r9), z80_flag::s | z80_flag::z | z80_flag::pv);
+		a.alu(alu_or, 4, reg(r9), rax);
+	}
+
+	// ld (bc)/(de), a; ld a, (bc)/(de); ld (nn), hl/ix/iy; ld hl/ix/iy, (nn); ld (nn), a; ld a, (nn)
+	void memory_a_hl (uint8_t op)
+	{
+		const jit_insn& in = *_in;
+		bool store = !(op & 8);
+		if (op < 0x20)
+		{
+			uint8_t pair = (op & 0x10) ? rdx : rbx;
+			use((op & 0x10) ? z80_de : z80_bc);
+			a.mov(4, reg(rsi), pair);
+		}
+		else
+			a.mov_imm(4, reg(rsi), in.operand);
+
+		if ((op & 0xF7) == 0x22)
+		{
+			// 16-bit
+			uint8_t host = xy_host(in.xy);
+			check16(store);
+			if (store)
+			{
+				use(xy_mask(in.xy));
+				a.mov(4, reg(rax), host);
+				write16(true);
+				exit_if_written_block(in.operand, 2);
+			}
+			else
+			{
+				def(xy_mask(in.xy));
+				read16();
+				a.mov(4, reg(host), rax);
+			}
+			return;
+		}
+
+		// The opcodes with bit 3 clear store A.
+		if (store)
+		{
+			use(z80_a);
+			check(rsi, true);
+			a.mov(4, reg(rax), r8);
+			write_byte(rsi, true);
+			if (op < 0x20)
+				exit_if_written_block(1);
+			else
+				exit_if_written_block(in.operand, 1);
+		}
+		else
+		{
+			def(z80_a);
+			check(rsi, false);
+			read_byte(rsi, rax);
+			a.mov(4, reg(r8), rax);
+		}
+	}
+
+	// inc r / dec r, with r as in bits 3-5 of the opcodes
+	void inc_dec (uint8_t y, bool dec)
+	{
+		if (y == 6)
+		{
+			address_hl();
+			check(rsi, false);
+			check(rsi, true);
+			read_byte(rsi, rax);
+		}
+		else
+			load_r8(y, _in->xy);
+
+		if (dec)
+			a.dec(1, reg(rax));
+		else
+			a.inc(1, reg(rax));
+		capture_flags();
+
+		if (y == 6)
+			write_byte(rsi, false);
+		else
+			store_r8(y, _in->xy);
+
+		if (_in->f_live)
+		{
+			// S, Z, H and P/V from the host flags, N, bits 3 and 5 from the result, and C as it was.
+			def(z80_f);
+			a.movzx(r15, reg(r15), 1);
+			a.mov(4, reg(rdi), rax);
+			a.alu_imm(alu_and, 4, reg(rdi), z80_flag::r3 | z80_flag::r5);
+			a.shift(shift_shr, 4, reg(rax), 8);
+			a.alu_imm(alu_and, 4, reg(rax), z80_flag::s | z80_flag::z | z80_flag::h);
+			a.lea(4, rax, mem(rax, r15, 4, dec ? z80_flag::n : 0));
+			a.alu(alu_or, 4, reg(rax), rdi);
+			a.alu_imm(alu_and, 4, reg(r9), z80_flag::c);
+			a.alu(alu_or, 4, reg(r9), rax);
+		}
+
+		if (y == 6)
+			exit_if_written_block(1);
+	}
+
+	// rlca, rrca, rla, rra, daa (not compiled), cpl, scf, ccf
+	void accumulator_flags (uint8_t op)
+	{
+		bool live = _in->f_live;
+		if (live)
+			def(z80_f);
+		switch (op)
+		{
+			case 0x07:
+			case 0x0F:
+			case 0x17:
+			case 0x1F:
+			{
+				static constexpr x64_shift kinds[] = { shift_rol, shift_ror, shift_rcl, shift_rcr };
+				def(z80_a);
+				if (op >= 0x17)
+				{
+					use(z80_f);
+					a.bt(4, reg(r9), 0);
+				}
+
+				a.shift(kinds[op >> 3], 1, reg(r8), 1);
+				if (live)
+				{
+					a.setcc(cc_b, reg(r15));
+					a.movzx(r15, reg(r15), 1);
+					a.alu_imm(alu_and, 4, reg(r9), z80_flag::s | z80_flag::z | z80_flag::pv);
+					a.alu(alu_or, 4, reg(r9), r15);
+					x_flags_from_a();
+				}
+				break;
+			}
+
+			case 0x2F:
+				def(z80_a);
+				a.alu_imm(alu_xor, 4, reg(r8), 0xFF);
+				if (live)
+				{
+					a.alu_imm(alu_and, 4, reg(r9), z80_flag::s | z80_flag::z | z80_flag::pv | z80_flag::c);
+					a.alu_imm(alu_or, 4, reg(r9), z80_flag::h | z80_flag::n);
+					x_flags_from_a();
+				}
+				break;
+
+			case 0x37:
+				use(z80_a);
+				if (live)
+				{
+					a.alu_imm(alu_and, 4, reg(r9), z80_flag::s | z80_flag::z | z80_flag::pv);
+					a.alu_imm(alu_or, 4, reg(r9), z80_flag::c);
+					x_flags_from_a();
+				}
+				break;
+
+			default:
+				use(z80_a);
+				if (live)
+				{
+					// H = the old C, and C inverted.
+					a.mov(4, reg(rdi), r9);
+					a.alu_imm(alu_and, 4, reg(rdi), z80_flag::c);
+					a.shift(shift_shl, 4, reg(rdi), 4);
+					a.alu_imm(alu_xor, 4, reg(r9), z80_flag::c);
+					a.alu_imm(alu_and, 4, reg(r9), z80_flag::s | z80_flag::z | z80_flag::pv | z80_flag::c);
+					a.alu(alu_or, 4, reg(r9), rdi);
+					x_flags_from_a();
+				}
+				break;
+		}
+	}
+
+	// ret / ret cc; "adjust_stack_start" for ret, which moves the start of the stack as sim_c9 does.
+	void ret (bool adjust_stack_start, uint8_t time)
+	{
+		def(z80_sp);
+		a.mov(4, reg(rsi), r10);
+		check16(false);
+		if (adjust_stack_start)
+		{
+			uint32_t skip = a.new_label();
+			a.alu(alu_cmp, 2, mem(r14, L.start_of_stack), r10);
+			a.jcc(cc_ne, skip);
+			a.alu_imm(alu_add, 2, mem(r14, L.start_of_stack), 2);
+			a.bind(skip);
+		}
+
+		read16();
+		a.alu_imm(alu_add, 2, reg(r10), 2);
+		a.mov(4, reg(rsi), rax);
+		jump_esi(time);
+	}
+
+	// call nn / call cc, nn / rst, which write the return address with Bus::write.
+	void call (uint16_t target, uint16_t return_address, uint8_t time)
+	{
+		def(z80_sp);
+		a.lea(4, rsi, mem(r10, -2));
+		a.movzx(rsi, reg(rsi), 2);
+		check16(true);
+		a.mov_imm(4, reg(rax), return_address);
+		write16(false);
+		a.mov(4, reg(r10), rsi);
+		jump(target, time);
+	}
+
+	void push (uint8_t p, hl_ix_iy xy)
+	{
+		def(z80_sp);
+		a.lea(4, rsi, mem(r10, -2));
+		a.movzx(rsi, reg(rsi), 2);
+		check16(true);
+		if (p == 3)
+		{
+			use(z80_a | z80_f);
+			a.mov(4, reg(rax), r8);
+			a.shift(shift_shl, 4, reg(rax), 8);
+			a.alu(alu_or, 4, reg(rax), r9);
+		}
+		else
+		{
+			use(rr_mask(p, xy));
+			a.mov(4, reg(rax), rr_host(p, xy));
+		}
+
+		write16(true);
+		a.mov(4, reg(r10), rsi);
+		exit_if_written_block(2);
+	}
+
+	void pop (uint8_t p, hl_ix_iy xy)
+	{
+		def(z80_sp);
+		a.mov(4, reg(rsi), r10);
+		check16(false);
+		read16();
+		if (p == 3)
+		{
+			def(z80_a | z80_f);
+			a.movzx(r9, reg(rax), 1);
+			a.shift(shift_shr, 4, reg(rax), 8);
+			a.mov(4, reg(r8), rax);
+		}
+		else
+		{
+			def(rr_mask(p, xy));
+			a.mov(4, reg(rr_host(p, xy)), rax);
+		}
+
+		a.alu_imm(alu_add, 2, reg(r10), 2);
+	}
+
+	// ex (sp), hl/ix/iy, which reads with try_read_request and writes with Bus::write.
+	void ex_sp_hl (hl_ix_iy xy)
+	{
+		use(z80_sp);
+		def(xy_mask(xy));
+		a.mov(4, reg(rsi), r10);
+		check16(false);
+		check16(true);
+		read16();
+		a.xchg(4, reg(xy_host(xy)), rax);
+		write16(false);
+		exit_if_written_block(2);
+	}
+	#pragma endregion
+
+	#pragma region ED and CB instructions
+	void compile_ed()
+	{
+		const jit_insn& in = *_in;
+		uint8_t op = in.opcode;
+		uint8_t p = (op >> 4) & 3;
+		if ((op & 0xC7) == 0x42)
+		{
+			// sbc hl, rr / adc hl, rr
+			bool sbc = !(op & 8);
+			uint8_t src = rr_host(p, hl_ix_iy::hl);
+			use(rr_mask(p, hl_ix_iy::hl) | z80_f);
+			def(z80_hl);
+			a.mov(4, reg(rbp), rcx);
+			a.mov(4, reg(rdi), src);
+			a.bt(4, reg(r9), 0);
+			a.alu(sbc ? alu_sbb : alu_adc, 2, reg(rcx), rdi);
+			if (!in.f_live)
+				return;
+
+			// S, Z and C from the host flags, P/V from the overflow, H from the carry into bit 12,
+			// bits 3 and 5 from the high byte.
+			def(z80_f);
+			capture_flags();
+			a.movzx(r15, reg(r15), 1);
+			a.alu(alu_xor, 4, reg(rbp), rdi);
+			a.alu(alu_xor, 4, reg(rbp), rcx);
+			a.shift(shift_shr, 4, reg(rbp), 8);
+			a.alu_imm(alu_and, 4, reg(rbp), z80_flag::h);
+			a.shift(shift_shr, 4, reg(rax), 8);
+			a.alu_imm(alu_and, 4, reg(rax), z80_flag::s | z80_flag::z | z80_flag::c);
+			a.lea(4, rax, mem(rax, r15, 4, sbc ? z80_flag::n : 0));
+			a.alu(alu_or, 4, reg(rax), rbp);
+			a.mov(4, reg(rdi), rcx);
+			a.shift(shift_shr, 4, reg(rdi), 8);
+			a.alu_imm(alu_and, 4, reg(rdi), z80_flag::r3 | z80_flag::r5);
+			a.alu(alu_or, 4, reg(rax), rdi);
+			a.mov(4, reg(r9), rax);
+		}
+		else if ((op & 0xC7) == 0x43)
+		{
+			// ld (nn), rr / ld rr, (nn)
+			uint8_t host = rr_host(p, hl_ix_iy::hl);
+			bool store = !(op & 8);
+			a.mov_imm(4, reg(rsi), in.operand);
+			check16(store);
+			if (store)
+			{
+				use(rr_mask(p, hl_ix_iy::hl));
+				a.mov(4, reg(rax), host);
+				write16(true);
+				exit_if_written_block(in.operand, 2);
+			}
+			else
+			{
+				def(rr_mask(p, hl_ix_iy::hl));
+				read16();
+				a.mov(4, reg(host), rax);
+				if (p == 3)
+					a.mov(2, mem(r14, L.start_of_stack), rax);
+			}
+		}
+		else if (op == 0x44)
+		{
+			// neg
+			def(z80_a);
+			a.neg(1, reg(r8));
+			if (in.f_live)
+			{
+				capture_flags();
+				compose_flags(r8, true);
+			}
+		}
+		else
+			rrd_rld(op == 0x6F);
+	}
+
+	void rrd_rld (bool rld)
+	{
+		use(z80_hl);
+		def(z80_a);
+		a.mov(4, reg(rsi), rcx);
+		check(rsi, false);
+		check(rsi, true);
+		read_byte(rsi, rax);
+
+		// r15d = the new A, eax = the new (hl)
+		a.mov(4, reg(r15), r8);
+		a.alu_imm(alu_and, 4, reg(r15), 0xF0);
+		a.mov(4, reg(rdi), rax);
+		a.mov(4, reg(rbp), r8);
+		if (rld)
+		{
+			a.shift(shift_shr, 4, reg(rdi), 4);
+			a.shift(shift_shl, 4, reg(rax), 4);
+			a.alu_imm(alu_and, 4, reg(rbp), 0x0F);
+		}
+		else
+		{
+			a.alu_imm(alu_and, 4, reg(rdi), 0x0F);
+			a.shift(shift_shr, 4, reg(rax), 4);
+			a.shift(shift_shl, 4, reg(rbp), 4);
+		}
+
+		a.alu(alu_or, 4, reg(r15), rdi);
+		a.alu(alu_or, 4, reg(rax), rbp);
+		write_byte(rsi, true);
+		a.mov(4, reg(r8), r15);
+		if (_in->f_live)
+		{
+			use(z80_f);
+			a.test(1, reg(r8), r8);
+			a.lahf();
+			compose_logic_flags(r8, 0, z80_flag::c);
+		}
+
+		exit_if_written_block(1);
+	}
+
+	void compile_cb()
+	{
+		const jit_insn& in = *_in;
+		uint8_t op = in.opcode;
+		uint8_t x = op >> 6;
+		uint8_t y = (op >> 3) & 7;
+		uint8_t z = op & 7;
+		bool memory = (z == 6) || ((x == 1) && (in.xy != hl_ix_iy::hl));
+		if (memory)
+		{
+			address_hl();
+			check(rsi, false);
+			if (x != 1)
+				check(rsi, true);
+			read_byte(rsi, rax);
+		}
+		else
+			load_r8(z, hl_ix_iy::hl);
+
+		if (x == 0)
+		{
+			// rlc, rrc, rl, rr, sla, sra, sll, srl
+			static constexpr x64_shift kinds[] = { shift_rol, shift_ror, shift_rcl, shift_rcr, shift_shl, shift_sar, shift_shl, shift_shr };
+			if ((y == 2) || (y == 3))
+			{
+				use(z80_f);
+				a.bt(4, reg(r9), 0);
+			}
+
+			a.shift(kinds[y], 1, reg(rax), 1);
+			if (in.f_live)
+				a.setcc(cc_b, reg(r15));
+			if (y == 6)
+				a.alu_imm(alu_or, 1, reg(rax), 1);
+			if (in.f_live)
+			{
+				a.test(1, reg(rax), rax);
+				a.lahf();
+			}
+		}
+		else if (x == 1)
+		{
+			// bit
+			if (in.f_live)
+			{
+				// S, Z, P/V and bits 3 and 5 from the tested bit alone, H, and C as it was.
+				def(z80_f);
+				a.alu_imm(alu_and, 4, reg(rax), 1 << y);
+				a.mov(4, reg(rdi), rax);
+				a.alu_imm(alu_and, 4, reg(rdi), z80_flag::s | z80_flag::r5 | z80_flag::r3);
+				a.alu_imm(alu_cmp, 4, reg(rax), 1);
+				a.alu(alu_sbb, 4, reg(r15), r15);
+				a.alu_imm(alu_and, 4, reg(r15), z80_flag::z | z80_flag::pv);
+				a.alu(alu_or, 4, reg(rdi), r15);
+				a.alu_imm(alu_or, 4, reg(rdi), z80_flag::h);
+				a.alu_imm(alu_and, 4, reg(r9), z80_flag::c);
+				a.alu(alu_or, 4, reg(r9), rdi);
+			}
+			return;
+		}
+		else if (x == 2)
+			a.alu_imm(alu_and, 1, reg(rax), (uint8_t)~(1 << y));
+		else
+			a.alu_imm(alu_or, 1, reg(rax), (uint8_t)(1 << y));
+
+		if (memory)
+			write_byte(rsi, true);
+		else
+			store_r8(z, hl_ix_iy::hl);
+
+		if ((x == 0) && in.f_live)
+		{
+			def(z80_f);
+			a.movzx(r15, reg(r15), 1);
+			a.mov(4, reg(r9), rax);
+			a.shift(shift_shr, 4, reg(r9), 8);
+			a.alu_imm(alu_and, 4, reg(r9), z80_flag::s | z80_flag::z | z80_flag::pv);
+			a.alu(alu_or, 4, reg(r9), r15);
+			a.mov(4, reg(rdi), rax);
+			a.alu_imm(alu_and, 4, reg(rdi), z80_flag::r3 | z80_flag::r5);
+			a.alu(alu_or, 4, reg(r9), rdi);
+		}
+
+		if (memory)
+			exit_if_written_block(1);
+	}
+	#pragma endregion
+};
+#pragma endregion
+
+#pragma region Blocks and their memory
+// Memory for the compiled blocks. Its pages are executable or writable, never both: the compiler makes
+// the pages of a new block writable, copies the block there, and makes them executable again.
+class executable_memory
+{
+	uint8_t* _base = nullptr;
+	size_t _size = 0;
+
+	static constexpr size_t host_page_size = 0x1000;
+
+public:
+	executable_memory() = default;
+	executable_memory (const executable_memory&) = delete;
+	executable_memory& operator= (const executable_memory&) = delete;
+
+	~executable_memory()
+	{
+		if (_base)
+		{
+		#ifdef _WIN32
+			VirtualFree (_base, 0, MEM_RELEASE);
+		#else
+			munmap (_base, _size);
+		#endif
+		}
+	}
+
+	HRESULT allocate (size_t size)
+	{
+	#ifdef _WIN32
+		_base = (uint8_t*)VirtualAlloc (nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_EXECUTE_READ);
+		RETURN_IF_NULL_ALLOC(_base);
+	#else
+		void* p = mmap (nullptr, size, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		RETURN_HR_IF(E_OUTOFMEMORY, p == MAP_FAILED);
+		_base = (uint8_t*)p;
+	#endif
+		_size = size;
+		return S_OK;
+	}
+
+	uint8_t* base() const { return _base; }
+	size_t size() const { return _size; }
+
+	bool protect (size_t offset, size_t size, bool writable)
+	{
+		size_t begin = offset & ~(host_page_size - 1);
+		size_t end = (offset + size + host_page_size - 1) & ~(host_page_size - 1);
+	#ifdef _WIN32
+		DWORD old;
+		if (!VirtualProtect (_base + begin, end - begin, writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old))
+			return false;
+		if (!writable)
+			FlushInstructionCache (GetCurrentProcess(), _base + begin, end - begin);
+		return true;
+	#else
+		return !mprotect (_base + begin, end - begin, writable ? (PROT_READ | PROT_WRITE) : (PROT_READ | PROT_EXEC));
+	#endif
+	}
+};
+
+// Lives in executable memory, followed by the Z80 code it was compiled from, then by its x86-64 code.
+struct jit_block
+{
+	z80_jit_block_code code;
+	uint32_t prefix_time; // of all its instructions but the last
+	uint16_t size;        // of its Z80 code
+
+	const uint8_t* z80_code() const { return (const uint8_t*)(this + 1); }
+};
+
+class z80_jit : public IZ80Jit
+{
+	// Times the interpreter must start at an address before we compile the code there.
+	static constexpr uint16_t hot_runs = 16;
+	// In jit_entry::runs, for an address where compiling failed.
+	static constexpr uint16_t not_compilable = UINT16_MAX;
+
+	static constexpr uint32_t max_block_instructions = 64;
+	static constexpr size_t memory_size = 0x100000;
+	static constexpr uint32_t scratch_size = 0x10000;
+	static constexpr uint32_t prologue_room = 256;
+
+	struct jit_entry
+	{
+		uint32_t epoch; // of the page when "runs" and "block" were last valid
+		uint16_t runs;
+		const jit_block* block;
+	};
+
+	z80_jit_cpu _cpu;
+	jit_layout _layout;
+
+	// Allocated when the CPU first executes from a page; see cpu::_decoded.
+	wistd::unique_ptr<jit_entry[]> _entries[Bus::page_count];
+
+	executable_memory _memory;
+	size_t _memory_used = 0;
+
+	wistd::unique_ptr<uint8_t[]> _scratch; // where the compiler assembles a block
+	wistd::unique_ptr<x64_assembler> _assembler;
+	uint32_t _compiled_blocks = 0;
+
+public:
+	HRESULT InitInstance (const z80_jit_cpu& cpu)
+	{
+		_cpu = cpu;
+
+		auto regs = (const uint8_t*)cpu.regs;
+		bool far = false;
+		auto disp = [&far](const void* field, const void* base) -> int32_t
+		{
+			intptr_t d = (const uint8_t*)field - (const uint8_t*)base;
+			far |= (d != (int32_t)d);
+			return (int32_t)d;
+		};
+
+		auto& r = *cpu.regs;
+		_layout = {
+			.bc = disp(&r.main.bc, regs), .de = disp(&r.main.de, regs), .hl = disp(&r.main.hl, regs), .af = disp(&r.main.af, regs),
+			.sp = disp(&r.sp, regs), .ix = disp(&r.ix, regs), .iy = disp(&r.iy, regs), .pc = disp(&r.pc, regs),
+			.r = disp(&r.r, regs), .iff1 = disp(&r.iff1, regs),
+			.alt_bc = disp(&r.alt.bc, regs), .alt_de = disp(&r.alt.de, regs), .alt_hl = disp(&r.alt.hl, regs), .alt_af = disp(&r.alt.af, regs),
+			.time = disp(cpu.time, regs), .start_of_stack = disp(cpu.start_of_stack, regs),
+			.write_count = disp(&cpu.memory->write_count, cpu.memory->pages),
+		};
+		RETURN_HR_IF(E_INVALIDARG, far);
+
+		_scratch = wil::make_unique_nothrow<uint8_t[]>(scratch_size); RETURN_IF_NULL_ALLOC(_scratch);
+		_assembler = wil::make_unique_nothrow<x64_assembler>(); RETURN_IF_NULL_ALLOC(_assembler);
+		auto hr = _memory.allocate(memory_size); RETURN_IF_FAILED(hr);
+		return S_OK;
+	}
+
+	virtual z80_jit_block_code find_block (uint32_t epoch, UINT64 time_limit, bool check_bps, const uint8_t* code_bps_bitmap) override
+	{
+		uint16_t pc = _cpu.regs->pc;
+		uint32_t page_index = pc >> Bus::page_shift;
+		uint32_t offset = pc & (Bus::page_size - 1);
+		const uint8_t* page_code = _cpu.memory->pages[page_index].read;
+
+		auto& entries = _entries[page_index];
+		if (!entries)
+		{
+			// Value-initialized, so with epoch 0, which no page has.
+			entries = wil::make_unique_nothrow<jit_entry[]>(Bus::page_size);
+			if (!entries)
+				return nullptr;
+		}
+
+		auto& e = entries[offset];
+		if (e.epoch != epoch)
+		{
+			// Something wrote to the page since. Most such writes are to data next to the code, so the count
+			// goes on; but code that changed under a block must get hot again before we compile it again.
+			if (e.block && memcmp(e.block->z80_code(), &page_code[offset], e.block->size))
+			{
+				e.block = nullptr;
+				e.runs = 0;
+			}
+			else if (e.runs == not_compilable)
+				e.runs = 0;
+
+			e.epoch = epoch;
+		}
+
+		if (!e.block)
+		{
+			if ((e.runs == not_compilable) || (++e.runs < hot_runs))
+				return nullptr;
+
+			e.block = compile(page_code, pc);
+			if (!e.block)
+			{
+				e.runs = not_compilable;
+				return nullptr;
+			}
+		}
+
+		UINT64 time = *_cpu.time;
+		if ((time_limit <= time) || (time_limit - time <= e.block->prefix_time))
+			return nullptr;
+
+		if (check_bps)
+		{
+			for (uint32_t a = pc; a < pc + e.block->size; a++)
+			{
+				if (code_bps_bitmap[a / 8] & (1 << (a % 8)))
+					return nullptr;
+			}
+		}
+
+		return e.block->code;
+	}
+
+	virtual void drop_page (uint32_t page_index) override
+	{
+		_entries[page_index].reset();
+	}
+
+	#ifdef SIM_TESTS
+	virtual uint32_t compiled_blocks() const override { return _compiled_blocks; }
+	#endif
+
+private:
+	// Compiles the code at "pc" up to the first instruction we leave to the interpreter, the first
+	// that transfers control, or the end of the page. Returns null if there's nothing to compile.
+	const jit_block* compile (const uint8_t* page_code, uint16_t pc)
+	{
+		jit_insn insns[max_block_instructions];
+		uint32_t count = 0;
+		uint32_t offset = pc & (Bus::page_size - 1);
+		while ((count < max_block_instructions) && (offset <= Bus::page_size - 4))
+		{
+			jit_insn& in = insns[count];
+			if (!decode(&page_code[offset], (uint16_t)((pc & ~(Bus::page_size - 1)) | offset), in))
+				break;
+			count++;
+			offset += in.length;
+			if (in.props & insn_ends)
+				break;
+		}
+
+		if (!count)
+			return nullptr;
+
+		compute_f_liveness(insns, count);
+
+		auto& a = *_assembler;
+		a.reset (&_scratch[prologue_room], scratch_size - prologue_room);
+		block_compiler c (a, _layout, insns, count);
+		if (!c.compile_body() || !a.finish())
+			return nullptr;
+		uint32_t body_size = a.size();
+
+		uint8_t prologue[prologue_room];
+		a.reset (prologue, prologue_room);
+		c.compile_prologue (_cpu.regs, _cpu.memory->pages);
+		if (!a.finish())
+			return nullptr;
+		uint32_t prologue_size = a.size();
+		uint8_t* code = &_scratch[prologue_room - prologue_size];
+		memcpy (code, prologue, prologue_size);
+		uint32_t code_size = prologue_size + body_size;
+
+		uint16_t size = (uint16_t)(offset - (pc & (Bus::page_size - 1)));
+		size_t header_size = (sizeof(jit_block) + size + 15) & ~(size_t)15;
+		size_t total = (header_size + code_size + 15) & ~(size_t)15;
+		if (_memory_used + total > _memory.size())
+		{
+			flush();
+			if (total > _memory.size())
+				return nullptr;
+		}
+
+		if (!_memory.protect(_memory_used, total, true))
+			return nullptr;
+		auto block = (jit_block*)(_memory.base() + _memory_used);
+		block->code = (z80_jit_block_code)(_memory.base() + _memory_used + header_size);
+		block->prefix_time = c.prefix_time();
+		block->size = size;
+		memcpy ((uint8_t*)(block + 1), &page_code[pc & (Bus::page_size - 1)], size);
+		memcpy (_memory.base() + _memory_used + header_size, code, code_size);
+		bool executable = _memory.protect(_memory_used, total, false);
+		FAIL_FAST_IF(!executable);
+		_memory_used += total;
+		_compiled_blocks++;
+		return block;
+	}
+
+	// Drops all blocks, when their memory is full. The code that's hot now gets compiled again.
+	void flush()
+	{
+		for (auto& entries : _entries)
+		{
+			if (entries)
+			{
+				for (uint32_t i = 0; i < Bus::page_size; i++)
+				{
+					entries[i].block = nullptr;
+					if (entries[i].runs != not_compilable)
+						entries[i].runs = 0;
+				}
+			}
+		}
+
+		_memory_used = 0;
+	}
+};
+#pragma endregion
+
+HRESULT STDMETHODCALLTYPE MakeZ80Jit (const z80_jit_cpu& cpu, wistd::unique_ptr<IZ80Jit>* to)
+{
+	auto j = wil::make_unique_nothrow<z80_jit>(); RETURN_IF_NULL_ALLOC(j);
+	auto hr = j->InitInstance(cpu); RETURN_IF_FAILED(hr);
+	*to = std::move(j);
+	return S_OK;
+}
+
+#else
+
+HRESULT STDMETHODCALLTYPE MakeZ80Jit (const z80_jit_cpu& cpu, wistd::unique_ptr<IZ80Jit>* to)
+{
+	return E_NOTIMPL;
+}
+
+#endif
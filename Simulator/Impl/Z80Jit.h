@@ -0,0 +1,46 @@
+#pragma once
+#include "shared/z80_register_set.h"
+#include "SimulatorInternal.h"
+
+// The fields of the CPU that compiled blocks read and write. They must all lie within 2 GB of "regs",
+// since the blocks address them relative to it.
+struct z80_jit_cpu
+{
+	z80_register_set* regs;
+	UINT64*           time;
+	uint16_t*         start_of_stack;
+	Bus*              memory;
+};
+
+// A compiled block. It runs from regs->pc while the instructions it starts begin before "time_limit", and leaves
+// the registers, the time and R as the interpreter would have after the same instructions. It stops before an
+// instruction that would access memory the interpreter must go through the bus for (a page that isn't mapped,
+// or is watched), after a write into its own code, and where its code continues with something it can't run.
+// Returns the address of the last instruction it executed, or -1 if it executed none.
+using z80_jit_block_code = int32_t(*)(UINT64 time_limit);
+
+// The x86-64 tier of the Z80 CPU; see IZ80CPU::SetJit. It counts how often the interpreter starts at each address
+// in mapped memory, and compiles the code at addresses where it starts often, up to the first instruction that
+// does I/O, changes the interrupt mode or transfers control. Instructions that are rare in hot code (DAA, the block
+// instructions, and most ED ones) end a block too, and the interpreter executes them.
+struct DECLSPEC_NOVTABLE IZ80Jit
+{
+	virtual ~IZ80Jit() = default;
+
+	// Returns the block for the code at PC, compiling it if the code is hot enough; or null if the interpreter
+	// should execute the next instruction. "epoch" is that of the page (see cpu::code_epoch); blocks compiled
+	// from an earlier epoch are used again only if their code is still the same. Returns null also when the first
+	// instructions of the block don't all begin before "time_limit", and, with "check_bps", when the block has
+	// a code breakpoint on any of its instructions. The caller must make sure the page of PC can be decoded.
+	virtual z80_jit_block_code find_block (uint32_t epoch, UINT64 time_limit, bool check_bps, const uint8_t* code_bps_bitmap) = 0;
+
+	// Forgets the blocks compiled from a page, for when the CPU starts its epochs again from 1.
+	virtual void drop_page (uint32_t page_index) = 0;
+
+	#ifdef SIM_TESTS
+	virtual uint32_t compiled_blocks() const = 0;
+	#endif
+};
+
+// Returns E_NOTIMPL on hosts other than x86-64.
+HRESULT STDMETHODCALLTYPE MakeZ80Jit (const z80_jit_cpu& cpu, wistd::unique_ptr<IZ80Jit>* to);
@@ -2,6 +2,7 @@
 #ifndef PCH_H
 #define PCH_H
 
+#ifdef _WIN32
 #define STRICT
 #define _WIN32_WINNT    _WIN32_WINNT_WIN7
 #define NTDDI_VERSION   NTDDI_WIN7
@@ -25,5 +26,10 @@
 #include <wil/wistd_type_traits.h>
 
 extern "C" IMAGE_DOS_HEADER __ImageBase;
+#else
+// The core and the headless simulator build also with GCC and Clang; see CMakeLists.txt.
+#include "win32_compat.h"
+#include <algorithm>
+#endif
 
 #endif //PCH_H
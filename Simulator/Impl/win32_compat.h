@@ -0,0 +1,344 @@
+#pragma once
+
+// The simulator core and the headless simulator build also with GCC and Clang, on platforms other than Windows
+// (see Simulator/CMakeLists.txt). This header gives them the Windows and WIL names they use - and only those - with
+// the same meaning, so the code reads the same on all platforms. It's meant only for those builds; on Windows the real
+// headers are used.
+#ifdef _WIN32
+#error This header is not meant for Windows builds.
+#endif
+
+#include <cassert>
+#include <cerrno>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cwchar>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#pragma region Types
+typedef int32_t  HRESULT;
+typedef int      BOOL;
+typedef unsigned UINT;
+typedef uint8_t  byte;
+typedef uint16_t WORD;
+typedef uint32_t DWORD;
+typedef int32_t  LONG;
+typedef uint32_t ULONG;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef const wchar_t* LPCWSTR;
+
+#define TRUE  1
+#define FALSE 0
+
+#define MAX_PATH 260
+
+#define STDMETHODCALLTYPE
+#define DECLSPEC_NOVTABLE
+#define DECLSPEC_UUID(x)
+#define OUT
+
+#define _countof(a) std::size(a)
+
+inline uint32_t __popcnt (uint32_t value) { return (uint32_t)__builtin_popcount(value); }
+
+#define __forceinline inline __attribute__((always_inline))
+#pragma endregion
+
+#pragma region CRT
+template<size_t size>
+int sprintf_s (char (&buffer)[size], const char* format, ...)
+{
+	va_list args;
+	va_start (args, format);
+	int res = vsnprintf (buffer, size, format, args);
+	va_end (args);
+	return res;
+}
+#pragma endregion
+
+#pragma region HRESULT
+#define SUCCEEDED(hr) (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)    (((HRESULT)(hr)) < 0)
+
+#define S_OK           ((HRESULT)0)
+#define S_FALSE        ((HRESULT)1)
+#define E_NOTIMPL      ((HRESULT)0x80004001L)
+#define E_NOINTERFACE  ((HRESULT)0x80004002L)
+#define E_POINTER      ((HRESULT)0x80004003L)
+#define E_FAIL         ((HRESULT)0x80004005L)
+#define E_BOUNDS       ((HRESULT)0x8000000BL)
+#define E_UNEXPECTED   ((HRESULT)0x8000FFFFL)
+#define E_ACCESSDENIED ((HRESULT)0x80070005L)
+#define E_OUTOFMEMORY  ((HRESULT)0x8007000EL)
+#define E_INVALIDARG   ((HRESULT)0x80070057L)
+
+#define ERROR_FILE_NOT_FOUND 2L
+#define ERROR_HANDLE_EOF     38L
+#define ERROR_FILE_TOO_LARGE 223L
+#define ERROR_FILE_CORRUPT   1392L
+#define ERROR_TIMEOUT        1460L
+
+constexpr HRESULT HRESULT_FROM_WIN32 (long x)
+{
+	return (x <= 0) ? (HRESULT)x : (HRESULT)(((uint32_t)x & 0x0000FFFF) | (7 << 16) | 0x80000000);
+}
+
+// Error descriptions go through COM on Windows. Here the last one stays with the thread that set it,
+// for the caller to read with GetErrorDescription.
+inline thread_local wchar_t error_description[256];
+
+inline HRESULT SetErrorInfo (HRESULT errorHR, LPCWSTR messageFormat, ...)
+{
+	// The messages are written for Windows, where %s in a wide format takes a wide string; here that's %ls.
+	wchar_t format[256];
+	size_t length = 0;
+	for (LPCWSTR f = messageFormat; *f && (length < std::size(format) - 2); f++)
+	{
+		format[length++] = *f;
+		if (*f == L'%')
+		{
+			while (f[1] && wcschr(L"-+ #0123456789.", f[1]) && (length < std::size(format) - 2))
+				format[length++] = *++f;
+			if (f[1] == L's')
+				format[length++] = L'l';
+			else if (f[1] == L'%')
+				format[length++] = *++f;
+		}
+	}
+	format[length] = 0;
+
+	va_list args;
+	va_start (args, messageFormat);
+	if (vswprintf (error_description, std::size(error_description), format, args) < 0)
+		error_description[std::size(error_description) - 1] = 0; // truncated
+	va_end (args);
+	return errorHR;
+}
+
+// The description passed to SetErrorInfo most recently on this thread.
+inline LPCWSTR GetErrorDescription()
+{
+	return error_description;
+}
+#pragma endregion
+
+#pragma region WIL
+#define WI_ASSERT(condition) assert(condition)
+
+#define FAIL_FAST() std::abort()
+#define FAIL_FAST_IF(condition) do { if (condition) std::abort(); } while (0)
+#define FAIL_FAST_IF_FAILED(hr) do { if (FAILED(hr)) std::abort(); } while (0)
+
+#define RETURN_HR(hr) return (hr)
+#define RETURN_WIN32(err) return HRESULT_FROM_WIN32(err)
+#define RETURN_IF_FAILED(hr) do { HRESULT __hrRet = (hr); if (FAILED(__hrRet)) return __hrRet; } while (0)
+#define RETURN_IF_FAILED_EXPECTED(hr) RETURN_IF_FAILED(hr)
+#define RETURN_HR_IF(hr, condition) do { if (condition) return (hr); } while (0)
+#define RETURN_IF_NULL_ALLOC(ptr) RETURN_HR_IF(E_OUTOFMEMORY, !(ptr))
+#define RETURN_IF_NULL_ALLOC_EXPECTED(ptr) RETURN_IF_NULL_ALLOC(ptr)
+#define LOG_IF_FAILED(hr) (hr)
+
+// The builds using this header have no exceptions to throw, just like the Windows ones; these end the process.
+#define THROW_IF_FAILED(hr) FAIL_FAST_IF_FAILED(hr)
+#define THROW_HR_IF(hr, condition) FAIL_FAST_IF(condition)
+#define THROW_IF_NULL_ALLOC(ptr) FAIL_FAST_IF(!(ptr))
+
+namespace wistd
+{
+	using std::unique_ptr;
+	using std::move;
+	using std::forward;
+}
+
+namespace wil
+{
+	template<typename T, typename... Args, std::enable_if_t<!std::is_array_v<T>, int> = 0>
+	std::unique_ptr<T> make_unique_nothrow (Args&&... args)
+	{
+		return std::unique_ptr<T>(new (std::nothrow) T(std::forward<Args>(args)...));
+	}
+
+	template<typename T, std::enable_if_t<std::is_unbounded_array_v<T>, int> = 0>
+	std::unique_ptr<T> make_unique_nothrow (size_t size)
+	{
+		return std::unique_ptr<T>(new (std::nothrow) std::remove_extent_t<T>[size]());
+	}
+
+	template<typename F>
+	class scope_exit_t
+	{
+		F _f;
+		bool _active = true;
+
+	public:
+		explicit scope_exit_t (F&& f) : _f(std::move(f)) { }
+		scope_exit_t (scope_exit_t&& other) : _f(std::move(other._f)), _active(other._active) { other._active = false; }
+		scope_exit_t (const scope_exit_t&) = delete;
+		scope_exit_t& operator= (const scope_exit_t&) = delete;
+		~scope_exit_t() { reset(); }
+		void reset() { if (_active) { _active = false; _f(); } }
+		void release() { _active = false; }
+	};
+
+	template<typename F>
+	[[nodiscard]] scope_exit_t<F> scope_exit (F&& f)
+	{
+		return scope_exit_t<F>(std::forward<F>(f));
+	}
+}
+#pragma endregion
+
+#pragma region COM
+// COM identifies an interface by the GUID attached to it with DECLSPEC_UUID, which GCC and Clang don't support;
+// here an interface is identified instead by the address of a variable of its own.
+typedef const void* IID;
+typedef const IID& REFIID;
+
+template<typename I>
+IID iid_of()
+{
+	static const char tag = 0;
+	return &tag;
+}
+
+// Only the form that takes an expression, as used by TryQI in com.h.
+#define __uuidof(x) iid_of<std::remove_cv_t<std::remove_pointer_t<decltype(x)>>>()
+
+struct IUnknown
+{
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface (REFIID riid, void** ppvObject) = 0;
+	virtual ULONG STDMETHODCALLTYPE AddRef() = 0;
+	virtual ULONG STDMETHODCALLTYPE Release() = 0;
+};
+
+namespace wil
+{
+	template<typename T>
+	class com_ptr_nothrow
+	{
+		T* _ptr = nullptr;
+
+	public:
+		com_ptr_nothrow() = default;
+		com_ptr_nothrow (std::nullptr_t) { }
+		com_ptr_nothrow (T* ptr) : _ptr(ptr) { if (_ptr) _ptr->AddRef(); }
+		com_ptr_nothrow (const com_ptr_nothrow& other) : com_ptr_nothrow(other._ptr) { }
+		com_ptr_nothrow (com_ptr_nothrow&& other) : _ptr(other._ptr) { other._ptr = nullptr; }
+		~com_ptr_nothrow() { reset(); }
+
+		com_ptr_nothrow& operator= (T* ptr)
+		{
+			if (ptr)
+				ptr->AddRef();
+			reset();
+			_ptr = ptr;
+			return *this;
+		}
+
+		com_ptr_nothrow& operator= (const com_ptr_nothrow& other) { return *this = other._ptr; }
+
+		com_ptr_nothrow& operator= (com_ptr_nothrow&& other)
+		{
+			if (this != std::addressof(other))
+			{
+				reset();
+				_ptr = other._ptr;
+				other._ptr = nullptr;
+			}
+			return *this;
+		}
+
+		void reset()
+		{
+			if (auto p = _ptr)
+			{
+				_ptr = nullptr;
+				p->Release();
+			}
+		}
+
+		T* get() const { return _ptr; }
+		T* detach() { T* p = _ptr; _ptr = nullptr; return p; }
+		T** put() { reset(); return &_ptr; }
+		T** operator&() { return put(); }
+		T* operator->() const { return _ptr; }
+		T& operator*() const { return *_ptr; }
+		explicit operator bool() const { return _ptr != nullptr; }
+	};
+}
+
+inline void* CoTaskMemAlloc (size_t size) { return std::malloc(size); }
+
+inline void CoTaskMemFree (void* ptr) { std::free(ptr); }
+#pragma endregion
+
+#pragma region Keyboard
+// The keyboard device takes Windows virtual-key codes on all platforms.
+#define MK_SHIFT     0x0004
+#define VK_BACK      0x08
+#define VK_RETURN    0x0D
+#define VK_SHIFT     0x10
+#define VK_LEFT      0x25
+#define VK_UP        0x26
+#define VK_RIGHT     0x27
+#define VK_DOWN      0x28
+#define VK_LSHIFT    0xA0
+#define VK_RSHIFT    0xA1
+#define VK_OEM_1     0xBA
+#define VK_OEM_PLUS  0xBB
+#define VK_OEM_COMMA 0xBC
+#define VK_OEM_MINUS 0xBD
+#define VK_OEM_7     0xDE
+
+// These builds have no keyboard of their own to ask; keys reach the simulator only through ProcessKeyDown / ProcessKeyUp.
+inline short GetKeyState (int) { return 0; }
+#pragma endregion
+
+#pragma region GDI
+#define BI_RGB 0L
+
+struct POINT
+{
+	LONG x;
+	LONG y;
+};
+
+struct BITMAPINFOHEADER
+{
+	DWORD biSize;
+	LONG  biWidth;
+	LONG  biHeight;
+	WORD  biPlanes;
+	WORD  biBitCount;
+	DWORD biCompression;
+	DWORD biSizeImage;
+	LONG  biXPelsPerMeter;
+	LONG  biYPelsPerMeter;
+	DWORD biClrUsed;
+	DWORD biClrImportant;
+};
+
+struct RGBQUAD
+{
+	uint8_t rgbBlue;
+	uint8_t rgbGreen;
+	uint8_t rgbRed;
+	uint8_t rgbReserved;
+};
+
+struct BITMAPINFO
+{
+	BITMAPINFOHEADER bmiHeader;
+	RGBQUAD bmiColors[1];
+};
+#pragma endregion
@@ -20,8 +20,67 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("F578EBE3-7596-4FC7-A976-56C9B0AAD856") I
 
 enum class BreakpointType { Code, Data };
 
+enum class DataBreakpointAccess : uint8_t { Read = 1, Write = 2, ReadWrite = 3 };
+
 typedef DWORD SIM_BP_COOKIE;
 
+// The condition of a code breakpoint is compiled by the debugger into a small program for a stack machine,
+// which the simulator runs each time the CPU reaches the breakpoint address. Values on the stack are 32-bit
+// signed integers. The breakpoint is hit only if the program leaves a non-zero value on the stack.
+enum class BreakpointConditionOp : uint8_t
+{
+	PushConst,  // followed by a 16-bit constant, little endian
+	PushReg8,   // followed by one byte with a z80_reg8 value
+	PushReg16,  // followed by one byte with a z80_reg16 value
+	ReadMem8,   // replaces the address on top of the stack with the byte at that address
+	Neg,        // unary ops replace the value on top of the stack
+	Not,
+	Compl,
+	Add,        // binary ops pop two values and push the result
+	Sub,
+	And,
+	Or,
+	Xor,
+	Eq,
+	Ne,
+	Lt,
+	Le,
+	Gt,
+	Ge,
+	LogicalAnd,
+	LogicalOr,  // must remain last
+};
+
+// The simulator counts the hits of each code breakpoint (the times the CPU reached it with the condition true)
+// and breaks only on the hits that satisfy the pass count rule; these values mirror BP_PASSCOUNT_STYLE.
+enum class BreakpointPassCountStyle : uint8_t
+{
+	None,           // break on every hit
+	Equal,          // break when the hit count equals the pass count
+	EqualOrGreater, // break when the hit count is equal or greater than the pass count
+	Mod,            // break when the hit count is a multiple of the pass count
+};
+
+// How fast the simulated clock runs compared to the real one, while the simulator is running.
+enum class RunSpeed : uint8_t
+{
+	RealTime,    // the speed of the real machine
+	Multiplier,  // a whole multiple of the speed of the real machine (see ISimulator::SetRunSpeed)
+	Unthrottled, // as fast as the host can go
+};
+
+static constexpr uint32_t TracepointMaxValues = 8;
+
+// Recorded by the simulator each time the CPU reaches a tracepoint (see ISimulator::SetTracepoint).
+struct TracepointHit
+{
+	SIM_BP_COOKIE cookie;
+	uint16_t address;
+	uint8_t value_count;
+	UINT64 time;
+	int32_t values[TracepointMaxValues];
+};
+
 struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{33551613-1FE1-4D48-B805-9D5C82ACDA0E}") ISimulatorBreakpointEvent : ISimulatorEvent
 {
 	virtual BreakpointType GetType() = 0;
@@ -30,6 +89,51 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{33551613-1FE1-4D48-B805-9D5C82ACDA0E}")
 	virtual HRESULT GetBreakpointAt(ULONG i, SIM_BP_COOKIE* ppKey) = 0;
 };
 
+// One executed instruction, as recorded by the instruction trace (see ISimulator::SetInstructionTrace).
+// The registers are those before the instruction executed.
+struct InstructionTraceRecord
+{
+	UINT64 time;
+	uint16_t pc;
+	uint16_t af;
+	uint16_t bc;
+	uint16_t de;
+	uint16_t hl;
+	uint16_t sp;
+	uint8_t opcode[4]; // the four bytes at PC, whatever the length of the instruction
+};
+
+// A memory write found in a trace file (see ISimulator::StartTraceFile).
+struct TraceFileWrite
+{
+	UINT64 time;
+	uint16_t pc; // address of the instruction that made the write
+	uint16_t address;
+	uint8_t value;
+};
+
+// Queries over a trace file written by ISimulator::StartTraceFile. The file is split in chunks indexed by time,
+// PC range and written addresses, so queries read only the chunks that may contain what they look for.
+// Time ranges are [from, to). The file may be opened while the simulator is still writing it;
+// the queries then see only the chunks written before the file was opened.
+struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{7C1E5B9A-3F6D-4E2B-9A41-C8D05F3E6B17}") ITraceFile : IUnknown
+{
+	// Returns S_FALSE if there were more than "maxCount" writes.
+	virtual HRESULT STDMETHODCALLTYPE FindWrites (uint16_t address, UINT64 fromTime, UINT64 toTime, UINT32 maxCount, TraceFileWrite* writes, UINT32* count) = 0;
+	// Returns S_FALSE if there was no write to "address" before "beforeTime".
+	virtual HRESULT STDMETHODCALLTYPE FindLastWrite (uint16_t address, UINT64 beforeTime, TraceFileWrite* write) = 0;
+	// Returns S_FALSE if the instruction at "pc" was not executed at or after "fromTime".
+	virtual HRESULT STDMETHODCALLTYPE FindFirstExecution (uint16_t pc, UINT64 fromTime, UINT64* time) = 0;
+};
+
+// Tracepoint hits reach the main thread in batches, in the order they happened.
+struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{53786336-A9D2-4EA5-BA86-F7E2916ED1D9}") ISimulatorTracepointEvent : ISimulatorEvent
+{
+	virtual ULONG GetHitCount() = 0;
+	virtual const TracepointHit* GetHits() = 0;
+	virtual ULONG GetLostHitCount() = 0; // hits not recorded because the main thread didn't keep up
+};
+
 struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{D9C9D2E8-E684-451A-B614-CD7ADB3792F5}") ISimulatorSimulateOneEvent : ISimulatorEvent
 {
 };
@@ -42,6 +146,27 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{CD782861-2511-4B52-BE2C-0EC6F9D4F0D6}")
 {
 };
 
+// Called on the main thread when an asynchronous request to the simulator (one of the "...Async" methods of ISimulator)
+// completes, with the result of the request. SimulatorAsync.h has the helpers for awaiting these from coroutines.
+struct SimulatorCompletion
+{
+	void* Context;
+	void(*OnComplete)(void* context, HRESULT hr);
+};
+
+// What ISimulator::ResumeWithAsync changes before it resumes the simulation, in this order. The simulator copies
+// it all before ResumeWithAsync returns, so the buffers don't need to outlive the call.
+struct SimulatorResumeChanges
+{
+	const z80_register_set* Registers; // null to leave the registers as they are
+	const void* Memory;                // "MemorySize" bytes to write at "MemoryAddress"
+	uint16_t MemoryAddress;
+	uint16_t MemorySize;               // zero to write nothing
+	BOOL SetPC;                        // whether to set the PC to "PC"
+	uint16_t PC;
+	BOOL CheckBreakpointsAtCurrentPC;  // as for ISimulator::Resume
+};
+
 struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{56344845-3DDA-4BC0-9645-7EBA3FE94A93}") ISimulator : IUnknown
 {
 	virtual HRESULT STDMETHODCALLTYPE ReadMemoryBus  (uint16_t address, uint16_t size, void* to) = 0;
@@ -55,11 +180,33 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{56344845-3DDA-4BC0-9645-7EBA3FE94A93}")
 	virtual HRESULT STDMETHODCALLTYPE UnadviseDebugEvents (ISimulatorEventHandler* handler) = 0;
 	virtual HRESULT STDMETHODCALLTYPE AdviseScreenComplete (IScreenCompleteEventHandler* handler) = 0;
 	virtual HRESULT STDMETHODCALLTYPE UnadviseScreenComplete (IScreenCompleteEventHandler* handler) = 0;
+	// These two don't wait for the simulator thread to process the key; they fail only if they can't queue it.
 	virtual HRESULT STDMETHODCALLTYPE ProcessKeyDown (uint32_t vkey, uint32_t modifiers) = 0;
 	virtual HRESULT STDMETHODCALLTYPE ProcessKeyUp   (uint32_t vkey, uint32_t modifiers) = 0;
 	virtual HRESULT STDMETHODCALLTYPE AddBreakpoint (BreakpointType type, bool physicalMemorySpace, UINT64 address, SIM_BP_COOKIE* pCookie) = 0;
+	// Breaks after an instruction that accessed (as specified by "access") some address in [address, address + size).
+	// The address reported through ISimulatorBreakpointEvent is the address that was accessed.
+	virtual HRESULT STDMETHODCALLTYPE AddDataBreakpoint (bool physicalMemorySpace, UINT64 address, UINT32 size, DataBreakpointAccess access, SIM_BP_COOKIE* pCookie) = 0;
 	virtual HRESULT STDMETHODCALLTYPE RemoveBreakpoint (SIM_BP_COOKIE cookie) = 0;
+	// Sets the condition (see BreakpointConditionOp) of a code breakpoint. Pass a zero "size" to remove the condition.
+	virtual HRESULT STDMETHODCALLTYPE SetBreakpointCondition (SIM_BP_COOKIE cookie, const uint8_t* condition, uint32_t size) = 0;
+	virtual HRESULT STDMETHODCALLTYPE SetBreakpointPassCount (SIM_BP_COOKIE cookie, BreakpointPassCountStyle style, uint32_t passCount) = 0;
+	virtual HRESULT STDMETHODCALLTYPE GetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t* hitCount) = 0;
+	virtual HRESULT STDMETHODCALLTYPE SetBreakpointHitCount (SIM_BP_COOKIE cookie, uint32_t hitCount) = 0;
+	// Turns a code breakpoint into a tracepoint, which doesn't stop the simulation; instead, on each hit the simulator
+	// runs "values" - a program like a condition that leaves up to TracepointMaxValues values on the stack - and records
+	// the values in a TracepointHit. Pass FALSE for "tracepoint" to make it a normal breakpoint again.
+	virtual HRESULT STDMETHODCALLTYPE SetTracepoint (SIM_BP_COOKIE cookie, BOOL tracepoint, const uint8_t* values, uint32_t size) = 0;
 	virtual HRESULT STDMETHODCALLTYPE HasBreakpoints_HR() = 0;
+	// Starts recording the last "capacity" executed instructions, discarding any previous records; zero stops recording.
+	virtual HRESULT STDMETHODCALLTYPE SetInstructionTrace (UINT32 capacity) = 0;
+	// Copies into "records" the last "maxCount" (or fewer) instructions executed, oldest first.
+	virtual HRESULT STDMETHODCALLTYPE GetInstructionTrace (UINT32 maxCount, InstructionTraceRecord* records, UINT32* count) = 0;
+	// Starts writing to a file every instruction executed and every memory write made by the CPU, for later
+	// querying with OpenTraceFile. Any trace file already being written is closed first.
+	virtual HRESULT STDMETHODCALLTYPE StartTraceFile (LPCWSTR path) = 0;
+	// Returns S_FALSE if no trace file was being written; otherwise the error (if any) from writing the file.
+	virtual HRESULT STDMETHODCALLTYPE StopTraceFile() = 0;
 	virtual HRESULT STDMETHODCALLTYPE LoadFile (LPCWSTR pFileName) = 0;
 	virtual HRESULT STDMETHODCALLTYPE LoadBinary (LPCWSTR pFileName, DWORD address, DWORD* loadedSize) = 0;
 	virtual HRESULT STDMETHODCALLTYPE GetPC (uint16_t* pc) = 0;
@@ -69,6 +216,80 @@ struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{56344845-3DDA-4BC0-9645-7EBA3FE94A93}")
 	virtual HRESULT STDMETHODCALLTYPE SetRegisters (const z80_register_set* buffer, uint32_t size) = 0;
 	virtual HRESULT STDMETHODCALLTYPE GetShowCRTSnapshot() = 0; // returns S_OK or S_FALSE
 	virtual HRESULT STDMETHODCALLTYPE SetShowCRTSnapshot(BOOL val) = 0;
+	// The multiplier is used only with RunSpeed::Multiplier, and must be between 2 and 100. At any speed other than
+	// real time the beeper is muted, and IScreenCompleteEventHandler receives at most 50 screens per real second.
+	// Doesn't wait for the simulator thread to switch to the new speed.
+	virtual HRESULT STDMETHODCALLTYPE SetRunSpeed (RunSpeed speed, UINT32 multiplier) = 0;
+
+	// Asynchronous variants of the methods of the same name: they queue the request to the simulator thread and return
+	// without waiting; "completion" is called later on the main thread. Requests made one after the other are answered
+	// together, in the order they were made. Out parameters must stay valid until the completion is called.
+	// Unlike ReadMemoryBus and GetRegisters, the two reads below work also while the simulation is running.
+	virtual HRESULT STDMETHODCALLTYPE ReadMemoryBusAsync (uint16_t address, uint16_t size, void* to, SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE GetRegistersAsync (z80_register_set* buffer, uint32_t size, SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE AddBreakpointAsync (BreakpointType type, bool physicalMemorySpace, UINT64 address, SIM_BP_COOKIE* pCookie, SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE RemoveBreakpointAsync (SIM_BP_COOKIE cookie, SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE GetBreakpointHitCountAsync (SIM_BP_COOKIE cookie, uint32_t* hitCount, SimulatorCompletion completion) = 0;
+	// These change the state of the simulation. Their completion is called after the events and the screen caused by
+	// the change were sent. BreakAsync completes with S_FALSE if the simulation had already stopped. Until all of them
+	// complete, the methods of the same name fail with E_UNEXPECTED, and so do the methods that read or write the
+	// state directly (GetPC, ReadMemoryBus etc.), as the simulator thread may be changing it.
+	virtual HRESULT STDMETHODCALLTYPE BreakAsync (SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE ResumeAsync (BOOL checkBreakpointsAtCurrentPC, SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE ResetAsync (UINT16 startAddress, SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE SimulateOneAsync (SimulatorCompletion completion) = 0;
+	virtual HRESULT STDMETHODCALLTYPE LoadFileAsync (LPCWSTR pFileName, SimulatorCompletion completion) = 0;
+	// Sets registers, writes memory, sets the PC and resumes the simulation in one request to the simulator thread.
+	virtual HRESULT STDMETHODCALLTYPE ResumeWithAsync (const SimulatorResumeChanges* changes, SimulatorCompletion completion) = 0;
+	// For callers that must answer synchronously what they asked asynchronously (see simulator_request::wait): runs
+	// the completions that are ready, waiting up to "timeoutMs" for the first one, and returns S_FALSE if none came.
+	// It dispatches only the simulator's own messages; but the completions, and the events sent from the main thread
+	// together with them (ISimulatorEventHandler), run from within this call. Main thread only.
+	virtual HRESULT STDMETHODCALLTYPE RunCompletions (DWORD timeoutMs) = 0;
+};
+
+// The HC-91 ROM, loaded once and shared, read-only, by any number of headless simulators on any threads.
+struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{A4F3E2B1-5C7D-4A86-9E0F-3B2D1C6E8A57}") IRomImage : IUnknown
+{
+	virtual const uint8_t* STDMETHODCALLTYPE GetBytes() = 0; // 32 KB
+};
+
+// A simulator with no window, no thread and no audio, for running programs unattended (test suites, for example).
+// It simulates only from within RunUntil, on the caller's thread, as fast as the host can go. Devices that
+// would wait for real time don't. An instance must be used by one thread at a time.
+struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{2E8B0C6D-71A4-4F0B-9C53-B4E1D6A2F817}") IHeadlessSimulator : IUnknown
+{
+	virtual HRESULT STDMETHODCALLTYPE Reset (UINT16 startAddress) = 0;
+	virtual HRESULT STDMETHODCALLTYPE LoadFile (LPCWSTR pFileName) = 0;
+	virtual HRESULT STDMETHODCALLTYPE LoadBinary (LPCWSTR pFileName, DWORD address, DWORD* loadedSize) = 0;
+	virtual HRESULT STDMETHODCALLTYPE ReadMemoryBus  (uint16_t address, uint16_t size, void* to) = 0;
+	virtual HRESULT STDMETHODCALLTYPE WriteMemoryBus (uint16_t address, uint16_t size, const void* from) = 0;
+	virtual HRESULT STDMETHODCALLTYPE GetRegisters (z80_register_set* buffer, uint32_t size) = 0;
+	virtual HRESULT STDMETHODCALLTYPE SetRegisters (const z80_register_set* buffer, uint32_t size) = 0;
+	virtual HRESULT STDMETHODCALLTYPE AddBreakpoint (BreakpointType type, UINT16 address, SIM_BP_COOKIE* pCookie) = 0;
+	virtual HRESULT STDMETHODCALLTYPE RemoveBreakpoint (SIM_BP_COOKIE cookie) = 0;
+	virtual UINT64 STDMETHODCALLTYPE Time() = 0;
+	// Returns S_OK when the simulated time reached "time", or S_FALSE when a breakpoint was hit; in the latter case,
+	// and if "bp" is not null, it receives the cookie of (one of) the breakpoints hit. The next call continues
+	// from the instruction that was at the breakpoint without hitting it again.
+	virtual HRESULT STDMETHODCALLTYPE RunUntil (UINT64 time, SIM_BP_COOKIE* bp) = 0;
+};
+
+// Runs headless simulators on a fixed set of worker threads. A run is done in slices of simulated time: a worker
+// runs one slice, then queues the rest of the run again; a worker with nothing queued takes runs queued by others.
+// The pool doesn't keep references to the simulators; the caller keeps them alive, and doesn't use them, until Wait
+// returns. Submit and Wait must be called from one thread.
+struct DECLSPEC_NOVTABLE DECLSPEC_UUID("{6B9D4C2E-0A1F-4E37-8D65-F2C7B3A9E014}") ISimulatorPool : IUnknown
+{
+	// Queues a run of "sim" until it reaches "time" or a breakpoint, as IHeadlessSimulator::RunUntil does.
+	// When the run completes, "result" receives what RunUntil returned, and "bp" (if not null) the breakpoint hit.
+	virtual HRESULT STDMETHODCALLTYPE Submit (IHeadlessSimulator* sim, UINT64 time, HRESULT* result, SIM_BP_COOKIE* bp) = 0;
+	// Waits until all runs submitted so far have completed.
+	virtual HRESULT STDMETHODCALLTYPE Wait() = 0;
 };
 
 HRESULT MakeSimulator (LPCWSTR dir, LPCWSTR romFilename, ISimulator** to);
+HRESULT LoadRomImage (LPCWSTR dir, LPCWSTR romFilename, IRomImage** to);
+HRESULT MakeHeadlessSimulator (IRomImage* rom, IHeadlessSimulator** to);
+HRESULT MakeSimulatorPool (UINT32 threadCount, UINT64 sliceTicks, ISimulatorPool** to);
+HRESULT OpenTraceFile (LPCWSTR path, ITraceFile** to);
@@ -0,0 +1,138 @@
+#pragma once
+#include "Simulator.h"
+#include <coroutine>
+#include <type_traits>
+#include <utility>
+
+// Lets coroutines await the "...Async" methods of ISimulator. A simulator_request starts its request when constructed,
+// and co_await on it returns the HRESULT of the request; so a coroutine can start several requests and then await
+// them, and the simulator thread answers all of them in one round trip:
+//
+//     simulator_request<uint32_t> hits ([&](uint32_t& hitCount, auto c) { return simulator->GetBreakpointHitCountAsync(cookie, &hitCount, c); });
+//     simulator_request<z80_register_set> regs ([&](z80_register_set& r, auto c) { return simulator->GetRegistersAsync(&r, sizeof(r), c); });
+//     HRESULT hr = co_await hits;   // then hits.value() is the hit count
+//     HRESULT hr2 = co_await regs;
+//
+// The out parameter of the request is "T", which lives in a state the request shares with the completion; the simulator
+// writes there, not into the caller's frame. So a request may be destroyed before it completes (together with the frame
+// of a coroutine that will never be resumed, for example): the state stays alive until the completion comes, and the
+// completion then resumes nobody. The coroutine resumes on the main thread, where requests must be created and destroyed.
+template<typename T = void>
+class simulator_request
+{
+	struct empty { };
+	using value_type = std::conditional_t<std::is_void_v<T>, empty, T>;
+
+	struct state
+	{
+		ULONG refs = 2; // one for the request, one for the completion
+		HRESULT hr = S_OK;
+		bool complete = false;
+		std::coroutine_handle<> waiter;
+		value_type value = { };
+	};
+
+	state* _state = nullptr;
+	HRESULT _startHR = S_OK; // when _state is null: why the request wasn't queued
+
+public:
+	template<typename Start>
+	explicit simulator_request (Start&& start)
+	{
+		_state = new (std::nothrow) state();
+		if (!_state)
+		{
+			_startHR = E_OUTOFMEMORY;
+			return;
+		}
+
+		HRESULT hr;
+		if constexpr (std::is_void_v<T>)
+			hr = start(SimulatorCompletion { _state, &on_complete });
+		else
+			hr = start(_state->value, SimulatorCompletion { _state, &on_complete });
+		if (FAILED(hr))
+		{
+			// The request didn't even get queued, so no completion will come.
+			delete _state;
+			_state = nullptr;
+			_startHR = hr;
+		}
+	}
+
+	~simulator_request()
+	{
+		if (_state)
+		{
+			_state->waiter = nullptr;
+			release(_state);
+		}
+	}
+
+	simulator_request (const simulator_request&) = delete;
+	simulator_request& operator= (const simulator_request&) = delete;
+
+	bool await_ready() const noexcept { return !_state || _state->complete; }
+
+	void await_suspend (std::coroutine_handle<> waiter) noexcept { _state->waiter = waiter; }
+
+	HRESULT await_resume() const noexcept { return _state ? _state->hr : _startHR; }
+
+	// What the simulator wrote; meaningful only after the request completed successfully.
+	template<typename U = T, std::enable_if_t<!std::is_void_v<U>, int> = 0>
+	U& value() noexcept
+	{
+		WI_ASSERT(_state && _state->complete);
+		return _state->value;
+	}
+
+	// For callers that must answer synchronously, such as COM methods: runs the simulator's completions
+	// (ISimulator::RunCompletions) until this request completes. If no completion comes for "timeoutMs",
+	// gives up with ERROR_TIMEOUT; as above, the request may then be destroyed.
+	HRESULT wait (ISimulator* simulator, DWORD timeoutMs = 5000)
+	{
+		while (!await_ready())
+		{
+			auto hr = simulator->RunCompletions(timeoutMs); RETURN_IF_FAILED(hr);
+			if (hr == S_FALSE)
+				RETURN_WIN32(ERROR_TIMEOUT);
+		}
+
+		return await_resume();
+	}
+
+private:
+	static void release (state* s)
+	{
+		if (--s->refs == 0)
+			delete s;
+	}
+
+	static void on_complete (void* context, HRESULT hr)
+	{
+		auto s = static_cast<state*>(context);
+		s->hr = hr;
+		s->complete = true;
+		if (auto waiter = std::exchange(s->waiter, nullptr))
+			waiter.resume(); // may destroy the request; our reference keeps "s" alive
+		release(s);
+	}
+};
+
+// The return type of a coroutine that nobody awaits, such as one a COM method starts and returns without waiting for.
+// The coroutine runs right away until its first co_await, and its frame is freed when it returns. It must handle its
+// own errors. If there isn't enough memory for the frame, the coroutine doesn't run and "started" is false.
+struct fire_and_forget
+{
+	bool started;
+
+	struct promise_type
+	{
+		fire_and_forget get_return_object() noexcept { return { true }; }
+		static fire_and_forget get_return_object_on_allocation_failure() noexcept { return { false }; }
+		std::suspend_never initial_suspend() noexcept { return { }; }
+		std::suspend_never final_suspend() noexcept { return { }; }
+		void return_void() noexcept { }
+		void unhandled_exception() noexcept { FAIL_FAST(); }
+	};
+};
@@ -0,0 +1,111 @@
+#include "Impl/Z80CPU.h"
+#include <chrono>
+
+// Prints how fast the CPU runs a mix of instructions - loads and ALU operations, IX with displacements,
+// CB and DDCB, jumps, calls and a block copy - once executing each instruction through try_execute_one,
+// once with threaded dispatch, and once with the JIT. Not a test; build it in Release for numbers that
+// mean something.
+
+static const uint8_t code[] = {
+	0x31, 0x00, 0xFF,       // 8000: ld sp, 0FF00h
+	0xDD, 0x21, 0x00, 0x90, // 8003: ld ix, 9000h
+	0x21, 0x00, 0x91,       // 8007: ld hl, 9100h
+	0x06, 0x00,             // 800A: ld b, 0
+	0xDD, 0x7E, 0x01,       // 800C: ld a, (ix+1)
+	0x80,                   // 800F: add a, b
+	0xA9,                   // 8010: xor c
+	0x4F,                   // 8011: ld c, a
+	0xDD, 0x77, 0x02,       // 8012: ld (ix+2), a
+	0x2C,                   // 8015: inc l
+	0x5E,                   // 8016: ld e, (hl)
+	0x77,                   // 8017: ld (hl), a
+	0xDD, 0xCB, 0x03, 0x16, // 8018: rl (ix+3)
+	0xCB, 0x5F,             // 801C: bit 3, a
+	0x28, 0x01,             // 801E: jr z, 8021h
+	0x14,                   // 8020: inc d
+	0xCD, 0x40, 0x80,       // 8021: call 8040h
+	0x10, 0xE6,             // 8024: djnz 800Ch
+	0xE5,                   // 8026: push hl
+	0x21, 0x00, 0x90,       // 8027: ld hl, 9000h
+	0x11, 0x00, 0x92,       // 802A: ld de, 9200h
+	0x01, 0x10, 0x00,       // 802D: ld bc, 16
+	0xED, 0xB0,             // 8030: ldir
+	0xE1,                   // 8032: pop hl
+	0xC3, 0x0A, 0x80,       // 8033: jp 800Ah
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0xF5,                   // 8040: push af
+	0xEB,                   // 8041: ex de, hl
+	0xED, 0x44,             // 8042: neg
+	0xEB,                   // 8044: ex de, hl
+	0xF1,                   // 8045: pop af
+	0xC9,                   // 8046: ret
+};
+
+// Owns the pages mapped on the bus; the CPU reads and writes them directly.
+class BenchmarkRAM : public IDevice
+{
+public:
+	uint8_t data[0x10000] = { };
+
+	virtual void Reset() override { }
+	virtual uint64_t Time() override { return UINT64_MAX; }
+	virtual BOOL NeedSyncWithRealTime (UINT64* sync_time) override { return FALSE; }
+	virtual void SimulateTo (UINT64 requested_time) override { }
+};
+
+enum class dispatch { interpreted, threaded, jit };
+
+static double run (dispatch d)
+{
+	static constexpr UINT64 slice = milliseconds_to_ticks(20);
+	static constexpr UINT64 duration = milliseconds_to_ticks(20'000);
+
+	auto ram = wil::make_unique_nothrow<BenchmarkRAM>(); FAIL_FAST_IF(!ram);
+	memcpy (&ram->data[0x8000], code, sizeof(code));
+	Bus memory;
+	Bus io;
+	irq_line_i irq;
+	memory.map_read_pages (ram.get(), 0, sizeof(ram->data), ram->data);
+	memory.map_write_pages (ram.get(), 0, sizeof(ram->data), ram->data);
+
+	wistd::unique_ptr<IZ80CPU> cpu;
+	auto hr = MakeZ80CPU (&memory, &io, &irq, &cpu); FAIL_FAST_IF_FAILED(hr);
+	hr = cpu->SetThreadedDispatch(d == dispatch::threaded); FAIL_FAST_IF_FAILED(hr);
+	hr = cpu->SetJit(d == dispatch::jit);
+	if (hr == E_NOTIMPL)
+		return 0; // not on this host
+	FAIL_FAST_IF_FAILED(hr);
+	hr = cpu->SetPC(0x8000); FAIL_FAST_IF_FAILED(hr);
+
+	// In slices, as the simulator runs the CPU.
+	auto start = std::chrono::steady_clock::now();
+	while (cpu->Time() < duration)
+	{
+		auto reason = cpu->SimulateUntil(std::min(cpu->Time() + slice, duration), nullptr);
+		FAIL_FAST_IF(reason != SimulateStopReason::TimeReached);
+	}
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	return cpu->Time() / elapsed.count() / 1e6;
+}
+
+// The best of a few runs, which is the one the rest of the machine disturbed least.
+static double best_of_runs (dispatch d)
+{
+	double best = 0;
+	for (uint32_t i = 0; i < 5; i++)
+		best = std::max(best, run(d));
+	return best;
+}
+
+int main()
+{
+	double interpreted = best_of_runs(dispatch::interpreted);
+	printf ("try_execute_one    %8.1f MHz\n", interpreted);
+	double threaded = best_of_runs(dispatch::threaded);
+	printf ("threaded dispatch  %8.1f MHz (%.2fx)\n", threaded, threaded / interpreted);
+	double jit = best_of_runs(dispatch::jit);
+	if (jit)
+		printf ("JIT                %8.1f MHz (%.2fx)\n", jit, jit / interpreted);
+	return 0;
+}
@@ -1,9 +1,13 @@
 
 #include "CppUnitTest.h"
 #include "Impl/Z80CPU.h"
+#include "Impl/SimulatorCommands.h"
 #include "Simulator.h"
+#include "SimulatorAsync.h"
+#include "shared/com.h"
 #include "shared/string_builder.h"
 #include "shared/unordered_map_nothrow.h"
+#include <thread>
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -22,15 +26,14 @@ public:
 	HRESULT InitInstance (Bus* memory_bus)
 	{
 		_memory_bus = memory_bus;
-		bool pushed = _memory_bus->read_responders.try_push_back({ this, &process_mem_read_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
-		pushed = _memory_bus->write_responders.try_push_back({ this, &process_mem_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool pushed = _memory_bus->try_add_read_responder({ this, &process_mem_read_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		pushed = _memory_bus->try_add_write_responder({ this, &process_mem_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
 		return S_OK;
 	}
 
 	~TestRAM()
 	{
-		_memory_bus->write_responders.remove([this](auto& d) { return d.Device == this; });
-		_memory_bus->read_responders.remove([this](auto& d) { return d.Device == this; });
+		_memory_bus->remove_responders(this);
 	}
 
 	virtual void STDMETHODCALLTYPE Reset() override
@@ -69,18 +72,19 @@ class TestIODevice : public IDevice
 	unordered_map_nothrow<uint16_t, uint8_t> _data;
 
 public:
+	uint32_t read_count = 0;
+
 	HRESULT InitInstance (Bus* io_bus)
 	{
 		_io_bus = io_bus;
-		bool pushed = _io_bus->read_responders.try_push_back({ this, &process_io_read_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
-		pushed = _io_bus->write_responders.try_push_back({ this, &process_io_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		bool pushed = _io_bus->try_add_read_responder({ this, &process_io_read_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		pushed = _io_bus->try_add_write_responder({ this, &process_io_write_request }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
 		return S_OK;
 	}
 
 	~TestIODevice()
 	{
-		_io_bus->write_responders.remove([this](auto& d) { return d.Device == this; });
-		_io_bus->read_responders.remove([this](auto& d) { return d.Device == this; });
+		_io_bus->remove_responders(this);
 	}
 
 	virtual void STDMETHODCALLTYPE Reset() override
@@ -101,6 +105,7 @@ public:
 	static uint8_t process_io_read_request (IDevice* d, uint16_t address)
 	{
 		auto* iod = static_cast<TestIODevice*>(d);
+		iod->read_count++;
 		auto it = iod->_data.find(address);
 		if (it != iod->_data.end())
 			return it->second;
@@ -120,6 +125,305 @@ public:
 	}
 };
 
+// Responds to the ports that match a mask and value, and counts the requests it gets.
+class TestPortDevice : public IDevice
+{
+	Bus* _io_bus = nullptr;
+
+public:
+	uint8_t read_value;
+	uint32_t read_count = 0;
+	uint32_t write_count = 0;
+	uint16_t last_address = 0;
+
+	TestPortDevice (uint8_t read_value)
+		: read_value(read_value)
+	{ }
+
+	HRESULT InitInstance (Bus* io_bus, uint16_t mask, uint16_t value)
+	{
+		_io_bus = io_bus;
+		bool pushed = _io_bus->try_add_read_responder({ this, &process_io_read_request, mask, value }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		pushed = _io_bus->try_add_write_responder({ this, &process_io_write_request, mask, value }); RETURN_HR_IF(E_OUTOFMEMORY, !pushed);
+		return S_OK;
+	}
+
+	~TestPortDevice()
+	{
+		if (_io_bus)
+			_io_bus->remove_responders(this);
+	}
+
+	virtual void STDMETHODCALLTYPE Reset() override { }
+
+	virtual UINT64 STDMETHODCALLTYPE Time() override { return 0; }
+
+	virtual BOOL STDMETHODCALLTYPE NeedSyncWithRealTime (UINT64* sync_time) override { return FALSE; }
+
+	virtual void SimulateTo (UINT64 requested_time) override { }
+
+	static uint8_t process_io_read_request (IDevice* d, uint16_t address)
+	{
+		auto* pd = static_cast<TestPortDevice*>(d);
+		pd->read_count++;
+		pd->last_address = address;
+		return pd->read_value;
+	}
+
+	static void process_io_write_request (IDevice* d, uint16_t address, uint8_t value)
+	{
+		auto* pd = static_cast<TestPortDevice*>(d);
+		pd->write_count++;
+		pd->last_address = address;
+	}
+};
+
+// Requests one interrupt, at a given time.
+class TestInterruptingDevice : public IDevice, public IInterruptingDevice
+{
+	UINT64 _time = 0;
+	UINT64 _irq_time;
+	bool _pending = false;
+	bool _acknowledged = false;
+
+public:
+	mutable uint32_t poll_count = 0;
+
+	TestInterruptingDevice (UINT64 irq_time)
+		: _irq_time(irq_time)
+	{ }
+
+	virtual void STDMETHODCALLTYPE Reset() override { Assert::Fail(); }
+
+	virtual UINT64 STDMETHODCALLTYPE Time() override { return _time; }
+
+	virtual BOOL STDMETHODCALLTYPE NeedSyncWithRealTime (UINT64* sync_time) override { Assert::Fail(); return false; }
+
+	virtual void SimulateTo (UINT64 requested_time) override
+	{
+		_time = requested_time;
+		if (!_acknowledged && (_time >= _irq_time))
+			_pending = true;
+	}
+
+	virtual IDevice* as_device() override { return this; }
+
+	virtual uint8_t STDMETHODCALLTYPE irq_priority() override { return 0; }
+
+	virtual bool irq_pending (uint64_t& irq_time, uint8_t& irq_address) const override
+	{
+		poll_count++;
+		irq_time = _irq_time;
+		irq_address = 0xFF;
+		return _pending;
+	}
+
+	virtual void acknowledge_irq() override
+	{
+		_pending = false;
+		_acknowledged = true;
+	}
+
+	virtual bool next_irq_time (UINT64& irq_time) const override
+	{
+		irq_time = _irq_time;
+		return !_acknowledged;
+	}
+};
+
+// Advances no further than the device it follows, if any, and syncs with real time every 1000 cycles.
+class TestFollowingDevice : public IDevice
+{
+	IDevice* _leader;
+	UINT64 _time = 0;
+
+public:
+	TestFollowingDevice (IDevice* leader)
+		: _leader(leader)
+	{ }
+
+	virtual void STDMETHODCALLTYPE Reset() override { _time = 0; }
+
+	virtual UINT64 STDMETHODCALLTYPE Time() override { return _time; }
+
+	virtual BOOL STDMETHODCALLTYPE NeedSyncWithRealTime (UINT64* sync_time) override
+	{
+		*sync_time = _time - _time % 1000 + 999;
+		return TRUE;
+	}
+
+	virtual void SimulateTo (UINT64 requested_time) override
+	{
+		_time = _leader ? std::min(requested_time, _leader->Time()) : requested_time;
+	}
+};
+
+class TestRomImage : public IRomImage
+{
+	ULONG _refCount = 0;
+	uint8_t _bytes[0x8000] = { }; // all NOPs
+
+public:
+	virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void** ppvObject) override
+	{
+		if (TryQI<IUnknown>(this, riid, ppvObject) || TryQI<IRomImage>(this, riid, ppvObject))
+			return S_OK;
+
+		*ppvObject = nullptr;
+		return E_NOINTERFACE;
+	}
+
+	virtual ULONG STDMETHODCALLTYPE AddRef() override { return ++_refCount; }
+
+	virtual ULONG STDMETHODCALLTYPE Release() override { return ReleaseST(this, _refCount); }
+
+	virtual const uint8_t* STDMETHODCALLTYPE GetBytes() override { return _bytes; }
+};
+
+// Stands in for the simulator's side of the "...Async" methods: keeps what they were given, for the test
+// to complete them later, as the simulator would.
+struct fake_async_simulator
+{
+	SimulatorCompletion completions[4];
+	uint32_t* outs[4];
+	uint32_t count = 0;
+
+	HRESULT start (uint32_t* out, SimulatorCompletion completion)
+	{
+		RETURN_HR_IF(E_OUTOFMEMORY, count == _countof(completions));
+		outs[count] = out;
+		completions[count] = completion;
+		count++;
+		return S_OK;
+	}
+
+	// The simulator thread writes the out parameter, then the main thread calls the completion.
+	void complete (uint32_t i, uint32_t value)
+	{
+		*outs[i] = value;
+		completions[i].OnComplete(completions[i].Context, S_OK);
+	}
+};
+
+// An out parameter that counts its instances, to see when a request frees its state.
+struct tracked_value
+{
+	static inline int alive = 0;
+	uint32_t value = 0;
+
+	tracked_value() { alive++; }
+	~tracked_value() { alive--; }
+};
+
+// Starts two requests, then awaits them one after the other.
+static fire_and_forget add_two (fake_async_simulator& sim, uint32_t* sum)
+{
+	simulator_request<uint32_t> a ([&sim](uint32_t& v, SimulatorCompletion c) { return sim.start(&v, c); });
+	simulator_request<uint32_t> b ([&sim](uint32_t& v, SimulatorCompletion c) { return sim.start(&v, c); });
+	if (FAILED(co_await a) || FAILED(co_await b))
+		co_return;
+	*sum = a.value() + b.value();
+}
+
+// A coroutine the test can destroy while it's suspended, as happens when its owner goes away.
+struct destroyable_coroutine
+{
+	struct promise_type
+	{
+		destroyable_coroutine get_return_object() noexcept { return { std::coroutine_handle<promise_type>::from_promise(*this) }; }
+		std::suspend_never initial_suspend() noexcept { return { }; }
+		std::suspend_always final_suspend() noexcept { return { }; }
+		void return_void() noexcept { }
+		void unhandled_exception() noexcept { FAIL_FAST(); }
+	};
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+static destroyable_coroutine await_tracked (fake_async_simulator& sim, bool* resumed)
+{
+	simulator_request<tracked_value> r ([&sim](tracked_value& v, SimulatorCompletion c) { return sim.start(&v.value, c); });
+	co_await r;
+	*resumed = true;
+}
+
+// Plays the simulator thread of SimulatorImpl for a simulator_command_queue: runs the commands each time the queue
+// wakes it up, either on a thread of its own (after start) or when the test calls run_commands. It keeps the
+// completions for the test, which plays the main thread, to run with run_main_thread_work.
+struct test_simulator_thread
+{
+	std::mutex lock;
+	std::condition_variable wake;
+	bool woken = false;
+	bool exit = false;
+	uint32_t wakes = 0;
+	simulator_command_queue queue { [this] { on_wake(); } };
+	std::mutex main_thread_lock;
+	vector_nothrow<stdext::inplace_function<void()>> main_thread_work;
+	std::thread thread;
+
+	~test_simulator_thread()
+	{
+		if (thread.joinable())
+		{
+			{
+				std::lock_guard l(lock);
+				exit = true;
+			}
+			wake.notify_one();
+			thread.join();
+		}
+	}
+
+	void on_wake()
+	{
+		{
+			std::lock_guard l(lock);
+			woken = true;
+			wakes++;
+		}
+		wake.notify_one();
+	}
+
+	void start()
+	{
+		thread = std::thread([this]
+		{
+			while (true)
+			{
+				{
+					std::unique_lock l(lock);
+					wake.wait(l, [this] { return woken || exit; });
+					if (exit)
+						return;
+					woken = false;
+				}
+				run_commands();
+			}
+		});
+	}
+
+	void run_commands()
+	{
+		queue.run_commands([this](stdext::inplace_function<void()> work)
+		{
+			std::lock_guard l(main_thread_lock);
+			bool pushed = main_thread_work.try_push_back(std::move(work));
+			return pushed ? S_OK : E_OUTOFMEMORY;
+		});
+	}
+
+	uint32_t run_main_thread_work()
+	{
+		std::unique_lock l(main_thread_lock);
+		auto work = std::move(main_thread_work);
+		l.unlock();
+		for (auto& w : work)
+			w();
+		return (uint32_t)work.size();
+	}
+};
+
 namespace Z80SimulatorTests
 {
 	TEST_CLASS(Z80SimulatorTests)
@@ -153,6 +457,55 @@ namespace Z80SimulatorTests
 			Assert::IsTrue(res);
 		}
 
+		static constexpr hl_ix_iy prefixes[] = { hl_ix_iy::hl, hl_ix_iy::ix, hl_ix_iy::iy };
+		static constexpr int8_t prefixed_disp = -2;
+
+		// Resets the CPU and memory, points HL, IX and IY at different places, and writes at address 0 the
+		// prefix for "xy" (none for HL) followed by "code". If "indexed" and "xy" is IX or IY, the displacement
+		// prefixed_disp goes after the first byte of "code", as in "ld (ix+d),n" and "rlc (ix+d)".
+		// Returns the length of the instruction.
+		uint16_t write_prefixed (hl_ix_iy xy, const std::initializer_list<uint8_t>& code, bool indexed)
+		{
+			cpu->Reset();
+			ram->Reset();
+			regs->main.bc = 0x0102;
+			regs->main.de = 0x0304;
+			regs->main.hl = 0x1020;
+			regs->ix = 0x3040;
+			regs->iy = 0x5060;
+			regs->sp = 0x8000;
+			regs->main.a = 0x0F;
+
+			uint16_t addr = 0;
+			if (xy != hl_ix_iy::hl)
+				memory.write(addr++, (uint8_t)((xy == hl_ix_iy::ix) ? 0xDD : 0xFD));
+			for (auto b = code.begin(); b != code.end(); b++)
+			{
+				memory.write(addr++, *b);
+				if ((b == code.begin()) && indexed && (xy != hl_ix_iy::hl))
+					memory.write(addr++, (uint8_t)prefixed_disp);
+			}
+
+			return addr;
+		}
+
+		// The address of the operand of an instruction written by write_prefixed with "indexed": (HL) or (XY+d).
+		uint16_t prefixed_operand (hl_ix_iy xy)
+		{
+			return (xy == hl_ix_iy::hl) ? regs->main.hl : (uint16_t)(regs->hl(xy) + prefixed_disp);
+		}
+
+		// Checks that an instruction with the prefix for "xy" left the other two of HL, IX and IY alone.
+		void assert_other_pointers_unchanged (hl_ix_iy xy)
+		{
+			if (xy != hl_ix_iy::hl)
+				Assert::AreEqual<uint16_t>(0x1020, regs->main.hl);
+			if (xy != hl_ix_iy::ix)
+				Assert::AreEqual<uint16_t>(0x3040, regs->ix);
+			if (xy != hl_ix_iy::iy)
+				Assert::AreEqual<uint16_t>(0x5060, regs->iy);
+		}
+
 		TEST_METHOD_INITIALIZE(MethodInitialize)
 		{
 			cpu->Reset();
@@ -228,6 +581,21 @@ namespace Z80SimulatorTests
 			Assert::AreEqual<uint64_t>(19, cpu->Time());
 		}
 
+		TEST_METHOD(test_ld_a_nn_from_mapped_page)
+		{
+			uint8_t page[Bus::page_size];
+			memset (page, 0x55, sizeof(page));
+			page[0x34] = 0xA5;
+			memory.map_read_pages (ram.get(), 0x1200, Bus::page_size, page);
+			auto unmap = wil::scope_exit([this] { memory.unmap_pages(ram.get()); });
+
+			memory.write(0, { 0x3A, 0x34, 0x12 }); // ld a, (1234h)
+			SimulateOne();
+			Assert::AreEqual<uint64_t>(13, cpu->Time());
+			Assert::AreEqual<uint8_t>(0xA5, regs->main.a);
+			Assert::AreEqual<uint8_t>(0x55, memory.read(0x1235));
+		}
+
 		TEST_METHOD(test_ld_b_a)
 		{
 			regs->main.a = 0x55;
@@ -1328,7 +1696,7 @@ namespace Z80SimulatorTests
 			regs->main.bc = 1;
 			regs->pc = 0;
 			cpu->SimulateOne(nullptr);
-			Assert::AreEqual(32ui8, regs->main.a);
+			Assert::AreEqual<uint8_t>(32, regs->main.a);
 			Assert::AreEqual<uint8_t>(0, regs->main.f.s);
 			Assert::AreEqual<uint8_t>(0, regs->main.f.z);
 			Assert::AreEqual<uint8_t>(1, regs->main.f.x5);
@@ -2383,12 +2751,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xC2, 0x34, 0x12 }); // JP NZ, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.z = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_z_nn)
@@ -2396,12 +2764,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xCA, 0x34, 0x12 }); // JP Z, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.z = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_nc_nn)
@@ -2409,12 +2777,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xD2, 0x34, 0x12 }); // JP NC, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.c = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_c_nn)
@@ -2422,12 +2790,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xDA, 0x34, 0x12 }); // JP C, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.c = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_po_nn)
@@ -2435,12 +2803,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xE2, 0x34, 0x12 }); // JP PO, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.pv = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_pe_nn)
@@ -2448,12 +2816,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xEA, 0x34, 0x12 }); // JP PE, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.pv = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_p)
@@ -2461,12 +2829,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xF2, 0x34, 0x12 }); // JP P, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.s = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jp_m_nn)
@@ -2474,12 +2842,12 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0xFA, 0x34, 0x12 }); // JP M, 1234h
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(3, regs->pc);
-			Assert::AreEqual(10ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(10, cpu->Time());
 			regs->pc = 0;
 			regs->main.f.s = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual(20ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
 		}
 
 		TEST_METHOD(jr_e)
@@ -2487,19 +2855,19 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0x18, 0x7F }); // JR +127
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2 + 127, regs->pc);
-			Assert::AreEqual (12ui64, cpu->Time());
+			Assert::AreEqual<uint64_t> (12, cpu->Time());
 
 			regs->pc = 0;
 			memory.write (0, { 0x18, 0 }); // JR +0
 			SimulateOne();
 			Assert::AreEqual ((uint16_t)2, regs->pc);
-			Assert::AreEqual (24ui64, cpu->Time());
+			Assert::AreEqual<uint64_t> (24, cpu->Time());
 
 			regs->pc = 0;
 			memory.write (0, { 0x18, 0x80 }); // JR -128
 			SimulateOne();
 			Assert::AreEqual ((uint16_t)(2 - 128), regs->pc);
-			Assert::AreEqual (36ui64, cpu->Time());
+			Assert::AreEqual<uint64_t> (36, cpu->Time());
 		}
 
 		TEST_METHOD(jr_nz_e)
@@ -2507,13 +2875,13 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0x20, 100 }); // JR NZ, +100
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2 + 100, regs->pc);
-			Assert::AreEqual(12ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(12, cpu->Time());
 			
 			cpu->Reset();
 			regs->main.f.z = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2, regs->pc);
-			Assert::AreEqual(7ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(7, cpu->Time());
 		}
 
 		TEST_METHOD(jr_z_e)
@@ -2521,13 +2889,13 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0x28, 256 - 100 }); // JR NZ, -100
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2, regs->pc);
-			Assert::AreEqual(7ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(7, cpu->Time());
 
 			cpu->Reset();
 			regs->main.f.z = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>((uint16_t)(2 - 100), regs->pc);
-			Assert::AreEqual(12ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(12, cpu->Time());
 		}
 
 		TEST_METHOD(jr_nc_e)
@@ -2535,13 +2903,13 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0x30, 100 }); // JR NC, +100
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2 + 100, regs->pc);
-			Assert::AreEqual(12ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(12, cpu->Time());
 
 			cpu->Reset();
 			regs->main.f.c = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2, regs->pc);
-			Assert::AreEqual(7ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(7, cpu->Time());
 		}
 
 		TEST_METHOD(jr_c_e)
@@ -2549,13 +2917,13 @@ namespace Z80SimulatorTests
 			memory.write (0, { 0x38, 256 - 100 }); // JR C, -100
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(2, regs->pc);
-			Assert::AreEqual(7ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(7, cpu->Time());
 
 			cpu->Reset();
 			regs->main.f.c = 1;
 			SimulateOne();
 			Assert::AreEqual<uint16_t>((uint16_t)(2 - 100), regs->pc);
-			Assert::AreEqual(12ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(12, cpu->Time());
 		}
 
 		TEST_METHOD(jp_hl_ix_iy)
@@ -2563,110 +2931,415 @@ namespace Z80SimulatorTests
 			memory.write (0, 0xE9); // JP (HL)
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0, regs->pc);
-			Assert::AreEqual(4ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(4, cpu->Time());
 
 			cpu->Reset();
 			memory.write (0, { 0xDD, 0xE9 }); // JP (IX)
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0, regs->pc);
-			Assert::AreEqual(8ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(8, cpu->Time());
 
 			cpu->Reset();
 			memory.write (0, { 0xFD, 0xE9 }); // JP (IY)
 			SimulateOne();
 			Assert::AreEqual<uint16_t>(0, regs->pc);
-			Assert::AreEqual(8ui64, cpu->Time());
+			Assert::AreEqual<uint64_t>(8, cpu->Time());
 		}
 
-		TEST_METHOD(djnz_e)
+		// The tests below run each instruction whose behavior depends on the DD / FD prefix once with HL,
+		// once with IX and once with IY, to check that the handlers specialized per prefix pick the right
+		// registers, displacement and timing.
+
+		TEST_METHOD(prefixed_ld_rr_nn_inc_dec_rr)
 		{
-			memory.write (0, { 0x10, 256 - 128 }); // DJNZ -128
-			SimulateOne();
-			Assert::AreEqual(255ui8, regs->b());
-			Assert::AreEqual((uint16_t)(2 - 128), regs->pc);
-			Assert::AreEqual(13ui64, cpu->Time());
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
 
-			cpu->Reset();
-			regs->b() = 1;
-			SimulateOne();
-			Assert::AreEqual(0ui8, regs->b());
-			Assert::AreEqual((uint16_t)2, regs->pc);
-			Assert::AreEqual(8ui64, cpu->Time());
+				uint16_t len = write_prefixed (xy, { 0x21, 0x34, 0x12 }, false); // ld hl/ix/iy, 1234h
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0x1234, regs->hl(xy));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(10 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
 
-			cpu->Reset();
-			memory.write (0, { 0x10, 127 }); // DJNZ +127
-			regs->b() = 255;
-			SimulateOne();
-			Assert::AreEqual(254ui8, regs->b());
-			Assert::AreEqual((uint16_t)(2 + 127), regs->pc);
-			Assert::AreEqual(13ui64, cpu->Time());
+				len = write_prefixed (xy, { 0x23 }, false); // inc hl/ix/iy
+				uint16_t before = regs->hl(xy);
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(before + 1, regs->hl(xy));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(6 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
 
-			cpu->Reset();
-			regs->b() = 1;
-			SimulateOne();
-			Assert::AreEqual(0ui8, regs->b());
-			Assert::AreEqual((uint16_t)2, regs->pc);
-			Assert::AreEqual(8ui64, cpu->Time());
+				write_prefixed (xy, { 0x2B }, false); // dec hl/ix/iy
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(before - 1, regs->hl(xy));
+				Assert::AreEqual<uint64_t>(6 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+			}
 		}
 
-		TEST_METHOD(call_nn)
+		TEST_METHOD(prefixed_add_hl_rr)
 		{
-			memory.write (0, { 0xCD, 0x34, 0x12 }); // CALL 1234h
-			SimulateOne();
-			Assert::AreEqual<uint64_t>(17, cpu->Time());
-			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-			Assert::AreEqual<uint16_t>(0xFFFE, regs->sp);
-			Assert::AreEqual<uint16_t>(3, memory.read_uint16(0xFFFE));
-		}
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
 
-		TEST_METHOD(call_cc_nn)
-		{
-			static const uint8_t ccmask[] = { z80_flag::z, z80_flag::c, z80_flag::pv, z80_flag::s };
+				uint16_t len = write_prefixed (xy, { 0x09 }, false); // add hl/ix/iy, bc
+				uint16_t before = regs->hl(xy);
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(before + 0x0102, regs->hl(xy));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(11 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
 
-			for (uint8_t i = 0; i < 8; i++)
-			{
-				// call must be taken
-				cpu->Reset();
-				memory.write (0, { (uint8_t)(0xC4 | (i << 3)), 0x34, 0x12 }); // CALL cc, 1234h
-				if (i & 1)
-				{
-					// Z, C, PE, M
-					regs->main.f.val |= ccmask[i / 2];
-				}
+				// add hl,hl / add ix,ix / add iy,iy: the prefix also replaces the source
+				write_prefixed (xy, { 0x29 }, false);
 				SimulateOne();
-				Assert::AreEqual<uint16_t>(0x1234, regs->pc);
-				Assert::AreEqual<uint64_t>(17, cpu->Time());
-				Assert::AreEqual<uint16_t>(0xFFFE, regs->sp);
-				Assert::AreEqual<uint16_t>(3, memory.read_uint16(0xFFFE));
+				Assert::AreEqual<uint16_t>(before * 2, regs->hl(xy));
+				assert_other_pointers_unchanged(xy);
 
-				// call must not be taken
-				cpu->Reset();
-				if ((i & 1) == 0)
-				{
-					// NZ, NC, PO, P
-					regs->main.f.val |= ccmask[i / 2];
-				}
+				write_prefixed (xy, { 0x39 }, false); // add hl/ix/iy, sp
+				regs->hl(xy) = 0x9000;
 				SimulateOne();
-				Assert::AreEqual<uint16_t>(3, regs->pc);
-				Assert::AreEqual<uint64_t>(10, cpu->Time());
-				Assert::AreEqual<uint16_t>(0, regs->sp);
+				Assert::AreEqual<uint16_t>(0x1000, regs->hl(xy));
+				Assert::AreEqual<uint8_t>(1, regs->main.f.c);
 			}
 		}
 
-		TEST_METHOD(ret)
+		TEST_METHOD(prefixed_ld_nn_hl)
 		{
-			memory.write(0, 0xC9); // RET
-			memory.write(0xFFFE, { 0x34, 0x12 }); // return address is 0x1234
-			regs->sp = 0xFFFE;
-			SimulateOne();
-			Assert::AreEqual (10ui64, cpu->Time());
-			Assert::AreEqual (0x1234ui16, regs->pc);
-			Assert::AreEqual (0ui16, regs->sp);
-		}
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
 
-		TEST_METHOD(ret_cc)
-		{
-			static const uint8_t ccmask[] = { z80_flag::z, z80_flag::c, z80_flag::pv, z80_flag::s };
+				uint16_t len = write_prefixed (xy, { 0x22, 0x00, 0x40 }, false); // ld (4000h), hl/ix/iy
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(regs->hl(xy), memory.read_uint16(0x4000));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(16 + extra, cpu->Time());
+
+				write_prefixed (xy, { 0x2A, 0x00, 0x40 }, false); // ld hl/ix/iy, (4000h)
+				memory.write(0x4000, { 0xEF, 0xBE });
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0xBEEF, regs->hl(xy));
+				Assert::AreEqual<uint64_t>(16 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+			}
+		}
+
+		TEST_METHOD(prefixed_ld_r_n)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
+
+				uint16_t len = write_prefixed (xy, { 0x26, 0x55 }, false); // ld h/ixh/iyh, 55h
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x55, regs->r8(4, xy));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(7 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+
+				write_prefixed (xy, { 0x2E, 0x66 }, false); // ld l/ixl/iyl, 66h
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x66, regs->r8(5, xy));
+				assert_other_pointers_unchanged(xy);
+
+				len = write_prefixed (xy, { 0x36, 0x77 }, true); // ld (hl) / (ix+d) / (iy+d), 77h
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x77, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 10 : 19, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+			}
+		}
+
+		TEST_METHOD(prefixed_inc_dec_r)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
+
+				uint16_t len = write_prefixed (xy, { 0x24 }, false); // inc h/ixh/iyh
+				uint8_t before = regs->r8(4, xy);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(before + 1, regs->r8(4, xy));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(4 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+
+				write_prefixed (xy, { 0x2D }, false); // dec l/ixl/iyl
+				before = regs->r8(5, xy);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(before - 1, regs->r8(5, xy));
+				Assert::AreEqual<uint64_t>(4 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+
+				len = write_prefixed (xy, { 0x34 }, true); // inc (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0x7F);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x80, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint8_t>(1, regs->main.f.pv);
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 11 : 23, cpu->Time());
+
+				write_prefixed (xy, { 0x35 }, true); // dec (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0x01);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint8_t>(1, regs->main.f.z);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 11 : 23, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+			}
+		}
+
+		TEST_METHOD(prefixed_ld_r_r)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
+
+				uint16_t len = write_prefixed (xy, { 0x44 }, false); // ld b, h/ixh/iyh
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(regs->r8(4, xy), regs->b());
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(4 + extra, cpu->Time());
+
+				// ld h,l / ld ixh,ixl / ld iyh,iyl: between registers, the prefix applies to both
+				write_prefixed (xy, { 0x65 }, false);
+				uint8_t low = regs->r8(5, xy);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(low, regs->r8(4, xy));
+				assert_other_pointers_unchanged(xy);
+
+				// ld h, (hl) / (ix+d) / (iy+d): with a memory operand, the register is always the real H
+				len = write_prefixed (xy, { 0x66 }, true);
+				memory.write(prefixed_operand(xy), 0xA5);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0xA5, regs->h());
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 7 : 19, cpu->Time());
+				if (xy == hl_ix_iy::ix)
+					Assert::AreEqual<uint16_t>(0x3040, regs->ix);
+				if (xy == hl_ix_iy::iy)
+					Assert::AreEqual<uint16_t>(0x5060, regs->iy);
+
+				// ld (hl) / (ix+d) / (iy+d), l: same for the source
+				write_prefixed (xy, { 0x75 }, true);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x20, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 7 : 19, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+			}
+		}
+
+		TEST_METHOD(prefixed_alu)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
+
+				uint16_t len = write_prefixed (xy, { 0x84 }, false); // add a, h/ixh/iyh
+				uint8_t expected = 0x0F + regs->r8(4, xy);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(expected, regs->main.a);
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(4 + extra, cpu->Time());
+
+				len = write_prefixed (xy, { 0xAE }, true); // xor (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0xFF);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0xF0, regs->main.a);
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 7 : 19, cpu->Time());
+
+				write_prefixed (xy, { 0xBE }, true); // cp (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0x0F);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x0F, regs->main.a);
+				Assert::AreEqual<uint8_t>(1, regs->main.f.z);
+				assert_other_pointers_unchanged(xy);
+			}
+		}
+
+		TEST_METHOD(prefixed_stack_and_jumps)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint8_t extra = (xy == hl_ix_iy::hl) ? 0 : 4;
+
+				uint16_t len = write_prefixed (xy, { 0xE5 }, false); // push hl/ix/iy
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0x7FFE, regs->sp);
+				Assert::AreEqual<uint16_t>(regs->hl(xy), memory.read_uint16(0x7FFE));
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>(11 + extra, cpu->Time());
+
+				write_prefixed (xy, { 0xE1 }, false); // pop hl/ix/iy
+				memory.write(0x8000, { 0xEF, 0xBE });
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0xBEEF, regs->hl(xy));
+				Assert::AreEqual<uint16_t>(0x8002, regs->sp);
+				Assert::AreEqual<uint64_t>(10 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+
+				write_prefixed (xy, { 0xE3 }, false); // ex (sp), hl/ix/iy
+				uint16_t before = regs->hl(xy);
+				memory.write(0x8000, { 0xEF, 0xBE });
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0xBEEF, regs->hl(xy));
+				Assert::AreEqual<uint16_t>(before, memory.read_uint16(0x8000));
+				Assert::AreEqual<uint64_t>(19 + extra, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+
+				write_prefixed (xy, { 0xF9 }, false); // ld sp, hl/ix/iy
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(regs->hl(xy), regs->sp);
+				Assert::AreEqual<uint64_t>(6 + extra, cpu->Time());
+
+				write_prefixed (xy, { 0xE9 }, false); // jp (hl) / (ix) / (iy)
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(regs->hl(xy), regs->pc);
+				Assert::AreEqual<uint64_t>(4 + extra, cpu->Time());
+			}
+		}
+
+		TEST_METHOD(prefixed_ex_de_hl_ignores_prefix)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				write_prefixed (xy, { 0xEB }, false); // ex de, hl
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0x1020, regs->main.de);
+				Assert::AreEqual<uint16_t>(0x0304, regs->main.hl);
+				Assert::AreEqual<uint16_t>(0x3040, regs->ix);
+				Assert::AreEqual<uint16_t>(0x5060, regs->iy);
+			}
+		}
+
+		TEST_METHOD(prefixed_cb_memory)
+		{
+			for (hl_ix_iy xy : prefixes)
+			{
+				uint16_t len = write_prefixed (xy, { 0xCB, 0x06 }, true); // rlc (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0x81);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x03, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint8_t>(1, regs->main.f.c);
+				Assert::AreEqual<uint16_t>(len, regs->pc);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 15 : 23, cpu->Time());
+
+				write_prefixed (xy, { 0xCB, 0x5E }, true); // bit 3, (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0x08);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0, regs->main.f.z);
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 12 : 20, cpu->Time());
+
+				write_prefixed (xy, { 0xCB, 0xC6 }, true); // set 0, (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0x01, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 15 : 23, cpu->Time());
+
+				write_prefixed (xy, { 0xCB, 0x86 }, true); // res 0, (hl) / (ix+d) / (iy+d)
+				memory.write(prefixed_operand(xy), 0xFF);
+				SimulateOne();
+				Assert::AreEqual<uint8_t>(0xFE, memory.read(prefixed_operand(xy)));
+				Assert::AreEqual<uint64_t>((xy == hl_ix_iy::hl) ? 15 : 23, cpu->Time());
+				assert_other_pointers_unchanged(xy);
+			}
+		}
+
+		TEST_METHOD(djnz_e)
+		{
+			memory.write (0, { 0x10, 256 - 128 }); // DJNZ -128
+			SimulateOne();
+			Assert::AreEqual<uint8_t>(255, regs->b());
+			Assert::AreEqual((uint16_t)(2 - 128), regs->pc);
+			Assert::AreEqual<uint64_t>(13, cpu->Time());
+
+			cpu->Reset();
+			regs->b() = 1;
+			SimulateOne();
+			Assert::AreEqual<uint8_t>(0, regs->b());
+			Assert::AreEqual((uint16_t)2, regs->pc);
+			Assert::AreEqual<uint64_t>(8, cpu->Time());
+
+			cpu->Reset();
+			memory.write (0, { 0x10, 127 }); // DJNZ +127
+			regs->b() = 255;
+			SimulateOne();
+			Assert::AreEqual<uint8_t>(254, regs->b());
+			Assert::AreEqual((uint16_t)(2 + 127), regs->pc);
+			Assert::AreEqual<uint64_t>(13, cpu->Time());
+
+			cpu->Reset();
+			regs->b() = 1;
+			SimulateOne();
+			Assert::AreEqual<uint8_t>(0, regs->b());
+			Assert::AreEqual((uint16_t)2, regs->pc);
+			Assert::AreEqual<uint64_t>(8, cpu->Time());
+		}
+
+		TEST_METHOD(call_nn)
+		{
+			memory.write (0, { 0xCD, 0x34, 0x12 }); // CALL 1234h
+			SimulateOne();
+			Assert::AreEqual<uint64_t>(17, cpu->Time());
+			Assert::AreEqual<uint16_t>(0x1234, regs->pc);
+			Assert::AreEqual<uint16_t>(0xFFFE, regs->sp);
+			Assert::AreEqual<uint16_t>(3, memory.read_uint16(0xFFFE));
+		}
+
+		TEST_METHOD(call_cc_nn)
+		{
+			static const uint8_t ccmask[] = { z80_flag::z, z80_flag::c, z80_flag::pv, z80_flag::s };
+
+			for (uint8_t i = 0; i < 8; i++)
+			{
+				// call must be taken
+				cpu->Reset();
+				memory.write (0, { (uint8_t)(0xC4 | (i << 3)), 0x34, 0x12 }); // CALL cc, 1234h
+				if (i & 1)
+				{
+					// Z, C, PE, M
+					regs->main.f.val |= ccmask[i / 2];
+				}
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(0x1234, regs->pc);
+				Assert::AreEqual<uint64_t>(17, cpu->Time());
+				Assert::AreEqual<uint16_t>(0xFFFE, regs->sp);
+				Assert::AreEqual<uint16_t>(3, memory.read_uint16(0xFFFE));
+
+				// call must not be taken
+				cpu->Reset();
+				if ((i & 1) == 0)
+				{
+					// NZ, NC, PO, P
+					regs->main.f.val |= ccmask[i / 2];
+				}
+				SimulateOne();
+				Assert::AreEqual<uint16_t>(3, regs->pc);
+				Assert::AreEqual<uint64_t>(10, cpu->Time());
+				Assert::AreEqual<uint16_t>(0, regs->sp);
+			}
+		}
+
+		TEST_METHOD(ret)
+		{
+			memory.write(0, 0xC9); // RET
+			memory.write(0xFFFE, { 0x34, 0x12 }); // return address is 0x1234
+			regs->sp = 0xFFFE;
+			SimulateOne();
+			Assert::AreEqual<uint64_t> (10, cpu->Time());
+			Assert::AreEqual<uint16_t> (0x1234, regs->pc);
+			Assert::AreEqual<uint16_t> (0, regs->sp);
+		}
+
+		TEST_METHOD(ret_cc)
+		{
+			static const uint8_t ccmask[] = { z80_flag::z, z80_flag::c, z80_flag::pv, z80_flag::s };
 
 			memory.write(0xFFFE, { 0x34, 0x12 }); // return address is 0x1234
 
@@ -2707,9 +3380,9 @@ namespace Z80SimulatorTests
 			memory.write (0xFFFE, { 0x34, 0x12 });
 			regs->sp = 0xFFFE;
 			SimulateOne();
-			Assert::AreEqual (14ui64, cpu->Time());
-			Assert::AreEqual (0x1234ui16, regs->pc);
-			Assert::AreEqual (0ui16, regs->sp);
+			Assert::AreEqual<uint64_t> (14, cpu->Time());
+			Assert::AreEqual<uint16_t> (0x1234, regs->pc);
+			Assert::AreEqual<uint16_t> (0, regs->sp);
 		}
 
 		TEST_METHOD(retn)
@@ -2719,18 +3392,18 @@ namespace Z80SimulatorTests
 			regs->sp = 0xFFFE;
 			regs->iff1 = 1;
 			SimulateOne();
-			Assert::AreEqual (14ui64, cpu->Time());
-			Assert::AreEqual (0x1234ui16, regs->pc);
-			Assert::AreEqual (0ui16, regs->sp);
+			Assert::AreEqual<uint64_t> (14, cpu->Time());
+			Assert::AreEqual<uint16_t> (0x1234, regs->pc);
+			Assert::AreEqual<uint16_t> (0, regs->sp);
 			Assert::AreEqual<bool>(0, regs->iff1);
 
 			cpu->Reset();
 			regs->sp = 0xFFFE;
 			regs->iff2 = 1;
 			SimulateOne();
-			Assert::AreEqual (14ui64, cpu->Time());
-			Assert::AreEqual (0x1234ui16, regs->pc);
-			Assert::AreEqual (0ui16, regs->sp);
+			Assert::AreEqual<uint64_t> (14, cpu->Time());
+			Assert::AreEqual<uint16_t> (0x1234, regs->pc);
+			Assert::AreEqual<uint16_t> (0, regs->sp);
 			Assert::AreEqual<bool>(1, regs->iff1);
 		}
 
@@ -2803,6 +3476,110 @@ namespace Z80SimulatorTests
 			}
 		}
 
+		// Writes to "port" and returns which of the devices got the write, one bit per device.
+		static uint32_t devices_written (Bus& bus, uint16_t port, TestPortDevice* const (&devices)[4])
+		{
+			for (auto d : devices)
+				d->write_count = 0;
+			bool written = bus.try_write_request(port, (uint8_t)0x55, 0);
+			Assert::IsTrue(written);
+			uint32_t mask = 0;
+			for (uint32_t i = 0; i < 4; i++)
+			{
+				Assert::IsTrue(devices[i]->write_count <= 1);
+				if (devices[i]->write_count)
+				{
+					Assert::AreEqual(port, devices[i]->last_address);
+					mask |= 1 << i;
+				}
+			}
+
+			return mask;
+		}
+
+		TEST_METHOD(port_decode_overlapping_masks)
+		{
+			Bus bus;
+			TestPortDevice ula (0xF0);  // even ports, as the ULA
+			TestPortDevice fe (0x3C);   // the whole low byte 0xFE, and A15 low
+			TestPortDevice hc (0x5A);   // A7 and A0 low, as the HC memory paging
+			TestPortDevice all (0xFF);  // every port
+			Assert::IsTrue(SUCCEEDED(ula.InitInstance(&bus, 0x0001, 0x0000)));
+			Assert::IsTrue(SUCCEEDED(fe.InitInstance(&bus, 0x80FF, 0x00FE)));
+			Assert::IsTrue(SUCCEEDED(hc.InitInstance(&bus, 0x0081, 0x0000)));
+			Assert::IsTrue(SUCCEEDED(all.InitInstance(&bus, 0x0000, 0x0000)));
+			TestPortDevice* const devices[4] = { &ula, &fe, &hc, &all };
+
+			Assert::AreEqual(0b1011u, devices_written(bus, 0x00FE, devices)); // A7 high: not "hc"
+			Assert::AreEqual(0b1001u, devices_written(bus, 0x80FE, devices)); // A15 high: not "fe" either
+			Assert::AreEqual(0b1101u, devices_written(bus, 0x007E, devices));
+			Assert::AreEqual(0b1101u, devices_written(bus, 0xFF7C, devices));
+			Assert::AreEqual(0b1000u, devices_written(bus, 0x00FF, devices));
+			Assert::AreEqual(0b1000u, devices_written(bus, 0x1F01, devices));
+
+			// A read gets the AND of what all the decoding devices return.
+			uint8_t value;
+			Assert::IsTrue(bus.try_read_request(0x00FE, value, 0));
+			Assert::AreEqual<uint8_t>(0xF0 & 0x3C, value);
+			Assert::IsTrue(bus.try_read_request(0x80FE, value, 0));
+			Assert::AreEqual<uint8_t>(0xF0, value);
+			Assert::IsTrue(bus.try_read_request(0x00FD, value, 0));
+			Assert::AreEqual<uint8_t>(0xFF, value);
+			Assert::AreEqual(1u, fe.read_count);
+			Assert::AreEqual(3u, all.read_count);
+
+			// read() and write(), which the debugger uses, decode the same way.
+			Assert::AreEqual<uint8_t>(0xF0 & 0x5A, bus.read(0x007E));
+			ula.write_count = fe.write_count = 0;
+			bus.write(0x00FE, 0x55);
+			Assert::AreEqual(1u, ula.write_count);
+			Assert::AreEqual(1u, fe.write_count);
+		}
+
+		TEST_METHOD(port_decode_after_removing_responders)
+		{
+			Bus bus;
+			TestPortDevice ula (0xF0);
+			TestPortDevice all (0xFF);
+			TestPortDevice hc (0x5A);
+			TestPortDevice fe (0x3C);
+			Assert::IsTrue(SUCCEEDED(ula.InitInstance(&bus, 0x0001, 0x0000)));
+			Assert::IsTrue(SUCCEEDED(all.InitInstance(&bus, 0x0000, 0x0000)));
+			TestPortDevice* const devices[4] = { &ula, &all, &hc, &fe };
+
+			Assert::AreEqual(0b0011u, devices_written(bus, 0x00FE, devices));
+
+			Assert::IsTrue(SUCCEEDED(hc.InitInstance(&bus, 0x0081, 0x0000)));
+			Assert::IsTrue(SUCCEEDED(fe.InitInstance(&bus, 0x00FF, 0x00FE)));
+			Assert::AreEqual(0b1011u, devices_written(bus, 0x00FE, devices));
+			Assert::AreEqual(0b0111u, devices_written(bus, 0x007E, devices));
+
+			// Removing one device leaves the others decoding as before, on all low bytes.
+			bus.remove_responders(&all);
+			Assert::AreEqual(0b1001u, devices_written(bus, 0x00FE, devices));
+			Assert::AreEqual(0b0000u, devices_written(bus, 0x00FF, devices));
+			Assert::AreEqual(0b0101u, devices_written(bus, 0x007C, devices));
+
+			bus.remove_responders(&ula);
+			bus.remove_responders(&fe);
+			Assert::AreEqual(0b0000u, devices_written(bus, 0x00FE, devices));
+			Assert::AreEqual(0b0100u, devices_written(bus, 0x007E, devices));
+			uint8_t value;
+			Assert::IsTrue(bus.try_read_request(0x007E, value, 0));
+			Assert::AreEqual<uint8_t>(0x5A, value);
+
+			// Added back, a device decodes again.
+			Assert::IsTrue(SUCCEEDED(all.InitInstance(&bus, 0x0000, 0x0000)));
+			Assert::AreEqual(0b0110u, devices_written(bus, 0x007E, devices));
+			Assert::AreEqual(0b0010u, devices_written(bus, 0x00FF, devices));
+
+			bus.remove_responders(&hc);
+			bus.remove_responders(&all);
+			Assert::AreEqual(0b0000u, devices_written(bus, 0x007E, devices));
+			Assert::IsTrue(bus.try_read_request(0x007E, value, 0));
+			Assert::AreEqual<uint8_t>(0xFF, value);
+		}
+
 		TEST_METHOD(ini)
 		{
 			memory.write(0, { 0xED, 0xA2 }); // INI
@@ -3054,5 +3831,1781 @@ namespace Z80SimulatorTests
 			Assert::AreEqual<uint8_t>(3, regs->r);
 			Assert::AreEqual<uint16_t>(0x1235, regs->main.hl);
 		}
+
+		TEST_METHOD(simulate_until_time)
+		{
+			// Each NOP takes 4 cycles, so we expect to go slightly past the requested time.
+			memory.write(0, { 0, 0, 0, 0 });
+			auto reason = cpu->SimulateUntil(10, nullptr);
+			Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+			Assert::AreEqual<uint64_t>(12, cpu->Time());
+			Assert::AreEqual<uint16_t>(3, cpu->GetPC());
+		}
+
+		TEST_METHOD(simulate_until_code_breakpoint)
+		{
+			for (uint16_t addr = 0; addr < 25; addr++)
+				memory.write(addr, 0); // NOP
+
+			SIM_BP_COOKIE cookie;
+			auto hr = cpu->AddBreakpoint(BreakpointType::Code, 5, &cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			BreakpointsHit bps;
+			auto reason = cpu->SimulateUntil(100, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+			Assert::AreEqual<uint16_t>(5, cpu->GetPC());
+			Assert::AreEqual<uint64_t>(20, cpu->Time());
+			Assert::AreEqual<uint32_t>(1, bps.size);
+			Assert::AreEqual<uint16_t>(5, bps.address);
+			Assert::IsTrue(bps.bps[0] == cookie);
+
+			// Without the breakpoint structure, execution goes past the breakpoint.
+			reason = cpu->SimulateUntil(100, nullptr);
+			Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+			Assert::AreEqual<uint64_t>(100, cpu->Time());
+
+			hr = cpu->RemoveBreakpoint(cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+		}
+
+		TEST_METHOD(code_breakpoints_same_address)
+		{
+			memory.write(0, { 0, 0, 0 }); // NOP; NOP; NOP
+
+			SIM_BP_COOKIE cookie1, cookie2;
+			auto hr = cpu->AddBreakpoint(BreakpointType::Code, 1, &cookie1);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = cpu->AddBreakpoint(BreakpointType::Code, 1, &cookie2);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			BreakpointsHit bps;
+			SimulateOne();
+			Assert::IsFalse(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(2, bps.size);
+
+			// Removing one of them must leave the other one in place.
+			hr = cpu->RemoveBreakpoint(cookie1);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::IsFalse(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(1, bps.size);
+			Assert::IsTrue(bps.bps[0] == cookie2);
+
+			hr = cpu->RemoveBreakpoint(cookie2);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::IsTrue(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(0, bps.size);
+			Assert::AreEqual<uint16_t>(2, cpu->GetPC());
+		}
+
+		TEST_METHOD(data_breakpoint_write)
+		{
+			memory.write(0, { 0x32, 0x01, 0x80, 0x3A, 0x01, 0x80, 0 }); // ld (8001h), a; ld a, (8001h); nop
+
+			SIM_BP_COOKIE writeCookie, readCookie;
+			auto hr = cpu->AddDataBreakpoint(0x8000, 2, DataBreakpointAccess::Write, &writeCookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = cpu->AddDataBreakpoint(0x8001, 1, DataBreakpointAccess::Read, &readCookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// Data breakpoints are reported after the instruction that hit them was executed.
+			BreakpointsHit bps;
+			Assert::IsTrue(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint16_t>(3, cpu->GetPC());
+			Assert::IsTrue(bps.type == BreakpointType::Data);
+			Assert::AreEqual<uint16_t>(0x8001, bps.address);
+			Assert::AreEqual<uint32_t>(1, bps.size);
+			Assert::IsTrue(bps.bps[0] == writeCookie);
+
+			auto reason = cpu->SimulateUntil(1000, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+			Assert::AreEqual<uint16_t>(6, cpu->GetPC());
+			Assert::AreEqual<uint32_t>(1, bps.size);
+			Assert::IsTrue(bps.bps[0] == readCookie);
+
+			hr = cpu->RemoveBreakpoint(writeCookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = cpu->RemoveBreakpoint(readCookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::IsFalse(cpu->HasBreakpoints());
+
+			regs->pc = 0;
+			Assert::IsTrue(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(0, bps.size);
+		}
+
+		TEST_METHOD(conditional_breakpoint)
+		{
+			memory.write(0, { 0, 0 }); // NOP; NOP
+
+			SIM_BP_COOKIE cookie;
+			auto hr = cpu->AddBreakpoint(BreakpointType::Code, 0, &cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			using op = BreakpointConditionOp;
+			static const uint8_t condition[] = // A == 3Fh && (HL) != 0
+			{
+				(uint8_t)op::PushReg8, (uint8_t)z80_reg8::a, (uint8_t)op::PushConst, 0x3F, 0, (uint8_t)op::Eq,
+				(uint8_t)op::PushReg16, (uint8_t)z80_reg16::hl, (uint8_t)op::ReadMem8, (uint8_t)op::PushConst, 0, 0, (uint8_t)op::Ne,
+				(uint8_t)op::LogicalAnd,
+			};
+			hr = cpu->SetBreakpointCondition(cookie, condition, sizeof(condition));
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// A malformed program (binary operator with a single operand) is rejected.
+			static const uint8_t bad_condition[] = { (uint8_t)op::PushConst, 1, 0, (uint8_t)op::Add };
+			hr = cpu->SetBreakpointCondition(cookie, bad_condition, sizeof(bad_condition));
+			Assert::IsTrue(hr == E_INVALIDARG);
+
+			regs->main.hl = 0x8000;
+			memory.write(0x8000, 1);
+
+			BreakpointsHit bps;
+			regs->main.a = 0x3E;
+			Assert::IsTrue(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(0, bps.size);
+
+			regs->pc = 0;
+			regs->main.a = 0x3F;
+			Assert::IsFalse(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(1, bps.size);
+			Assert::IsTrue(bps.bps[0] == cookie);
+
+			memory.write(0x8000, 0);
+			Assert::IsTrue(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(0, bps.size);
+
+			// Without a condition the breakpoint is hit again.
+			hr = cpu->SetBreakpointCondition(cookie, nullptr, 0);
+			Assert::IsTrue(SUCCEEDED(hr));
+			regs->pc = 0;
+			Assert::IsFalse(cpu->SimulateOne(&bps));
+			Assert::AreEqual<uint32_t>(1, bps.size);
+
+			hr = cpu->RemoveBreakpoint(cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+		}
+
+		TEST_METHOD(breakpoint_pass_count)
+		{
+			memory.write(0, { 0x3C, 0x18, 0xFD }); // loop: INC A; JR loop
+
+			SIM_BP_COOKIE cookie;
+			auto hr = cpu->AddBreakpoint(BreakpointType::Code, 0, &cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = cpu->SetBreakpointPassCount(cookie, BreakpointPassCountStyle::Equal, 5);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			regs->main.a = 0;
+			BreakpointsHit bps;
+			auto reason = cpu->SimulateUntil(100000, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+			Assert::AreEqual<uint8_t>(4, regs->main.a);
+			uint32_t hitCount;
+			hr = cpu->GetBreakpointHitCount(cookie, &hitCount);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::AreEqual<uint32_t>(5, hitCount);
+
+			// Step over the breakpoint the way the simulator resumes, then break on every third hit.
+			hr = cpu->SetBreakpointPassCount(cookie, BreakpointPassCountStyle::Mod, 3);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::IsTrue(cpu->SimulateOne(nullptr));
+			reason = cpu->SimulateUntil(cpu->Time() + 100000, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+			Assert::AreEqual<uint8_t>(5, regs->main.a);
+
+			hr = cpu->SetBreakpointHitCount(cookie, 0);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::IsTrue(cpu->SimulateOne(nullptr));
+			reason = cpu->SimulateUntil(cpu->Time() + 100000, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+			Assert::AreEqual<uint8_t>(8, regs->main.a);
+
+			hr = cpu->SetBreakpointPassCount(cookie, BreakpointPassCountStyle::Mod, 0);
+			Assert::IsTrue(hr == E_INVALIDARG);
+
+			hr = cpu->RemoveBreakpoint(cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+		}
+
+		TEST_METHOD(tracepoint)
+		{
+			memory.write(0, { 0x3C, 0x18, 0xFD }); // loop: INC A; JR loop
+
+			vector_nothrow<TracepointHit> hits;
+			cpu->SetTracepointHandler({ &hits, [](void* context, const TracepointHit& hit)
+				{
+					bool pushed = static_cast<vector_nothrow<TracepointHit>*>(context)->try_push_back(hit);
+					Assert::IsTrue(pushed);
+				} });
+			auto clear_handler = wil::scope_exit([this] { cpu->SetTracepointHandler({ }); });
+
+			SIM_BP_COOKIE cookie;
+			auto hr = cpu->AddBreakpoint(BreakpointType::Code, 0, &cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+			using op = BreakpointConditionOp;
+			static const uint8_t values[] = { (uint8_t)op::PushReg8, (uint8_t)z80_reg8::a, (uint8_t)op::PushConst, 0x34, 0x12 };
+			hr = cpu->SetTracepoint(cookie, true, values, sizeof(values));
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// The tracepoint records values without stopping the CPU.
+			regs->main.a = 0;
+			BreakpointsHit bps;
+			auto reason = cpu->SimulateUntil(100, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+			Assert::IsTrue(hits.size() > 1);
+			for (uint32_t i = 0; i < hits.size(); i++)
+			{
+				Assert::IsTrue(hits[i].cookie == cookie);
+				Assert::AreEqual<uint16_t>(0, hits[i].address);
+				Assert::AreEqual<uint8_t>(2, hits[i].value_count);
+				Assert::AreEqual<int32_t>(i, hits[i].values[0]);
+				Assert::AreEqual<int32_t>(0x1234, hits[i].values[1]);
+				if (i)
+					Assert::IsTrue(hits[i].time > hits[i - 1].time);
+			}
+
+			// As a normal breakpoint it stops the CPU again.
+			hr = cpu->SetTracepoint(cookie, false, nullptr, 0);
+			Assert::IsTrue(SUCCEEDED(hr));
+			uint32_t hitsBefore = hits.size();
+			reason = cpu->SimulateUntil(cpu->Time() + 100, &bps);
+			Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+			Assert::AreEqual<uint32_t>(hitsBefore, hits.size());
+
+			hr = cpu->RemoveBreakpoint(cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+		}
+
+		TEST_METHOD(instruction_trace)
+		{
+			memory.write(0, { 0x3E, 0x01, 0x06, 0x02, 0x3C, 0, 0 }); // LD A, 1; LD B, 2; INC A; NOP; NOP
+
+			auto hr = cpu->SetInstructionTrace(4);
+			Assert::IsTrue(SUCCEEDED(hr));
+			for (int i = 0; i < 5; i++)
+				Assert::IsTrue(cpu->SimulateOne(nullptr));
+
+			// Only the last four instructions are kept, oldest first.
+			InstructionTraceRecord records[10];
+			uint32_t count = cpu->GetInstructionTrace(records, _countof(records));
+			Assert::AreEqual<uint32_t>(4, count);
+			Assert::AreEqual<uint16_t>(2, records[0].pc);
+			Assert::AreEqual<uint16_t>(1, records[0].af >> 8);
+			Assert::AreEqual<uint8_t>(0x06, records[0].opcode[0]);
+			Assert::AreEqual<uint8_t>(0x02, records[0].opcode[1]);
+			Assert::AreEqual<uint64_t>(7, records[0].time);
+			Assert::AreEqual<uint16_t>(4, records[1].pc);
+			Assert::AreEqual<uint16_t>(0x0200, records[1].bc & 0xFF00);
+			Assert::AreEqual<uint16_t>(6, records[3].pc);
+
+			count = cpu->GetInstructionTrace(records, 2);
+			Assert::AreEqual<uint32_t>(2, count);
+			Assert::AreEqual<uint16_t>(5, records[0].pc);
+			Assert::AreEqual<uint16_t>(6, records[1].pc);
+
+			hr = cpu->SetInstructionTrace(0);
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::AreEqual<uint32_t>(0, cpu->GetInstructionTrace(records, _countof(records)));
+		}
+
+		#ifdef _WIN32 // TraceFile.cpp is Windows-only for now
+		TEST_METHOD(trace_file)
+		{
+			// LD A, 5; LD (5C3Ah), A; INC A; LD (5C3Ah), A; LD (5C3Bh), A; NOP
+			memory.write(0, { 0x3E, 0x05, 0x32, 0x3A, 0x5C, 0x3C, 0x32, 0x3A, 0x5C, 0x32, 0x3B, 0x5C, 0 });
+
+			wchar_t dir[MAX_PATH];
+			wchar_t path[MAX_PATH];
+			Assert::IsTrue(GetTempPathW(_countof(dir), dir) != 0);
+			Assert::IsTrue(GetTempFileNameW(dir, L"trc", 0, path) != 0);
+			auto delete_file = wil::scope_exit([&path] { DeleteFileW(path); });
+
+			wistd::unique_ptr<ITraceWriter> writer;
+			auto hr = MakeTraceWriter(path, &writer);
+			Assert::IsTrue(SUCCEEDED(hr));
+			cpu->SetTraceWriter(writer.get());
+			for (int i = 0; i < 6; i++)
+				Assert::IsTrue(cpu->SimulateOne(nullptr));
+			cpu->SetTraceWriter(nullptr);
+
+			// Writes made by the debugger are not in the trace.
+			memory.write(0x5C3A, 0x55);
+
+			hr = writer->Flush();
+			Assert::IsTrue(SUCCEEDED(hr));
+			writer.reset();
+
+			wil::com_ptr_nothrow<ITraceFile> file;
+			hr = OpenTraceFile(path, &file);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			TraceFileWrite writes[4];
+			UINT32 count;
+			hr = file->FindWrites(0x5C3A, 0, UINT64_MAX, _countof(writes), writes, &count);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint32_t>(2, count);
+			Assert::AreEqual<uint8_t>(5, writes[0].value);
+			Assert::AreEqual<uint16_t>(2, writes[0].pc);
+			Assert::AreEqual<uint8_t>(6, writes[1].value);
+			Assert::AreEqual<uint16_t>(6, writes[1].pc);
+			Assert::IsTrue(writes[0].time < writes[1].time);
+
+			hr = file->FindWrites(0x5C3A, writes[0].time + 1, UINT64_MAX, _countof(writes), writes, &count);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint32_t>(1, count);
+			Assert::AreEqual<uint8_t>(6, writes[0].value);
+
+			hr = file->FindWrites(0x5C3A, 0, UINT64_MAX, 1, writes, &count);
+			Assert::IsTrue(hr == S_FALSE);
+			Assert::AreEqual<uint32_t>(1, count);
+
+			hr = file->FindWrites(0x5C3C, 0, UINT64_MAX, _countof(writes), writes, &count);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint32_t>(0, count);
+
+			TraceFileWrite last;
+			hr = file->FindLastWrite(0x5C3B, UINT64_MAX, &last);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint8_t>(6, last.value);
+			Assert::AreEqual<uint16_t>(9, last.pc);
+			hr = file->FindLastWrite(0x5C3B, last.time, &last);
+			Assert::IsTrue(hr == S_FALSE);
+
+			UINT64 time;
+			hr = file->FindFirstExecution(5, 0, &time);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint64_t>(20, time);
+			hr = file->FindFirstExecution(5, 21, &time);
+			Assert::IsTrue(hr == S_FALSE);
+			hr = file->FindFirstExecution(1, 0, &time);
+			Assert::IsTrue(hr == S_FALSE);
+		}
+		#endif
+
+		TEST_METHOD(decoded_instruction_cache)
+		{
+			uint8_t page[Bus::page_size] = { };
+			memory.map_read_pages (ram.get(), 0x8000, Bus::page_size, page);
+			memory.map_write_pages (ram.get(), 0x8000, Bus::page_size, page);
+			auto unmap = wil::scope_exit([this] { memory.unmap_pages(ram.get()); });
+
+			// Self-modifying code: LD A, 5; INC A; LD (8001h), A; JR 8000h
+			memory.write(0x8000, { 0x3E, 0x05, 0x3C, 0x32, 0x01, 0x80, 0x18, 0xF8 });
+			regs->pc = 0x8000;
+			for (int i = 0; i < 3 * 4; i++)
+				SimulateOne();
+			Assert::AreEqual<uint8_t>(8, regs->main.a);
+			Assert::AreEqual<uint8_t>(8, page[1]);
+			Assert::AreEqual<uint16_t>(0x8000, regs->pc);
+
+			// Prefixed instructions must behave the same when decoded from a mapped page as when fetched from the bus.
+			// LD IX, 8040h; LD (IX+2), 77h; SET 3, (IX+2); LD BC, (8042h)
+			static const uint8_t code[] = { 0xDD, 0x21, 0x40, 0x80, 0xDD, 0x36, 0x02, 0x77, 0xDD, 0xCB, 0x02, 0xDE, 0xED, 0x4B, 0x42, 0x80 };
+			memcpy (&page[0x10], code, sizeof(code));
+			for (uint32_t i = 0; i < sizeof(code); i++)
+				memory.write((uint16_t)(0x100 + i), code[i]);
+
+			uint64_t times[2];
+			uint8_t r[2];
+			for (uint16_t run = 0; run < 2; run++)
+			{
+				page[0x42] = 0;
+				page[0x43] = 0;
+				regs->pc = run ? 0x100 : 0x8010;
+				regs->r = 0;
+				uint64_t start = cpu->Time();
+				for (int i = 0; i < 4; i++)
+					SimulateOne();
+				times[run] = cpu->Time() - start;
+				r[run] = regs->r;
+				Assert::AreEqual<uint16_t>(0x8040, regs->ix);
+				Assert::AreEqual<uint16_t>(0x007F, regs->main.bc);
+			}
+
+			Assert::AreEqual(times[1], times[0]);
+			Assert::AreEqual(r[1], r[0]);
+			Assert::AreEqual<uint8_t>(8, r[0]);
+		}
+
+		TEST_METHOD(lazy_flags)
+		{
+			// Flags left pending by CP and SUB must be there for ADC, JR Z and PUSH AF,
+			// across instructions that don't touch them.
+			memory.write(0, { 0x3E, 0x10, // ld a, 10h
+				0xFE, 0x20,               // cp 20h
+				0x06, 0x00,               // ld b, 0
+				0xCE, 0x00,               // adc a, 0
+				0xD6, 0x11,               // sub 11h
+				0x0E, 0x07,               // ld c, 7
+				0x28, 0x02,               // jr z, $+4
+				0x3E, 0xFF,               // ld a, 0FFh
+				0xF5,                     // push af
+				0xD1 });                  // pop de
+			regs->sp = 0x8000;
+			auto reason = cpu->SimulateUntil(75, nullptr);
+			Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+			Assert::AreEqual<uint16_t>(0x12, regs->pc);
+			Assert::AreEqual<uint16_t>(0x0042, regs->main.de);
+			Assert::AreEqual<uint8_t>(0x42, regs->main.f.val);
+		}
+
+		struct lazy_flags_case
+		{
+			uint8_t code[4]; // one or two instructions
+			uint8_t size;
+			uint16_t af, bc, de, hl, ix;
+			uint8_t f;       // expected after "code"
+		};
+
+		// Flags that INC, DEC, ADD/ADC/SBC HL, ADC/SBC A and the rotates leave pending, including the ones they
+		// keep from F or take from a previous instruction whose flags are themselves still pending.
+		static constexpr lazy_flags_case lazy_flags_cases[] = {
+			{ .code = { 0x04 }, .size = 1, .af = 0x0001, .bc = 0x7F00, .f = 0x95 },                     // inc b: S, H, P/V, C kept
+			{ .code = { 0x04 }, .size = 1, .af = 0x00FE, .bc = 0x2F00, .f = 0x30 },                     // inc b: X5, H; N reset
+			{ .code = { 0x0D }, .size = 1, .af = 0x0000, .bc = 0x0001, .f = 0x42 },                     // dec c: Z, N
+			{ .code = { 0x0D }, .size = 1, .af = 0x0001, .bc = 0x0080, .f = 0x3F },                     // dec c: X5, H, X3, P/V, N, C kept
+			{ .code = { 0xFE, 0x20, 0x3C }, .size = 3, .af = 0x1000, .f = 0x01 },                       // cp 20h / inc a: C from CP
+			{ .code = { 0xDD, 0x24 }, .size = 2, .af = 0x0001, .ix = 0xFF00, .f = 0x51 },               // inc ixh
+			{ .code = { 0x34 }, .size = 1, .af = 0x0000, .hl = 0x4000, .f = 0x00 },                     // inc (hl): 01h to 02h
+			{ .code = { 0x09 }, .size = 1, .af = 0x00FF, .bc = 0x0001, .hl = 0x0FFF, .f = 0xD4 },       // add hl, bc: S, Z, P/V kept; H
+			{ .code = { 0x29 }, .size = 1, .af = 0x0000, .hl = 0x9400, .f = 0x29 },                     // add hl, hl: X5, X3 from H; C
+			{ .code = { 0xDD, 0x19 }, .size = 2, .af = 0x0000, .de = 0xF000, .ix = 0x1000, .f = 0x01 }, // add ix, de
+			{ .code = { 0xED, 0x5A }, .size = 2, .af = 0x0001, .de = 0x0000, .hl = 0x7FFF, .f = 0x94 }, // adc hl, de: S, H, P/V
+			{ .code = { 0xED, 0x4A }, .size = 2, .af = 0x0000, .bc = 0x0001, .hl = 0xFFFF, .f = 0x51 }, // adc hl, bc: Z, H, C
+			{ .code = { 0xED, 0x52 }, .size = 2, .af = 0x0001, .de = 0x0000, .hl = 0x2800, .f = 0x22 }, // sbc hl, de: X5 from H
+			{ .code = { 0xED, 0x42 }, .size = 2, .af = 0x0000, .bc = 0x0001, .hl = 0x0000, .f = 0xBB }, // sbc hl, bc
+			{ .code = { 0xFE, 0x20, 0x88 }, .size = 3, .af = 0x0F00, .bc = 0x7000, .f = 0x94 },         // cp 20h / adc a, b: C from CP
+			{ .code = { 0xDE, 0x00 }, .size = 2, .af = 0x0001, .f = 0xBB },                             // sbc a, 0
+			{ .code = { 0x07 }, .size = 1, .af = 0x94FF, .f = 0xED },                                   // rlca: S, Z, P/V kept; X5, X3 from A
+			{ .code = { 0x0F }, .size = 1, .af = 0x5100, .f = 0x29 },                                   // rrca
+			{ .code = { 0xFE, 0x20, 0x17 }, .size = 3, .af = 0x1400, .f = 0xA8 },                       // cp 20h / rla: S and C from CP
+			{ .code = { 0x1F }, .size = 1, .af = 0x0140, .f = 0x41 },                                   // rra
+			{ .code = { 0xCB, 0x11 }, .size = 2, .af = 0x0001, .bc = 0x0014, .f = 0x28 },               // rl c
+			{ .code = { 0xCB, 0x2A }, .size = 2, .af = 0x0000, .de = 0x8100, .f = 0x85 },               // sra d
+			{ .code = { 0xCB, 0x3E }, .size = 2, .af = 0x0000, .hl = 0x4000, .f = 0x45 },               // srl (hl)
+		};
+
+		// Runs "c.code" then "then" in a single SimulateUntil, so that the flags "c.code" leaves pending are
+		// still pending when "then" runs. "then" must end in a "jr $"; so must the code at 0100h.
+		void run_lazy_flags_case (const lazy_flags_case& c, bool threaded, const std::initializer_list<uint8_t>& then)
+		{
+			cpu->Reset();
+			auto hr = cpu->SetThreadedDispatch(threaded);
+			Assert::IsTrue(SUCCEEDED(hr));
+			regs->main.af = c.af;
+			regs->main.bc = c.bc;
+			regs->main.de = c.de;
+			regs->main.hl = c.hl;
+			regs->ix = c.ix;
+			regs->sp = 0x8000;
+			memory.write(0x4000, 0x01);
+			memory.write(0x0100, { 0x18, 0xFE }); // jr $
+			uint16_t addr = 0;
+			for (uint8_t i = 0; i < c.size; i++)
+				memory.write(addr++, c.code[i]);
+			for (uint8_t b : then)
+				memory.write(addr++, b);
+
+			auto reason = cpu->SimulateUntil(1000, nullptr);
+			Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+		}
+
+		TEST_METHOD(lazy_flags_read_by_get_registers_and_push_af)
+		{
+			for (bool threaded : { false, true })
+			{
+				for (auto& c : lazy_flags_cases)
+				{
+					run_lazy_flags_case (c, threaded, { 0xF5, 0xD1, 0x18, 0xFE }); // push af / pop de / jr $
+					Assert::AreEqual<uint8_t>(c.f, regs->e());
+					z80_register_set r;
+					cpu->GetZ80Registers(&r);
+					Assert::AreEqual<uint8_t>(c.f, r.main.f.val);
+				}
+			}
+		}
+
+		TEST_METHOD(lazy_flags_read_by_conditional_jumps)
+		{
+			for (bool threaded : { false, true })
+			{
+				for (auto& c : lazy_flags_cases)
+				{
+					for (uint8_t cc = 0; cc < 8; cc++)
+					{
+						// jp nz/z/nc/c/po/pe/p/m, 0100h / jr $
+						run_lazy_flags_case (c, threaded, { (uint8_t)(0xC2 | (cc << 3)), 0x00, 0x01, 0x18, 0xFE });
+						static constexpr uint8_t flag_of_cc[] = { z80_flag::z, z80_flag::c, z80_flag::pv, z80_flag::s };
+						bool flag = (c.f & flag_of_cc[cc / 2]) != 0;
+						bool taken = (cc & 1) ? flag : !flag;
+						Assert::AreEqual<uint16_t>(taken ? 0x0100 : c.size + 3, regs->pc);
+					}
+				}
+			}
+		}
+
+		TEST_METHOD(threaded_dispatch_matches_interpreter)
+		{
+			// A loop with main, ED, DDCB and undefined ED instructions that, once every
+			// 256 iterations, writes to its own code; data is in the next page.
+			static const uint8_t code[] = {
+				0x06, 0x00,             // 8000: ld b, 0
+				0xDD, 0x21, 0x80, 0x81, // 8002: ld ix, 8180h
+				0xDD, 0x7E, 0x00,       // 8006: ld a, (ix+0)
+				0x80,                   // 8009: add a, b
+				0xDD, 0x77, 0x00,       // 800A: ld (ix+0), a
+				0xDD, 0xCB, 0x01, 0xC6, // 800D: set 0, (ix+1)
+				0xDD, 0xCB, 0x01, 0x16, // 8011: rl (ix+1)
+				0xED, 0x00,             // 8015: undefined, two NOPs
+				0xED, 0x42,             // 8017: sbc hl, bc
+				0x07,                   // 8019: rlca
+				0x10, 0xEA,             // 801A: djnz 8006h
+				0x32, 0x01, 0x80,       // 801C: ld (8001h), a
+				0x18, 0xDF,             // 801F: jr 8000h
+			};
+
+			uint8_t mem[2][2 * Bus::page_size] = { };
+			Bus buses[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				buses[i].map_read_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_line, &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->pc = 0x8000;
+			}
+
+			auto hr = cpus[1]->SetThreadedDispatch(true);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			for (UINT64 time = 1000; time < 500000; time += 1000)
+			{
+				for (auto& c : cpus)
+				{
+					auto reason = c->SimulateUntil(time, nullptr);
+					Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+				}
+
+				auto r0 = cpus[0]->GetRegsPtr();
+				auto r1 = cpus[1]->GetRegsPtr();
+				Assert::AreEqual(cpus[0]->Time(), cpus[1]->Time());
+				Assert::AreEqual(r0->pc, r1->pc);
+				Assert::AreEqual(r0->main.af, r1->main.af);
+				Assert::AreEqual(r0->main.bc, r1->main.bc);
+				Assert::AreEqual(r0->main.hl, r1->main.hl);
+				Assert::AreEqual(r0->r, r1->r);
+				Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0])));
+			}
+		}
+
+		TEST_METHOD(threaded_dispatch_takes_interrupt_on_time)
+		{
+			// A long loop that the decoded instructions run through by themselves, until an interrupt.
+			uint8_t mem[2][2 * Bus::page_size] = { };
+			static const uint8_t start[] = { 0xED, 0x56, 0xFB, 0xC3, 0x40, 0x00 }; // im 1 / ei / jp 0040h
+			static const uint8_t body[] = { 0x3C, 0x47, 0xDD, 0x23, 0xCB, 0x07, 0xDD, 0x77, 0x00 }; // inc a / ld b, a / inc ix / rlc a / ld (ix+0), a
+			Bus buses[2];
+			TestInterruptingDevice devices[2] = { TestInterruptingDevice(20001), TestInterruptingDevice(20001) };
+			dummy_irq_line irq_lines[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], start, sizeof(start));
+				mem[i][0x38] = 0x76; // halt
+				uint32_t addr = 0x40;
+				for (; addr + sizeof(body) < 0x100; addr += sizeof(body))
+					memcpy (&mem[i][addr], body, sizeof(body));
+				memcpy (&mem[i][addr], start + 3, 3); // jp 0040h
+				buses[i].map_read_pages (ram.get(), 0, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0, sizeof(mem[i]), mem[i]);
+				Assert::IsTrue(irq_lines[i].interrupting_devices.try_push_back(&devices[i]));
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_lines[i], &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->sp = 0x200;
+				cpus[i]->GetRegsPtr()->ix = 0x100;
+			}
+
+			auto hr = cpus[1]->SetThreadedDispatch(true);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				while (cpus[i]->Time() < 30000)
+				{
+					if (cpus[i]->SimulateUntil(30000, nullptr) == SimulateStopReason::Stalled)
+						devices[i].SimulateTo(cpus[i]->Time());
+				}
+			}
+
+			auto r0 = cpus[0]->GetRegsPtr();
+			auto r1 = cpus[1]->GetRegsPtr();
+			Assert::IsTrue(cpus[1]->Halted());
+			Assert::AreEqual<uint16_t>(0x39, r1->pc);
+			Assert::AreEqual(cpus[0]->Time(), cpus[1]->Time());
+			Assert::AreEqual(r0->sp, r1->sp);
+			Assert::AreEqual(r0->main.af, r1->main.af);
+			Assert::AreEqual(r0->ix, r1->ix);
+			Assert::AreEqual(r0->r, r1->r);
+			Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0]))); // with the return address
+		}
+
+		// Checks that a CPU with the JIT is in the same state as one without that ran the same code.
+		static void assert_same_state (IZ80CPU* interpreted, IZ80CPU* compiled)
+		{
+			auto r0 = interpreted->GetRegsPtr();
+			auto r1 = compiled->GetRegsPtr();
+			Assert::AreEqual(interpreted->Time(), compiled->Time());
+			Assert::AreEqual(r0->pc, r1->pc);
+			Assert::AreEqual(r0->sp, r1->sp);
+			Assert::AreEqual(r0->main.af, r1->main.af);
+			Assert::AreEqual(r0->main.bc, r1->main.bc);
+			Assert::AreEqual(r0->main.de, r1->main.de);
+			Assert::AreEqual(r0->main.hl, r1->main.hl);
+			Assert::AreEqual(r0->alt.af, r1->alt.af);
+			Assert::AreEqual(r0->alt.bc, r1->alt.bc);
+			Assert::AreEqual(r0->alt.de, r1->alt.de);
+			Assert::AreEqual(r0->alt.hl, r1->alt.hl);
+			Assert::AreEqual(r0->ix, r1->ix);
+			Assert::AreEqual(r0->iy, r1->iy);
+			Assert::AreEqual(r0->i, r1->i);
+			Assert::AreEqual(r0->r, r1->r);
+			Assert::AreEqual(r0->halted, r1->halted);
+			Assert::AreEqual(interpreted->GetStackStartAddress(), compiled->GetStackStartAddress());
+		}
+
+		TEST_METHOD(jit_matches_interpreter)
+		{
+			// A loop with main, ED, CB and DDCB instructions, the stack and the alternate registers, that writes to
+			// its own code on every iteration; data is in the next page, and (HL) goes outside the mapped pages.
+			static const uint8_t code[] = {
+				0x31, 0xF0, 0x81,       // 8000: ld sp, 81F0h
+				0x06, 0x00,             // 8003: ld b, 0
+				0xDD, 0x21, 0x80, 0x81, // 8005: ld ix, 8180h
+				0x21, 0x40, 0x81,       // 8009: ld hl, 8140h
+				0xDD, 0x7E, 0x00,       // 800C: ld a, (ix+0)
+				0x80,                   // 800F: add a, b
+				0xDD, 0x77, 0x00,       // 8010: ld (ix+0), a
+				0xDD, 0xCB, 0x01, 0xC6, // 8013: set 0, (ix+1)
+				0xDD, 0xCB, 0x01, 0x16, // 8017: rl (ix+1)
+				0xED, 0x42,             // 801B: sbc hl, bc
+				0x86,                   // 801D: add a, (hl)
+				0x08,                   // 801E: ex af, af'
+				0xD9,                   // 801F: exx
+				0x2C,                   // 8020: inc l
+				0xD9,                   // 8021: exx
+				0x08,                   // 8022: ex af, af'
+				0xC5,                   // 8023: push bc
+				0xCD, 0x3E, 0x80,       // 8024: call 803Eh
+				0xD1,                   // 8027: pop de
+				0xED, 0x44,             // 8028: neg
+				0xCB, 0x3F,             // 802A: srl a
+				0x32, 0x30, 0x80,       // 802C: ld (8030h), a
+				0x0E, 0x00,             // 802F: ld c, 0
+				0xED, 0x5A,             // 8031: adc hl, de
+				0xE3,                   // 8033: ex (sp), hl
+				0xE3,                   // 8034: ex (sp), hl
+				0xCB, 0x79,             // 8035: bit 7, c
+				0x28, 0x01,             // 8037: jr z, 803Ah
+				0x14,                   // 8039: inc d
+				0x10, 0xD0,             // 803A: djnz 800Ch
+				0x18, 0xC5,             // 803C: jr 8003h
+				0xCB, 0x03,             // 803E: rlc e
+				0xED, 0x5F,             // 8040: ld a, r
+				0x83,                   // 8042: add a, e
+				0xC9,                   // 8043: ret
+			};
+
+			uint8_t mem[2][2 * Bus::page_size] = { };
+			Bus buses[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				buses[i].map_read_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_line, &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->pc = 0x8000;
+			}
+
+			auto hr = cpus[1]->SetJit(true);
+			if (hr == E_NOTIMPL)
+				return;
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// Uneven slices, so that blocks are cut short at all sorts of places.
+			for (UINT64 time = 1000; time < 500000; time += 997)
+			{
+				for (auto& c : cpus)
+				{
+					auto reason = c->SimulateUntil(time, nullptr);
+					Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+				}
+
+				assert_same_state (cpus[0].get(), cpus[1].get());
+				Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0])));
+			}
+
+			Assert::IsTrue(cpus[1]->GetJitBlockCount() > 0);
+		}
+
+		TEST_METHOD(jit_matches_interpreter_on_random_code)
+		{
+			// Loops of random instructions. The code is in four read-only pages at 8000h; data in the twelve pages
+			// after it, where the loop brings back SP, IX, IY, HL and DE on every iteration. The instructions change
+			// HL, BC and the others as they like, so many accesses go to pages that aren't mapped (or not for writing),
+			// which a RAM device behind each bus answers. I/O goes to a device that remembers what was written.
+			static constexpr uint8_t loop_head[] = {
+				0x31, 0x00, 0x8F,             // ld sp, 8F00h
+				0xDD, 0x21, 0x80, 0x88,       // ld ix, 8880h
+				0xFD, 0x21, 0x80, 0x8A,       // ld iy, 8A80h
+				0x7C, 0xE6, 0x07, 0xF6, 0x88, // ld a, h / and 07h / or 88h
+				0x67,                         // ld h, a
+				0x7A, 0xE6, 0x07, 0xF6, 0x8C, // ld a, d / and 07h / or 8Ch
+				0x57,                         // ld d, a
+			};
+			static constexpr uint8_t subroutine[] = { 0x1C, 0xD8, 0x2C, 0xC9 }; // 8300: inc e / ret c / inc l / ret
+
+			uint32_t seed = 1;
+			auto next = [&seed]() -> uint8_t { seed = seed * 1103515245 + 12345; return (uint8_t)(seed >> 16); };
+
+			// Writes a random instruction at "p" and returns its length.
+			auto random_instruction = [&next](uint8_t* p) -> uint32_t
+			{
+				static constexpr uint8_t single[] = {
+					0x00, 0x03, 0x0B, 0x13, 0x1B, 0x23, 0x2B, 0x09, 0x19, 0x29, 0x39, 0x07, 0x0F, 0x17, 0x1F,
+					0x2F, 0x37, 0x3F, 0x08, 0xEB, 0xD9, 0x27, 0x0A, 0x1A, 0x02, 0x12, 0xE3,
+				};
+				static constexpr uint8_t ed[] = {
+					0x44, 0x42, 0x4A, 0x52, 0x5A, 0x62, 0x6A, 0x72, 0x7A, 0x67, 0x6F, 0x47, 0x4F, 0x57, 0x5F, 0x78, 0x79, 0x00,
+				};
+				static constexpr uint8_t xy_single[] = { 0x24, 0x25, 0x2C, 0x2D, 0x44, 0x4D, 0x65, 0x6C, 0x7C, 0x7D, 0x84, 0x9D, 0xA4, 0xBD, 0x23, 0x2B, 0x09, 0xE3 };
+
+				switch (next() % 14)
+				{
+					case 0: p[0] = 0x40 + next() % 0x40; if (p[0] == 0x76) p[0] = 0x7E; return 1;     // ld r, r'
+					case 1: p[0] = 0x80 + next() % 0x40; return 1;                                   // alu a, r
+					case 2: p[0] = 0xC6 + 8 * (next() % 8); p[1] = next(); return 2;                 // alu a, n
+					case 3: p[0] = single[next() % _countof(single)]; return 1;
+					case 4: p[0] = 0x04 + 8 * (next() % 8) + (next() & 1); return 1;                 // inc r / dec r
+					case 5: p[0] = 0x06 + 8 * (next() % 8); p[1] = next(); return 2;                 // ld r, n
+					case 6: p[0] = 0xCB; p[1] = next(); return 2;
+					case 7:
+					{
+						p[0] = (next() & 1) ? 0xDD : 0xFD;
+						p[2] = next();
+						switch (next() % 7)
+						{
+							case 0: p[1] = 0x46 + 8 * (next() % 8); if (p[1] == 0x76) p[1] = 0x7E; return 3; // ld r, (xy+d)
+							case 1: p[1] = 0x70 + next() % 8; if (p[1] == 0x76) p[1] = 0x77; return 3;       // ld (xy+d), r
+							case 2: p[1] = 0x86 + 8 * (next() % 8); return 3;                                // alu a, (xy+d)
+							case 3: p[1] = 0x34 + (next() & 1); return 3;                                    // inc / dec (xy+d)
+							case 4: p[1] = 0x36; p[3] = next(); return 4;                                    // ld (xy+d), n
+							case 5: p[1] = 0xCB; p[3] = next(); return 4;
+							default: p[1] = xy_single[next() % _countof(xy_single)]; return 2;
+						}
+					}
+					case 8: p[0] = 0xED; p[1] = ed[next() % _countof(ed)]; return 2;
+					case 9:
+					{
+						// Some of these straddle the end of the mapped pages.
+						static constexpr uint8_t ops[] = { 0x3A, 0x32, 0x2A, 0x22 }; // ld a, (nn) / ld (nn), a / ld hl, (nn) / ld (nn), hl
+						uint16_t address = 0x8400 + (next() | (next() << 8)) % 0x0E00;
+						if (next() & 1)
+						{
+							p[0] = ops[next() % 4];
+							p[1] = (uint8_t)address;
+							p[2] = (uint8_t)(address >> 8);
+							return 3;
+						}
+
+						p[0] = 0xED;
+						p[1] = 0x43 + 16 * (next() % 4) + 8 * (next() & 1);  // ld (nn), rr / ld rr, (nn)
+						if (p[1] == 0x7B)
+							p[1] = 0x73;
+						p[2] = (uint8_t)address;
+						p[3] = (uint8_t)(address >> 8);
+						return 4;
+					}
+					case 10:
+					{
+						// jr cc / djnz / jr over an "inc a"
+						static constexpr uint8_t ops[] = { 0x10, 0x18, 0x20, 0x28, 0x30, 0x38 };
+						p[0] = ops[next() % _countof(ops)];
+						p[1] = 1;
+						p[2] = 0x3C;
+						return 3;
+					}
+					case 11: p[0] = (next() & 1) ? 0xCD : (0xC4 + 8 * (next() % 8)); p[1] = 0x00; p[2] = 0x83; return 3; // call (cc,) 8300h
+					case 12: p[0] = 0xC5 + 16 * (next() % 4); p[1] = 0xC1 + 16 * (next() % 4); return 2;            // push rr / pop rr'
+					default: p[0] = (next() & 1) ? 0xD3 : 0xDB; p[1] = next(); return 2;                           // out (n), a / in a, (n)
+				}
+			};
+
+			for (uint32_t program = 0; program < 32; program++)
+			{
+				seed = program + 1;
+				uint8_t code[4 * Bus::page_size] = { };
+				uint32_t size = 0;
+				for (auto b : loop_head)
+					code[size++] = b;
+				while (size < 0x2C0)
+					size += random_instruction(&code[size]);
+				code[size++] = 0xC3; // jp 8000h
+				code[size++] = 0x00;
+				code[size++] = 0x80;
+				memcpy (&code[0x300], subroutine, sizeof(subroutine));
+
+				uint8_t mem[2][16 * Bus::page_size];
+				Bus buses[2];
+				Bus io_buses[2];
+				wistd::unique_ptr<TestRAM> rams[2];
+				TestIODevice ports[2];
+				wistd::unique_ptr<IZ80CPU> cpus[2];
+				for (uint32_t i = 0; i < 2; i++)
+				{
+					rams[i] = wil::make_unique_nothrow<TestRAM>();
+					Assert::IsTrue(!!rams[i]);
+					auto hr = rams[i]->InitInstance(&buses[i]);
+					Assert::IsTrue(SUCCEEDED(hr));
+					for (uint32_t address = 0; address < 0x10000; address++)
+						buses[i].write((uint16_t)address, (uint8_t)address);
+
+					memset (mem[i], 0, sizeof(mem[i]));
+					memcpy (mem[i], code, sizeof(code));
+					buses[i].map_read_pages (rams[i].get(), 0x8000, sizeof(mem[i]), mem[i]);
+					buses[i].map_write_pages (rams[i].get(), 0x8400, sizeof(mem[i]) - sizeof(code), mem[i] + sizeof(code));
+					hr = ports[i].InitInstance(&io_buses[i]);
+					Assert::IsTrue(SUCCEEDED(hr));
+					hr = MakeZ80CPU (&buses[i], &io_buses[i], &irq_line, &cpus[i]);
+					Assert::IsTrue(SUCCEEDED(hr));
+					cpus[i]->GetRegsPtr()->pc = 0x8000;
+				}
+
+				auto hr = cpus[1]->SetJit(true);
+				if (hr == E_NOTIMPL)
+					return;
+				Assert::IsTrue(SUCCEEDED(hr));
+
+				UINT64 time = 0;
+				while (time < 200000)
+				{
+					time += 1 + (next() | (next() << 8)) % 3000;
+					for (auto& c : cpus)
+					{
+						auto reason = c->SimulateUntil(time, nullptr);
+						Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+					}
+
+					assert_same_state (cpus[0].get(), cpus[1].get());
+					Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0])));
+					Assert::AreEqual(ports[0].read_count, ports[1].read_count);
+				}
+
+				for (uint32_t address = 0; address < 0x10000; address++)
+					Assert::AreEqual(buses[0].read((uint16_t)address), buses[1].read((uint16_t)address));
+				Assert::IsTrue(cpus[1]->GetJitBlockCount() > 0);
+			}
+		}
+
+		TEST_METHOD(jit_takes_interrupt_on_time)
+		{
+			// A long loop that compiles to a single block, until an interrupt.
+			uint8_t mem[2][2 * Bus::page_size] = { };
+			static const uint8_t start[] = { 0xED, 0x56, 0xFB, 0xC3, 0x40, 0x00 }; // im 1 / ei / jp 0040h
+			static const uint8_t body[] = { 0x3C, 0x47, 0xDD, 0x23, 0xCB, 0x07, 0xDD, 0x77, 0x00 }; // inc a / ld b, a / inc ix / rlc a / ld (ix+0), a
+			Bus buses[2];
+			TestInterruptingDevice devices[2] = { TestInterruptingDevice(20001), TestInterruptingDevice(20001) };
+			dummy_irq_line irq_lines[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], start, sizeof(start));
+				mem[i][0x38] = 0x76; // halt
+				uint32_t addr = 0x40;
+				for (; addr + sizeof(body) < 0x100; addr += sizeof(body))
+					memcpy (&mem[i][addr], body, sizeof(body));
+				memcpy (&mem[i][addr], start + 3, 3); // jp 0040h
+				buses[i].map_read_pages (ram.get(), 0, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0, sizeof(mem[i]), mem[i]);
+				Assert::IsTrue(irq_lines[i].interrupting_devices.try_push_back(&devices[i]));
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_lines[i], &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->sp = 0x200;
+				cpus[i]->GetRegsPtr()->ix = 0x100;
+			}
+
+			auto hr = cpus[1]->SetJit(true);
+			if (hr == E_NOTIMPL)
+				return;
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				while (cpus[i]->Time() < 30000)
+				{
+					if (cpus[i]->SimulateUntil(30000, nullptr) == SimulateStopReason::Stalled)
+						devices[i].SimulateTo(cpus[i]->Time());
+				}
+			}
+
+			Assert::IsTrue(cpus[1]->Halted());
+			Assert::AreEqual<uint16_t>(0x39, cpus[1]->GetRegsPtr()->pc);
+			assert_same_state (cpus[0].get(), cpus[1].get());
+			Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0]))); // with the return address
+			Assert::IsTrue(cpus[1]->GetJitBlockCount() > 0);
+		}
+
+		TEST_METHOD(jit_stops_at_breakpoints)
+		{
+			// A loop that compiles to a single block.
+			static const uint8_t code[] = {
+				0x21, 0x80, 0x80, // 8000: ld hl, 8080h
+				0x3C,             // 8003: inc a
+				0x77,             // 8004: ld (hl), a
+				0x2C,             // 8005: inc l
+				0xCB, 0xFD,       // 8006: set 7, l
+				0x80,             // 8008: add a, b
+				0x18, 0xF8,       // 8009: jr 8003h
+			};
+
+			uint8_t mem[2][Bus::page_size] = { };
+			Bus buses[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				buses[i].map_read_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_line, &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->pc = 0x8000;
+				cpus[i]->GetRegsPtr()->b() = 0x11;
+			}
+
+			auto hr = cpus[1]->SetJit(true);
+			if (hr == E_NOTIMPL)
+				return;
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			for (auto& c : cpus)
+			{
+				auto reason = c->SimulateUntil(10000, nullptr);
+				Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+			}
+			assert_same_state (cpus[0].get(), cpus[1].get());
+			Assert::IsTrue(cpus[1]->GetJitBlockCount() > 0);
+
+			// A code breakpoint in the middle of the block, then a data breakpoint on one of the bytes it writes.
+			for (uint32_t round = 0; round < 2; round++)
+			{
+				SIM_BP_COOKIE cookies[2];
+				for (uint32_t i = 0; i < 2; i++)
+				{
+					hr = (round == 0) ? cpus[i]->AddBreakpoint(BreakpointType::Code, 0x8005, &cookies[i])
+						: cpus[i]->AddDataBreakpoint(0x80C0, 1, DataBreakpointAccess::Write, &cookies[i]);
+					Assert::IsTrue(SUCCEEDED(hr));
+				}
+
+				for (uint32_t hit = 0; hit < 3; hit++)
+				{
+					BreakpointsHit bps[2];
+					for (uint32_t i = 0; i < 2; i++)
+					{
+						auto reason = cpus[i]->SimulateUntil(100000, &bps[i]);
+						Assert::IsTrue(reason == SimulateStopReason::Breakpoint);
+						Assert::AreEqual<uint32_t>(1, bps[i].size);
+						Assert::IsTrue(bps[i].bps[0] == cookies[i]);
+					}
+
+					Assert::AreEqual(bps[0].address, bps[1].address);
+					assert_same_state (cpus[0].get(), cpus[1].get());
+					Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0])));
+				}
+
+				for (uint32_t i = 0; i < 2; i++)
+				{
+					hr = cpus[i]->RemoveBreakpoint(cookies[i]);
+					Assert::IsTrue(SUCCEEDED(hr));
+				}
+			}
+		}
+
+		TEST_METHOD(jit_stalls_on_slow_device)
+		{
+			// A loop that reads a page that isn't mapped, from a device that lags behind the CPU. The blocks
+			// stop before the read and the interpreter stalls there, as it would without them.
+			static const uint8_t code[] = {
+				0x21, 0x00, 0x90, // 8000: ld hl, 9000h
+				0x3C,             // 8003: inc a
+				0x86,             // 8004: add a, (hl)
+				0x2C,             // 8005: inc l
+				0x07,             // 8006: rlca
+				0x18, 0xFA,       // 8007: jr 8003h
+			};
+
+			uint8_t mem[2][Bus::page_size] = { };
+			Bus buses[2];
+			TestFollowingDevice leaders[2] = { TestFollowingDevice(nullptr), TestFollowingDevice(nullptr) };
+			TestFollowingDevice followers[2] = { TestFollowingDevice(&leaders[0]), TestFollowingDevice(&leaders[1]) };
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				buses[i].map_read_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				auto read = [](IDevice*, uint16_t address) { return (uint8_t)(address * 3); };
+				bool pushed = buses[i].try_add_read_responder({ &followers[i], read, 0xFF00, 0x9000 });
+				Assert::IsTrue(pushed);
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_line, &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->pc = 0x8000;
+			}
+
+			auto hr = cpus[1]->SetJit(true);
+			if (hr == E_NOTIMPL)
+				return;
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			uint32_t stalls = 0;
+			while (cpus[0]->Time() < 100000)
+			{
+				SimulateStopReason reasons[2];
+				for (uint32_t i = 0; i < 2; i++)
+				{
+					leaders[i].SimulateTo(leaders[i].Time() + 777);
+					reasons[i] = cpus[i]->SimulateUntil(100000, nullptr);
+				}
+
+				Assert::IsTrue(reasons[0] == reasons[1]);
+				stalls += (reasons[0] == SimulateStopReason::Stalled);
+				assert_same_state (cpus[0].get(), cpus[1].get());
+			}
+
+			Assert::IsTrue(stalls > 100);
+			Assert::IsTrue(cpus[1]->GetJitBlockCount() > 0);
+		}
+
+		TEST_METHOD(block_instructions_in_bulk)
+		{
+			// A fill, an overlapping copy downwards and a search, all crossing pages.
+			static const uint8_t code[] = {
+				0x21, 0x00, 0x81, // 8000: ld hl, 8100h
+				0x11, 0x01, 0x81, // 8003: ld de, 8101h
+				0x01, 0xFF, 0x01, // 8006: ld bc, 01FFh
+				0x36, 0x5A,       // 8009: ld (hl), 5Ah
+				0xED, 0xB0,       // 800B: ldir
+				0x21, 0xFF, 0x82, // 800D: ld hl, 82FFh
+				0x11, 0xFF, 0x83, // 8010: ld de, 83FFh
+				0x01, 0x80, 0x01, // 8013: ld bc, 0180h
+				0xED, 0xB8,       // 8016: lddr
+				0x21, 0x00, 0x81, // 8018: ld hl, 8100h
+				0x01, 0x00, 0x03, // 801B: ld bc, 0300h
+				0x3E, 0x00,       // 801E: ld a, 0
+				0xED, 0xB1,       // 8020: cpir
+				0x76,             // 8022: halt
+			};
+
+			// SimulateOne runs one iteration per call; SimulateUntil runs them in bulk.
+			uint8_t mem[2][4 * Bus::page_size] = { };
+			Bus buses[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				buses[i].map_read_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_line, &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->pc = 0x8000;
+			}
+
+			for (UINT64 time = 1000; time <= 40000; time += 1000)
+			{
+				while (cpus[0]->Time() < time)
+					Assert::IsTrue(cpus[0]->SimulateOne(nullptr));
+				auto reason = cpus[1]->SimulateUntil(time, nullptr);
+				Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+
+				auto r0 = cpus[0]->GetRegsPtr();
+				auto r1 = cpus[1]->GetRegsPtr();
+				Assert::AreEqual(cpus[0]->Time(), cpus[1]->Time());
+				Assert::AreEqual(r0->pc, r1->pc);
+				Assert::AreEqual(r0->main.af, r1->main.af);
+				Assert::AreEqual(r0->main.bc, r1->main.bc);
+				Assert::AreEqual(r0->main.de, r1->main.de);
+				Assert::AreEqual(r0->main.hl, r1->main.hl);
+				Assert::AreEqual(r0->r, r1->r);
+				Assert::IsTrue(!memcmp(mem[0], mem[1], sizeof(mem[0])));
+			}
+
+			Assert::IsTrue(cpus[1]->Halted());
+			Assert::AreEqual<uint8_t>(0x5A, mem[1][0x3FF]);
+		}
+
+		TEST_METHOD(halt_fast_forward)
+		{
+			static const uint8_t code[] = { 0xED, 0x56, 0xFB, 0x76 }; // im 1 / ei / halt
+			static const uint8_t isr[] = { 0x3E, 0x42, 0x76 };       // ld a, 42h / halt
+
+			// SimulateOne runs one 4-cycle step while halted; SimulateUntil skips to the interrupt.
+			uint8_t mem[2][Bus::page_size] = { };
+			Bus buses[2];
+			dummy_irq_line irq_lines[2];
+			wistd::unique_ptr<TestInterruptingDevice> devices[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				memcpy (mem[i] + 0x38, isr, sizeof(isr));
+				buses[i].map_read_pages (ram.get(), 0, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0, sizeof(mem[i]), mem[i]);
+				devices[i] = wil::make_unique_nothrow<TestInterruptingDevice>(10007);
+				Assert::IsTrue(!!devices[i]);
+				Assert::IsTrue(irq_lines[i].interrupting_devices.try_push_back(devices[i].get()));
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_lines[i], &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->sp = 0x100;
+			}
+
+			// Like the simulator does, bring the device up to the CPU whenever the CPU stalls on it.
+			while (cpus[0]->Time() < 20000)
+			{
+				if (!cpus[0]->SimulateOne(nullptr))
+					devices[0]->SimulateTo(cpus[0]->Time());
+			}
+
+			uint32_t calls = 0;
+			while (cpus[1]->Time() < 20000)
+			{
+				auto reason = cpus[1]->SimulateUntil(20000, nullptr);
+				if (reason == SimulateStopReason::Stalled)
+					devices[1]->SimulateTo(cpus[1]->Time());
+				calls++;
+			}
+
+			auto r0 = cpus[0]->GetRegsPtr();
+			auto r1 = cpus[1]->GetRegsPtr();
+			Assert::AreEqual<uint8_t>(0x42, r1->main.a);
+			Assert::AreEqual(cpus[0]->Time(), cpus[1]->Time());
+			Assert::AreEqual(r0->pc, r1->pc);
+			Assert::AreEqual(r0->sp, r1->sp);
+			Assert::AreEqual(r0->r, r1->r);
+			Assert::IsTrue(calls < 10);
+		}
+
+		TEST_METHOD(idle_loop_skip)
+		{
+			// A short delay, then a wait for a key that never comes.
+			static const uint8_t code[] = {
+				0xF3,       // 8000: di
+				0x06, 0x05, // 8001: ld b, 5
+				0x10, 0xFE, // 8003: djnz 8003h
+				0xDB, 0xFE, // 8005: in a, (0FEh)
+				0xE6, 0x1F, // 8007: and 1Fh
+				0xFE, 0x1F, // 8009: cp 1Fh
+				0x28, 0xF8, // 800B: jr z, 8005h
+				0x76,       // 800D: halt
+			};
+
+			// SimulateOne runs each iteration; SimulateUntil skips them.
+			uint8_t mem[2][Bus::page_size] = { };
+			Bus buses[2];
+			wistd::unique_ptr<IZ80CPU> cpus[2];
+			for (uint32_t i = 0; i < 2; i++)
+			{
+				memcpy (mem[i], code, sizeof(code));
+				buses[i].map_read_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				buses[i].map_write_pages (ram.get(), 0x8000, sizeof(mem[i]), mem[i]);
+				auto hr = MakeZ80CPU (&buses[i], &io_bus, &irq_line, &cpus[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+				cpus[i]->GetRegsPtr()->pc = 0x8000;
+			}
+
+			while (cpus[0]->Time() < 1000000)
+				Assert::IsTrue(cpus[0]->SimulateOne(nullptr));
+			auto io = static_cast<TestIODevice*>(iodevice.get());
+			uint32_t reads = io->read_count;
+			auto reason = cpus[1]->SimulateUntil(1000000, nullptr);
+			Assert::IsTrue(reason == SimulateStopReason::TimeReached);
+			Assert::IsTrue(io->read_count - reads < 5);
+
+			auto r0 = cpus[0]->GetRegsPtr();
+			auto r1 = cpus[1]->GetRegsPtr();
+			Assert::AreEqual(cpus[0]->Time(), cpus[1]->Time());
+			Assert::AreEqual(r0->pc, r1->pc);
+			Assert::AreEqual(r0->main.af, r1->main.af);
+			Assert::AreEqual(r0->r, r1->r);
+		}
+
+		TEST_METHOD(device_scheduler)
+		{
+			TestFollowingDevice leader (nullptr);
+			TestFollowingDevice follower (&leader);
+			DeviceScheduler scheduler;
+			auto hr = scheduler.add_device(&follower);
+			Assert::IsTrue(hr == S_OK);
+			hr = scheduler.add_device(&leader);
+			Assert::IsTrue(hr == S_OK);
+
+			// The follower can't advance until the leader does.
+			bool advanced = scheduler.simulate_to(100);
+			Assert::IsTrue(advanced);
+			Assert::AreEqual<UINT64>(100, leader.Time());
+			Assert::AreEqual<UINT64>(100, follower.Time());
+			Assert::IsFalse(scheduler.simulate_to(100));
+
+			// Both sync at the same time point, and the follower waits for the leader.
+			IDevice* device;
+			UINT64 sync_time;
+			Assert::IsTrue(scheduler.next_sync(&device, &sync_time));
+			Assert::AreEqual<UINT64>(999, sync_time);
+			scheduler.simulate_to(999);
+			scheduler.release_sync(999);
+			Assert::AreEqual<UINT64>(1000, leader.Time());
+			Assert::AreEqual<UINT64>(1000, follower.Time());
+			Assert::IsTrue(scheduler.next_sync(&device, &sync_time));
+			Assert::AreEqual<UINT64>(1999, sync_time);
+
+			// Devices that advance outside the scheduler leave stale entries behind.
+			leader.SimulateTo(1500);
+			scheduler.simulate_to(1200);
+			Assert::AreEqual<UINT64>(1500, leader.Time());
+			Assert::AreEqual<UINT64>(1200, follower.Time());
+		}
+
+		TEST_METHOD(earliest_interrupt_first)
+		{
+			TestInterruptingDevice early (100);
+			TestInterruptingDevice late (200);
+			dummy_irq_line line;
+			Assert::IsTrue(line.interrupting_devices.try_push_back({ &late, &early }));
+			late.SimulateTo(300);
+			early.SimulateTo(300);
+
+			bool interrupted;
+			uint8_t address;
+			Assert::IsTrue(line.try_poll_irq_at_time_point(interrupted, address, 300));
+			Assert::IsTrue(interrupted);
+			uint64_t irq_time;
+			Assert::IsFalse(early.irq_pending(irq_time, address));
+			Assert::IsTrue(late.irq_pending(irq_time, address));
+		}
+
+		TEST_METHOD(scheduled_interrupt_delivery)
+		{
+			static const uint8_t code[] = { 0xED, 0x56, 0xFB, 0x00, 0x18, 0xFD }; // im 1 / ei / nop / jr $-1
+			uint8_t mem[Bus::page_size] = { };
+			memcpy (mem, code, sizeof(code));
+			mem[0x38] = 0x76; // halt
+
+			Bus bus;
+			bus.map_read_pages (ram.get(), 0, sizeof(mem), mem);
+			bus.map_write_pages (ram.get(), 0, sizeof(mem), mem);
+			TestInterruptingDevice device (20000);
+			dummy_irq_line line;
+			Assert::IsTrue(line.interrupting_devices.try_push_back(&device));
+			wistd::unique_ptr<IZ80CPU> cpu;
+			auto hr = MakeZ80CPU (&bus, &io_bus, &line, &cpu);
+			Assert::IsTrue(SUCCEEDED(hr));
+			cpu->GetRegsPtr()->sp = 0x100;
+
+			// The CPU polls the device once to learn the deadline, and once more when it comes.
+			while (cpu->Time() < 30000)
+			{
+				if (!cpu->SimulateOne(nullptr))
+					device.SimulateTo(cpu->Time());
+			}
+
+			Assert::IsTrue(device.poll_count <= 3);
+			Assert::IsTrue(cpu->Halted());
+			Assert::AreEqual<uint16_t>(0x39, cpu->GetPC());
+		}
+
+		static wil::com_ptr_nothrow<IHeadlessSimulator> MakeHeadlessWithCode (const std::initializer_list<uint8_t>& code)
+		{
+			com_ptr<TestRomImage> rom = new (std::nothrow) TestRomImage(); THROW_IF_NULL_ALLOC(rom);
+			wil::com_ptr_nothrow<IHeadlessSimulator> sim;
+			auto hr = MakeHeadlessSimulator(rom.get(), &sim); THROW_IF_FAILED(hr);
+			hr = sim->Reset(0x8000); THROW_IF_FAILED(hr);
+			hr = sim->WriteMemoryBus(0x8000, (uint16_t)code.size(), code.begin()); THROW_IF_FAILED(hr);
+			return sim;
+		}
+
+		static uint16_t GetHeadlessPC (IHeadlessSimulator* sim)
+		{
+			z80_register_set regs;
+			auto hr = sim->GetRegisters(&regs, sizeof(regs)); THROW_IF_FAILED(hr);
+			return regs.pc;
+		}
+
+		TEST_METHOD(headless_run_until_time)
+		{
+			auto sim = MakeHeadlessWithCode({ 0x00, 0x18, 0xFD }); // nop / jr $-1
+
+			SIM_BP_COOKIE bp = 0;
+			auto hr = sim->RunUntil(1000, &bp);
+			Assert::IsTrue(hr == S_OK);
+			Assert::IsTrue(sim->Time() >= 1000);
+			Assert::IsTrue(sim->Time() < 1000 + 12);
+			Assert::AreEqual<SIM_BP_COOKIE>(0, bp);
+
+			// A time already reached runs nothing.
+			UINT64 time = sim->Time();
+			hr = sim->RunUntil(500, &bp);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint64_t>(time, sim->Time());
+		}
+
+		TEST_METHOD(headless_run_until_breakpoint)
+		{
+			auto sim = MakeHeadlessWithCode({ 0x00, 0x00, 0x00, 0x18, 0xFB }); // nop / nop / nop / jr $-3
+
+			SIM_BP_COOKIE cookie;
+			auto hr = sim->AddBreakpoint(BreakpointType::Code, 0x8002, &cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			SIM_BP_COOKIE bp = 0;
+			hr = sim->RunUntil(1000, &bp);
+			Assert::IsTrue(hr == S_FALSE);
+			Assert::AreEqual<SIM_BP_COOKIE>(cookie, bp);
+			Assert::AreEqual<uint16_t>(0x8002, GetHeadlessPC(sim.get()));
+			Assert::AreEqual<uint64_t>(8, sim->Time());
+
+			// The next run executes the instruction at the breakpoint instead of stopping there again,
+			// and stops when the loop comes back to it: nop / jr / nop / nop.
+			bp = 0;
+			hr = sim->RunUntil(1000, &bp);
+			Assert::IsTrue(hr == S_FALSE);
+			Assert::AreEqual<SIM_BP_COOKIE>(cookie, bp);
+			Assert::AreEqual<uint16_t>(0x8002, GetHeadlessPC(sim.get()));
+			Assert::AreEqual<uint64_t>(8 + 24, sim->Time());
+
+			// Resuming past the breakpoint happens also when the run ends before the loop comes back to it.
+			hr = sim->RunUntil(sim->Time() + 1, &bp);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual<uint16_t>(0x8003, GetHeadlessPC(sim.get()));
+
+			hr = sim->RemoveBreakpoint(cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = sim->RunUntil(1000, &bp);
+			Assert::IsTrue(hr == S_OK);
+			Assert::IsTrue(sim->Time() >= 1000);
+		}
+
+		TEST_METHOD(headless_reset_forgets_breakpoint_stop)
+		{
+			auto sim = MakeHeadlessWithCode({ 0x00, 0x18, 0xFD }); // nop / jr $-1
+
+			SIM_BP_COOKIE cookie;
+			auto hr = sim->AddBreakpoint(BreakpointType::Code, 0x8000, &cookie);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// The CPU starts at the breakpoint, so it stops there without executing anything.
+			SIM_BP_COOKIE bp = 0;
+			hr = sim->RunUntil(1000, &bp);
+			Assert::IsTrue(hr == S_FALSE);
+			Assert::AreEqual<SIM_BP_COOKIE>(cookie, bp);
+			Assert::AreEqual<uint64_t>(0, sim->Time());
+
+			// After a reset the CPU is again at the breakpoint, and a run must stop there again.
+			hr = sim->Reset(0x8000);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = sim->RunUntil(1000, &bp);
+			Assert::IsTrue(hr == S_FALSE);
+			Assert::AreEqual<uint64_t>(0, sim->Time());
+		}
+
+		#ifndef _WIN32 // on Windows the description goes to IErrorInfo
+		TEST_METHOD(headless_error_keeps_description)
+		{
+			auto sim = MakeHeadlessWithCode({ 0x00 });
+			auto hr = sim->LoadFile(L"/nonexistent/snapshot.tap");
+			Assert::IsTrue(hr == E_FAIL);
+			Assert::IsTrue(!wcscmp(L"The file extension .tap is not recognized.", GetErrorDescription()));
+		}
+		#endif
+
+		static z80_register_set GetHeadlessRegisters (IHeadlessSimulator* sim)
+		{
+			z80_register_set regs;
+			auto hr = sim->GetRegisters(&regs, sizeof(regs)); THROW_IF_FAILED(hr);
+			return regs;
+		}
+
+		TEST_METHOD(pool_more_runs_than_workers)
+		{
+			// Each run takes many slices and there are more runs than workers,
+			// so workers queue runs again and take them from each other.
+			wil::com_ptr_nothrow<ISimulatorPool> pool;
+			auto hr = MakeSimulatorPool(2, 1000, &pool);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			static constexpr uint32_t count = 8;
+			wil::com_ptr_nothrow<IHeadlessSimulator> sims[count];
+			HRESULT results[count];
+			SIM_BP_COOKIE bps[count] = { };
+			for (uint32_t i = 0; i < count; i++)
+			{
+				sims[i] = MakeHeadlessWithCode({ 0x3C, 0x18, 0xFD }); // inc a / jr $-1
+				results[i] = E_FAIL;
+				hr = pool->Submit(sims[i].get(), 20000 + i * 1000, &results[i], &bps[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+			}
+
+			hr = pool->Wait();
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// Each simulator is where one RunUntil would have taken it.
+			for (uint32_t i = 0; i < count; i++)
+			{
+				auto ref = MakeHeadlessWithCode({ 0x3C, 0x18, 0xFD });
+				hr = ref->RunUntil(20000 + i * 1000, nullptr);
+				Assert::IsTrue(hr == S_OK);
+
+				Assert::IsTrue(results[i] == S_OK);
+				Assert::AreEqual<SIM_BP_COOKIE>(0, bps[i]);
+				Assert::AreEqual<uint64_t>(ref->Time(), sims[i]->Time());
+				auto expected = GetHeadlessRegisters(ref.get());
+				auto actual = GetHeadlessRegisters(sims[i].get());
+				Assert::AreEqual(expected.pc, actual.pc);
+				Assert::AreEqual(expected.main.af, actual.main.af);
+			}
+		}
+
+		TEST_METHOD(pool_runs_with_breakpoints)
+		{
+			wil::com_ptr_nothrow<ISimulatorPool> pool;
+			auto hr = MakeSimulatorPool(3, 1000, &pool);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// Every other simulator has a breakpoint on the third NOP; the others run to the end.
+			static constexpr uint32_t count = 6;
+			wil::com_ptr_nothrow<IHeadlessSimulator> sims[count];
+			SIM_BP_COOKIE cookies[count] = { };
+			HRESULT results[count];
+			SIM_BP_COOKIE bps[count] = { };
+			for (uint32_t i = 0; i < count; i++)
+			{
+				sims[i] = MakeHeadlessWithCode({ 0x00, 0x00, 0x00, 0x18, 0xFB }); // nop / nop / nop / jr $-3
+				if (i % 2)
+				{
+					hr = sims[i]->AddBreakpoint(BreakpointType::Code, 0x8002, &cookies[i]);
+					Assert::IsTrue(SUCCEEDED(hr));
+				}
+
+				results[i] = E_FAIL;
+				hr = pool->Submit(sims[i].get(), 10000, &results[i], &bps[i]);
+				Assert::IsTrue(SUCCEEDED(hr));
+			}
+
+			hr = pool->Wait();
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (i % 2)
+				{
+					Assert::IsTrue(results[i] == S_FALSE);
+					Assert::AreEqual<SIM_BP_COOKIE>(cookies[i], bps[i]);
+					Assert::AreEqual<uint16_t>(0x8002, GetHeadlessRegisters(sims[i].get()).pc);
+					Assert::AreEqual<uint64_t>(8, sims[i]->Time());
+				}
+				else
+				{
+					Assert::IsTrue(results[i] == S_OK);
+					Assert::AreEqual<SIM_BP_COOKIE>(0, bps[i]);
+					Assert::IsTrue(sims[i]->Time() >= 10000);
+				}
+			}
+
+			// A run submitted again continues past the breakpoint and stops the next time around.
+			hr = pool->Submit(sims[1].get(), 10000, &results[1], &bps[1]);
+			Assert::IsTrue(SUCCEEDED(hr));
+			hr = pool->Wait();
+			Assert::IsTrue(SUCCEEDED(hr));
+			Assert::IsTrue(results[1] == S_FALSE);
+			Assert::AreEqual<uint64_t>(8 + 24, sims[1]->Time());
+		}
+
+		TEST_METHOD(pool_wait)
+		{
+			wil::com_ptr_nothrow<ISimulatorPool> pool;
+			auto hr = MakeSimulatorPool(2, 0, &pool);
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// With nothing submitted, Wait returns right away.
+			hr = pool->Wait();
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			// Wait returns only after the runs completed, and the pool can be used again after it.
+			for (uint32_t round = 0; round < 3; round++)
+			{
+				auto sim = MakeHeadlessWithCode({ 0x3C, 0x18, 0xFD }); // inc a / jr $-1
+				UINT64 time = milliseconds_to_ticks(100) * (round + 1);
+				HRESULT result = E_FAIL;
+				hr = pool->Submit(sim.get(), time, &result, nullptr);
+				Assert::IsTrue(SUCCEEDED(hr));
+				hr = pool->Wait();
+				Assert::IsTrue(SUCCEEDED(hr));
+				Assert::IsTrue(result == S_OK);
+				Assert::IsTrue(sim->Time() >= time);
+			}
+		}
+
+		TEST_METHOD(commands_from_many_threads_run_in_order)
+		{
+			test_simulator_thread st;
+			st.start();
+
+			// Each producer's commands run in the order it queued them, however they interleave with the others'.
+			static constexpr uint32_t producers = 4;
+			static constexpr uint32_t per_producer = 2000;
+			uint32_t next[producers] = { };
+			uint32_t out_of_order = 0;
+			std::thread threads[producers];
+			for (uint32_t p = 0; p < producers; p++)
+			{
+				threads[p] = std::thread([&st, &next, &out_of_order, p]
+				{
+					for (uint32_t i = 0; i < per_producer; i++)
+					{
+						// These run on the simulator thread, one at a time.
+						auto hr = st.queue.post([&next, &out_of_order, p, i]
+						{
+							if (next[p] != i)
+								out_of_order++;
+							next[p] = i + 1;
+							return S_OK;
+						});
+						FAIL_FAST_IF(FAILED(hr));
+					}
+				});
+			}
+
+			for (auto& t : threads)
+				t.join();
+
+			// A blocking command queued after all of them returns after all of them ran.
+			auto hr = st.queue.run([] { return S_FALSE; }, simulator_command_queue::no_timeout);
+			Assert::IsTrue(hr == S_FALSE);
+			Assert::AreEqual(0u, out_of_order);
+			for (uint32_t p = 0; p < producers; p++)
+				Assert::AreEqual(per_producer, next[p]);
+		}
+
+		TEST_METHOD(commands_queued_together_run_in_one_batch)
+		{
+			test_simulator_thread st;
+
+			// Only the first command wakes up the simulator thread; it then runs all three, oldest first.
+			uint32_t order[3] = { };
+			uint32_t count = 0;
+			HRESULT completed = E_FAIL;
+			auto hr = st.queue.post([&] { order[count++] = 1; return S_OK; }); Assert::IsTrue(SUCCEEDED(hr));
+			hr = st.queue.post([&] { order[count++] = 2; return S_FALSE; }, [&](HRESULT hr) { completed = hr; }); Assert::IsTrue(SUCCEEDED(hr));
+			hr = st.queue.post([&] { order[count++] = 3; return S_OK; }); Assert::IsTrue(SUCCEEDED(hr));
+			Assert::AreEqual(1u, st.wakes);
+			Assert::AreEqual(0u, count);
+
+			st.run_commands();
+			Assert::AreEqual(3u, count);
+			Assert::AreEqual(1u, order[0]);
+			Assert::AreEqual(2u, order[1]);
+			Assert::AreEqual(3u, order[2]);
+
+			// The completion runs on the main thread, with what its command returned.
+			Assert::IsTrue(completed == E_FAIL);
+			Assert::AreEqual(1u, st.run_main_thread_work());
+			Assert::IsTrue(completed == S_FALSE);
+
+			// With the queue empty again, the next command wakes up the simulator thread again.
+			hr = st.queue.post([] { return S_OK; }); Assert::IsTrue(SUCCEEDED(hr));
+			Assert::AreEqual(2u, st.wakes);
+			st.run_commands();
+		}
+
+		TEST_METHOD(command_caller_times_out_while_queued)
+		{
+			test_simulator_thread st;
+
+			// Nobody runs the commands, so the caller gives up; its command must then never run,
+			// as it may reference the caller's stack. The one queued after it still runs.
+			bool ran = false;
+			bool ran_next = false;
+			auto hr = st.queue.run([&ran] { ran = true; return S_OK; }, 10);
+			Assert::IsTrue(hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT));
+			hr = st.queue.post([&ran_next] { ran_next = true; return S_OK; });
+			Assert::IsTrue(SUCCEEDED(hr));
+
+			st.run_commands();
+			Assert::IsFalse(ran);
+			Assert::IsTrue(ran_next);
+		}
+
+		TEST_METHOD(command_caller_times_out_while_running)
+		{
+			test_simulator_thread st;
+			st.start();
+
+			// The command started before the caller's timeout, so the caller waits for it to finish.
+			std::atomic<bool> started = false;
+			auto hr = st.queue.run([&started]
+				{
+					started = true;
+					std::this_thread::sleep_for(std::chrono::milliseconds(100));
+					return S_FALSE;
+				}, 10);
+			Assert::IsTrue(started);
+			Assert::IsTrue(hr == S_FALSE);
+		}
+
+		TEST_METHOD(run_then_sync_and_async)
+		{
+			test_simulator_thread st;
+
+			static constexpr auto on_complete = [](void* context, HRESULT hr) { *static_cast<HRESULT*>(context) = hr; };
+			HRESULT completed = E_FAIL;
+			SimulatorCompletion completion = { .Context = &completed, .OnComplete = on_complete };
+
+			// Asynchronously: "then" gets what "fun" returned, and the completion what "then" returned.
+			HRESULT then_got = E_FAIL;
+			auto hr = st.queue.run_then([] { return S_FALSE; }, [&then_got](HRESULT hr) { then_got = hr; return E_NOTIMPL; }, &completion, 10);
+			Assert::IsTrue(hr == S_OK);
+			Assert::AreEqual(1u, st.queue.pending_state_changes());
+
+			// While that's pending, the synchronous way fails without queueing anything.
+			hr = st.queue.run_then([] { return S_OK; }, [](HRESULT hr) { return hr; }, nullptr, 10);
+			Assert::IsTrue(hr == E_UNEXPECTED);
+
+			st.run_commands();
+			Assert::AreEqual(1u, st.queue.pending_state_changes());
+			Assert::AreEqual(1u, st.run_main_thread_work());
+			Assert::IsTrue(then_got == S_FALSE);
+			Assert::IsTrue(completed == E_NOTIMPL);
+			Assert::AreEqual(0u, st.queue.pending_state_changes());
+
+			// Synchronously: this waits for "fun", and returns what "then" returned.
+			st.start();
+			then_got = E_FAIL;
+			hr = st.queue.run_then([] { return S_FALSE; }, [&then_got](HRESULT hr) { then_got = hr; return E_NOTIMPL; },
+				nullptr, simulator_command_queue::no_timeout);
+			Assert::IsTrue(then_got == S_FALSE);
+			Assert::IsTrue(hr == E_NOTIMPL);
+		}
+
+		TEST_METHOD(run_speed_arguments)
+		{
+			Assert::IsTrue(validate_run_speed(RunSpeed::Multiplier, 0) == E_INVALIDARG);
+			Assert::IsTrue(validate_run_speed(RunSpeed::Multiplier, 1) == E_INVALIDARG);
+			Assert::IsTrue(validate_run_speed(RunSpeed::Multiplier, 2) == S_OK);
+			Assert::IsTrue(validate_run_speed(RunSpeed::Multiplier, 100) == S_OK);
+			Assert::IsTrue(validate_run_speed(RunSpeed::Multiplier, 101) == E_INVALIDARG);
+
+			// The multiplier is ignored at the other speeds.
+			for (UINT32 multiplier : { 0u, 1u, 7u, 1000u })
+			{
+				Assert::IsTrue(validate_run_speed(RunSpeed::RealTime, multiplier) == S_OK);
+				Assert::IsTrue(validate_run_speed(RunSpeed::Unthrottled, multiplier) == S_OK);
+			}
+
+			Assert::IsTrue(validate_run_speed((RunSpeed)3, 2) == E_INVALIDARG);
+		}
+
+		TEST_METHOD(run_speed_drops_screens)
+		{
+			static constexpr int64_t frequency = 1000; // a clock that ticks every millisecond
+
+			// In real time, every screen goes to the GUI, however close together.
+			screen_rate_limiter real_time;
+			for (int64_t now = 0; now < 10; now++)
+				Assert::IsTrue(real_time.should_send(RunSpeed::RealTime, now, frequency));
+
+			for (RunSpeed speed : { RunSpeed::Multiplier, RunSpeed::Unthrottled })
+			{
+				// The first screen goes; the next one goes only 20 ms after it.
+				screen_rate_limiter limiter;
+				Assert::IsTrue(limiter.should_send(speed, 1000, frequency));
+				Assert::IsFalse(limiter.should_send(speed, 1001, frequency));
+				Assert::IsFalse(limiter.should_send(speed, 1019, frequency));
+				Assert::IsTrue(limiter.should_send(speed, 1020, frequency));
+				Assert::IsFalse(limiter.should_send(speed, 1039, frequency));
+				Assert::IsTrue(limiter.should_send(speed, 1045, frequency));
+
+				// At 5x we complete a screen every 4 ms; of those, 50 per second reach the GUI.
+				screen_rate_limiter fast;
+				uint32_t sent = 0;
+				for (int64_t now = 0; now < 1000; now += 4)
+					sent += fast.should_send(speed, now, frequency);
+				Assert::AreEqual(50u, sent);
+			}
+
+			// Back in real time after running faster, screens go again right away.
+			screen_rate_limiter switched;
+			Assert::IsTrue(switched.should_send(RunSpeed::Unthrottled, 0, frequency));
+			Assert::IsFalse(switched.should_send(RunSpeed::Unthrottled, 1, frequency));
+			Assert::IsTrue(switched.should_send(RunSpeed::RealTime, 2, frequency));
+		}
+
+		TEST_METHOD(async_requests_resume_awaiter)
+		{
+			fake_async_simulator sim;
+			uint32_t sum = 0;
+			auto coro = add_two(sim, &sum);
+			Assert::IsTrue(coro.started);
+			Assert::AreEqual(2u, sim.count); // both started before the first co_await
+
+			sim.complete(0, 5);
+			Assert::AreEqual(0u, sum);
+			sim.complete(1, 7);
+			Assert::AreEqual(12u, sum);
+
+			// Completed in the other order, the second co_await doesn't suspend.
+			fake_async_simulator sim2;
+			sum = 0;
+			add_two(sim2, &sum);
+			sim2.complete(1, 7);
+			Assert::AreEqual(0u, sum);
+			sim2.complete(0, 5);
+			Assert::AreEqual(12u, sum);
+		}
+
+		TEST_METHOD(async_request_that_fails_to_start)
+		{
+			simulator_request<uint32_t> r ([](uint32_t&, SimulatorCompletion) { return E_INVALIDARG; });
+			Assert::IsTrue(r.await_ready());
+			Assert::IsTrue(r.await_resume() == E_INVALIDARG);
+		}
+
+		TEST_METHOD(async_request_destroyed_before_completion)
+		{
+			fake_async_simulator sim;
+			{
+				simulator_request<tracked_value> r ([&sim](tracked_value& v, SimulatorCompletion c) { return sim.start(&v.value, c); });
+				Assert::AreEqual(1, tracked_value::alive);
+			}
+
+			// The simulator still writes the out parameter, and the completion still comes.
+			Assert::AreEqual(1, tracked_value::alive);
+			sim.complete(0, 5);
+			Assert::AreEqual(0, tracked_value::alive);
+		}
+
+		TEST_METHOD(async_request_in_destroyed_coroutine)
+		{
+			fake_async_simulator sim;
+			bool resumed = false;
+			auto coro = await_tracked(sim, &resumed);
+			Assert::AreEqual(1u, sim.count);
+			coro.handle.destroy();
+
+			Assert::AreEqual(1, tracked_value::alive);
+			sim.complete(0, 5);
+			Assert::IsFalse(resumed);
+			Assert::AreEqual(0, tracked_value::alive);
+		}
 	};
 }
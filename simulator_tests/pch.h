@@ -7,10 +7,16 @@
 #ifndef PCH_H
 #define PCH_H
 
+#ifdef _WIN32
 #define NOMINMAX // Windows Platform min and max macros cause problems for the Standard C++ Library
 
 #include <OCIdl.h>
 #include <algorithm>
 #include <wil/com.h>
+#else
+// The tests build also with GCC and Clang; see CMakeLists.txt.
+#include "Impl/win32_compat.h"
+#include <algorithm>
+#endif
 
 #endif //PCH_H
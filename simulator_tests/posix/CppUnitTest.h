@@ -0,0 +1,112 @@
+#pragma once
+
+// Stands in for the Microsoft C++ Unit Test Framework when the tests build with GCC or Clang (see CMakeLists.txt),
+// with only what the tests use: TEST_CLASS, TEST_METHOD, TEST_METHOD_INITIALIZE and the Assert methods.
+// As in the real framework, each test method runs on a new instance of its class, and a failed assertion throws.
+#include <cstdio>
+#include <cwchar>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace Microsoft::VisualStudio::CppUnitTestFramework
+{
+	struct AssertFailed
+	{
+		const char* what;
+		const wchar_t* message;
+	};
+
+	class Assert
+	{
+	public:
+		// The second type parameter lets the tests compare a literal with a value of another type of the same size,
+		// as MSVC allows (for example 16ull with a UINT64, which is an unsigned long here).
+		template<typename T, typename U = T>
+		static void AreEqual (const T& expected, const U& actual, const wchar_t* message = nullptr)
+		{
+			if (!(expected == (T)actual))
+			{
+				if constexpr (std::is_integral_v<T>)
+					fprintf (stderr, "    expected %llu (0x%llX), actual %llu (0x%llX)\n",
+						(unsigned long long)expected, (unsigned long long)expected, (unsigned long long)(T)actual, (unsigned long long)(T)actual);
+				throw AssertFailed { "Assert::AreEqual", message };
+			}
+		}
+
+		static void IsTrue (bool condition, const wchar_t* message = nullptr)
+		{
+			if (!condition)
+				throw AssertFailed { "Assert::IsTrue", message };
+		}
+
+		static void IsFalse (bool condition, const wchar_t* message = nullptr)
+		{
+			if (condition)
+				throw AssertFailed { "Assert::IsFalse", message };
+		}
+
+		[[noreturn]] static void Fail (const wchar_t* message = nullptr)
+		{
+			throw AssertFailed { "Assert::Fail", message };
+		}
+	};
+
+	struct TestMethodInfo
+	{
+		const char* class_name;
+		const char* method_name;
+		void (*run)();
+	};
+
+	inline std::vector<TestMethodInfo>& TestMethods()
+	{
+		static std::vector<TestMethodInfo> methods;
+		return methods;
+	}
+
+	template<typename T, typename Info>
+	struct TestClass
+	{
+		using ThisClass = T;
+		using ThisClassInfo = Info;
+
+		virtual ~TestClass() = default;
+		virtual void RunMethodInitialize() { }
+
+		template<void (T::*method)()>
+		static void RunMethod()
+		{
+			auto test = std::make_unique<T>();
+			test->RunMethodInitialize();
+			(test.get()->*method)();
+		}
+
+		struct Registrar
+		{
+			Registrar (const char* class_name, const char* method_name, void (*run)())
+			{
+				TestMethods().push_back({ class_name, method_name, run });
+			}
+		};
+	};
+}
+
+#define TEST_CLASS(className) \
+	struct className##_info { static constexpr const char* name = #className; }; \
+	class className : public ::Microsoft::VisualStudio::CppUnitTestFramework::TestClass<className, className##_info>
+
+#define TEST_METHOD_INITIALIZE(methodName) \
+	virtual void RunMethodInitialize() override { methodName(); } \
+	void methodName()
+
+#define TEST_METHOD(methodName) \
+	struct methodName##_registrar \
+	{ \
+		methodName##_registrar() \
+		{ \
+			static Registrar r (ThisClassInfo::name, #methodName, &RunMethod<&ThisClass::methodName>); \
+		} \
+	}; \
+	static inline methodName##_registrar methodName##_registration; \
+	void methodName()
@@ -0,0 +1,34 @@
+#include "CppUnitTest.h"
+#include <cstdint>
+#include <cstring>
+
+using namespace Microsoft::VisualStudio::CppUnitTestFramework;
+
+// Runs all test methods, or only those whose names are given on the command line.
+int main (int argc, char** argv)
+{
+	uint32_t run = 0;
+	uint32_t failed = 0;
+	for (auto& m : TestMethods())
+	{
+		bool selected = (argc < 2);
+		for (int i = 1; i < argc; i++)
+			selected |= !strcmp(argv[i], m.method_name);
+		if (!selected)
+			continue;
+
+		run++;
+		try
+		{
+			m.run();
+		}
+		catch (const AssertFailed& e)
+		{
+			failed++;
+			fprintf (stderr, "FAILED %s::%s: %s%s%ls\n", m.class_name, m.method_name, e.what, e.message ? " - " : "", e.message ? e.message : L"");
+		}
+	}
+
+	printf ("%u tests run, %u failed.\n", run, failed);
+	return (failed || !run) ? 1 : 0;
+}